@@ -2,13 +2,20 @@
 echo y\JnEIob`̎Qlz
 echo E^C~OExecOnStartRec=\JnAExecOnEndRec=\I2b
 echo EobNOEhŋN̂Ńob`Ɏ̗\񂪎n܂邱Ƃ
+echo EɎsł鐔ExecMaxJobs܂łŁA͑Ô̂̏I҂
 echo EuA\Cxg1t@Cɂ܂Ƃ߂v̂Ƃ͍Ō̗\̏I
 echo   NB̂ƂCxgȂǂ͍ŏ̗\̂̂i[
 echo EJgfBNgTVTest.exêꏊ
-echo Ee͊ϐɊi[
+echo Ee̓^f[^t@C(^t@CƓꏊ"`.start.meta.txt"
+echo   ܂"`.end.meta.txt")ɏoÃpXR}hCƂ
+echo   n
+echo E^f[^t@ĆuL[=lv`(UTF-16)Ȃ̂ŁAȉ̂悤Ɋϐɓǂ
+echo   ނƕ֗BEPG̃eLXg̉s\nɁA\\\ɃGXP[vĂ
 echo Eob`łȂĂ
 echo   ()ExecOnEndRec=""C:\windows\system32\wscript" "Plugins\TTRec_Exec.vbs""
 echo.
+for /f "usebackq tokens=1,* delims==" %%a in (`type "%~1"`) do set "TTRec%%a=%%b"
+echo ^f[^t@C   "%~1"
 echo s^C~O       %TTRecExec%
 echo \Jn         %TTRecStartTime%
 echo \̒           %TTRecDuration%
@@ -16,6 +23,7 @@ echo OriginalNetworkID    %TTRecONID%
 echo TransportStreamID    %TTRecTSID%
 echo ServiceID            %TTRecSID%
 echo EventID              %TTRecEID%
+echo Jn/I}[W    %TTRecStartMargin%/%TTRecEndMargin%
 echo.
 echo ȉ͗\JnƏĨJEg̍狁߂
 echo \Jn10bȓ̃JEg͔fȂ
@@ -25,14 +33,14 @@ echo 
 echo XNu       %TTRecScrambles%
 echo.
 echo ȉ́u邾v̂ƂZbgȂ
-echo R}hCɂi[(ob`ł͂̂ق֗)
+echo u邾v̂Ƃ^f[^t@C͈ꎞtH_ɍ
 echo t@C̃tpX   "%TTRecFilePath%"
-echo R}hC   "%~1"
 echo.
 echo ȉEPG񂻂̂̂Ȃ̂Ńt@CɎgpłȂL܂ނȂ
 echo T[rX           "%TTRecServiceName%"
 echo CxgJn     %TTRecEventStartTime%
 echo Cxg̒       %TTRecEventDuration%
+echo W             %TTRecGenre%
 echo Cxg           "%TTRecEventName%"
 setlocal EnableDelayedExpansion
 echo (CxgeLXg)
@@ -42,5 +50,5 @@ echo "!TTRecEventExText!"
 endlocal
 echo.
 echo yt@CɃG[JEgtz
-echo if "%TTRecExec%"=="EndRec" if exist "%~1" rename "%~1" "%~n1-D%TTRecDrops%E%TTRecErrors%S%TTRecScrambles%%~x1"
+echo if "%%TTRecExec%%"=="EndRec" for %%%%f in ("%%TTRecFilePath%%") do rename "%%%%~f" "%%%%~nf-D%%TTRecDrops%%E%%TTRecErrors%%S%%TTRecScrambles%%%%%%~xf"
 pause
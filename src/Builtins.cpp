@@ -1,4 +1,5 @@
 ﻿#include <Windows.h>
+#include "JstTime.h"
 #include "Util.h"
 
 #ifdef NO_CRT
@@ -0,0 +1,79 @@
+﻿#include <Windows.h>
+#include "JstTime.h"
+#include "Util.h"
+#include "ChannelIndex.h"
+
+
+CChannelIndex::CChannelIndex()
+    : m_table(NULL)
+    , m_tableSize(0)
+    , m_count(0)
+    , m_fValid(false)
+{
+}
+
+
+CChannelIndex::~CChannelIndex()
+{
+    delete [] m_table;
+}
+
+
+void CChannelIndex::Invalidate()
+{
+    delete [] m_table;
+    m_table = NULL;
+    m_tableSize = m_count = 0;
+    m_fValid = false;
+}
+
+
+DWORD CChannelIndex::Hash(WORD networkID, WORD serviceID)
+{
+    return ((static_cast<DWORD>(networkID) << 16 | serviceID) * 2654435761U) >> 8;
+}
+
+
+void CChannelIndex::Add(WORD networkID, WORD serviceID, int space, int channel, LPCTSTR name)
+{
+    // 未スキャンのチャンネルなどは引けなくてよい
+    if (networkID == 0) return;
+    if (Find(networkID, serviceID)) return;
+
+    // 使用率が半分を超えないように拡張する
+    if ((m_count + 1) * 2 > m_tableSize) {
+        CHANNEL *oldTable = m_table;
+        int oldSize = m_tableSize;
+        m_tableSize = max(m_tableSize * 2, 256);
+        m_table = new CHANNEL[m_tableSize];
+        ::ZeroMemory(m_table, m_tableSize * sizeof(CHANNEL));
+        m_count = 0;
+        for (int i = 0; i < oldSize; ++i) {
+            const CHANNEL &ch = oldTable[i];
+            if (ch.networkID) Add(ch.networkID, ch.serviceID, ch.space, ch.channel, ch.name);
+        }
+        delete [] oldTable;
+    }
+
+    int mask = m_tableSize - 1;
+    int i = Hash(networkID, serviceID) & mask;
+    while (m_table[i].networkID) i = (i + 1) & mask;
+    CHANNEL &ch = m_table[i];
+    ch.networkID = networkID;
+    ch.serviceID = serviceID;
+    ch.space = space;
+    ch.channel = channel;
+    ::lstrcpyn(ch.name, name, ARRAY_SIZE(ch.name));
+    ++m_count;
+}
+
+
+const CChannelIndex::CHANNEL *CChannelIndex::Find(WORD networkID, WORD serviceID) const
+{
+    if (networkID == 0 || m_count == 0) return NULL;
+    int mask = m_tableSize - 1;
+    for (int i = Hash(networkID, serviceID) & mask; m_table[i].networkID; i = (i + 1) & mask) {
+        if (m_table[i].networkID == networkID && m_table[i].serviceID == serviceID) return &m_table[i];
+    }
+    return NULL;
+}
@@ -0,0 +1,36 @@
+﻿#ifndef INCLUDE_CHANNEL_INDEX_H
+#define INCLUDE_CHANNEL_INDEX_H
+
+// (ネットワークID, サービスID)からチャンネルを引く索引
+// チューニング空間とチャンネルをAPIで1つずつ取得して探すのは遅いので、1度だけ列挙して保持する
+class CChannelIndex
+{
+public:
+    struct CHANNEL {
+        WORD networkID;
+        WORD serviceID;     // networkIDが0なら空き
+        int space;
+        int channel;
+        TCHAR name[64];
+    };
+    CChannelIndex();
+    ~CChannelIndex();
+    // 内容が作成済みかどうか(作成後にドライバやチャンネル設定が変わったらInvalidate()すること)
+    bool IsValid() const { return m_fValid; }
+    void SetValid() { m_fValid = true; }
+    void Invalidate();
+    // 同じサービスが複数あれば最初に追加したものを残す
+    void Add(WORD networkID, WORD serviceID, int space, int channel, LPCTSTR name);
+    const CHANNEL *Find(WORD networkID, WORD serviceID) const;
+private:
+    CChannelIndex(const CChannelIndex&);
+    CChannelIndex &operator=(const CChannelIndex&);
+    static DWORD Hash(WORD networkID, WORD serviceID);
+
+    CHANNEL *m_table;
+    int m_tableSize;    // 2の冪
+    int m_count;
+    bool m_fValid;
+};
+
+#endif // INCLUDE_CHANNEL_INDEX_H
@@ -0,0 +1,186 @@
+﻿#include <Windows.h>
+#include "JstTime.h"
+#include "Util.h"
+#include "ControlPipe.h"
+
+#ifndef PIPE_REJECT_REMOTE_CLIENTS
+#define PIPE_REJECT_REMOTE_CLIENTS 0x00000008
+#endif
+
+
+void CControlResponse::Append(LPCTSTR str)
+{
+    int n = ::lstrlen(str);
+    if (m_len + n + 1 > m_size) {
+        int size = max(m_size * 2, m_len + n + 1024);
+        LPTSTR text = new TCHAR[size];
+        if (m_text) ::CopyMemory(text, m_text, m_len * sizeof(TCHAR));
+        delete [] m_text;
+        m_text = text;
+        m_size = size;
+    }
+    ::CopyMemory(m_text + m_len, str, (n + 1) * sizeof(TCHAR));
+    m_len += n;
+}
+
+
+void CControlResponse::Append(const CControlResponse &o)
+{
+    if (o.m_text) Append(o.m_text);
+}
+
+
+CControlPipe::CControlPipe()
+    : m_hThread(NULL)
+    , m_hStopEvent(NULL)
+    , m_hwndPost(NULL)
+    , m_uMsgPost(0)
+{
+    m_pipeName[0] = 0;
+}
+
+
+CControlPipe::~CControlPipe()
+{
+    Stop();
+}
+
+
+bool CControlPipe::Start(LPCTSTR pipeName, HWND hwndPost, UINT uMsgPost)
+{
+    Stop();
+    m_hStopEvent = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!m_hStopEvent) return false;
+    ::lstrcpyn(m_pipeName, pipeName, ARRAY_SIZE(m_pipeName));
+    m_hwndPost = hwndPost;
+    m_uMsgPost = uMsgPost;
+    m_hThread = ::CreateThread(NULL, 0, PipeThread, this, 0, NULL);
+    if (!m_hThread) {
+        ::CloseHandle(m_hStopEvent);
+        m_hStopEvent = NULL;
+        return false;
+    }
+    return true;
+}
+
+
+// ウィンドウのスレッドから呼ぶこと
+void CControlPipe::Stop()
+{
+    if (m_hThread) {
+        ::SetEvent(m_hStopEvent);
+        // パイプのスレッドがSendMessage()で待っていることがあるので、送られたメッセージを処理しながら待つ
+        while (::MsgWaitForMultipleObjects(1, &m_hThread, FALSE, INFINITE, QS_SENDMESSAGE) == WAIT_OBJECT_0 + 1) {
+            MSG msg;
+            ::PeekMessage(&msg, NULL, 0, 0, PM_NOREMOVE);
+        }
+        ::CloseHandle(m_hThread);
+        m_hThread = NULL;
+    }
+    if (m_hStopEvent) {
+        ::CloseHandle(m_hStopEvent);
+        m_hStopEvent = NULL;
+    }
+}
+
+
+// 非同期I/Oの完了を待つ。停止要求やタイムアウトのときは取り消してfalseを返す
+bool CControlPipe::WaitIo(HANDLE hPipe, OVERLAPPED *pol, DWORD timeout, DWORD *pBytes)
+{
+    HANDLE handles[2] = { m_hStopEvent, pol->hEvent };
+    *pBytes = 0;
+    if (::WaitForMultipleObjects(2, handles, FALSE, timeout) != WAIT_OBJECT_0 + 1) {
+        ::CancelIo(hPipe);
+        ::GetOverlappedResult(hPipe, pol, pBytes, TRUE);
+        ::SetLastError(ERROR_OPERATION_ABORTED);
+        return false;
+    }
+    return ::GetOverlappedResult(hPipe, pol, pBytes, FALSE) != FALSE;
+}
+
+
+void CControlPipe::Serve(HANDLE hPipe, OVERLAPPED *pol)
+{
+    // 要求のメッセージを読む
+    DWORD size = 0;
+    DWORD bufSize = 64 * 1024;
+    BYTE *buf = new BYTE[bufSize + sizeof(TCHAR)];
+    bool fRead = false;
+    for (;;) {
+        DWORD bytes;
+        if (!::ReadFile(hPipe, buf + size, bufSize - size, NULL, pol) &&
+            ::GetLastError() != ERROR_IO_PENDING && ::GetLastError() != ERROR_MORE_DATA) break;
+        fRead = WaitIo(hPipe, pol, INFINITE, &bytes);
+        size += bytes;
+        if (fRead || ::GetLastError() != ERROR_MORE_DATA || bufSize >= REQUEST_MAX_SIZE) break;
+        DWORD newSize = min(bufSize * 2, REQUEST_MAX_SIZE);
+        BYTE *newBuf = new BYTE[newSize + sizeof(TCHAR)];
+        ::CopyMemory(newBuf, buf, size);
+        delete [] buf;
+        buf = newBuf;
+        bufSize = newSize;
+    }
+
+    if (fRead) {
+        LPTSTR text = reinterpret_cast<LPTSTR>(buf);
+        text[size / sizeof(TCHAR)] = 0;
+        if (text[0] == L'\xFEFF') ++text;
+
+        CONTROL_REQUEST req;
+        req.text = text;
+        if (::WaitForSingleObject(m_hStopEvent, 0) != WAIT_OBJECT_0) {
+            ::SendMessage(m_hwndPost, m_uMsgPost, 0, reinterpret_cast<LPARAM>(&req));
+        }
+        DWORD bytes;
+        if ((::WriteFile(hPipe, req.response.GetText(), req.response.GetLength() * sizeof(TCHAR), NULL, pol) ||
+             ::GetLastError() == ERROR_IO_PENDING) &&
+            WaitIo(hPipe, pol, INFINITE, &bytes))
+        {
+            // クライアントが読み終えて閉じるのを待つ(すぐ切断すると応答が失われる)
+            BYTE dummy;
+            if (::ReadFile(hPipe, &dummy, 1, NULL, pol) || ::GetLastError() == ERROR_IO_PENDING) {
+                WaitIo(hPipe, pol, CLIENT_CLOSE_TIMEOUT, &bytes);
+            }
+        }
+    }
+    delete [] buf;
+}
+
+
+DWORD WINAPI CControlPipe::PipeThread(LPVOID pParam)
+{
+    CControlPipe *pThis = static_cast<CControlPipe*>(pParam);
+    OVERLAPPED ol;
+    ::ZeroMemory(&ol, sizeof(ol));
+    ol.hEvent = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!ol.hEvent) return 0;
+
+    while (::WaitForSingleObject(pThis->m_hStopEvent, 0) != WAIT_OBJECT_0) {
+        // 同時に処理するのは1つだけ
+        HANDLE hPipe = ::CreateNamedPipe(pThis->m_pipeName, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+                                         PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                         1, 64 * 1024, 64 * 1024, 0, NULL);
+        if (hPipe == INVALID_HANDLE_VALUE && ::GetLastError() == ERROR_INVALID_PARAMETER) {
+            // XPはPIPE_REJECT_REMOTE_CLIENTSを受け付けない
+            hPipe = ::CreateNamedPipe(pThis->m_pipeName, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+                                      PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
+                                      1, 64 * 1024, 64 * 1024, 0, NULL);
+        }
+        if (hPipe == INVALID_HANDLE_VALUE) break;
+
+        DWORD bytes;
+        bool fConnected = ::ConnectNamedPipe(hPipe, &ol) != FALSE;
+        if (!fConnected) {
+            DWORD err = ::GetLastError();
+            fConnected = err == ERROR_PIPE_CONNECTED ||
+                         err == ERROR_IO_PENDING && pThis->WaitIo(hPipe, &ol, INFINITE, &bytes);
+        }
+        if (fConnected) {
+            pThis->Serve(hPipe, &ol);
+            ::DisconnectNamedPipe(hPipe);
+        }
+        ::CloseHandle(hPipe);
+    }
+    ::CloseHandle(ol.hEvent);
+    return 0;
+}
@@ -0,0 +1,54 @@
+﻿#ifndef INCLUDE_CONTROL_PIPE_H
+#define INCLUDE_CONTROL_PIPE_H
+
+// 制御パイプの応答を組み立てる
+class CControlResponse
+{
+public:
+    CControlResponse() : m_text(NULL), m_len(0), m_size(0) {}
+    ~CControlResponse() { delete [] m_text; }
+    void Append(LPCTSTR str);
+    void Append(const CControlResponse &o);
+    LPCTSTR GetText() const { return m_text ? m_text : TEXT(""); }
+    int GetLength() const { return m_len; }
+private:
+    CControlResponse(const CControlResponse&);
+    CControlResponse &operator=(const CControlResponse&);
+    LPTSTR m_text;
+    int m_len;
+    int m_size;
+};
+
+// 制御パイプで受け取った要求(SendMessage()のLPARAMで渡す)
+struct CONTROL_REQUEST {
+    LPCTSTR text;
+    CControlResponse response;
+};
+
+// 名前つきパイプで一括操作の要求を受け付け、ウィンドウのスレッドに処理させる
+// 1つのメッセージ(UTF-16LE)が1つの要求で、応答も1つのメッセージで返す(CallNamedPipe()で使える)
+class CControlPipe
+{
+public:
+    // 要求の最大バイト数
+    static const DWORD REQUEST_MAX_SIZE = 4096 * 1024;
+    // 応答を書き込んだあとクライアントが閉じるのを待つ時間(ミリ秒)
+    static const DWORD CLIENT_CLOSE_TIMEOUT = 5000;
+
+    CControlPipe();
+    ~CControlPipe();
+    bool Start(LPCTSTR pipeName, HWND hwndPost, UINT uMsgPost);
+    void Stop();
+private:
+    static DWORD WINAPI PipeThread(LPVOID pParam);
+    bool WaitIo(HANDLE hPipe, OVERLAPPED *pol, DWORD timeout, DWORD *pBytes);
+    void Serve(HANDLE hPipe, OVERLAPPED *pol);
+
+    HANDLE m_hThread;
+    HANDLE m_hStopEvent;
+    HWND m_hwndPost;
+    UINT m_uMsgPost;
+    TCHAR m_pipeName[MAX_PATH + 16];
+};
+
+#endif // INCLUDE_CONTROL_PIPE_H
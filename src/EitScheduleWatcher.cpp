@@ -0,0 +1,123 @@
+﻿#include <Windows.h>
+#include "JstTime.h"
+#include "Util.h"
+#include "EitScheduleWatcher.h"
+
+
+CEitScheduleWatcher::CEitScheduleWatcher()
+    : m_fActive(false)
+    , m_keys(NULL)
+    , m_streams(NULL)
+    , m_versions(NULL)
+    , m_count(0)
+    , m_sectionCount(0)
+    , m_lastNewTick(0)
+    , m_otherStreamNum(0)
+{
+}
+
+
+CEitScheduleWatcher::~CEitScheduleWatcher()
+{
+    Stop();
+}
+
+
+// 監視を(チャンネルを変更するたびに)始めなおす
+void CEitScheduleWatcher::Start()
+{
+    CBlockLock lock(&m_lock);
+    if (!m_keys) {
+        m_keys = new DWORD[TABLE_SIZE];
+        m_streams = new DWORD[TABLE_SIZE];
+        m_versions = new BYTE[TABLE_SIZE];
+    }
+    ::ZeroMemory(m_keys, TABLE_SIZE * sizeof(DWORD));
+    m_count = 0;
+    m_sectionCount = 0;
+    m_lastNewTick = ::GetTickCount();
+    m_otherStreamNum = 0;
+    m_fActive = true;
+}
+
+
+void CEitScheduleWatcher::Stop()
+{
+    CBlockLock lock(&m_lock);
+    m_fActive = false;
+    delete [] m_keys;
+    m_keys = NULL;
+    delete [] m_streams;
+    m_streams = NULL;
+    delete [] m_versions;
+    m_versions = NULL;
+}
+
+
+// EITのパケットを1つ渡す(ストリームコールバックのスレッド)
+void CEitScheduleWatcher::Write(const BYTE *pPacket)
+{
+    if (!(pPacket[1]&0x40)) return;
+    int adaptationControl = (pPacket[3]>>4)&0x03;
+    if (!(adaptationControl & 1)) return;
+    const BYTE *pPayload = pPacket + 4;
+    if (adaptationControl == 3) {
+        if (pPacket[4] > 182) return;
+        pPayload += 1 + pPacket[4];
+    }
+    // セクションの開始(1つのパケットで複数のセクションが始まる場合は最初のものだけを扱う)
+    const BYTE *pTable = pPayload + 1 + pPayload[0];
+    if (pTable + 12 > pPacket + 188) return;
+
+    // EIT[schedule](自ストリーム0x50～0x5F、他ストリーム0x60～0x6F)の現在のもの
+    int tableID = pTable[0];
+    if (tableID < 0x50 || tableID > 0x6F || !(pTable[1]&0x80) || !(pTable[5]&0x01)) return;
+    DWORD serviceID = (pTable[3]<<8) | pTable[4];
+    BYTE version = (pTable[5]>>1) & 0x1f;
+    DWORD key = serviceID << 16 | tableID << 8 | pTable[6];
+    DWORD stream = static_cast<DWORD>((pTable[10]<<8) | pTable[11]) << 16 | (pTable[8]<<8) | pTable[9];
+
+    CBlockLock lock(&m_lock);
+    if (!m_fActive || !m_keys) return;
+    DWORD hash = (key * 2654435761UL ^ stream) * 2654435761UL;
+    DWORD i = (hash ^ hash >> 16) & (TABLE_SIZE - 1);
+    for (; m_keys[i] && (m_keys[i] != key || m_streams[i] != stream); i = (i + 1) & (TABLE_SIZE - 1));
+    if (m_keys[i]) {
+        if (m_versions[i] == version) return;
+    }
+    else {
+        // ほぼ埋まったら新しいセクションとみなさない(打ち切りは時間で行われる)
+        if (m_count >= TABLE_SIZE / 8 * 7) return;
+        m_keys[i] = key;
+        m_streams[i] = stream;
+        ++m_count;
+    }
+    m_versions[i] = version;
+    ++m_sectionCount;
+    m_lastNewTick = ::GetTickCount();
+
+    if (tableID >= 0x60) {
+        int j = 0;
+        while (j < m_otherStreamNum && m_otherStreams[j] != stream) ++j;
+        if (j == m_otherStreamNum && m_otherStreamNum < OTHER_STREAM_MAX) m_otherStreams[m_otherStreamNum++] = stream;
+    }
+}
+
+
+// 監視を始めてから届いた新しいセクションの数を返す
+DWORD CEitScheduleWatcher::GetSectionCount(DWORD *pLastNewTick)
+{
+    CBlockLock lock(&m_lock);
+    *pLastNewTick = m_lastNewTick;
+    return m_sectionCount;
+}
+
+
+// 他ストリームのEIT[schedule]で番組表が届いたストリーム(ONID<<16 | TSID)を返す
+int CEitScheduleWatcher::GetOtherStreams(DWORD *pIDs, int maxNum)
+{
+    CBlockLock lock(&m_lock);
+    int n = min(m_otherStreamNum, maxNum);
+    for (int i = 0; i < n; ++i) pIDs[i] = m_otherStreams[i];
+    return n;
+}
@@ -0,0 +1,42 @@
+﻿#ifndef INCLUDE_EIT_SCHEDULE_WATCHER_H
+#define INCLUDE_EIT_SCHEDULE_WATCHER_H
+
+// 受信中のTSのEIT[schedule]のセクションを監視し、新しいセクションが届かなくなったかを調べる
+// (番組表の取得がひととおり済んだことの目安にする)。セクションはヘッダだけを見る
+class CEitScheduleWatcher
+{
+public:
+    // 区別するセクションの数(2の冪)
+    static const int TABLE_SIZE = 65536;
+    // 記録する他ストリームの数
+    static const int OTHER_STREAM_MAX = 64;
+
+    CEitScheduleWatcher();
+    ~CEitScheduleWatcher();
+    void Start();
+    void Stop();
+    bool IsActive() const { return m_fActive; }
+    void Write(const BYTE *pPacket);
+    DWORD GetSectionCount(DWORD *pLastNewTick);
+    int GetOtherStreams(DWORD *pIDs, int maxNum);
+private:
+    CEitScheduleWatcher(const CEitScheduleWatcher&);
+    CEitScheduleWatcher &operator=(const CEitScheduleWatcher&);
+
+    CCriticalLock m_lock;
+    volatile bool m_fActive;
+    // キーは(service_id<<16 | table_id<<8 | section_number)で、0は空き
+    // 他ストリームのセクションと区別するため、そのストリーム(ONID<<16 | TSID)も照合する
+    DWORD *m_keys;
+    DWORD *m_streams;
+    BYTE *m_versions;
+    int m_count;
+    // 新しいセクション(またはバージョンの変わったセクション)の数と最後に受け取った時刻
+    DWORD m_sectionCount;
+    DWORD m_lastNewTick;
+    // 他ストリームのEIT[schedule]で届いたストリーム(ONID<<16 | TSID)
+    DWORD m_otherStreams[OTHER_STREAM_MAX];
+    int m_otherStreamNum;
+};
+
+#endif // INCLUDE_EIT_SCHEDULE_WATCHER_H
@@ -0,0 +1,82 @@
+﻿#include <Windows.h>
+#include "JstTime.h"
+#include "Util.h"
+#include "FileWatcher.h"
+
+
+CFileWatcher::CFileWatcher()
+    : m_hThread(NULL)
+    , m_hStopEvent(NULL)
+    , m_hChange(INVALID_HANDLE_VALUE)
+    , m_hwndPost(NULL)
+    , m_uMsgPost(0)
+    , m_fPosted(0)
+{
+}
+
+
+CFileWatcher::~CFileWatcher()
+{
+    Stop();
+}
+
+
+bool CFileWatcher::Start(LPCTSTR dirName, HWND hwndPost, UINT uMsgPost)
+{
+    Stop();
+    m_hChange = ::FindFirstChangeNotification(dirName, FALSE,
+                                              FILE_NOTIFY_CHANGE_FILE_NAME |
+                                              FILE_NOTIFY_CHANGE_SIZE |
+                                              FILE_NOTIFY_CHANGE_LAST_WRITE);
+    if (m_hChange == INVALID_HANDLE_VALUE) return false;
+
+    m_hStopEvent = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (m_hStopEvent) {
+        m_hwndPost = hwndPost;
+        m_uMsgPost = uMsgPost;
+        m_fPosted = 0;
+        m_hThread = ::CreateThread(NULL, 0, WatchThread, this, 0, NULL);
+        if (m_hThread) return true;
+        ::CloseHandle(m_hStopEvent);
+        m_hStopEvent = NULL;
+    }
+    ::FindCloseChangeNotification(m_hChange);
+    m_hChange = INVALID_HANDLE_VALUE;
+    return false;
+}
+
+
+void CFileWatcher::Stop()
+{
+    if (m_hThread) {
+        ::SetEvent(m_hStopEvent);
+        ::WaitForSingleObject(m_hThread, INFINITE);
+        ::CloseHandle(m_hThread);
+        m_hThread = NULL;
+    }
+    if (m_hStopEvent) {
+        ::CloseHandle(m_hStopEvent);
+        m_hStopEvent = NULL;
+    }
+    if (m_hChange != INVALID_HANDLE_VALUE) {
+        ::FindCloseChangeNotification(m_hChange);
+        m_hChange = INVALID_HANDLE_VALUE;
+    }
+}
+
+
+DWORD WINAPI CFileWatcher::WatchThread(LPVOID pParam)
+{
+    CFileWatcher *pThis = static_cast<CFileWatcher*>(pParam);
+    HANDLE handles[2] = { pThis->m_hStopEvent, pThis->m_hChange };
+
+    while (::WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+        if (::InterlockedExchange(&pThis->m_fPosted, 1) == 0) {
+            if (!::PostMessage(pThis->m_hwndPost, pThis->m_uMsgPost, 0, 0)) {
+                pThis->m_fPosted = 0;
+            }
+        }
+        if (!::FindNextChangeNotification(pThis->m_hChange)) break;
+    }
+    return 0;
+}
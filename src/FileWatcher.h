@@ -0,0 +1,29 @@
+﻿#ifndef INCLUDE_FILE_WATCHER_H
+#define INCLUDE_FILE_WATCHER_H
+
+// フォルダ内のファイルの作成・書き込みを監視してウィンドウにメッセージで知らせる
+// 通知は連続して届くので、受け取る側で落ち着くのを待ってから(デバウンス)処理すること
+// どのファイルが変わったかは通知しないので、受け取る側で最終書き込み時刻などを比べる
+class CFileWatcher
+{
+public:
+    CFileWatcher();
+    ~CFileWatcher();
+    bool Start(LPCTSTR dirName, HWND hwndPost, UINT uMsgPost);
+    void Stop();
+    bool IsWatching() const { return m_hThread != NULL; }
+    // 通知のメッセージを受け取ったら呼ぶ(次の変更をまた通知する)
+    void Acknowledge() { ::InterlockedExchange(&m_fPosted, 0); }
+private:
+    static DWORD WINAPI WatchThread(LPVOID pParam);
+
+    HANDLE m_hThread;
+    HANDLE m_hStopEvent;
+    HANDLE m_hChange;
+    HWND m_hwndPost;
+    UINT m_uMsgPost;
+    // 未処理の通知があれば非0(通知をためないため)
+    volatile LONG m_fPosted;
+};
+
+#endif // INCLUDE_FILE_WATCHER_H
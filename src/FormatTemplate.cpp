@@ -0,0 +1,310 @@
+﻿#include <Windows.h>
+#include <Shlwapi.h>
+#include "JstTime.h"
+#include "Util.h"
+#include "FormatTemplate.h"
+#include "NibbleList.h"
+
+// フォーマット指示子の種類
+enum {
+    OP_TEXT,
+    OP_DATE,
+    OP_YEAR,
+    OP_YEAR2,
+    OP_MONTH,
+    OP_MONTH2,
+    OP_DAY,
+    OP_DAY2,
+    OP_TIME,
+    OP_HOUR,
+    OP_HOUR2,
+    OP_MINUTE,
+    OP_MINUTE2,
+    OP_SECOND,
+    OP_SECOND2,
+    OP_DAY_OF_WEEK,
+    OP_EVENT_NAME,
+    OP_EVENT_ID,
+    OP_DURATION,
+    OP_ONID,
+    OP_SID,
+    OP_SERVICE_NAME,
+    OP_GENRE,
+    OP_NUM,
+    OP_NUM2,
+};
+
+// OP_TEXTを除いて上の並びと同じ順にすること
+static const struct {
+    LPCTSTR name;
+    BYTE code;
+    DWORD paramMask;
+} MACRO_LIST[] = {
+    { TEXT("date"),         OP_DATE,         FORMAT_PARAM_START_TIME },
+    { TEXT("year"),         OP_YEAR,         FORMAT_PARAM_START_TIME },
+    { TEXT("year2"),        OP_YEAR2,        FORMAT_PARAM_START_TIME },
+    { TEXT("month"),        OP_MONTH,        FORMAT_PARAM_START_TIME },
+    { TEXT("month2"),       OP_MONTH2,       FORMAT_PARAM_START_TIME },
+    { TEXT("day"),          OP_DAY,          FORMAT_PARAM_START_TIME },
+    { TEXT("day2"),         OP_DAY2,         FORMAT_PARAM_START_TIME },
+    { TEXT("time"),         OP_TIME,         FORMAT_PARAM_START_TIME },
+    { TEXT("hour"),         OP_HOUR,         FORMAT_PARAM_START_TIME },
+    { TEXT("hour2"),        OP_HOUR2,        FORMAT_PARAM_START_TIME },
+    { TEXT("minute"),       OP_MINUTE,       FORMAT_PARAM_START_TIME },
+    { TEXT("minute2"),      OP_MINUTE2,      FORMAT_PARAM_START_TIME },
+    { TEXT("second"),       OP_SECOND,       FORMAT_PARAM_START_TIME },
+    { TEXT("second2"),      OP_SECOND2,      FORMAT_PARAM_START_TIME },
+    { TEXT("day-of-week"),  OP_DAY_OF_WEEK,  FORMAT_PARAM_START_TIME },
+    { TEXT("event-name"),   OP_EVENT_NAME,   FORMAT_PARAM_EVENT_NAME },
+    { TEXT("event-id"),     OP_EVENT_ID,     FORMAT_PARAM_EVENT_ID },
+    { TEXT("duration"),     OP_DURATION,     FORMAT_PARAM_DURATION },
+    { TEXT("onid"),         OP_ONID,         FORMAT_PARAM_SERVICE_ID },
+    { TEXT("sid"),          OP_SID,          FORMAT_PARAM_SERVICE_ID },
+    { TEXT("service-name"), OP_SERVICE_NAME, FORMAT_PARAM_SERVICE_NAME },
+    { TEXT("genre"),        OP_GENRE,        FORMAT_PARAM_GENRE },
+    { TEXT("num"),          OP_NUM,          FORMAT_PARAM_NUM },
+    { TEXT("num2"),         OP_NUM2,         FORMAT_PARAM_NUM },
+};
+
+// コンパイル結果のキャッシュ(メインスレッドからのみ使う)
+static const int FORMAT_CACHE_MAX = 8;
+static FORMAT_TEMPLATE g_formatCache[FORMAT_CACHE_MAX];
+static int g_formatCacheNext;
+
+// ファイル名に使えない文字
+static const LPCTSTR FILE_NAME_TR = TEXT("!\\/:*?\"<>|!￥／：＊？”＜＞｜!");
+
+
+static void AddOp(FORMAT_TEMPLATE *pTemplate, BYTE code, int pos, int len)
+{
+    FORMAT_TEMPLATE::OP *pPrev = pTemplate->numOps > 0 ? &pTemplate->ops[pTemplate->numOps - 1] : NULL;
+    if (code == OP_TEXT && pPrev && pPrev->code == OP_TEXT && pPrev->pos + pPrev->len == pos) {
+        // 連続する文字列はまとめる
+        pPrev->len = static_cast<WORD>(pPrev->len + len);
+    }
+    else if (pTemplate->numOps < FORMAT_TEMPLATE::OPS_MAX) {
+        FORMAT_TEMPLATE::OP &op = pTemplate->ops[pTemplate->numOps++];
+        op.code = code;
+        op.pos = static_cast<WORD>(pos);
+        op.len = static_cast<WORD>(len);
+    }
+}
+
+// フォーマット文字列を命令列に変換する
+void CompileFormat(FORMAT_TEMPLATE *pTemplate, LPCTSTR pszFormat)
+{
+    ::lstrcpyn(pTemplate->source, pszFormat, ARRAY_SIZE(pTemplate->source));
+    pTemplate->numOps = 0;
+    pTemplate->paramMask = 0;
+
+    LPCTSTR p = pTemplate->source;
+    for (int i = 0; p[i];) {
+        if (p[i] != TEXT('%')) {
+            int j = i + 1;
+            while (p[j] && p[j] != TEXT('%')) ++j;
+            AddOp(pTemplate, OP_TEXT, i, j - i);
+            i = j;
+        }
+        else if (p[i + 1] == TEXT('%')) {
+            // "%%"は"%"
+            AddOp(pTemplate, OP_TEXT, i, 1);
+            i += 2;
+        }
+        else {
+            int j = i + 1;
+            while (p[j] && p[j] != TEXT('%')) ++j;
+            if (!p[j]) {
+                // 閉じていない
+                AddOp(pTemplate, OP_TEXT, i, 1);
+                ++i;
+                continue;
+            }
+            TCHAR szKeyword[32];
+            const int numMacros = ARRAY_SIZE(MACRO_LIST);
+            int k = 0;
+            if (j - i - 1 < ARRAY_SIZE(szKeyword)) {
+                ::lstrcpyn(szKeyword, &p[i + 1], j - i);
+                for (; k < numMacros && ::lstrcmpi(szKeyword, MACRO_LIST[k].name); ++k);
+            }
+            if (j - i - 1 >= ARRAY_SIZE(szKeyword)) {
+                // 長すぎる指示子は"%"だけ出力して続きを普通の文字列として扱う
+                AddOp(pTemplate, OP_TEXT, i, 1);
+                ++i;
+            }
+            else if (k < numMacros) {
+                AddOp(pTemplate, MACRO_LIST[k].code, i, j - i + 1);
+                pTemplate->paramMask |= MACRO_LIST[k].paramMask;
+                i = j + 1;
+            }
+            else {
+                // 知らない指示子はそのまま
+                AddOp(pTemplate, OP_TEXT, i, j - i + 1);
+                i = j + 1;
+            }
+        }
+    }
+}
+
+
+static int AppendText(LPTSTR pszDest, int MaxDest, int i, LPCTSTR pszSrc, int Length)
+{
+    int n = min(Length, MaxDest - 1 - i);
+    if (n > 0) {
+        ::memcpy(&pszDest[i], pszSrc, n * sizeof(TCHAR));
+        i += n;
+    }
+    return i;
+}
+
+static int AppendNumber(LPTSTR pszDest, int MaxDest, int i, DWORD Value, int Width, int Radix)
+{
+    TCHAR buf[16];
+    int n = 0;
+    do {
+        buf[n++] = TEXT("0123456789ABCDEF")[Value % Radix];
+        Value /= Radix;
+    } while (Value != 0);
+    while (n < Width) buf[n++] = TEXT('0');
+    while (n > 0 && i < MaxDest - 1) pszDest[i++] = buf[--n];
+    return i;
+}
+
+// 命令列に従って出力する
+int RenderFormat(LPTSTR pszDest, int MaxDest, const FORMAT_TEMPLATE &Template, const FORMAT_PARAMS &Params)
+{
+    if (MaxDest <= 0) return 0;
+
+    JST_CIVIL civil;
+    DWORD mask = Params.mask;
+    if (mask & FORMAT_PARAM_START_TIME) {
+        JST_TIME t = FileTimeToJst(Params.startTime);
+        if (t >= 0) JstTimeToCivil(t, &civil);
+        else mask &= ~FORMAT_PARAM_START_TIME;
+    }
+
+    int i = 0;
+    for (int n = 0; n < Template.numOps && i < MaxDest - 1; ++n) {
+        const FORMAT_TEMPLATE::OP &op = Template.ops[n];
+        if (op.code == OP_TEXT || !(mask & MACRO_LIST[op.code - 1].paramMask)) {
+            i = AppendText(pszDest, MaxDest, i, &Template.source[op.pos], op.len);
+            continue;
+        }
+        switch (op.code) {
+        case OP_DATE:
+            i = AppendNumber(pszDest, MaxDest, i, civil.year, 1, 10);
+            i = AppendNumber(pszDest, MaxDest, i, civil.month, 2, 10);
+            i = AppendNumber(pszDest, MaxDest, i, civil.day, 2, 10);
+            break;
+        case OP_YEAR:
+        case OP_YEAR2:
+            i = AppendNumber(pszDest, MaxDest, i, op.code == OP_YEAR ? civil.year : civil.year % 100, op.code == OP_YEAR ? 1 : 2, 10);
+            break;
+        case OP_MONTH:
+        case OP_MONTH2:
+            i = AppendNumber(pszDest, MaxDest, i, civil.month, op.code == OP_MONTH ? 1 : 2, 10);
+            break;
+        case OP_DAY:
+        case OP_DAY2:
+            i = AppendNumber(pszDest, MaxDest, i, civil.day, op.code == OP_DAY ? 1 : 2, 10);
+            break;
+        case OP_TIME:
+            i = AppendNumber(pszDest, MaxDest, i, civil.hour, 2, 10);
+            i = AppendNumber(pszDest, MaxDest, i, civil.minute, 2, 10);
+            i = AppendNumber(pszDest, MaxDest, i, civil.second, 2, 10);
+            break;
+        case OP_HOUR:
+        case OP_HOUR2:
+            i = AppendNumber(pszDest, MaxDest, i, civil.hour, op.code == OP_HOUR ? 1 : 2, 10);
+            break;
+        case OP_MINUTE:
+        case OP_MINUTE2:
+            i = AppendNumber(pszDest, MaxDest, i, civil.minute, op.code == OP_MINUTE ? 1 : 2, 10);
+            break;
+        case OP_SECOND:
+        case OP_SECOND2:
+            i = AppendNumber(pszDest, MaxDest, i, civil.second, op.code == OP_SECOND ? 1 : 2, 10);
+            break;
+        case OP_DAY_OF_WEEK:
+            {
+                LPCTSTR text = GetDayOfWeekText(civil.dayOfWeek);
+                i = AppendText(pszDest, MaxDest, i, text, ::lstrlen(text));
+            }
+            break;
+        case OP_EVENT_NAME:
+        case OP_SERVICE_NAME:
+            {
+                LPCTSTR text = op.code == OP_EVENT_NAME ? Params.pszEventName : Params.pszServiceName;
+                if (text) {
+                    int start = i;
+                    i = AppendText(pszDest, MaxDest, i, text, ::lstrlen(text));
+                    pszDest[i] = 0;
+                    TranslateText(&pszDest[start], FILE_NAME_TR);
+                }
+            }
+            break;
+        case OP_EVENT_ID:
+            i = AppendNumber(pszDest, MaxDest, i, Params.eventID, 4, 16);
+            break;
+        case OP_DURATION:
+            // 分単位
+            i = AppendNumber(pszDest, MaxDest, i, max(Params.duration, 0) / 60, 1, 10);
+            break;
+        case OP_ONID:
+        case OP_SID:
+            i = AppendNumber(pszDest, MaxDest, i, op.code == OP_ONID ? Params.networkID : Params.serviceID, 1, 10);
+            break;
+        case OP_GENRE:
+            if (Params.genre >= 0) {
+                // 先頭は"すべて"
+                LPCTSTR text = g_nibble1List[Params.genre <= 0x0B ? Params.genre + 1 : ARRAY_SIZE(g_nibble1List) - 1];
+                int start = i;
+                i = AppendText(pszDest, MaxDest, i, text, ::lstrlen(text));
+                pszDest[i] = 0;
+                TranslateText(&pszDest[start], FILE_NAME_TR);
+            }
+            break;
+        case OP_NUM:
+        case OP_NUM2:
+            if (Params.num > 0) i = AppendNumber(pszDest, MaxDest, i, Params.num, op.code == OP_NUM ? 1 : 2, 10);
+            break;
+        }
+    }
+    pszDest[i] = 0;
+    return i;
+}
+
+// コンパイル済みのフォーマットを取得する
+const FORMAT_TEMPLATE *GetCompiledFormat(LPCTSTR pszFormat)
+{
+    for (int i = 0; i < FORMAT_CACHE_MAX; ++i) {
+        if (g_formatCache[i].numOps > 0 && !::lstrcmp(g_formatCache[i].source, pszFormat)) {
+            return &g_formatCache[i];
+        }
+    }
+    FORMAT_TEMPLATE *pTemplate = &g_formatCache[g_formatCacheNext];
+    g_formatCacheNext = (g_formatCacheNext + 1) % FORMAT_CACHE_MAX;
+    CompileFormat(pTemplate, pszFormat);
+    return pTemplate;
+}
+
+// フォーマットが参照するFORMAT_PARAMSのメンバを取得する
+DWORD GetFormatParamMask(LPCTSTR pszFormat)
+{
+    return GetCompiledFormat(pszFormat)->paramMask;
+}
+
+// ファイル名のフォーマット指示子を"部分的に"置換する
+// Paramsで有効でないものや未知の指示子は後でTVTestが置換できるように残す
+int FormatFileName(LPTSTR pszFileName, int MaxFileName, const FORMAT_PARAMS &Params, LPCTSTR pszFormat)
+{
+    return RenderFormat(pszFileName, MaxFileName, *GetCompiledFormat(pszFormat), Params);
+}
+
+// イベント名に"%num%"or"%num2"(連番)フォーマット指示子があれば置換する
+int FormatEventName(LPTSTR pszEventName, int MaxEventName, int num, LPCTSTR pszFormat)
+{
+    FORMAT_PARAMS params;
+    params.mask = FORMAT_PARAM_NUM;
+    params.num = num;
+    return RenderFormat(pszEventName, MaxEventName, *GetCompiledFormat(pszFormat), params);
+}
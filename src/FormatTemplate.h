@@ -0,0 +1,52 @@
+﻿#ifndef INCLUDE_FORMAT_TEMPLATE_H
+#define INCLUDE_FORMAT_TEMPLATE_H
+
+// FORMAT_PARAMSのどのメンバが有効か
+// 無効なメンバを参照するフォーマット指示子は置換せずにそのまま出力する
+enum {
+    FORMAT_PARAM_START_TIME   = 0x0001,
+    FORMAT_PARAM_EVENT_NAME   = 0x0002,
+    FORMAT_PARAM_EVENT_ID     = 0x0004,
+    FORMAT_PARAM_DURATION     = 0x0008,
+    FORMAT_PARAM_SERVICE_ID   = 0x0010,
+    FORMAT_PARAM_SERVICE_NAME = 0x0020,
+    FORMAT_PARAM_GENRE        = 0x0040,
+    FORMAT_PARAM_NUM          = 0x0080,
+};
+
+struct FORMAT_PARAMS {
+    DWORD mask;
+    FILETIME startTime;
+    LPCTSTR pszEventName;
+    WORD eventID;
+    int duration;           // 秒
+    WORD networkID;
+    WORD serviceID;
+    LPCTSTR pszServiceName;
+    int genre;              // 大分類(0x00～0x0F)、ジャンルがなければ負
+    int num;                // 連番、0以下なら空文字列
+};
+
+// コンパイル済みのフォーマット文字列
+struct FORMAT_TEMPLATE {
+    static const int OPS_MAX = MAX_PATH / 2 + 1;
+    struct OP {
+        BYTE code;
+        WORD pos;   // sourceでの位置(置換しないときはここを出力する)
+        WORD len;
+    };
+    TCHAR source[MAX_PATH];
+    int numOps;
+    DWORD paramMask;    // 参照するFORMAT_PARAMSのメンバ
+    OP ops[OPS_MAX];
+};
+
+void CompileFormat(FORMAT_TEMPLATE *pTemplate, LPCTSTR pszFormat);
+int RenderFormat(LPTSTR pszDest, int MaxDest, const FORMAT_TEMPLATE &Template, const FORMAT_PARAMS &Params);
+const FORMAT_TEMPLATE *GetCompiledFormat(LPCTSTR pszFormat);
+DWORD GetFormatParamMask(LPCTSTR pszFormat);
+
+int FormatFileName(LPTSTR pszFileName, int MaxFileName, const FORMAT_PARAMS &Params, LPCTSTR pszFormat);
+int FormatEventName(LPTSTR pszEventName, int MaxEventName, int num, LPCTSTR pszFormat);
+
+#endif // INCLUDE_FORMAT_TEMPLATE_H
@@ -0,0 +1,348 @@
+﻿#include <Windows.h>
+#include <Shlwapi.h>
+#include "JstTime.h"
+#include "Util.h"
+#include "IniFile.h"
+
+
+static bool IsBlank(TCHAR c)
+{
+    return c == TEXT(' ') || c == TEXT('\t');
+}
+
+
+// 長さつき文字列とNUL終端文字列を大文字小文字を区別せずに比べる
+static bool EqualsIgnoreCase(LPCTSTR s, int len, LPCTSTR t)
+{
+    return ::StrCmpNI(s, t, len) == 0 && ::lstrlen(t) == len;
+}
+
+
+// 行がセクション名であれば名前の位置と長さを得る
+static bool ParseSection(LPCTSTR line, LPCTSTR *pName, int *pLen)
+{
+    while (IsBlank(*line)) ++line;
+    if (*line != TEXT('[')) return false;
+    LPCTSTR p = ++line;
+    while (*p && *p != TEXT(']')) ++p;
+    while (IsBlank(*line)) ++line;
+    while (p > line && IsBlank(p[-1])) --p;
+    *pName = line;
+    *pLen = static_cast<int>(p - line);
+    return true;
+}
+
+
+// 行がキーであれば名前と値の位置と長さを得る
+static bool ParseKey(LPCTSTR line, LPCTSTR *pKey, int *pKeyLen, LPCTSTR *pValue, int *pValueLen)
+{
+    while (IsBlank(*line)) ++line;
+    if (!*line || *line == TEXT(';') || *line == TEXT('[')) return false;
+    LPCTSTR p = line;
+    while (*p && *p != TEXT('=')) ++p;
+    if (!*p) return false;
+    *pKey = line;
+    *pKeyLen = static_cast<int>(p - line);
+    while (*pKeyLen > 0 && IsBlank(line[*pKeyLen - 1])) --*pKeyLen;
+
+    for (++p; IsBlank(*p); ++p);
+    *pValue = p;
+    *pValueLen = ::lstrlen(p);
+    while (*pValueLen > 0 && IsBlank(p[*pValueLen - 1])) --*pValueLen;
+    return true;
+}
+
+
+CIniFile::CIniFile()
+    : m_lines(NULL)
+    , m_lineCount(0)
+    , m_lineSize(0)
+    , m_fUnicode(false)
+    , m_fModified(false)
+{
+    m_fileName[0] = 0;
+}
+
+
+CIniFile::~CIniFile()
+{
+    Clear();
+}
+
+
+void CIniFile::Clear()
+{
+    for (int i = 0; i < m_lineCount; ++i) delete [] m_lines[i];
+    delete [] m_lines;
+    m_lines = NULL;
+    m_lineCount = m_lineSize = 0;
+    m_fModified = false;
+}
+
+
+// ファイルを読み込む。ファイルが存在しなければ空として扱う
+bool CIniFile::Load(LPCTSTR fileName)
+{
+    Clear();
+    m_fUnicode = false;
+    ::lstrcpyn(m_fileName, fileName, ARRAY_SIZE(m_fileName));
+    if (!m_fileName[0]) return false;
+
+    // 書き込み側はファイルを置き換えるので、共有違反が続かないかぎり書きかけの内容は読まない
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    for (int i = 0; i < 5; ++i) {
+        hFile = ::CreateFile(m_fileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                             NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile != INVALID_HANDLE_VALUE || ::GetLastError() != ERROR_SHARING_VIOLATION) break;
+        ::Sleep(200);
+    }
+    if (hFile == INVALID_HANDLE_VALUE) {
+        DWORD err = ::GetLastError();
+        return err == ERROR_FILE_NOT_FOUND || err == ERROR_PATH_NOT_FOUND;
+    }
+
+    bool fRet = false;
+    DWORD sizeHigh;
+    DWORD size = ::GetFileSize(hFile, &sizeHigh);
+    if (size != INVALID_FILE_SIZE && sizeHigh == 0 && size <= FILE_MAX_SIZE) {
+        BYTE *buf = new BYTE[size + sizeof(WCHAR)];
+        DWORD read;
+        if (::ReadFile(hFile, buf, size, &read, NULL) && read == size) {
+            if (size >= 2 && buf[0] == 0xFF && buf[1] == 0xFE) {
+                LPWSTR text = reinterpret_cast<LPWSTR>(buf + 2);
+                text[(size - 2) / sizeof(WCHAR)] = 0;
+                Parse(text);
+                m_fUnicode = true;
+            }
+            else {
+                LPCSTR src = reinterpret_cast<LPCSTR>(buf);
+                int len = size == 0 ? 0 : ::MultiByteToWideChar(CP_ACP, 0, src, size, NULL, 0);
+                LPWSTR text = new WCHAR[len + 1];
+                if (len > 0) len = ::MultiByteToWideChar(CP_ACP, 0, src, size, text, len);
+                text[max(len, 0)] = 0;
+                Parse(text);
+                delete [] text;
+            }
+            fRet = true;
+        }
+        delete [] buf;
+    }
+    ::CloseHandle(hFile);
+    return fRet;
+}
+
+
+// 変更があればファイルに書き戻す
+// 一時ファイルに書いてから置き換えるので、他のプロセスが書きかけの内容を読むことはない
+bool CIniFile::Save()
+{
+    if (!m_fModified) return true;
+    if (!m_fileName[0]) return false;
+
+    int len = 1;
+    for (int i = 0; i < m_lineCount; ++i) len += ::lstrlen(m_lines[i]) + 2;
+    LPWSTR text = new WCHAR[len + 1];
+    LPWSTR p = text;
+    *p++ = L'\xFEFF';
+    for (int i = 0; i < m_lineCount; ++i) {
+        int n = ::lstrlen(m_lines[i]);
+        ::CopyMemory(p, m_lines[i], n * sizeof(WCHAR));
+        p += n;
+        *p++ = L'\r';
+        *p++ = L'\n';
+    }
+    *p = 0;
+    len = static_cast<int>(p - text);
+
+    const BYTE *data = reinterpret_cast<const BYTE*>(text);
+    DWORD dataSize = len * sizeof(WCHAR);
+    char *mbText = NULL;
+    if (!m_fUnicode) {
+        // BOMは除く
+        int mbLen = len <= 1 ? 0 : ::WideCharToMultiByte(CP_ACP, 0, text + 1, len - 1, NULL, 0, NULL, NULL);
+        mbText = new char[mbLen + 1];
+        if (mbLen > 0) mbLen = ::WideCharToMultiByte(CP_ACP, 0, text + 1, len - 1, mbText, mbLen, NULL, NULL);
+        data = reinterpret_cast<const BYTE*>(mbText);
+        dataSize = max(mbLen, 0);
+    }
+
+    TCHAR tmpName[MAX_PATH + 8];
+    ::lstrcpy(tmpName, m_fileName);
+    ::lstrcat(tmpName, TEXT(".tmp"));
+
+    bool fRet = false;
+    HANDLE hFile = ::CreateFile(tmpName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile != INVALID_HANDLE_VALUE) {
+        DWORD written;
+        fRet = ::WriteFile(hFile, data, dataSize, &written, NULL) && written == dataSize &&
+               ::FlushFileBuffers(hFile);
+        ::CloseHandle(hFile);
+        if (fRet) {
+            // 読み込み中のプロセスがあると置き換えに失敗することがあるので何度か試す
+            fRet = false;
+            for (int i = 0; i < 5; ++i) {
+                if (::MoveFileEx(tmpName, m_fileName, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+                    fRet = true;
+                    break;
+                }
+                ::Sleep(200);
+            }
+        }
+        if (!fRet) ::DeleteFile(tmpName);
+    }
+    delete [] mbText;
+    delete [] text;
+
+    if (fRet) m_fModified = false;
+    return fRet;
+}
+
+
+// テキストを行に分けて保持する(ファイルを読まずに解析だけ行うときにも使う)
+void CIniFile::Parse(LPCTSTR text)
+{
+    Clear();
+    while (*text) {
+        LPCTSTR p = text;
+        while (*p && *p != TEXT('\r') && *p != TEXT('\n')) ++p;
+        int len = static_cast<int>(p - text);
+        LPTSTR line = new TCHAR[len + 1];
+        ::CopyMemory(line, text, len * sizeof(TCHAR));
+        line[len] = 0;
+        InsertLine(m_lineCount, line);
+        if (*p == TEXT('\r')) ++p;
+        if (*p == TEXT('\n')) ++p;
+        text = p;
+    }
+    m_fModified = false;
+}
+
+
+// キーのある行を探す。見つからなければ-1を返す
+// pInsertPosにはキーを追加すべき行(セクション最後の空行でない行の次)、セクションがなければ-1が入る
+int CIniFile::FindKey(LPCTSTR section, LPCTSTR key, int *pInsertPos) const
+{
+    bool fInSection = false;
+    *pInsertPos = -1;
+    for (int i = 0; i < m_lineCount; ++i) {
+        LPCTSTR name, value;
+        int nameLen, valueLen;
+        if (ParseSection(m_lines[i], &name, &nameLen)) {
+            // 同名のセクションが複数あれば最初のものを使う
+            if (fInSection) break;
+            if (EqualsIgnoreCase(name, nameLen, section)) {
+                fInSection = true;
+                *pInsertPos = i + 1;
+            }
+        }
+        else if (fInSection) {
+            if (ParseKey(m_lines[i], &name, &nameLen, &value, &valueLen) &&
+                EqualsIgnoreCase(name, nameLen, key)) return i;
+            LPCTSTR p = m_lines[i];
+            while (IsBlank(*p)) ++p;
+            if (*p) *pInsertPos = i + 1;
+        }
+    }
+    return -1;
+}
+
+
+void CIniFile::InsertLine(int index, LPTSTR line)
+{
+    if (m_lineCount >= m_lineSize) {
+        int size = max(m_lineSize * 2, 64);
+        LPTSTR *lines = new LPTSTR[size];
+        if (m_lines) ::CopyMemory(lines, m_lines, m_lineCount * sizeof(LPTSTR));
+        delete [] m_lines;
+        m_lines = lines;
+        m_lineSize = size;
+    }
+    for (int i = m_lineCount; i > index; --i) m_lines[i] = m_lines[i - 1];
+    m_lines[index] = line;
+    ++m_lineCount;
+}
+
+
+// GetPrivateProfileInt()と同じく、数値として解釈できなければ0を返す
+int CIniFile::GetInt(LPCTSTR section, LPCTSTR key, int defaultValue) const
+{
+    int insertPos;
+    if (FindKey(section, key, &insertPos) < 0) return defaultValue;
+    TCHAR str[32];
+    GetString(section, key, TEXT(""), str, ARRAY_SIZE(str));
+    int value;
+    return ::StrToIntEx(str, STIF_SUPPORT_HEX, &value) ? value : 0;
+}
+
+
+void CIniFile::GetString(LPCTSTR section, LPCTSTR key, LPCTSTR defaultValue, LPTSTR str, int max) const
+{
+    int insertPos;
+    int i = FindKey(section, key, &insertPos);
+    if (i < 0) {
+        ::lstrcpyn(str, defaultValue, max);
+        return;
+    }
+    LPCTSTR name, value;
+    int nameLen, valueLen;
+    ParseKey(m_lines[i], &name, &nameLen, &value, &valueLen);
+    // 対になった引用符は取り除く
+    if (valueLen >= 2 && (value[0] == TEXT('"') || value[0] == TEXT('\'')) && value[valueLen - 1] == value[0]) {
+        ++value;
+        valueLen -= 2;
+    }
+    ::lstrcpyn(str, value, min(valueLen + 1, max));
+}
+
+
+void CIniFile::SetInt(LPCTSTR section, LPCTSTR key, int value)
+{
+    TCHAR str[32];
+    ::wsprintf(str, TEXT("%d"), value);
+    SetString(section, key, str);
+}
+
+
+void CIniFile::SetString(LPCTSTR section, LPCTSTR key, LPCTSTR value)
+{
+    int keyLen = ::lstrlen(key);
+    int valueLen = ::lstrlen(value);
+    // 引用符で囲まれた値は読み込み時に取り除かれないようにさらに囲む
+    bool fQuote = valueLen >= 2 && value[0] == TEXT('"') && value[valueLen - 1] == TEXT('"');
+
+    LPTSTR line = new TCHAR[keyLen + valueLen + 4];
+    LPTSTR p = line;
+    ::CopyMemory(p, key, keyLen * sizeof(TCHAR));
+    p += keyLen;
+    *p++ = TEXT('=');
+    if (fQuote) *p++ = TEXT('"');
+    ::CopyMemory(p, value, valueLen * sizeof(TCHAR));
+    p += valueLen;
+    if (fQuote) *p++ = TEXT('"');
+    *p = 0;
+
+    int insertPos;
+    int i = FindKey(section, key, &insertPos);
+    if (i >= 0) {
+        if (!::lstrcmp(m_lines[i], line)) {
+            delete [] line;
+            return;
+        }
+        delete [] m_lines[i];
+        m_lines[i] = line;
+    }
+    else {
+        if (insertPos < 0) {
+            int sectionLen = ::lstrlen(section);
+            LPTSTR header = new TCHAR[sectionLen + 3];
+            header[0] = TEXT('[');
+            ::CopyMemory(header + 1, section, sectionLen * sizeof(TCHAR));
+            header[sectionLen + 1] = TEXT(']');
+            header[sectionLen + 2] = 0;
+            InsertLine(m_lineCount, header);
+            insertPos = m_lineCount;
+        }
+        InsertLine(insertPos, line);
+    }
+    m_fModified = true;
+}
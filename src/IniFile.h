@@ -0,0 +1,41 @@
+﻿#ifndef INCLUDE_INI_FILE_H
+#define INCLUDE_INI_FILE_H
+
+// INIファイルを一度に読み込んでメモリ上で読み書きし、まとめて書き戻す
+// GetPrivateProfile*()はキーごとにファイルを開いて解析するので、設定が多いと遅い
+// 解釈はGetPrivateProfile*()にあわせる(セクション名とキー名は大文字小文字を区別しない、
+// 値の前後の空白と対になった引用符は取り除く)。コメントや知らない行はそのまま書き戻す
+class CIniFile
+{
+public:
+    // 読み込むファイルの最大バイト数
+    static const DWORD FILE_MAX_SIZE = 1024 * 1024;
+
+    CIniFile();
+    ~CIniFile();
+    bool Load(LPCTSTR fileName);
+    bool Save();
+    void Parse(LPCTSTR text);
+    int GetInt(LPCTSTR section, LPCTSTR key, int defaultValue) const;
+    void GetString(LPCTSTR section, LPCTSTR key, LPCTSTR defaultValue, LPTSTR str, int max) const;
+    void SetInt(LPCTSTR section, LPCTSTR key, int value);
+    void SetString(LPCTSTR section, LPCTSTR key, LPCTSTR value);
+    bool IsModified() const { return m_fModified; }
+private:
+    CIniFile(const CIniFile&);
+    CIniFile &operator=(const CIniFile&);
+    void Clear();
+    int FindKey(LPCTSTR section, LPCTSTR key, int *pInsertPos) const;
+    void InsertLine(int index, LPTSTR line);
+
+    // 改行を含まない各行(new[]で確保)
+    LPTSTR *m_lines;
+    int m_lineCount;
+    int m_lineSize;
+    // UTF-16LE(BOM付き)のファイルならtrue。falseならANSIで読み書きする
+    bool m_fUnicode;
+    bool m_fModified;
+    TCHAR m_fileName[MAX_PATH];
+};
+
+#endif // INCLUDE_INI_FILE_H
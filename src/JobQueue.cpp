@@ -0,0 +1,288 @@
+﻿#include <Windows.h>
+#include <Shlwapi.h>
+#include "JstTime.h"
+#include "Util.h"
+#include "JobQueue.h"
+
+
+CJobQueue::CJobQueue()
+    : m_head(NULL)
+    , m_tail(NULL)
+    , m_pendingCount(0)
+    , m_runningCount(0)
+    , m_fLowPriority(false)
+{
+    m_saveFileName[0] = 0;
+}
+
+
+CJobQueue::~CJobQueue()
+{
+    Finalize();
+    Clear();
+}
+
+
+void CJobQueue::SetPluginFileName(LPCTSTR fileName)
+{
+    TCHAR saveFileName[MAX_PATH + 32];
+    ::lstrcpy(saveFileName, fileName);
+    ::PathRemoveExtension(saveFileName);
+    ::lstrcat(saveFileName, TEXT("_Jobs.txt"));
+    ::lstrcpyn(m_saveFileName, saveFileName, ARRAY_SIZE(m_saveFileName));
+}
+
+
+// 待機中のジョブをすべて破棄する
+void CJobQueue::Clear()
+{
+    while (m_head) {
+        JOB *pNext = m_head->next;
+        delete m_head;
+        m_head = pNext;
+    }
+    m_tail = NULL;
+    m_pendingCount = 0;
+}
+
+
+// 待機列の末尾にジョブを加える
+void CJobQueue::Append(JOB *pJob)
+{
+    // あふれたら古いものから捨てる
+    if (m_pendingCount >= PENDING_MAX && m_head) {
+        JOB *pNext = m_head->next;
+        delete m_head;
+        m_head = pNext;
+        if (!m_head) m_tail = NULL;
+        --m_pendingCount;
+    }
+    pJob->next = NULL;
+    if (m_tail) m_tail->next = pJob;
+    else m_head = pJob;
+    m_tail = pJob;
+    ++m_pendingCount;
+}
+
+
+// ジョブを追加する
+bool CJobQueue::Push(LPCTSTR commandLine, LPCTSTR currentDirectory, int retry)
+{
+    if (!commandLine[0]) return false;
+
+    JOB *pJob = new JOB;
+    pJob->retry = max(retry, 0);
+    pJob->readyTick = ::GetTickCount();
+    ::lstrcpyn(pJob->currentDirectory, currentDirectory ? currentDirectory : TEXT(""), ARRAY_SIZE(pJob->currentDirectory));
+    ::lstrcpyn(pJob->commandLine, commandLine, ARRAY_SIZE(pJob->commandLine));
+    Append(pJob);
+    Save();
+    return true;
+}
+
+
+// 終了したジョブを回収し、空きがあれば待機中のジョブを起動する
+// 戻り値は再実行せずに失敗とみなしたジョブの数
+int CJobQueue::Dispatch(int maxRunning, bool fLowPriority, int *pCompleted, DWORD *pFailedExitCode)
+{
+    int failed = 0;
+    bool fUpdated = false;
+    *pCompleted = 0;
+
+    for (int i = 0; i < m_runningCount;) {
+        if (::WaitForSingleObject(m_running[i].hProcess, 0) != WAIT_OBJECT_0) {
+            ++i;
+            continue;
+        }
+        DWORD exitCode;
+        if (!::GetExitCodeProcess(m_running[i].hProcess, &exitCode)) exitCode = static_cast<DWORD>(-1);
+        ::CloseHandle(m_running[i].hProcess);
+        JOB *pJob = m_running[i].pJob;
+        m_running[i] = m_running[--m_runningCount];
+
+        if (exitCode == 0) {
+            delete pJob;
+            ++*pCompleted;
+        }
+        else if (RetryOrDelete(pJob)) {
+            fUpdated = true;
+        }
+        else {
+            *pFailedExitCode = exitCode;
+            ++failed;
+        }
+    }
+
+    // 録画中は実行中のジョブの優先度を下げる
+    if (fLowPriority != m_fLowPriority) {
+        m_fLowPriority = fLowPriority;
+        for (int i = 0; i < m_runningCount; ++i) {
+            ::SetPriorityClass(m_running[i].hProcess, fLowPriority ? BELOW_NORMAL_PRIORITY_CLASS : NORMAL_PRIORITY_CLASS);
+        }
+    }
+
+    maxRunning = min(max(maxRunning, 1), RUNNING_MAX);
+    DWORD tick = ::GetTickCount();
+    JOB *pPrev = NULL;
+    for (JOB *pJob = m_head; pJob && m_runningCount < maxRunning;) {
+        JOB *pNext = pJob->next;
+        if (static_cast<int>(tick - pJob->readyTick) < 0) {
+            // 再実行待ち
+            pPrev = pJob;
+            pJob = pNext;
+            continue;
+        }
+        // 待機列から外す
+        if (pPrev) pPrev->next = pNext;
+        else m_head = pNext;
+        if (m_tail == pJob) m_tail = pPrev;
+        --m_pendingCount;
+        fUpdated = true;
+
+        HANDLE hProcess;
+        if (Execute(pJob, &hProcess)) {
+            m_running[m_runningCount].pJob = pJob;
+            m_running[m_runningCount].hProcess = hProcess;
+            ++m_runningCount;
+        }
+        else if (!RetryOrDelete(pJob)) {
+            *pFailedExitCode = static_cast<DWORD>(-1);
+            ++failed;
+        }
+        pJob = pNext;
+    }
+
+    if (fUpdated) Save();
+    return failed;
+}
+
+
+// 残りの再実行回数があれば待機列に戻し、なければ破棄する
+bool CJobQueue::RetryOrDelete(JOB *pJob)
+{
+    if (pJob->retry <= 0) {
+        delete pJob;
+        return false;
+    }
+    --pJob->retry;
+    pJob->readyTick = ::GetTickCount() + RETRY_DELAY;
+    Append(pJob);
+    return true;
+}
+
+
+// 実行中のジョブの管理をやめる
+// プロセスはそのまま実行を続ける
+void CJobQueue::Finalize()
+{
+    for (int i = 0; i < m_runningCount; ++i) {
+        ::CloseHandle(m_running[i].hProcess);
+        delete m_running[i].pJob;
+    }
+    m_runningCount = 0;
+}
+
+
+bool CJobQueue::Execute(const JOB *pJob, HANDLE *phProcess) const
+{
+    // CreateProcess()は引数を書き換えることがある
+    TCHAR commandLine[COMMAND_LINE_MAX];
+    ::lstrcpy(commandLine, pJob->commandLine);
+
+    STARTUPINFO si = { sizeof(si) };
+    PROCESS_INFORMATION ps;
+    if (!::CreateProcess(NULL, commandLine, NULL, NULL, FALSE, m_fLowPriority ? BELOW_NORMAL_PRIORITY_CLASS : 0, NULL,
+                         pJob->currentDirectory[0] ? pJob->currentDirectory : NULL, &si, &ps)) return false;
+    ::CloseHandle(ps.hThread);
+    *phProcess = ps.hProcess;
+    return true;
+}
+
+
+// 書式: 残り再実行回数<TAB>カレントディレクトリ<TAB>コマンドライン
+LPTSTR CJobQueue::NewJobString(const JOB &job)
+{
+    LPTSTR str = new TCHAR[16 + (::lstrlen(job.currentDirectory) + ::lstrlen(job.commandLine)) * 2 + 4];
+    LPTSTR tail = str + ::wsprintf(str, TEXT("%d\t"), job.retry);
+    tail = EscapeTextField(tail, job.currentDirectory);
+    *tail++ = TEXT('\t');
+    tail = EscapeTextField(tail, job.commandLine);
+    ::lstrcpy(tail, TEXT("\r\n"));
+    return str;
+}
+
+
+CJobQueue::JOB *CJobQueue::NewJobFromString(LPCTSTR str)
+{
+    int retry = ::StrToInt(str);
+    if (!NextToken(&str)) return NULL;
+
+    JOB *pJob = new JOB;
+    pJob->retry = max(retry, 0);
+    pJob->readyTick = ::GetTickCount();
+    UnescapeTextField(str, pJob->currentDirectory, ARRAY_SIZE(pJob->currentDirectory));
+    if (!NextToken(&str)) {
+        delete pJob;
+        return NULL;
+    }
+    UnescapeTextField(str, pJob->commandLine, ARRAY_SIZE(pJob->commandLine));
+    if (!pJob->commandLine[0]) {
+        delete pJob;
+        return NULL;
+    }
+    return pJob;
+}
+
+
+bool CJobQueue::Load()
+{
+    if (!::PathFileExists(m_saveFileName)) {
+        Clear();
+        return true;
+    }
+    LPTSTR text = NULL;
+    for (int i = 0; i < 5; ++i) {
+        if ((text = NewReadTextFileToEnd(m_saveFileName, FILE_SHARE_READ)) != NULL) break;
+        ::Sleep(200);
+    }
+    if (!text) return false;
+
+    Clear();
+
+    for (LPCTSTR line = text; line && *line;) {
+        JOB *pJob = NewJobFromString(line);
+        if (pJob) Append(pJob);
+        line = ::StrChr(line, TEXT('\n'));
+        if (line) ++line;
+    }
+
+    delete [] text;
+    return true;
+}
+
+
+bool CJobQueue::Save() const
+{
+    if (!m_saveFileName[0]) return false;
+
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    for (int i = 0; i < 5; ++i) {
+        hFile = ::CreateFile(m_saveFileName, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile != INVALID_HANDLE_VALUE) break;
+        ::Sleep(200);
+    }
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+
+    DWORD writtenBytes;
+    WCHAR bom = L'\xFEFF';
+    ::WriteFile(hFile, &bom, sizeof(bom), &writtenBytes, NULL);
+
+    for (const JOB *pJob = m_head; pJob; pJob = pJob->next) {
+        LPTSTR str = NewJobString(*pJob);
+        ::WriteFile(hFile, str, ::lstrlen(str) * sizeof(TCHAR), &writtenBytes, NULL);
+        delete [] str;
+    }
+
+    ::CloseHandle(hFile);
+    return true;
+}
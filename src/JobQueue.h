@@ -0,0 +1,57 @@
+﻿#ifndef INCLUDE_JOB_QUEUE_H
+#define INCLUDE_JOB_QUEUE_H
+
+// 録画開始/終了時コマンドなどの実行待ち行列
+class CJobQueue
+{
+public:
+    // 同時実行数の設定上限
+    static const int RUNNING_MAX = 8;
+    // 待機できるジョブの最大数(これを超えると古いものから捨てる)
+    static const int PENDING_MAX = 64;
+    // 失敗したジョブを再実行するまでの待ち時間(ミリ秒)
+    static const DWORD RETRY_DELAY = 60000;
+    static const int COMMAND_LINE_MAX = MAX_PATH * 3;
+
+    struct JOB {
+        int retry;                          // 残りの再実行回数
+        DWORD readyTick;                    // この時刻以降に実行する
+        TCHAR currentDirectory[MAX_PATH];
+        TCHAR commandLine[COMMAND_LINE_MAX];
+        JOB *next;
+    };
+
+    CJobQueue();
+    ~CJobQueue();
+    void SetPluginFileName(LPCTSTR fileName);
+    bool Load();
+    bool Save() const;
+    bool Push(LPCTSTR commandLine, LPCTSTR currentDirectory, int retry);
+    int Dispatch(int maxRunning, bool fLowPriority, int *pCompleted, DWORD *pFailedExitCode);
+    void Finalize();
+    int GetPendingCount() const { return m_pendingCount; }
+    int GetRunningCount() const { return m_runningCount; }
+    const JOB &GetRunningJob(int index) const { return *m_running[index].pJob; }
+private:
+    struct RUNNING {
+        JOB *pJob;
+        HANDLE hProcess;
+    };
+
+    JOB *m_head;
+    JOB *m_tail;
+    int m_pendingCount;
+    RUNNING m_running[RUNNING_MAX];
+    int m_runningCount;
+    bool m_fLowPriority;
+    TCHAR m_saveFileName[MAX_PATH];
+
+    void Clear();
+    void Append(JOB *pJob);
+    bool Execute(const JOB *pJob, HANDLE *phProcess) const;
+    bool RetryOrDelete(JOB *pJob);
+    static LPTSTR NewJobString(const JOB &job);
+    static JOB *NewJobFromString(LPCTSTR str);
+};
+
+#endif // INCLUDE_JOB_QUEUE_H
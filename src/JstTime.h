@@ -0,0 +1,123 @@
+﻿#ifndef INCLUDE_JST_TIME_H
+#define INCLUDE_JST_TIME_H
+
+// 放送時刻(JST)を扱う64ビット整数型
+// 値は1601-01-01T00:00:00(JST)からの100ナノ秒単位の経過時間で、このプラグインが
+// 扱うFILETIME(JSTとして解釈している)とビット表現が同じ
+// Win32に依存しないので単体でテストやベンチマークができる
+
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define JST_CONSTEXPR inline
+#else
+#define JST_CONSTEXPR constexpr
+#endif
+
+typedef long long JST_TIME;
+
+#define JST_TIME_MILLISECOND    10000LL
+#define JST_TIME_SECOND         (1000LL*JST_TIME_MILLISECOND)
+#define JST_TIME_MINUTE         (60LL*JST_TIME_SECOND)
+#define JST_TIME_HOUR           (60LL*JST_TIME_MINUTE)
+#define JST_TIME_DAY            (24LL*JST_TIME_HOUR)
+
+// 0000-03-01から1601-01-01までの日数
+#define JST_DAYS_0000_03_01     584694
+// 1601-01-01からMJDの起点(1858-11-17)までの日数
+#define JST_DAYS_MJD_EPOCH      94187
+
+struct JST_CIVIL {
+    int year;
+    int month;
+    int day;
+    int dayOfWeek;  // 0=日曜
+    int hour;
+    int minute;
+    int second;
+    int milliseconds;
+};
+
+// 3月始まりの年yearの年始から数えてdoy日目の、0000-03-01からの日数
+JST_CONSTEXPR int JstDaysFromMarchYear(int year, int doy)
+{
+    return year / 400 * 146097 + year % 400 * 365 + year % 400 / 4 - year % 400 / 100 + doy;
+}
+
+// 年月日を1601-01-01からの日数に変換する(1601年以降であること)
+JST_CONSTEXPR int JstDaysFromCivil(int year, int month, int day)
+{
+    return JstDaysFromMarchYear(month > 2 ? year : year - 1,
+                                (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1) - JST_DAYS_0000_03_01;
+}
+
+// 1601-01-01は月曜
+JST_CONSTEXPR int JstDayOfWeek(int days)
+{
+    return (days + 1) % 7;
+}
+
+JST_CONSTEXPR JST_TIME JstMakeTime(int year, int month, int day, int hour, int minute, int second)
+{
+    return JstDaysFromCivil(year, month, day) * JST_TIME_DAY +
+           ((hour * 60 + minute) * 60 + second) * JST_TIME_SECOND;
+}
+
+JST_CONSTEXPR int JstGetDays(JST_TIME t)
+{
+    return static_cast<int>(t / JST_TIME_DAY);
+}
+
+// 0時からの秒数
+// 64ビットの剰余はランタイムの_allremを呼ぶので除算と乗算で求める
+JST_CONSTEXPR int JstGetSecondsOfDay(JST_TIME t)
+{
+    return static_cast<int>((t - t / JST_TIME_DAY * JST_TIME_DAY) / JST_TIME_SECOND);
+}
+
+JST_CONSTEXPR int JstBcdToInt(unsigned char bcd)
+{
+    return (bcd >> 4) * 10 + (bcd & 15);
+}
+
+JST_CONSTEXPR int JstDaysFromMjd(int mjd)
+{
+    return mjd + JST_DAYS_MJD_EPOCH;
+}
+
+// 1601-01-01からの日数を年月日に変換する
+inline void JstCivilFromDays(int days, int *pYear, int *pMonth, int *pDay)
+{
+    int z = days + JST_DAYS_0000_03_01;
+    int doe = z % 146097;
+    int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int mp = (5 * doy + 2) / 153;
+    *pDay = doy - (153 * mp + 2) / 5 + 1;
+    *pMonth = mp < 10 ? mp + 3 : mp - 9;
+    *pYear = z / 146097 * 400 + yoe + (*pMonth <= 2 ? 1 : 0);
+}
+
+inline void JstTimeToCivil(JST_TIME t, JST_CIVIL *pCivil)
+{
+    int days = JstGetDays(t);
+    int sec = JstGetSecondsOfDay(t);
+    JstCivilFromDays(days, &pCivil->year, &pCivil->month, &pCivil->day);
+    pCivil->dayOfWeek = JstDayOfWeek(days);
+    pCivil->hour = sec / 3600;
+    pCivil->minute = sec / 60 % 60;
+    pCivil->second = sec % 60;
+    pCivil->milliseconds = static_cast<int>((t - t / JST_TIME_SECOND * JST_TIME_SECOND) / JST_TIME_MILLISECOND);
+}
+
+// ARIB STD-B10のMJD+BCD形式(5バイト)の日時を変換する
+inline bool JstTimeFromArib(const unsigned char *pData, JST_TIME *pTime)
+{
+    // 全ビットが1のときは未定義
+    if (pData[0] == 0xFF && pData[1] == 0xFF && pData[2] == 0xFF && pData[3] == 0xFF && pData[4] == 0xFF) {
+        return false;
+    }
+    *pTime = JstDaysFromMjd(pData[0] << 8 | pData[1]) * JST_TIME_DAY +
+             ((JstBcdToInt(pData[2]) * 60 + JstBcdToInt(pData[3])) * 60 + JstBcdToInt(pData[4])) * JST_TIME_SECOND;
+    return true;
+}
+
+#endif // INCLUDE_JST_TIME_H
@@ -1,16 +1,21 @@
 ﻿#include <Windows.h>
 #include <Shlwapi.h>
 #include "resource.h"
+#include "JstTime.h"
 #include "Util.h"
 #include "RecordingOption.h"
+#include "Stats.h"
 #include "ReserveList.h"
 #include "QueryList.h"
+#include "FormatTemplate.h"
 #include "NibbleList.h"
 
 
 CQueryList::CQueryList()
     : m_queriesLen(0)
+    , m_lineHashesLen(0)
 {
+    ::ZeroMemory(&m_fileStamp, sizeof(m_fileStamp));
     m_saveFileName[0] = 0;
 }
 
@@ -26,6 +31,7 @@ void CQueryList::Clear()
     while (m_queriesLen > 0) {
         delete m_queries[--m_queriesLen];
     }
+    m_lineHashesLen = 0;
 }
 
 
@@ -82,53 +88,58 @@ int CQueryList::Insert(int index, const QUERY &query)
 int CQueryList::Insert(int index, LPCTSTR str)
 {
     QUERY query;
+    return FromString(str, &query) ? Insert(index, query) : -1;
+}
+
+
+bool CQueryList::FromString(LPCTSTR str, QUERY *pQuery)
+{
+    QUERY &query = *pQuery;
     int i = 0;
 
     query.isEnabled = ::StrToInt(str) != 0;
-    if (!NextToken(&str)) return -1;
+    if (!NextToken(&str)) return false;
 
     ::StrToIntEx(str, STIF_SUPPORT_HEX, &i);
     query.networkID = static_cast<WORD>(i);
-    if (!NextToken(&str)) return -1;
+    if (!NextToken(&str)) return false;
 
     ::StrToIntEx(str, STIF_SUPPORT_HEX, &i);
     query.transportStreamID = static_cast<WORD>(i);
-    if (!NextToken(&str)) return -1;
+    if (!NextToken(&str)) return false;
 
     ::StrToIntEx(str, STIF_SUPPORT_HEX, &i);
     query.serviceID = static_cast<WORD>(i);
-    if (!NextToken(&str)) return -1;
+    if (!NextToken(&str)) return false;
 
     ::StrToIntEx(str, STIF_SUPPORT_HEX, &i);
     query.nibble1 = i >> 8 & 0xff;
     query.nibble2 = i & 0xff;
-    if (!NextToken(&str)) return -1;
+    if (!NextToken(&str)) return false;
 
-    if (!FlagStrToArray(str, query.daysOfWeek, 7)) return -1;
-    if (!NextToken(&str)) return -1;
+    if (!FlagStrToArray(str, query.daysOfWeek, 7)) return false;
+    if (!NextToken(&str)) return false;
 
-    if (!StrToTimeSpan(str, &query.start)) return -1;
+    if (!StrToTimeSpan(str, &query.start)) return false;
     if (query.start >= 24 * 60 * 60) query.start = 0;
-    if (!NextToken(&str)) return -1;
+    if (!NextToken(&str)) return false;
 
-    if (!StrToTimeSpan(str, &query.duration)) return -1;
+    if (!StrToTimeSpan(str, &query.duration)) return false;
     if (query.duration > 24 * 60 * 60) query.duration = 24 * 60 * 60;
-    if (!NextToken(&str)) return -1;
+    if (!NextToken(&str)) return false;
 
     query.reserveCount = ::StrToInt(str);
     if (query.reserveCount < 0) query.reserveCount = 0;
-    if (!NextToken(&str)) return -1;
+    if (!NextToken(&str)) return false;
 
     GetToken(str, query.keyword, ARRAY_SIZE(query.keyword));
-    if (!NextToken(&str)) return -1;
+    if (!NextToken(&str)) return false;
 
     GetToken(str, query.eventName, ARRAY_SIZE(query.eventName));
     if (!::lstrcmp(query.eventName, TEXT("*"))) query.eventName[0] = 0;
-    if (!NextToken(&str)) return -1;
+    if (!NextToken(&str)) return false;
 
-    if (!query.recOption.FromString(str)) return -1;
-
-    return Insert(index, query);
+    return query.recOption.FromString(str);
 }
 
 
@@ -332,6 +343,12 @@ int CQueryList::Delete(int index)
         m_queries[i] = m_queries[i + 1];
     }
     m_queriesLen--;
+    if (index < m_lineHashesLen) {
+        for (int i = index; i + 1 < m_lineHashesLen; i++) {
+            m_lineHashes[i] = m_lineHashes[i + 1];
+        }
+        m_lineHashesLen--;
+    }
 
     return index;
 }
@@ -377,8 +394,11 @@ bool CQueryList::CreateReserve(int index, RESERVE *pRes, WORD eventID, LPCTSTR e
 
 bool CQueryList::Load()
 {
-    if (!::PathFileExists(m_saveFileName)) {
+    // 読み込み中に書き換えられたときは次の変更通知で取り込めるよう、読む前の状態を記録する
+    FILE_STAMP stamp;
+    if (!GetFileStamp(m_saveFileName, &stamp)) {
         Clear();
+        m_fileStamp = stamp;
         return true;
     }
     LPTSTR text = NULL;
@@ -391,18 +411,82 @@ bool CQueryList::Load()
     Clear();
 
     for (LPCTSTR line = text; line; ) {
-        if (Insert(-1, line) < 0) {
+        int index = Insert(-1, line);
+        if (index < 0) {
             DEBUG_OUT(TEXT("CQueryList::Load(): Insert Error\n"));
         }
+        else {
+            m_lineHashes[index].hash = HashLine(line, &m_lineHashes[index].length);
+            m_lineHashesLen = index + 1;
+        }
         line = ::StrChr(line, TEXT('\n'));
         if (line) ++line;
     }
+    m_fileStamp = stamp;
 
     delete [] text;
     return true;
 }
 
 
+// 外部で書き換えられたクエリファイルのうち、前回の読み書きから変化した行のクエリだけを置き換える
+// クエリは位置で対応づける(途中に行を挿入すると以降の行はすべて置き換わる)
+// 戻り値: 反映したとき1、変化がなかったとき0、読み込みに失敗したとき-1
+int CQueryList::Merge()
+{
+    FILE_STAMP stamp;
+    bool fExists = GetFileStamp(m_saveFileName, &stamp);
+    if (stamp == m_fileStamp) return 0;
+
+    LPTSTR text = NULL;
+    if (fExists) {
+        for (int i = 0; i < 5; ++i) {
+            if ((text = NewReadTextFileToEnd(m_saveFileName, FILE_SHARE_READ)) != NULL) break;
+            ::Sleep(200);
+        }
+        if (!text) return -1;
+    }
+
+    bool fChanged = false;
+    int index = 0;
+    for (LPCTSTR line = text; line && *line; ) {
+        LINE_HASH lh;
+        lh.hash = HashLine(line, &lh.length);
+        if (index < m_queriesLen && index < m_lineHashesLen &&
+            m_lineHashes[index].hash == lh.hash && m_lineHashes[index].length == lh.length)
+        {
+            // 前回と同じ行は解析しない(メモリ上で更新された予約数なども保つ)
+            ++index;
+        }
+        else if (lh.length > 0) {
+            int ret = Insert(index < m_queriesLen ? index : -1, line);
+            if (ret >= 0) {
+                // indexはm_lineHashesLenを超えない
+                m_lineHashes[ret] = lh;
+                m_lineHashesLen = max(m_lineHashesLen, ret + 1);
+                index = ret + 1;
+                fChanged = true;
+            }
+            else {
+                DEBUG_OUT(TEXT("CQueryList::Merge(): Insert Error\n"));
+            }
+        }
+        line = ::StrChr(line, TEXT('\n'));
+        if (line) ++line;
+    }
+    // なくなった行のクエリを削除する
+    while (m_queriesLen > index) {
+        Delete(m_queriesLen - 1);
+        fChanged = true;
+    }
+    m_lineHashesLen = min(m_lineHashesLen, m_queriesLen);
+
+    delete [] text;
+    m_fileStamp = stamp;
+    return fChanged ? 1 : 0;
+}
+
+
 bool CQueryList::Save() const
 {
     HANDLE hFile = INVALID_HANDLE_VALUE;
@@ -420,11 +504,15 @@ bool CQueryList::Save() const
     for (int i = 0; i < m_queriesLen; i++) {
         TCHAR buf[1024 + 2];
         ToString(*m_queries[i], buf);
+        m_lineHashes[i].hash = HashLine(buf, &m_lineHashes[i].length);
         ::lstrcat(buf, TEXT("\r\n"));
         ::WriteFile(hFile, buf, ::lstrlen(buf) * sizeof(TCHAR), &writtenBytes, NULL);
     }
+    m_lineHashesLen = m_queriesLen;
 
     ::CloseHandle(hFile);
+    // 自身の書き込みを外部での変更として取り込まないため
+    GetFileStamp(m_saveFileName, &m_fileStamp);
     return true;
 }
 
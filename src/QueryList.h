@@ -19,7 +19,9 @@ struct QUERY {
 
 class CQueryList
 {
+public:
     static const int QUERIES_MAX = MENULIST_MAX;
+private:
 
     struct DIALOG_PARAMS {
         QUERY query;
@@ -28,19 +30,31 @@ class CQueryList
         LPCTSTR captionSuffix;
     };
 
+    // クエリファイルの1行のハッシュ値
+    struct LINE_HASH {
+        DWORD hash;
+        int length;
+    };
+
     QUERY *m_queries[QUERIES_MAX];
     int m_queriesLen;
     TCHAR m_saveFileName[MAX_PATH];
+    // 最後に読み書きしたクエリファイルの各クエリの行(外部での変更を行単位で取り込むため)
+    mutable LINE_HASH m_lineHashes[QUERIES_MAX];
+    mutable int m_lineHashesLen;
+    // 最後に読み書きしたクエリファイルの状態(自身の書き込みによる変更通知を無視するため)
+    mutable FILE_STAMP m_fileStamp;
 
     void Clear();
-    static void ToString(const QUERY &query, LPTSTR str);
-    int Insert(int index, const QUERY &query);
     int Insert(int index, LPCTSTR str);
-    int Delete(int index);
     static INT_PTR CALLBACK DlgProc(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lParam, void *pClientData);
 public:
     CQueryList();
     ~CQueryList();
+    static void ToString(const QUERY &query, LPTSTR str);
+    static bool FromString(LPCTSTR str, QUERY *pQuery);
+    int Insert(int index, const QUERY &query);
+    int Delete(int index);
     int Length() const;
     int Insert(int index, HINSTANCE hinst, HWND hwndOwner,
                INT_PTR pShowModalDialog(HINSTANCE, LPCWSTR, INT_PTR (CALLBACK *)(HWND, UINT, WPARAM, LPARAM, void *), void *, HWND, void *),
@@ -49,6 +63,7 @@ public:
     bool CreateReserve(int index, RESERVE *pRes, WORD eventID, LPCTSTR eventName, FILETIME startTime, int duration);
     bool Load();
     bool Save() const;
+    int Merge();
     void SetPluginFileName(LPCTSTR fileName);
     HMENU CreateListMenu(int idStart) const;
 };
@@ -0,0 +1,198 @@
+﻿#include <Windows.h>
+#include <Shlwapi.h>
+#include "JstTime.h"
+#include "Util.h"
+#include "RecHistory.h"
+
+
+CRecHistory::CRecHistory()
+    : m_num(0)
+    , m_useCount(0)
+{
+    m_saveFileName[0] = 0;
+}
+
+
+void CRecHistory::SetPluginFileName(LPCTSTR fileName)
+{
+    TCHAR saveFileName[MAX_PATH + 32];
+    ::lstrcpy(saveFileName, fileName);
+    ::PathRemoveExtension(saveFileName);
+    ::lstrcat(saveFileName, TEXT("_History.txt"));
+    ::lstrcpyn(m_saveFileName, saveFileName, ARRAY_SIZE(m_saveFileName));
+}
+
+
+// 履歴の末尾から要約を作る
+// 書式: ONID TSID SID EID Mode PlannedStart PlannedDuration Truncated ActualStart ActualEnd
+//       RecordedSec FileKB Errors Scrambles Drops TuneLatency FilePath EventName MinWriteRate WriteStalls
+//       (タブ区切り,#で始まる行はコメント。後ろの2列は古い履歴にはない)
+bool CRecHistory::Load()
+{
+    m_num = 0;
+    if (!m_saveFileName[0]) return false;
+    HANDLE hFile = ::CreateFile(m_saveFileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER size;
+    char *buf = NULL;
+    DWORD readBytes = 0;
+    if (::GetFileSizeEx(hFile, &size)) {
+        LARGE_INTEGER pos;
+        pos.QuadPart = max(size.QuadPart - LOAD_MAX_SIZE, 0LL);
+        DWORD len = static_cast<DWORD>(size.QuadPart - pos.QuadPart);
+        buf = new char[len + 1];
+        if (!::SetFilePointerEx(hFile, pos, NULL, FILE_BEGIN) ||
+            !::ReadFile(hFile, buf, len, &readBytes, NULL)) readBytes = 0;
+        buf[readBytes] = 0;
+        // 途中から読んだときは最初の行を捨てる
+        if (pos.QuadPart > 0) {
+            char *p = buf;
+            while (*p && *p != '\n') ++p;
+            if (*p) ::MoveMemory(buf, p + 1, readBytes - static_cast<DWORD>(p - buf));
+            else buf[0] = 0;
+        }
+    }
+    ::CloseHandle(hFile);
+    if (!buf) return false;
+
+    for (const char *line = buf; *line;) {
+        const char *next = line;
+        while (*next && *next != '\n') ++next;
+        if (*line != '#') {
+            // 要約に使う数値の列だけを読む
+            int values[12];
+            int n = 0;
+            for (const char *p = line; p < next && n < ARRAY_SIZE(values);) {
+                bool fNeg = *p == '-';
+                if (fNeg) ++p;
+                int v = 0;
+                for (; '0' <= *p && *p <= '9'; ++p) v = v * 10 + (*p - '0');
+                values[n++] = fNeg ? -v : v;
+                // 数値でない列(Modeや時刻)は先頭の文字で区別する
+                if (n == 5) values[4] = *p == 'L';
+                while (p < next && *p != '\t') ++p;
+                if (p < next) ++p;
+            }
+            if (n == ARRAY_SIZE(values)) {
+                AddSummary(static_cast<WORD>(values[0]), static_cast<WORD>(values[2]), values[4] != 0,
+                           values[10], static_cast<DWORD>(values[11]));
+            }
+        }
+        line = *next ? next + 1 : next;
+    }
+    delete [] buf;
+    return true;
+}
+
+
+bool CRecHistory::Append(const ENTRY &entry)
+{
+    AddSummary(entry.networkID, entry.serviceID, entry.fLean, entry.recordedSec, entry.fileKBytes);
+    if (!m_saveFileName[0]) return false;
+
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    for (int i = 0; i < 5; ++i) {
+        hFile = ::CreateFile(m_saveFileName, FILE_APPEND_DATA, FILE_SHARE_READ, NULL,
+                             OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile != INVALID_HANDLE_VALUE) break;
+        ::Sleep(200);
+    }
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+
+    LPTSTR line = new TCHAR[256 + MAX_PATH + EVENT_NAME_MAX];
+    LPTSTR tail = line;
+    LARGE_INTEGER size;
+    if (::GetFileSizeEx(hFile, &size) && size.QuadPart == 0) {
+        tail += ::wsprintf(tail, TEXT("#ONID\tTSID\tSID\tEID\tMode\tPlannedStart\tPlannedDuration\tTruncated\t")
+                                 TEXT("ActualStart\tActualEnd\tRecordedSec\tFileKB\tErrors\tScrambles\tDrops\t")
+                                 TEXT("TuneLatency\tFilePath\tEventName\tMinWriteRate\tWriteStalls\n"));
+    }
+    TCHAR plannedStart[32], actualStart[32], actualEnd[32];
+    FileTimeToStr(&entry.plannedStart, plannedStart);
+    FileTimeToStr(&entry.actualStart, actualStart);
+    FileTimeToStr(&entry.actualEnd, actualEnd);
+    tail += ::wsprintf(tail, TEXT("%d\t%d\t%d\t%d\t%c\t%s\t%d\t%d\t%s\t%s\t%d\t%u\t%d\t%d\t%d\t%d\t%s\t"),
+                       entry.networkID, entry.transportStreamID, entry.serviceID, entry.eventID,
+                       entry.fLean ? TEXT('L') : TEXT('N'), plannedStart, entry.plannedDuration, entry.truncated,
+                       actualStart, actualEnd, entry.recordedSec, entry.fileKBytes,
+                       entry.errors, entry.scrambles, entry.drops, entry.tuneLatency, entry.filePath);
+    // 区切りと衝突する文字は空白にする
+    LPTSTR eventName = tail;
+    ::lstrcpyn(eventName, entry.eventName, EVENT_NAME_MAX);
+    for (; *tail; ++tail) {
+        if (*tail == TEXT('\t') || *tail == TEXT('\r') || *tail == TEXT('\n')) *tail = TEXT(' ');
+    }
+    ::wsprintf(tail, TEXT("\t%d\t%d\n"), entry.minWriteRate, entry.writeStalls);
+
+    int len = ::WideCharToMultiByte(CP_UTF8, 0, line, -1, NULL, 0, NULL, NULL);
+    bool fRet = false;
+    if (len > 1) {
+        char *utf8 = new char[len];
+        DWORD writtenBytes;
+        ::WideCharToMultiByte(CP_UTF8, 0, line, -1, utf8, len, NULL, NULL);
+        fRet = ::WriteFile(hFile, utf8, len - 1, &writtenBytes, NULL) && writtenBytes == static_cast<DWORD>(len - 1);
+        delete [] utf8;
+    }
+    delete [] line;
+    ::CloseHandle(hFile);
+    return fRet;
+}
+
+
+void CRecHistory::AddSummary(WORD networkID, WORD serviceID, bool fLean, int recordedSec, DWORD fileKBytes)
+{
+    int i = Find(networkID, serviceID);
+    if (i < 0) {
+        if (m_num < SERVICE_MAX) {
+            i = m_num++;
+        }
+        else {
+            // 最も長く使われていないものを捨てる
+            i = 0;
+            for (int j = 1; j < m_num; ++j) {
+                if (m_lastUsed[j] < m_lastUsed[i]) i = j;
+            }
+        }
+        m_networkID[i] = networkID;
+        m_serviceID[i] = serviceID;
+        m_sampleNum[i] = 0;
+        m_sampleNext[i] = 0;
+    }
+    m_lastUsed[i] = ++m_useCount;
+
+    int k = m_sampleNext[i];
+    // 軽量録画はストリームを絞っているのでビットレートには使わない
+    m_columns[COLUMN_BITRATE][i][k] = recordedSec >= SUMMARY_MIN_DURATION && !fLean ?
+        static_cast<int>(fileKBytes / recordedSec) : -1;
+    m_sampleNext[i] = (k + 1) % SAMPLE_MAX;
+    m_sampleNum[i] = min(m_sampleNum[i] + 1, SAMPLE_MAX);
+}
+
+
+int CRecHistory::Find(WORD networkID, WORD serviceID) const
+{
+    for (int i = 0; i < m_num; ++i) {
+        if (m_networkID[i] == networkID && m_serviceID[i] == serviceID) return i;
+    }
+    return -1;
+}
+
+
+int CRecHistory::GetPercentile(int column, WORD networkID, WORD serviceID, int percent) const
+{
+    int i = Find(networkID, serviceID);
+    if (i < 0) return -1;
+
+    int values[SAMPLE_MAX];
+    int n = 0;
+    for (int k = 0; k < m_sampleNum[i]; ++k) {
+        if (m_columns[column][i][k] >= 0) values[n++] = m_columns[column][i][k];
+    }
+    if (n == 0) return -1;
+    SortInt(values, n);
+    // 切り上げ
+    int rank = (n * percent + 99) / 100;
+    return values[min(max(rank, 1), n) - 1];
+}
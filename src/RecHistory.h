@@ -0,0 +1,67 @@
+﻿#ifndef INCLUDE_REC_HISTORY_H
+#define INCLUDE_REC_HISTORY_H
+
+// 終えた録画の履歴を追記専用のファイルに残し、サービス(ONID,SID)ごとの要約をメモリに持つ
+// 履歴はほかの環境でも扱えるようにUTF-8・タブ区切り・改行LFで書く
+class CRecHistory
+{
+public:
+    // 要約するサービスの数
+    static const int SERVICE_MAX = 128;
+    // サービスあたりの要約に使う記録数(古いものから捨てる)
+    static const int SAMPLE_MAX = 16;
+    // 起動時に要約を作るために読む履歴の末尾のバイト数
+    static const DWORD LOAD_MAX_SIZE = 1024 * 1024;
+    // これより短い録画はビットレートを要約しない(秒)
+    static const int SUMMARY_MIN_DURATION = 60;
+
+    struct ENTRY {
+        WORD networkID;
+        WORD transportStreamID;
+        WORD serviceID;
+        WORD eventID;
+        bool fLean;
+        FILETIME plannedStart;  // 開始マージンを含む、切り詰め前の予約開始時刻
+        int plannedDuration;    // マージンを含む、切り詰め前の予約の長さ(秒)
+        int truncated;          // 優先度によって切り詰めた秒数
+        FILETIME actualStart;
+        FILETIME actualEnd;
+        int recordedSec;        // 実際に録画した秒数
+        DWORD fileKBytes;
+        int errors;             // 以下、不明なとき-1
+        int scrambles;
+        int drops;
+        int tuneLatency;        // チャンネル変更から受信が安定するまで(ミリ秒)
+        int minWriteRate;       // 録画中に計測した書き込み速度の最小値(KB/秒、不明なとき-1)
+        int writeStalls;        // 書き込みが滞ったと判断した回数
+        LPCTSTR filePath;
+        LPCTSTR eventName;
+    };
+
+    CRecHistory();
+    void SetPluginFileName(LPCTSTR fileName);
+    bool Load();
+    bool Append(const ENTRY &entry);
+    // 以下、記録のpercent%点を返す。記録がなければ-1
+    int GetBitrate(WORD networkID, WORD serviceID, int percent) const { return GetPercentile(COLUMN_BITRATE, networkID, serviceID, percent); }
+private:
+    // 要約の列(KB/秒)
+    // チャンネル変更の所要時間はCTuneLatencyがストリームごとに持つので、ここでは要約しない
+    enum { COLUMN_BITRATE, COLUMN_NUM };
+    void AddSummary(WORD networkID, WORD serviceID, bool fLean, int recordedSec, DWORD fileKBytes);
+    int Find(WORD networkID, WORD serviceID) const;
+    int GetPercentile(int column, WORD networkID, WORD serviceID, int percent) const;
+
+    // サービスごとの列指向の要約(各サービスの記録はリングで、-1は不明)
+    WORD m_networkID[SERVICE_MAX];
+    WORD m_serviceID[SERVICE_MAX];
+    DWORD m_lastUsed[SERVICE_MAX];
+    int m_sampleNum[SERVICE_MAX];
+    int m_sampleNext[SERVICE_MAX];
+    int m_columns[COLUMN_NUM][SERVICE_MAX][SAMPLE_MAX];
+    int m_num;
+    DWORD m_useCount;
+    TCHAR m_saveFileName[MAX_PATH];
+};
+
+#endif // INCLUDE_REC_HISTORY_H
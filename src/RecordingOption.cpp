@@ -1,7 +1,9 @@
 ﻿#include <Windows.h>
 #include <Shlwapi.h>
 #include "resource.h"
+#include "JstTime.h"
 #include "Util.h"
+#include "IniFile.h"
 #include "RecordingOption.h"
 
 static LPCTSTR INITIAL_SAVE_NAME = TEXT("%date%%hour2%%minute2%_%event-name%.ts");
@@ -34,6 +36,9 @@ bool RECORDING_OPTION::FromString(LPCTSTR str)
     GetToken(str, saveName, ARRAY_SIZE(saveName));
     if (!::lstrcmp(saveName, TEXT("*"))) saveName[0] = 0;
 
+    // ver.0.7以前との互換のため
+    startTrim = endTrim = 0;
+    recMode = REC_MODE_DEFAULT;
     if (NextToken(&str)) {
         startTrim = ::StrToInt(str);
         if (startTrim < 0) startTrim = 0;
@@ -41,57 +46,62 @@ bool RECORDING_OPTION::FromString(LPCTSTR str)
 
         endTrim = ::StrToInt(str);
         if (endTrim < 0) endTrim = 0;
-    }
-    else {
-        // ver.0.7以前との互換のため
-        startTrim = endTrim = 0;
+
+        if (NextToken(&str)) {
+            recMode = static_cast<BYTE>(::StrToInt(str));
+            if (recMode >= REC_MODE_MAX) recMode = REC_MODE_DEFAULT;
+        }
     }
     return true;
 }
 
 // saveDirはセットしないので注意
-void RECORDING_OPTION::LoadDefaultSetting(LPCTSTR fileName)
+void RECORDING_OPTION::LoadDefaultSetting(const CIniFile &ini)
 {
-    startMargin = ::GetPrivateProfileInt(TEXT("DefaultRec"), TEXT("StartMargin"), 30, fileName);
+    startMargin = ini.GetInt(TEXT("DefaultRec"), TEXT("StartMargin"), 30);
     if (startMargin < 0 || startMargin > MARGIN_MAX) startMargin = 30;
 
     // 互換のための変換あり!
-    endMargin = ::GetPrivateProfileInt(TEXT("DefaultRec"), TEXT("EndMargin"), 30, fileName);
+    endMargin = ini.GetInt(TEXT("DefaultRec"), TEXT("EndMargin"), 30);
     if (endMargin < 0 || endMargin > MARGIN_MAX * 2) endMargin = 30;
     else if (endMargin > MARGIN_MAX) endMargin = MARGIN_MAX - endMargin;
 
     // 互換のための変換あり!
-    priority = static_cast<BYTE>(static_cast<int>(::GetPrivateProfileInt(TEXT("DefaultRec"), TEXT("Priority"), PRIORITY_NORMAL, fileName)) + PRIORITY_MOD);
+    priority = static_cast<BYTE>(ini.GetInt(TEXT("DefaultRec"), TEXT("Priority"), PRIORITY_NORMAL) + PRIORITY_MOD);
     if (priority % PRIORITY_MOD == PRIORITY_DEFAULT || priority >= PRIORITY_MOD * 2) priority = PRIORITY_MOD + PRIORITY_NORMAL;
 
-    onStopped = static_cast<BYTE>(::GetPrivateProfileInt(TEXT("DefaultRec"), TEXT("OnStopped"), ON_STOPPED_NONE, fileName));
+    onStopped = static_cast<BYTE>(ini.GetInt(TEXT("DefaultRec"), TEXT("OnStopped"), ON_STOPPED_NONE));
     if (onStopped == ON_STOPPED_DEFAULT || onStopped >= ON_STOPPED_MAX) onStopped = ON_STOPPED_NONE;
 
-    ::GetPrivateProfileString(TEXT("DefaultRec"), TEXT("SaveName"), TEXT(""), saveName, ARRAY_SIZE(saveName), fileName);
+    ini.GetString(TEXT("DefaultRec"), TEXT("SaveName"), TEXT(""), saveName, ARRAY_SIZE(saveName));
     if (!saveName[0]) ::lstrcpy(saveName, INITIAL_SAVE_NAME);
 
+    recMode = static_cast<BYTE>(ini.GetInt(TEXT("DefaultRec"), TEXT("RecMode"), REC_MODE_NORMAL));
+    if (recMode == REC_MODE_DEFAULT || recMode >= REC_MODE_MAX) recMode = REC_MODE_NORMAL;
+
     startTrim = endTrim = 0;
 }
 
 // strには少なくとも600要素の確保が必要
 void RECORDING_OPTION::ToString(LPTSTR str) const
 {
-    ::wsprintf(str, TEXT("%d\t%d\t%d\t%d\t%s\t%s\t%d\t%d"),
+    ::wsprintf(str, TEXT("%d\t%d\t%d\t%d\t%s\t%s\t%d\t%d\t%d"),
                startMargin,
                endMargin == MARGIN_DEFAULT ? -1 : endMargin < 0 ? MARGIN_MAX - endMargin : endMargin,
                priority - PRIORITY_MOD, onStopped,
                saveDir[0] ? saveDir : TEXT("*"),
                saveName[0] ? saveName : TEXT("*"),
-               startTrim, endTrim);
+               startTrim, endTrim, recMode);
 }
 
-void RECORDING_OPTION::SaveDefaultSetting(LPCTSTR fileName) const
+void RECORDING_OPTION::SaveDefaultSetting(CIniFile &ini) const
 {
-    WritePrivateProfileInt(TEXT("DefaultRec"), TEXT("StartMargin"), startMargin, fileName);
-    WritePrivateProfileInt(TEXT("DefaultRec"), TEXT("EndMargin"), endMargin < 0 ? MARGIN_MAX - endMargin : endMargin, fileName);
-    WritePrivateProfileInt(TEXT("DefaultRec"), TEXT("Priority"), priority - PRIORITY_MOD, fileName);
-    WritePrivateProfileInt(TEXT("DefaultRec"), TEXT("OnStopped"), onStopped, fileName);
-    ::WritePrivateProfileString(TEXT("DefaultRec"), TEXT("SaveName"), saveName, fileName);
+    ini.SetInt(TEXT("DefaultRec"), TEXT("StartMargin"), startMargin);
+    ini.SetInt(TEXT("DefaultRec"), TEXT("EndMargin"), endMargin < 0 ? MARGIN_MAX - endMargin : endMargin);
+    ini.SetInt(TEXT("DefaultRec"), TEXT("Priority"), priority - PRIORITY_MOD);
+    ini.SetInt(TEXT("DefaultRec"), TEXT("OnStopped"), onStopped);
+    ini.SetString(TEXT("DefaultRec"), TEXT("SaveName"), saveName);
+    ini.SetInt(TEXT("DefaultRec"), TEXT("RecMode"), recMode);
 }
 
 void RECORDING_OPTION::SetEmpty(bool fViewOnly)
@@ -104,6 +114,7 @@ void RECORDING_OPTION::SetEmpty(bool fViewOnly)
     saveName[0] = 0;
     startTrim   = 0;
     endTrim     = 0;
+    recMode     = REC_MODE_NORMAL;
 }
 
 void RECORDING_OPTION::SetDefault(bool fViewOnly)
@@ -116,6 +127,7 @@ void RECORDING_OPTION::SetDefault(bool fViewOnly)
     saveName[0] = 0;
     startTrim   = 0;
     endTrim     = 0;
+    recMode     = REC_MODE_DEFAULT;
 }
 
 void RECORDING_OPTION::ApplyDefault(const RECORDING_OPTION &defaultOption)
@@ -126,6 +138,15 @@ void RECORDING_OPTION::ApplyDefault(const RECORDING_OPTION &defaultOption)
     if (onStopped == ON_STOPPED_DEFAULT) onStopped = defaultOption.onStopped;
     if (!saveDir[0]) ::lstrcpy(saveDir, defaultOption.saveDir);
     if (!saveName[0]) ::lstrcpy(saveName, defaultOption.saveName);
+    if (recMode == REC_MODE_DEFAULT) recMode = defaultOption.recMode;
+}
+
+bool RECORDING_OPTION::IsEqual(const RECORDING_OPTION &o) const
+{
+    return startMargin == o.startMargin && endMargin == o.endMargin &&
+           priority == o.priority && onStopped == o.onStopped &&
+           startTrim == o.startTrim && endTrim == o.endTrim && recMode == o.recMode &&
+           !::lstrcmp(saveDir, o.saveDir) && !::lstrcmp(saveName, o.saveName);
 }
 
 // ダイアログの"録画設定"部分のプロシージャ
@@ -163,6 +184,9 @@ INT_PTR RECORDING_OPTION::DlgProc(HWND hDlg, UINT uMsg, WPARAM wParam, bool hasD
                 hasDefault && endMargin == MARGIN_DEFAULT ? pDefaultOption->endMargin : endMargin, TRUE);
 
             ::CheckDlgButton(hDlg, IDC_CHECK_VIEW_ONLY, IsViewOnly() ? BST_CHECKED : BST_UNCHECKED);
+            // hasDefaultのときは3状態で、中間がデフォルト
+            ::CheckDlgButton(hDlg, IDC_CHECK_LEAN_REC, recMode == REC_MODE_LEAN ? BST_CHECKED :
+                             recMode == REC_MODE_NORMAL || !hasDefault ? BST_UNCHECKED : BST_INDETERMINATE);
 
             LPCTSTR pPriList[] = { TEXT("デフォルト"), TEXT("1--"), TEXT("2-"), TEXT("3"), TEXT("4+"), TEXT("5++") };
             SetComboBoxList(hDlg, IDC_COMBO_PRI, pPriList + (hasDefault ? 0 : 1), ARRAY_SIZE(pPriList) - (hasDefault ? 0 : 1));
@@ -227,6 +251,11 @@ INT_PTR RECORDING_OPTION::DlgProc(HWND hDlg, UINT uMsg, WPARAM wParam, bool hasD
                 LRESULT res = ::SendDlgItemMessage(hDlg, IDC_COMBO_ONSTOP, CB_GETCURSEL, 0, 0);
                 onStopped = res < 0 ? ON_STOPPED_NONE : static_cast<BYTE>(res + (hasDefault ? 0 : 1));
             }
+            {
+                UINT check = ::IsDlgButtonChecked(hDlg, IDC_CHECK_LEAN_REC);
+                recMode = check == BST_CHECKED ? REC_MODE_LEAN :
+                          check == BST_UNCHECKED || !hasDefault ? REC_MODE_NORMAL : REC_MODE_DEFAULT;
+            }
             if (hasDefault) {
                 saveDir[0] = 0;
                 if (::IsDlgButtonChecked(hDlg, IDC_CHECK_SAVE_DIR) == BST_CHECKED)
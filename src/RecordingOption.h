@@ -31,6 +31,16 @@ enum {
     ON_STOPPED_MAX
 };
 
+// 録画の方法
+enum {
+    REC_MODE_DEFAULT,       // デフォルト設定の方法
+    REC_MODE_NORMAL,        // TVTestで録画
+    REC_MODE_LEAN,          // 映像と主音声だけをプラグインで録画(軽量録画)
+    REC_MODE_MAX
+};
+
+class CIniFile;
+
 struct RECORDING_OPTION {
     int startMargin;            // 録画開始マージン[秒]
     int endMargin;              // 録画終了マージン[秒]
@@ -40,14 +50,16 @@ struct RECORDING_OPTION {
     TCHAR saveName[MAX_PATH];   // 保存ファイル名
     int startTrim;              // 録画開始時刻の遅延量[秒]
     int endTrim;                // 録画終了時刻の前倒し量[秒]
+    BYTE recMode;               // 録画の方法
     bool IsViewOnly() const { return priority < PRIORITY_MOD; }
     bool FromString(LPCTSTR str);
-    void LoadDefaultSetting(LPCTSTR fileName);
+    void LoadDefaultSetting(const CIniFile &ini);
     void ToString(LPTSTR str) const;
-    void SaveDefaultSetting(LPCTSTR fileName) const;
+    void SaveDefaultSetting(CIniFile &ini) const;
     void SetEmpty(bool fViewOnly);
     void SetDefault(bool fViewOnly);
     void ApplyDefault(const RECORDING_OPTION &defaultOption);
+    bool IsEqual(const RECORDING_OPTION &o) const;
     INT_PTR DlgProc(HWND hDlg, UINT uMsg, WPARAM wParam, bool hasDefault, const RECORDING_OPTION *pDefaultOption = NULL);
 };
 
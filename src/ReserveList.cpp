@@ -4,15 +4,38 @@
 #include <taskschd.h>
 #include <Lmcons.h>
 #include "resource.h"
+#include "JstTime.h"
 #include "Util.h"
 #include "RecordingOption.h"
+#include "Stats.h"
+#include "SeqTable.h"
 #include "ReserveList.h"
 
 
 CReserveList::CReserveList()
     : m_head(NULL)
+    , m_epoch(0)
+    , m_fNearestCached(false)
+    , m_nearestEpoch(static_cast<DWORD>(-1))
+    , m_nearestReadyOffset(0)
+    , m_expiryHeap(NULL)
+    , m_expiryHeapLen(0)
+    , m_expiryHeapSize(0)
+    , m_expiryHeapEpoch(0)
+    , m_idIndex(NULL)
+    , m_idIndexSize(0)
+    , m_idIndexEpoch(0)
     , m_hThread(NULL)
+    , m_pStats(NULL)
+    , m_hSharedMap(NULL)
+    , m_pShared(NULL)
+    , m_hSharedWriterMutex(NULL)
+    , m_sharedSeq(0)
+    , m_lineHashes(NULL)
+    , m_lineHashesSize(0)
+    , m_fMultiServiceRec(false)
 {
+    ::ZeroMemory(&m_fileStamp, sizeof(m_fileStamp));
     m_saveFileName[0] = 0;
     m_saveTaskName[0] = 0;
     m_pluginPath[0] = 0;
@@ -22,6 +45,11 @@ CReserveList::CReserveList()
 CReserveList::~CReserveList()
 {
     Clear();
+    delete [] m_expiryHeap;
+    delete [] m_idIndex;
+    delete [] m_lineHashes;
+    if (m_pShared) ::UnmapViewOfFile(m_pShared);
+    if (m_hSharedMap) ::CloseHandle(m_hSharedMap);
     if (m_hThread) {
         if (::WaitForSingleObject(m_hThread, 30000) != WAIT_OBJECT_0) {
             ::TerminateThread(m_hThread, 0);
@@ -38,6 +66,7 @@ void CReserveList::Clear()
         m_head = pRes->next;
         delete pRes;
     }
+    ++m_epoch;
 }
 
 
@@ -100,14 +129,15 @@ bool CReserveList::Insert(const RESERVE &in)
         tail->next = pRes;
     }
     m_eventIDLookup[(pRes->eventID & 0x3FFF) >> 3] |= 1 << (pRes->eventID & 7);
+    ++m_epoch;
 
     return true;
 }
 
 
-bool CReserveList::Insert(LPCTSTR str)
+bool CReserveList::FromString(LPCTSTR str, RESERVE *pRes)
 {
-    RESERVE res;
+    RESERVE &res = *pRes;
     int i = 0;
 
     ::StrToIntEx(str, STIF_SUPPORT_HEX, &i);
@@ -149,9 +179,7 @@ bool CReserveList::Insert(LPCTSTR str)
     GetToken(str, res.eventName, ARRAY_SIZE(res.eventName));
     if (!NextToken(&str)) return false;
 
-    if (!res.recOption.FromString(str)) return false;
-
-    return Insert(res);
+    return res.recOption.FromString(str);
 }
 
 
@@ -317,6 +345,7 @@ bool CReserveList::Delete(DWORD networkID, DWORD transportStreamID, DWORD servic
     if (!prev) m_head = tail->next;
     else prev->next = tail->next;
     delete tail;
+    ++m_epoch;
     return true;
 }
 
@@ -342,9 +371,49 @@ RESERVE *CReserveList::GetByID(DWORD networkID, DWORD transportStreamID, DWORD s
 }
 
 
+// 予約のID4つのハッシュ値
+static DWORD HashReserveID(DWORD networkID, DWORD transportStreamID, DWORD serviceID, DWORD eventID)
+{
+    DWORD key = (networkID << 16 | transportStreamID) * 2654435761UL ^ (serviceID << 16 | eventID);
+    key *= 2654435761UL;
+    return key ^ key >> 16;
+}
+
+
+// 続けて引かれることが多いので、リストを変更していなければ索引を使う
 const RESERVE *CReserveList::Get(DWORD networkID, DWORD transportStreamID, DWORD serviceID, DWORD eventID) const
 {
-    return GetByID(networkID, transportStreamID, serviceID, eventID, NULL);
+    if (!m_idIndex || m_idIndexEpoch != m_epoch) BuildIDIndex();
+    int mask = m_idIndexSize - 1;
+    for (int i = HashReserveID(networkID, transportStreamID, serviceID, eventID) & mask; m_idIndex[i]; i = (i + 1) & mask) {
+        const RESERVE *pRes = m_idIndex[i];
+        if (pRes->eventID == eventID &&
+            pRes->networkID == networkID &&
+            pRes->transportStreamID == transportStreamID &&
+            pRes->serviceID == serviceID) return pRes;
+    }
+    return NULL;
+}
+
+
+void CReserveList::BuildIDIndex() const
+{
+    // 占有率を1/2以下に保つ
+    int num = Length();
+    int size = 64;
+    while (size < num * 2) size *= 2;
+    if (size != m_idIndexSize) {
+        delete [] m_idIndex;
+        m_idIndex = new RESERVE*[size];
+        m_idIndexSize = size;
+    }
+    ::ZeroMemory(m_idIndex, sizeof(RESERVE*) * size);
+    for (RESERVE *tail = m_head; tail; tail = tail->next) {
+        int i = HashReserveID(tail->networkID, tail->transportStreamID, tail->serviceID, tail->eventID) & (size - 1);
+        while (m_idIndex[i]) i = (i + 1) & (size - 1);
+        m_idIndex[i] = tail;
+    }
+    m_idIndexEpoch = m_epoch;
 }
 
 
@@ -358,10 +427,25 @@ const RESERVE *CReserveList::Get(int index) const
 }
 
 
+int CReserveList::Length() const
+{
+    int len = 0;
+    for (const RESERVE *tail = m_head; tail; tail = tail->next) ++len;
+    return len;
+}
+
+
 bool CReserveList::Load()
 {
-    if (!::PathFileExists(m_saveFileName)) {
+    CStatScope scope(m_pStats, CStats::STAGE_RESERVE_LOAD);
+    // 読み込み中に書き換えられたときは次の変更通知で取り込めるよう、読む前の状態を記録する
+    FILE_STAMP stamp;
+    if (!GetFileStamp(m_saveFileName, &stamp)) {
         Clear();
+        delete [] m_lineHashes;
+        m_lineHashes = NewLineHashes(0, &m_lineHashesSize);
+        m_fileStamp = stamp;
+        PublishShared();
         return true;
     }
     LPTSTR text = NULL;
@@ -372,23 +456,207 @@ bool CReserveList::Load()
     if (!text) return false;
 
     Clear();
+    InsertLines(text, true);
+    m_fileStamp = stamp;
+
+    delete [] text;
+    PublishShared();
+    return true;
+}
 
+
+// 予約ファイルと同じ書式のテキストを読み込む
+// fHashLinesのときは読み込んだ行のハッシュ表を作り直す
+void CReserveList::InsertLines(LPCTSTR text, bool fHashLines)
+{
+    if (fHashLines) {
+        int num = 1;
+        for (LPCTSTR p = text; (p = ::StrChr(p, TEXT('\n'))) != NULL; ++p) ++num;
+        delete [] m_lineHashes;
+        m_lineHashes = NewLineHashes(num, &m_lineHashesSize);
+    }
     // Insertの効率のため(大して変わらんけど)逆順に読む
     LPCTSTR line = text + ::lstrlen(text);
     do {
         line = ::StrRChr(text, line, TEXT('\n'));
-        if (!Insert(!line ? text : line + 1)) {
+        LPCTSTR str = !line ? text : line + 1;
+        RESERVE res;
+        if (FromString(str, &res) && Insert(res)) {
+            if (fHashLines) {
+                int length;
+                DWORD hash = HashLine(str, &length);
+                AddLineHash(m_lineHashes, m_lineHashesSize, hash, length, res);
+            }
+        }
+        else {
             DEBUG_OUT(TEXT("CReserveList::Load(): Insert Error\n"));
         }
     } while (line);
+}
+
+
+// 外部で書き換えられた予約ファイルのうち、前回の読み書きから変化した行だけをリストに反映する
+// 戻り値: 反映したとき1、変化がなかったとき0、読み込みに失敗したとき-1
+int CReserveList::Merge()
+{
+    FILE_STAMP stamp;
+    bool fExists = GetFileStamp(m_saveFileName, &stamp);
+    if (stamp == m_fileStamp) return 0;
+
+    CStatScope scope(m_pStats, CStats::STAGE_RESERVE_LOAD);
+    LPTSTR text = NULL;
+    if (fExists) {
+        for (int i = 0; i < 5; ++i) {
+            if ((text = NewReadTextFileToEnd(m_saveFileName, FILE_SHARE_READ)) != NULL) break;
+            ::Sleep(200);
+        }
+        if (!text) return -1;
+    }
 
+    int num = 1;
+    for (LPCTSTR p = text; p && (p = ::StrChr(p, TEXT('\n'))) != NULL; ++p) ++num;
+    int size;
+    LINE_HASH *table = NewLineHashes(num, &size);
+    for (int i = 0; i < m_lineHashesSize; ++i) {
+        m_lineHashes[i].fMatched = false;
+    }
+
+    bool fChanged = false;
+    for (LPCTSTR line = text; line && *line; ) {
+        int length;
+        DWORD hash = HashLine(line, &length);
+        LINE_HASH *pOld = length > 0 ? FindLineHash(m_lineHashes, m_lineHashesSize, hash, length) : NULL;
+        if (pOld) {
+            // 前回と同じ行は解析しない
+            pOld->fMatched = true;
+            AddLineHash(table, size, *pOld);
+        }
+        else if (length > 0) {
+            RESERVE res;
+            if (FromString(line, &res) && Insert(res)) {
+                AddLineHash(table, size, hash, length, res);
+                fChanged = true;
+            }
+            else {
+                DEBUG_OUT(TEXT("CReserveList::Merge(): Insert Error\n"));
+            }
+        }
+        line = ::StrChr(line, TEXT('\n'));
+        if (line) ++line;
+    }
+
+    // なくなった行の予約を削除する(書き換えられた行の予約は置き換え済み)
+    int *keyIndex = NewLineKeyIndex(table, size);
+    for (int i = 0; i < m_lineHashesSize; ++i) {
+        const LINE_HASH &old = m_lineHashes[i];
+        if (old.hash && !old.fMatched && !ContainsLineHash(table, keyIndex, size, old) &&
+            Delete(old.networkID, old.transportStreamID, old.serviceID, old.eventID))
+        {
+            fChanged = true;
+        }
+    }
+
+    delete [] keyIndex;
     delete [] text;
-    return true;
+    delete [] m_lineHashes;
+    m_lineHashes = table;
+    m_lineHashesSize = size;
+    m_fileStamp = stamp;
+    if (fChanged) PublishShared();
+    return fChanged ? 1 : 0;
+}
+
+
+// ハッシュ表を確保する(numは格納する最大数)
+CReserveList::LINE_HASH *CReserveList::NewLineHashes(int num, int *pSize)
+{
+    // 占有率を1/2以下に保つ
+    int size = 64;
+    while (size < num * 2) size *= 2;
+    LINE_HASH *pTable = new LINE_HASH[size];
+    ::ZeroMemory(pTable, sizeof(LINE_HASH) * size);
+    *pSize = size;
+    return pTable;
+}
+
+
+void CReserveList::AddLineHash(LINE_HASH *pTable, int size, DWORD hash, int length, const RESERVE &res)
+{
+    LINE_HASH entry;
+    entry.hash = hash;
+    entry.length = length;
+    entry.networkID = res.networkID;
+    entry.transportStreamID = res.transportStreamID;
+    entry.serviceID = res.serviceID;
+    entry.eventID = res.eventID;
+    AddLineHash(pTable, size, entry);
+}
+
+
+void CReserveList::AddLineHash(LINE_HASH *pTable, int size, const LINE_HASH &entry)
+{
+    // 空きは必ずある
+    int i = entry.hash & (size - 1);
+    while (pTable[i].hash) i = (i + 1) & (size - 1);
+    pTable[i] = entry;
+    pTable[i].fMatched = false;
+}
+
+
+// 照合済みでない一致する行を探す
+CReserveList::LINE_HASH *CReserveList::FindLineHash(LINE_HASH *pTable, int size, DWORD hash, int length)
+{
+    if (size == 0) return NULL;
+    for (int i = hash & (size - 1); pTable[i].hash; i = (i + 1) & (size - 1)) {
+        if (pTable[i].hash == hash && pTable[i].length == length && !pTable[i].fMatched) {
+            return &pTable[i];
+        }
+    }
+    return NULL;
+}
+
+
+// 予約のID4つからキーの索引の位置を求める
+int CReserveList::GetLineKeySlot(const LINE_HASH &entry, int size)
+{
+    return HashReserveID(entry.networkID, entry.transportStreamID, entry.serviceID, entry.eventID) & (size - 1);
+}
+
+
+// ハッシュ表の各行を予約のID4つで引く索引を作る(要素はハッシュ表の位置で、-1は空き)
+int *CReserveList::NewLineKeyIndex(const LINE_HASH *pTable, int size)
+{
+    int *pIndex = new int[size];
+    for (int i = 0; i < size; ++i) pIndex[i] = -1;
+    for (int i = 0; i < size; ++i) {
+        if (pTable[i].hash) {
+            // ハッシュ表と同じ大きさなので空きは必ずある
+            int j = GetLineKeySlot(pTable[i], size);
+            while (pIndex[j] >= 0) j = (j + 1) & (size - 1);
+            pIndex[j] = i;
+        }
+    }
+    return pIndex;
+}
+
+
+// 同じ予約の行があるか調べる
+bool CReserveList::ContainsLineHash(const LINE_HASH *pTable, const int *pKeyIndex, int size, const LINE_HASH &entry)
+{
+    for (int j = GetLineKeySlot(entry, size); pKeyIndex[j] >= 0; j = (j + 1) & (size - 1)) {
+        const LINE_HASH &e = pTable[pKeyIndex[j]];
+        if (e.eventID == entry.eventID &&
+            e.networkID == entry.networkID &&
+            e.transportStreamID == entry.transportStreamID &&
+            e.serviceID == entry.serviceID) return true;
+    }
+    return false;
 }
 
 
 bool CReserveList::Save() const
 {
+    CStatScope scope(m_pStats, CStats::STAGE_RESERVE_SAVE);
     HANDLE hFile = INVALID_HANDLE_VALUE;
     for (int i = 0; i < 5; ++i) {
         hFile = ::CreateFile(m_saveFileName, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
@@ -401,20 +669,130 @@ bool CReserveList::Save() const
     WCHAR bom = L'\xFEFF';
     ::WriteFile(hFile, &bom, sizeof(bom), &writtenBytes, NULL);
 
+    int size;
+    LINE_HASH *table = NewLineHashes(Length(), &size);
     for (RESERVE *tail = m_head; tail; tail = tail->next) {
         TCHAR buf[1024 + 2];
         ToString(*tail, buf);
+        int length;
+        DWORD hash = HashLine(buf, &length);
+        AddLineHash(table, size, hash, length, *tail);
         ::lstrcat(buf, TEXT("\r\n"));
         ::WriteFile(hFile, buf, ::lstrlen(buf) * sizeof(TCHAR), &writtenBytes, NULL);
     }
 
     ::CloseHandle(hFile);
+    delete [] m_lineHashes;
+    m_lineHashes = table;
+    m_lineHashesSize = size;
+    // 自身の書き込みを外部での変更として取り込まないため
+    GetFileStamp(m_saveFileName, &m_fileStamp);
+    PublishShared();
+    return true;
+}
+
+
+// 共有メモリを開く(名前は予約ファイルのパスから作る)
+bool CReserveList::OpenShared() const
+{
+    if (m_pShared) return true;
+    if (!m_saveFileName[0]) return false;
+
+    TCHAR name[MAX_PATH + 16];
+    ::lstrcpy(name, TEXT("TTREC-RES-"));
+    ::lstrcat(name, m_saveFileName);
+    ::CharUpperBuff(name, ::lstrlen(name));
+    TranslateText(name, TEXT("!\\!/!"));
+
+    m_hSharedMap = CreateFullAccessFileMapping(SeqTableGetSize(SHARED_CAPACITY), name);
+    if (!m_hSharedMap) return false;
+    m_pShared = static_cast<SEQ_TABLE_HEADER*>(::MapViewOfFile(m_hSharedMap, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+    if (!m_pShared) {
+        ::CloseHandle(m_hSharedMap);
+        m_hSharedMap = NULL;
+        return false;
+    }
     return true;
 }
 
 
+// 有効なTTRecとして予約の読み書きを共有メモリに反映する(hMutex=NULLで止める)
+// 書き込みはhMutexで排他する
+void CReserveList::SetSharedWriter(HANDLE hMutex)
+{
+    m_hSharedWriterMutex = hMutex;
+    m_sharedSeq = 0;
+    PublishShared();
+}
+
+
+// 予約ファイルと同じ書式で共有メモリに書き出す
+void CReserveList::PublishShared() const
+{
+    if (!m_hSharedWriterMutex || !OpenShared()) return;
+    if (::WaitForSingleObject(m_hSharedWriterMutex, 5000) == WAIT_TIMEOUT) return;
+
+    if (!SeqTableIsInitialized(m_pShared, SHARED_CAPACITY)) {
+        SeqTableInitialize(m_pShared, SHARED_CAPACITY);
+    }
+    // 読み込み側は書き込み中のデータを捨ててやり直すので、直接書き込んでよい
+    SeqTableBeginWrite(m_pShared);
+    LPTSTR text = reinterpret_cast<LPTSTR>(SeqTableGetData(m_pShared));
+    int len = 0;
+    bool fOverflow = false;
+    for (RESERVE *tail = m_head; tail; tail = tail->next) {
+        TCHAR buf[1024 + 2];
+        ToString(*tail, buf);
+        ::lstrcat(buf, TEXT("\r\n"));
+        int n = ::lstrlen(buf);
+        if ((len + n) * sizeof(TCHAR) > SHARED_CAPACITY) {
+            fOverflow = true;
+            break;
+        }
+        ::CopyMemory(text + len, buf, n * sizeof(TCHAR));
+        len += n;
+    }
+    SeqTableEndWrite(m_pShared, fOverflow ? SEQ_TABLE_OVERFLOW : len * sizeof(TCHAR));
+
+    ::ReleaseMutex(m_hSharedWriterMutex);
+}
+
+
+// 有効なTTRecが共有メモリに書き出した予約に変化があれば読み込む
+bool CReserveList::LoadShared()
+{
+    if (m_hSharedWriterMutex || !OpenShared()) return false;
+    int seq = SeqTableGetSeq(m_pShared);
+    if (seq == 0 || seq == m_sharedSeq) return false;
+
+    // 読み込み中に大きくなったときは1度だけやり直す
+    for (int i = 0; i < 2; ++i) {
+        unsigned int size = SeqTableGetLength(m_pShared);
+        if (size == SEQ_TABLE_OVERFLOW) {
+            // 格納しきれなかったのでファイルから読む
+            m_sharedSeq = seq;
+            return Load();
+        }
+        LPTSTR text = new TCHAR[size / sizeof(TCHAR) + 1];
+        int ret = SeqTableRead(m_pShared, text, size, &seq);
+        if (ret >= 0) {
+            text[ret / sizeof(TCHAR)] = 0;
+            Clear();
+            InsertLines(text, false);
+            delete [] text;
+            m_sharedSeq = seq;
+            return true;
+        }
+        delete [] text;
+        if (ret != -2) break;
+    }
+    return false;
+}
+
+
 #define GET_PRIORITY(x) ((x) % PRIORITY_MOD == PRIORITY_DEFAULT ? (x) + defaultRecOption.priority % PRIORITY_MOD : (x))
 #define GET_START_MARGIN(x) ((x) < 0 ? defaultRecOption.startMargin : (x))
+#define GET_END_MARGIN(x) ((x) == MARGIN_DEFAULT ? defaultRecOption.endMargin : (x))
 
 
 // 直近の予約を取得
@@ -462,11 +840,29 @@ const RESERVE *CReserveList::GetNearest(const RECORDING_OPTION &defaultRecOption
 // ・eventNameのPREFIX_EPGORIGINは削除される
 bool CReserveList::GetNearest(RESERVE *pRes, const RECORDING_OPTION &defaultRecOption, int readyOffset) const
 {
-    const RESERVE *pNearest = GetNearest(defaultRecOption, true);
-    if (!pNearest || !pRes) return false;
+    if (!pRes) return false;
+
+    // リストとデフォルト設定に変更がなければ前回の結果を使う
+    if (m_nearestEpoch != m_epoch || m_nearestReadyOffset != readyOffset ||
+        !m_nearestDefaultRecOption.IsEqual(defaultRecOption))
+    {
+        m_fNearestCached = ResolveNearest(&m_nearestCache, defaultRecOption, readyOffset);
+        m_nearestEpoch = m_epoch;
+        m_nearestReadyOffset = readyOffset;
+        m_nearestDefaultRecOption = defaultRecOption;
+    }
+    if (!m_fNearestCached) return false;
+    *pRes = m_nearestCache;
+    return true;
+}
+
+
+// デフォルト適用・トリム済みの予約をコピーする
+void CReserveList::CopyResolved(RESERVE *pRes, const RESERVE &in, const RECORDING_OPTION &defaultRecOption)
+{
     RESERVE &res = *pRes;
-    res = *pNearest;
-    ::lstrcpy(res.eventName, pNearest->eventName + (pNearest->eventName[0]==PREFIX_EPGORIGIN ? 1 : 0));
+    res = in;
+    ::lstrcpy(res.eventName, in.eventName + (in.eventName[0]==PREFIX_EPGORIGIN ? 1 : 0));
     res.recOption.ApplyDefault(defaultRecOption);
 
     // トリム済みにする
@@ -477,6 +873,15 @@ bool CReserveList::GetNearest(RESERVE *pRes, const RECORDING_OPTION &defaultRecO
 
     // 終了マージンは録画時間を超えて負であってはならない
     if (res.recOption.endMargin < -res.duration) res.recOption.endMargin = -res.duration;
+}
+
+
+bool CReserveList::ResolveNearest(RESERVE *pRes, const RECORDING_OPTION &defaultRecOption, int readyOffset) const
+{
+    const RESERVE *pNearest = GetNearest(defaultRecOption, true);
+    if (!pNearest) return false;
+    RESERVE &res = *pRes;
+    CopyResolved(&res, *pNearest, defaultRecOption);
 
     FILETIME resEnd = res.startTime;
     resEnd += (res.duration + res.recOption.endMargin) * FILETIME_SECOND;
@@ -489,7 +894,7 @@ bool CReserveList::GetNearest(RESERVE *pRes, const RECORDING_OPTION &defaultRecO
         start += -(GET_START_MARGIN(tail->recOption.startMargin) + readyOffset) * FILETIME_SECOND;
 
         if (tail->isEnabled && res.recOption.priority < GET_PRIORITY(tail->recOption.priority) &&
-            resRealEnd - start > 0) resRealEnd = start;
+            resRealEnd - start > 0 && !IsServiceRecordable(*tail, res, resEnd, defaultRecOption)) resRealEnd = start;
 
         if (start - resRealEnd > MARGIN_MAX * FILETIME_SECOND) break;
     }
@@ -521,6 +926,60 @@ bool CReserveList::GetNearest(RESERVE *pRes, const RECORDING_OPTION &defaultRecO
 }
 
 
+// 予約inが主の予約mainResと同じストリームの別サービスで、mainEndまでに終わるので同時に録画できるか
+// mainResはデフォルト適用済みであること
+bool CReserveList::IsServiceRecordable(const RESERVE &in, const RESERVE &mainRes, const FILETIME &mainEnd,
+                                       const RECORDING_OPTION &defaultRecOption) const
+{
+    if (!m_fMultiServiceRec || !in.isEnabled || mainRes.recOption.IsViewOnly() ||
+        GET_PRIORITY(in.recOption.priority) < PRIORITY_MOD) return false;
+    if (in.networkID != mainRes.networkID || in.transportStreamID != mainRes.transportStreamID ||
+        in.serviceID == mainRes.serviceID) return false;
+    FILETIME end = in.GetTrimmedEndTime();
+    end += GET_END_MARGIN(in.recOption.endMargin) * FILETIME_SECOND;
+    return mainEnd - end >= 0;
+}
+
+
+// 主の予約mainResと同時に録画できる予約のうち、開始時刻を過ぎたものを取得
+// ・pResはデフォルト適用・トリム済みになる
+bool CReserveList::GetServiceRecordable(RESERVE *pRes, const RESERVE &mainRes, const FILETIME &now,
+                                        const RECORDING_OPTION &defaultRecOption) const
+{
+    if (!m_fMultiServiceRec) return false;
+
+    FILETIME mainEnd = mainRes.startTime;
+    mainEnd += (mainRes.duration + mainRes.recOption.endMargin) * FILETIME_SECOND;
+
+    for (const RESERVE *tail = m_head; tail; tail = tail->next) {
+        // リストは既ソートなので開始マージンを含めて開始前の予約より後を探す必要はない
+        if (tail->startTime - now > MARGIN_MAX * FILETIME_SECOND) break;
+
+        FILETIME start = tail->GetTrimmedStartTime();
+        start += -GET_START_MARGIN(tail->recOption.startMargin) * FILETIME_SECOND;
+        if (now - start >= 0 && IsServiceRecordable(*tail, mainRes, mainEnd, defaultRecOption)) {
+            FILETIME end = tail->GetTrimmedEndTime();
+            end += GET_END_MARGIN(tail->recOption.endMargin) * FILETIME_SECOND;
+            if (end - now > 0) {
+                CopyResolved(pRes, *tail, defaultRecOption);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+void CReserveList::SetMultiServiceRec(bool fEnable)
+{
+    if (m_fMultiServiceRec != fEnable) {
+        m_fMultiServiceRec = fEnable;
+        // 直近の予約の切り詰めかたが変わる
+        ++m_epoch;
+    }
+}
+
+
 // 直近の予約を削除
 bool CReserveList::DeleteNearest(const RECORDING_OPTION &defaultRecOption, bool fEnabledOnly)
 {
@@ -531,10 +990,83 @@ bool CReserveList::DeleteNearest(const RECORDING_OPTION &defaultRecOption, bool
     if (!prev) m_head = pRes->next;
     else prev->next = pRes->next;
     delete pRes;
+    ++m_epoch;
     return true;
 }
 
 
+#define EXPIRY_LESS(a, b) ((b)->GetTrimmedEndTime() - (a)->GetTrimmedEndTime() > 0)
+
+// 無効な予約を終了時刻の早い順に並べたヒープを作りなおす
+void CReserveList::BuildExpiryHeap()
+{
+    int num = 0;
+    for (const RESERVE *tail = m_head; tail; tail = tail->next) {
+        if (!tail->isEnabled) ++num;
+    }
+    if (num > m_expiryHeapSize) {
+        delete [] m_expiryHeap;
+        m_expiryHeapSize = num + 16;
+        m_expiryHeap = new RESERVE*[m_expiryHeapSize];
+    }
+    m_expiryHeapLen = 0;
+    for (RESERVE *tail = m_head; tail; tail = tail->next) {
+        if (!tail->isEnabled) m_expiryHeap[m_expiryHeapLen++] = tail;
+    }
+    // 下から順にふるい落とす
+    for (int i = m_expiryHeapLen / 2 - 1; i >= 0; --i) {
+        RESERVE *pRes = m_expiryHeap[i];
+        int j = i;
+        for (;;) {
+            int child = j * 2 + 1;
+            if (child >= m_expiryHeapLen) break;
+            if (child + 1 < m_expiryHeapLen && EXPIRY_LESS(m_expiryHeap[child + 1], m_expiryHeap[child])) ++child;
+            if (!EXPIRY_LESS(m_expiryHeap[child], pRes)) break;
+            m_expiryHeap[j] = m_expiryHeap[child];
+            j = child;
+        }
+        m_expiryHeap[j] = pRes;
+    }
+    m_expiryHeapEpoch = m_epoch;
+}
+
+
+void CReserveList::PopExpiryHeap()
+{
+    if (m_expiryHeapLen <= 0) return;
+    RESERVE *pRes = m_expiryHeap[--m_expiryHeapLen];
+    int j = 0;
+    for (;;) {
+        int child = j * 2 + 1;
+        if (child >= m_expiryHeapLen) break;
+        if (child + 1 < m_expiryHeapLen && EXPIRY_LESS(m_expiryHeap[child + 1], m_expiryHeap[child])) ++child;
+        if (!EXPIRY_LESS(m_expiryHeap[child], pRes)) break;
+        m_expiryHeap[j] = m_expiryHeap[child];
+        j = child;
+    }
+    if (m_expiryHeapLen > 0) m_expiryHeap[j] = pRes;
+}
+
+
+// 予約時間を過ぎた無効な予約を削除
+bool CReserveList::DeleteExpiredDisabled(const FILETIME &now)
+{
+    if (m_expiryHeapEpoch != m_epoch) BuildExpiryHeap();
+
+    bool fDeleted = false;
+    while (m_expiryHeapLen > 0 && now - m_expiryHeap[0]->GetTrimmedEndTime() >= 0) {
+        const RESERVE *pExpired = m_expiryHeap[0];
+        PopExpiryHeap();
+        if (Delete(pExpired->networkID, pExpired->transportStreamID, pExpired->serviceID, pExpired->eventID)) {
+            fDeleted = true;
+        }
+        // ヒープは削除後のリストとも整合している
+        m_expiryHeapEpoch = m_epoch;
+    }
+    return fDeleted;
+}
+
+
 void CReserveList::SetPluginFileName(LPCTSTR fileName)
 {
     TCHAR saveFileName[MAX_PATH + 32];
@@ -572,6 +1104,7 @@ bool CReserveList::RunSaveTask(bool fNoWakeViewOnly, int resumeMargin, int execW
     ::lstrcpyn(m_saveTask.appCmdOption, appCmdOption, ARRAY_SIZE(m_saveTask.appCmdOption));
     m_saveTask.hwndPost = hwndPost;
     m_saveTask.uMsgPost = uMsgPost;
+    m_saveTask.pStats = m_pStats;
     ::lstrcpy(m_saveTask.saveTaskName, m_saveTaskName);
     ::lstrcpy(m_saveTask.saveTaskNameNoWake, m_saveTaskName);
     ::lstrcat(m_saveTask.saveTaskNameNoWake, TEXT("N"));
@@ -630,6 +1163,7 @@ bool CReserveList::RunSaveTask(bool fNoWakeViewOnly, int resumeMargin, int execW
 DWORD WINAPI CReserveList::SaveTaskThread(LPVOID pParam)
 {
     const CONTEXT_SAVE_TASK *pSaveTask = static_cast<CONTEXT_SAVE_TASK*>(pParam);
+    CStatScope scope(pSaveTask->pStats, CStats::STAGE_SAVE_TASK);
     bool fInitialized = false;
     HRESULT hr;
     ITaskScheduler *pScheduler = NULL;
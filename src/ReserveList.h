@@ -8,6 +8,8 @@ enum FOLLOW_MODE {
     FOLLOW_MODE_PF_FOLLOWING // durationはさらに延長中
 };
 
+struct SEQ_TABLE_HEADER;
+
 struct RESERVE {
     bool isEnabled;
     WORD networkID;
@@ -31,10 +33,17 @@ struct RESERVE {
     int GetTrimmedDuration() const {
         return max(duration - recOption.startTrim - recOption.endTrim, 0);
     }
+    FILETIME GetTrimmedEndTime() const {
+        FILETIME time = GetTrimmedStartTime();
+        time += GetTrimmedDuration() * FILETIME_SECOND;
+        return time;
+    }
 };
 
 class CReserveList
 {
+    // 共有メモリのデータ部のバイト数
+    static const unsigned int SHARED_CAPACITY = 512 * 1024;
     struct DIALOG_PARAMS {
         RESERVE res;
         const RECORDING_OPTION *pDefaultRecOption;
@@ -56,26 +65,84 @@ class CReserveList
         int resumeTimeNum;
         SYSTEMTIME resumeTime[TASK_TRIGGER_MAX];
         bool resumeIsNoWake[TASK_TRIGGER_MAX];
+        CStats *pStats;
+    };
+    // 予約ファイルの1行のハッシュ値とその行の予約
+    struct LINE_HASH {
+        DWORD hash;     // 0は空き
+        int length;
+        bool fMatched;
+        WORD networkID;
+        WORD transportStreamID;
+        WORD serviceID;
+        WORD eventID;
     };
 
     RESERVE *m_head;
     BYTE m_eventIDLookup[2048];
+    // リストを変更するたびに増加する
+    DWORD m_epoch;
+    // 直近の有効な予約(デフォルト適用・優先度による切り詰め済み)のキャッシュ
+    mutable RESERVE m_nearestCache;
+    mutable bool m_fNearestCached;
+    mutable DWORD m_nearestEpoch;
+    mutable int m_nearestReadyOffset;
+    mutable RECORDING_OPTION m_nearestDefaultRecOption;
+    // 無効な予約の終了時刻についての最小ヒープ
+    RESERVE **m_expiryHeap;
+    int m_expiryHeapLen;
+    int m_expiryHeapSize;
+    DWORD m_expiryHeapEpoch;
+    // IDから予約を引く索引(NULLは空き)
+    mutable RESERVE **m_idIndex;
+    mutable int m_idIndexSize;
+    mutable DWORD m_idIndexEpoch;
     TCHAR m_saveFileName[MAX_PATH];
     TCHAR m_saveTaskName[64];
     TCHAR m_pluginPath[MAX_PATH];
     HANDLE m_hThread;
     CONTEXT_SAVE_TASK m_saveTask;
+    CStats *m_pStats;
+    // 同名のTTRecどうしで予約を共有する共有メモリ(有効なものが書き込み、番組表だけ使うものが読み込む)
+    mutable HANDLE m_hSharedMap;
+    mutable SEQ_TABLE_HEADER *m_pShared;
+    HANDLE m_hSharedWriterMutex;
+    int m_sharedSeq;
+    // 最後に読み書きした予約ファイルの各行のハッシュ表(外部での変更を行単位で取り込むため)
+    mutable LINE_HASH *m_lineHashes;
+    mutable int m_lineHashesSize;
+    // 最後に読み書きした予約ファイルの状態(自身の書き込みによる変更通知を無視するため)
+    mutable FILE_STAMP m_fileStamp;
+    // 同じストリームの別サービスの予約を同時に録画するか
+    bool m_fMultiServiceRec;
 
     void Clear();
-    static void ToString(const RESERVE &res, LPTSTR str);
-    bool Insert(LPCTSTR str);
+    void InsertLines(LPCTSTR text, bool fHashLines);
+    static LINE_HASH *NewLineHashes(int num, int *pSize);
+    static void AddLineHash(LINE_HASH *pTable, int size, DWORD hash, int length, const RESERVE &res);
+    static void AddLineHash(LINE_HASH *pTable, int size, const LINE_HASH &entry);
+    static LINE_HASH *FindLineHash(LINE_HASH *pTable, int size, DWORD hash, int length);
+    static int GetLineKeySlot(const LINE_HASH &entry, int size);
+    static int *NewLineKeyIndex(const LINE_HASH *pTable, int size);
+    static bool ContainsLineHash(const LINE_HASH *pTable, const int *pKeyIndex, int size, const LINE_HASH &entry);
+    bool OpenShared() const;
+    void PublishShared() const;
     static INT_PTR CALLBACK DlgProc(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lParam, void *pClientData);
     RESERVE *GetByID(DWORD networkID, DWORD transportStreamID, DWORD serviceID, DWORD eventID, RESERVE **pPrev) const;
     RESERVE *GetNearest(const RECORDING_OPTION &defaultRecOption, RESERVE **pPrev, bool fEnabledOnly) const;
+    static void CopyResolved(RESERVE *pRes, const RESERVE &in, const RECORDING_OPTION &defaultRecOption);
+    bool ResolveNearest(RESERVE *pRes, const RECORDING_OPTION &defaultRecOption, int readyOffset) const;
+    bool IsServiceRecordable(const RESERVE &in, const RESERVE &mainRes, const FILETIME &mainEnd,
+                             const RECORDING_OPTION &defaultRecOption) const;
+    void BuildExpiryHeap();
+    void BuildIDIndex() const;
+    void PopExpiryHeap();
     static DWORD WINAPI SaveTaskThread(LPVOID pParam);
 public:
     CReserveList();
     ~CReserveList();
+    static void ToString(const RESERVE &res, LPTSTR str);
+    static bool FromString(LPCTSTR str, RESERVE *pRes);
     bool Insert(const RESERVE &in);
     bool Insert(HINSTANCE hinst, HWND hwndOwner,
                 INT_PTR pShowModalDialog(HINSTANCE, LPCWSTR, INT_PTR (CALLBACK *)(HWND, UINT, WPARAM, LPARAM, void *), void *, HWND, void *),
@@ -83,12 +150,24 @@ public:
     bool Delete(DWORD networkID, DWORD transportStreamID, DWORD serviceID, DWORD eventID);
     const RESERVE *Get(DWORD networkID, DWORD transportStreamID, DWORD serviceID, DWORD eventID) const;
     const RESERVE *Get(int index) const;
+    // 先頭から順にたどるとき(RESERVE::nextで次の予約)
+    const RESERVE *GetHead() const { return m_head; }
+    int Length() const;
     bool Load();
     bool Save() const;
+    int Merge();
+    void SetSharedWriter(HANDLE hMutex);
+    bool LoadShared();
     const RESERVE *GetNearest(const RECORDING_OPTION &defaultRecOption, bool fEnabledOnly = true) const;
     bool GetNearest(RESERVE *pRes, const RECORDING_OPTION &defaultRecOption, int readyOffset) const;
     bool DeleteNearest(const RECORDING_OPTION &defaultRecOption, bool fEnabledOnly = true);
+    bool GetServiceRecordable(RESERVE *pRes, const RESERVE &mainRes, const FILETIME &now,
+                              const RECORDING_OPTION &defaultRecOption) const;
+    void SetMultiServiceRec(bool fEnable);
+    bool DeleteExpiredDisabled(const FILETIME &now);
+    DWORD GetEpoch() const { return m_epoch; }
     void SetPluginFileName(LPCTSTR fileName);
+    void SetStats(CStats *pStats) { m_pStats = pStats; }
     bool RunSaveTask(bool fNoWakeViewOnly, int resumeMargin, int execWait, LPCTSTR appName, LPCTSTR driverName,
                      LPCTSTR appCmdOption, HWND hwndPost = NULL, UINT uMsgPost = 0);
     HMENU CreateListMenu(int idStart) const;
@@ -1,7 +1,11 @@
 ﻿#include <Windows.h>
 #include <Shlwapi.h>
 #include <powrprof.h>
+#include "JstTime.h"
 #include "Util.h"
+#include "IniFile.h"
+#include "TsAnalyzer.h"
+#include "WakeTrace.h"
 
 extern HINSTANCE g_hinstDLL;
 
@@ -88,11 +92,14 @@ extern "C" __declspec(dllexport) void CALLBACK DelayedSuspendW(HWND hwnd, HINSTA
 }
 
 static void ShowBalloonTip(LPCTSTR text, int notifyLevel);
+static void WaitForReady(LPCTSTR moduleFileName, const CIniFile &ini, LPCTSTR cmdLine,
+                         LPCTSTR optionToReplace, LPCTSTR subDriverName, int maxWait);
 
 extern "C" __declspec(dllexport) void CALLBACK DelayedExecuteW(HWND hwnd, HINSTANCE hinst, LPWSTR lpszCmdLine, int nCmdShow)
 {
     LPCTSTR notifyText = TEXT("TVTestの起動に失敗しました。");
     int notifyLevel = 1;
+    CWakeTrace *pWakeTrace = NULL;
     TCHAR moduleFileName[MAX_PATH];
     if (GetLongModuleFileName(g_hinstDLL, moduleFileName, MAX_PATH)) {
         // このメソッドの処理中はDelayedSuspendW()させない
@@ -101,23 +108,31 @@ extern "C" __declspec(dllexport) void CALLBACK DelayedExecuteW(HWND hwnd, HINSTA
 
         if (!lpszCmdLine || !lpszCmdLine[0]) goto EXIT;
 
+        // 起動から録画開始までの段階を記録する(スタックが大きいのでヒープに置く)
+        pWakeTrace = new CWakeTrace;
+        pWakeTrace->SetPluginFileName(moduleFileName);
+        pWakeTrace->Begin();
+
         // 補欠のドライバで起動すべきか確認する
         TCHAR optionToReplace[MAX_PATH + 8], subDriverName[MAX_PATH];
         optionToReplace[0] = subDriverName[0] = 0;
+        // 設定はまとめて読み込む
+        CIniFile ini;
         TCHAR iniFileName[MAX_PATH];
         ::lstrcpy(iniFileName, moduleFileName);
         if (::PathRenameExtension(iniFileName, TEXT(".ini"))) {
+            ini.Load(iniFileName);
             FILETIME ft, ftNow;
             GetEpgTimeAsFileTime(&ftNow);
             TCHAR times[128];
-            ::GetPrivateProfileString(TEXT("Settings"), TEXT("SubDriverUseTimes"), TEXT(""), times, ARRAY_SIZE(times), iniFileName);
+            ini.GetString(TEXT("Settings"), TEXT("SubDriverUseTimes"), TEXT(""), times, ARRAY_SIZE(times));
             for (int i = 0; times[i] && StrToFileTime(times + i + 1, &ft);) {
                 // 前後計4分だけマージンをとる
                 if (-FILETIME_MINUTE < ftNow - ft && ftNow - ft < 3 * FILETIME_MINUTE) {
                     ::lstrcpy(optionToReplace, TEXT(" /D \""));
-                    ::GetPrivateProfileString(TEXT("Settings"), TEXT("Driver"), TEXT(""), optionToReplace + 5, MAX_PATH, iniFileName);
+                    ini.GetString(TEXT("Settings"), TEXT("Driver"), TEXT(""), optionToReplace + 5, MAX_PATH);
                     ::lstrcat(optionToReplace, TEXT("\""));
-                    ::GetPrivateProfileString(TEXT("Settings"), TEXT("SubDriver"), TEXT(""), subDriverName, MAX_PATH, iniFileName);
+                    ini.GetString(TEXT("Settings"), TEXT("SubDriver"), TEXT(""), subDriverName, MAX_PATH);
                     break;
                 }
                 i += 1 + ::StrCSpn(times + i + 1, TEXT("/"));
@@ -129,9 +144,16 @@ extern "C" __declspec(dllexport) void CALLBACK DelayedExecuteW(HWND hwnd, HINSTA
             // AwayMode未対応
             ::SetThreadExecutionState(ES_CONTINUOUS | ES_SYSTEM_REQUIRED);
         }
-        for (int i = ::StrToInt(lpszCmdLine); i > 0; i--) {
-            ::Sleep(1000);
+        if (ini.GetInt(TEXT("Settings"), TEXT("ExecProbe"), 1) != 0) {
+            // 準備が整いしだい起動する(ExecWaitは待機の上限)
+            WaitForReady(moduleFileName, ini, lpszCmdLine, optionToReplace, subDriverName, ::StrToInt(lpszCmdLine));
+        }
+        else {
+            for (int i = ::StrToInt(lpszCmdLine); i > 0; i--) {
+                ::Sleep(1000);
+            }
         }
+        pWakeTrace->Mark(CWakeTrace::STAGE_EXEC_WAIT);
 
         // 同名のプラグインが有効化されていれば起動しない
         TCHAR name[MAX_PATH];
@@ -141,6 +163,8 @@ extern "C" __declspec(dllexport) void CALLBACK DelayedExecuteW(HWND hwnd, HINSTA
             ::CloseHandle(hMutex);
             notifyText = TEXT("TVTestは既に起動しています。");
             notifyLevel = 3;
+            // 以降の段階は記録されない
+            pWakeTrace->Finish();
             goto EXIT;
         }
 
@@ -165,7 +189,9 @@ extern "C" __declspec(dllexport) void CALLBACK DelayedExecuteW(HWND hwnd, HINSTA
             STARTUPINFO si = { sizeof(si) };
             PROCESS_INFORMATION ps;
             if (::CreateProcess(NULL, lpszCmdLine, NULL, NULL, FALSE, 0, NULL, NULL, &si, &ps)) {
+                pWakeTrace->Mark(CWakeTrace::STAGE_APP_LAUNCH);
                 if (::WaitForInputIdle(ps.hProcess, 60000) == 0) {
+                    pWakeTrace->Mark(CWakeTrace::STAGE_APP_IDLE);
                     notifyText = TEXT("TVTestを起動しました。");
                     notifyLevel = 3;
                 }
@@ -178,10 +204,34 @@ extern "C" __declspec(dllexport) void CALLBACK DelayedExecuteW(HWND hwnd, HINSTA
     }
 
 EXIT:
+    // 記録の続きはプラグインが引き継ぐ
+    delete pWakeTrace;
     ::SetThreadExecutionState(ES_CONTINUOUS);
     ShowBalloonTip(notifyText, notifyLevel);
 }
 
+// 録画ファイルを解析して結果を"{録画ファイル名}.err.txt"に書き出す
+extern "C" __declspec(dllexport) void CALLBACK AnalyzeTsW(HWND hwnd, HINSTANCE hinst, LPWSTR lpszCmdLine, int nCmdShow)
+{
+    if (!lpszCmdLine || !lpszCmdLine[0]) return;
+
+    TCHAR fileName[MAX_PATH];
+    ::lstrcpyn(fileName, lpszCmdLine, ARRAY_SIZE(fileName));
+    ::PathUnquoteSpaces(fileName);
+
+    // 録画中のディスクI/Oを邪魔しない(Vista以降)
+    if (!::SetPriorityClass(::GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN)) {
+        ::SetPriorityClass(::GetCurrentProcess(), IDLE_PRIORITY_CLASS);
+    }
+
+    TCHAR reportName[MAX_PATH + 8];
+    ::wsprintf(reportName, TEXT("%s.err.txt"), fileName);
+    CTsAnalyzer analyzer;
+    if (!analyzer.AnalyzeFile(fileName) || !analyzer.WriteReport(reportName, fileName)) {
+        ShowBalloonTip(TEXT("録画ファイルの解析に失敗しました。"), 1);
+    }
+}
+
 // 必要であればバルーンチップを表示する
 static void ShowBalloonTip(LPCTSTR text, int notifyLevel)
 {
@@ -217,3 +267,87 @@ static void ShowBalloonTip(LPCTSTR text, int notifyLevel)
         }
     }
 }
+
+// 予約起動後、TVTestを起動できる状態になるまで最大maxWait秒待つ
+// 以下がそろえば準備完了とみなす
+// ・起動に使うBonDriverを読み込める(デバイスドライバやランタイムの復帰)
+// ・直近の予約の保存先ボリュームが応答する(ディスクのスピンアップ、ネットワーク共有の再接続)
+// ・システム時刻の補正が落ち着いている(復帰直後の時刻同期)
+//   1回の確認では同期がまだ始まっていないだけのこともあるので、CLOCK_SETTLE_MSEC続けて補正されないことを確かめる
+static const DWORD CLOCK_SETTLE_MSEC = 5000;
+static void WaitForReady(LPCTSTR moduleFileName, const CIniFile &ini, LPCTSTR cmdLine,
+                         LPCTSTR optionToReplace, LPCTSTR subDriverName, int maxWait)
+{
+    if (maxWait <= 0) return;
+    DWORD startTick = ::GetTickCount();
+
+    // BonDriverのパスを求める(TVTestのフォルダからの相対パスのこともある)
+    TCHAR driverPath[MAX_PATH];
+    driverPath[0] = 0;
+    LPCTSTR appName = ::StrChr(cmdLine, TEXT(' '));
+    LPCTSTR driverOption = appName ? ::StrStrI(appName, TEXT(" /D \"")) : NULL;
+    if (appName && appName[1] == TEXT('"') && driverOption) {
+        TCHAR name[MAX_PATH], pluginDir[MAX_PATH], appDir[MAX_PATH];
+        if (subDriverName[0] && ::lstrlen(optionToReplace) > 6 && ::StrStrI(appName, optionToReplace)) {
+            ::lstrcpyn(name, subDriverName, MAX_PATH);
+        }
+        else {
+            ::lstrcpyn(name, driverOption + 5, min(::StrCSpn(driverOption + 5, TEXT("\"")) + 1, MAX_PATH));
+        }
+        ::lstrcpy(pluginDir, moduleFileName);
+        ::PathRemoveFileSpec(pluginDir);
+        ::lstrcpyn(appDir, appName + 2, min(::StrCSpn(appName + 2, TEXT("\"")) + 1, MAX_PATH));
+        if (!::PathCombine(driverPath, pluginDir, appDir) || !::PathRemoveFileSpec(driverPath) ||
+            !::PathCombine(appDir, driverPath, name) || !::PathFileExists(appDir))
+        {
+            // 別のフォルダにあるなどして見つからないときは確認しない
+            driverPath[0] = 0;
+        }
+        else {
+            ::lstrcpy(driverPath, appDir);
+        }
+    }
+
+    // 保存先はプラグインがタスクスケジューラ登録時に記録している
+    TCHAR probeDir[MAX_PATH];
+    ini.GetString(TEXT("Settings"), TEXT("ExecProbeDir"), TEXT(""), probeDir, ARRAY_SIZE(probeDir));
+    // フォルダが未作成のこともあるのでボリュームのルートを調べる
+    if (::PathIsRelative(probeDir) || !::PathStripToRoot(probeDir)) probeDir[0] = 0;
+
+    bool fDriverReady = !driverPath[0];
+    bool fDirReady = !probeDir[0];
+    FILETIME lastTime;
+    ::GetSystemTimeAsFileTime(&lastTime);
+    DWORD lastTick = ::GetTickCount();
+    DWORD settledTick = lastTick;
+    for (;;) {
+        if (!fDriverReady) {
+            // 読み込めないときにダイアログを出さない
+            UINT errorMode = ::SetErrorMode(SEM_FAILCRITICALERRORS | SEM_NOOPENFILEERRORBOX);
+            HMODULE hModule = ::LoadLibraryEx(driverPath, NULL, LOAD_WITH_ALTERED_SEARCH_PATH);
+            ::SetErrorMode(errorMode);
+            if (hModule) {
+                ::FreeLibrary(hModule);
+                fDriverReady = true;
+            }
+        }
+        if (!fDirReady) {
+            ULARGE_INTEGER freeBytes;
+            fDirReady = ::GetDiskFreeSpaceEx(probeDir, &freeBytes, NULL, NULL) != FALSE;
+        }
+        if (::GetTickCount() - startTick >= static_cast<DWORD>(maxWait) * 1000) break;
+        ::Sleep(500);
+
+        // システム時刻の進みが経過時間とほぼ一致する状態が続けば、時刻の補正は落ち着いている
+        FILETIME now;
+        ::GetSystemTimeAsFileTime(&now);
+        DWORD tick = ::GetTickCount();
+        LONGLONG drift = (now - lastTime) - static_cast<LONGLONG>(tick - lastTick) * FILETIME_MILLISECOND;
+        if (drift <= -200 * FILETIME_MILLISECOND || 200 * FILETIME_MILLISECOND <= drift) settledTick = tick;
+        bool fClockSettled = tick - settledTick >= CLOCK_SETTLE_MSEC;
+        lastTime = now;
+        lastTick = tick;
+
+        if (fDriverReady && fDirReady && fClockSettled) break;
+    }
+}
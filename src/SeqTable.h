@@ -0,0 +1,169 @@
+﻿#ifndef INCLUDE_SEQ_TABLE_H
+#define INCLUDE_SEQ_TABLE_H
+
+// 共有メモリ上の可変長データを書き込み側1つと任意の数の読み込み側で共有する(シーケンスロック)
+// 書き込み側どうしの排他は呼び出し側で行うこと。読み込み側はロックを取らず、書き込みと
+// 重なったときはやり直す
+// Win32に依存しないのでPOSIXの共有メモリ上でも単体でテストできる
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#pragma intrinsic(_InterlockedIncrement, _ReadWriteBarrier)
+#endif
+
+#define SEQ_TABLE_MAGIC     0x54514553  // "SEQT"
+// データが大きすぎて格納できなかったことを示すlength
+#define SEQ_TABLE_OVERFLOW  0xFFFFFFFFU
+// 読み込み側が書き込み中に当たったときにやり直す回数
+#define SEQ_TABLE_READ_RETRY 100
+
+struct SEQ_TABLE_HEADER {
+    unsigned int magic;
+    unsigned int capacity;  // データ部のバイト数
+    volatile int seq;       // 書き込み中は奇数。0は未書き込み
+    unsigned int length;    // データのバイト数またはSEQ_TABLE_OVERFLOW
+};
+
+// 32ビットと64ビットのプロセスで共有できるようにデータ部は8バイト境界から始める
+#define SEQ_TABLE_HEADER_SIZE ((sizeof(SEQ_TABLE_HEADER) + 7) / 8 * 8)
+
+inline unsigned int SeqTableGetSize(unsigned int capacity)
+{
+    return static_cast<unsigned int>(SEQ_TABLE_HEADER_SIZE) + capacity;
+}
+
+inline unsigned char *SeqTableGetData(SEQ_TABLE_HEADER *pHeader)
+{
+    return reinterpret_cast<unsigned char*>(pHeader) + SEQ_TABLE_HEADER_SIZE;
+}
+
+inline const unsigned char *SeqTableGetData(const SEQ_TABLE_HEADER *pHeader)
+{
+    return reinterpret_cast<const unsigned char*>(pHeader) + SEQ_TABLE_HEADER_SIZE;
+}
+
+inline int SeqTableIncrement(volatile int *p)
+{
+#ifdef _MSC_VER
+    return _InterlockedIncrement(reinterpret_cast<volatile long*>(p));
+#else
+    return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+#endif
+}
+
+inline int SeqTableLoad(const volatile int *p)
+{
+#ifdef _MSC_VER
+    // x86/x64ではロードどうしの順序は入れ替わらないのでコンパイラの並べ替えだけ防ぐ
+    int v = *p;
+    _ReadWriteBarrier();
+    return v;
+#else
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+inline void SeqTableLoadFence()
+{
+#ifdef _MSC_VER
+    _ReadWriteBarrier();
+#else
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+#endif
+}
+
+inline void SeqTableStoreFence()
+{
+#ifdef _MSC_VER
+    // x86/x64ではストアどうしの順序は入れ替わらない
+    _ReadWriteBarrier();
+#else
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+#endif
+}
+
+// 書き込み側の排他の中で呼ぶこと
+inline bool SeqTableIsInitialized(const SEQ_TABLE_HEADER *pHeader, unsigned int capacity)
+{
+    return pHeader->magic == SEQ_TABLE_MAGIC && pHeader->capacity == capacity;
+}
+
+inline void SeqTableInitialize(SEQ_TABLE_HEADER *pHeader, unsigned int capacity)
+{
+    pHeader->capacity = capacity;
+    pHeader->length = 0;
+    pHeader->seq = 0;
+    SeqTableStoreFence();
+    pHeader->magic = SEQ_TABLE_MAGIC;
+}
+
+// SeqTableGetData()の内容を直接書き換えるときはBeginWrite()とEndWrite()で囲む
+inline void SeqTableBeginWrite(SEQ_TABLE_HEADER *pHeader)
+{
+    SeqTableIncrement(&pHeader->seq);
+}
+
+inline void SeqTableEndWrite(SEQ_TABLE_HEADER *pHeader, unsigned int length)
+{
+    pHeader->length = length <= pHeader->capacity ? length : SEQ_TABLE_OVERFLOW;
+    SeqTableIncrement(&pHeader->seq);
+}
+
+inline bool SeqTableWrite(SEQ_TABLE_HEADER *pHeader, const void *pData, unsigned int length)
+{
+    SeqTableBeginWrite(pHeader);
+    if (length <= pHeader->capacity) {
+        const unsigned char *p = static_cast<const unsigned char*>(pData);
+        unsigned char *q = SeqTableGetData(pHeader);
+        for (unsigned int i = 0; i < length; ++i) q[i] = p[i];
+    }
+    SeqTableEndWrite(pHeader, length);
+    return length <= pHeader->capacity;
+}
+
+// 最後に書き込みが完了したときのシーケンス番号(0は未書き込み)
+inline int SeqTableGetSeq(const SEQ_TABLE_HEADER *pHeader)
+{
+    if (pHeader->magic != SEQ_TABLE_MAGIC) return 0;
+    return SeqTableLoad(&pHeader->seq) & ~1;
+}
+
+// 読み込みに必要なバッファのバイト数の目安(直後に変わることがある)
+inline unsigned int SeqTableGetLength(const SEQ_TABLE_HEADER *pHeader)
+{
+    return pHeader->magic == SEQ_TABLE_MAGIC ? pHeader->length : 0;
+}
+
+// 一貫したデータをbufにコピーする
+// 戻り値: コピーしたバイト数。未書き込みまたは格納できなかったときは-1、バッファ不足のとき-2、
+//         書き込み中が続いたときは-3
+inline int SeqTableRead(const SEQ_TABLE_HEADER *pHeader, void *buf, unsigned int bufSize, int *pSeq)
+{
+    if (pHeader->magic != SEQ_TABLE_MAGIC) return -1;
+    for (int retry = 0; retry < SEQ_TABLE_READ_RETRY; ++retry) {
+        int seq = SeqTableLoad(&pHeader->seq);
+        if (seq & 1) continue;
+        unsigned int length = pHeader->length;
+        int ret;
+        if (seq == 0 || length == SEQ_TABLE_OVERFLOW || length > pHeader->capacity) {
+            ret = -1;
+        }
+        else if (length > bufSize) {
+            ret = -2;
+        }
+        else {
+            const unsigned char *p = SeqTableGetData(pHeader);
+            unsigned char *q = static_cast<unsigned char*>(buf);
+            for (unsigned int i = 0; i < length; ++i) q[i] = p[i];
+            ret = static_cast<int>(length);
+        }
+        SeqTableLoadFence();
+        if (SeqTableLoad(&pHeader->seq) == seq) {
+            if (pSeq) *pSeq = seq;
+            return ret;
+        }
+    }
+    return -3;
+}
+
+#endif // INCLUDE_SEQ_TABLE_H
@@ -0,0 +1,211 @@
+﻿#include <Windows.h>
+#include "JstTime.h"
+#include "Util.h"
+#include "TsRingBuffer.h"
+#include "TsServiceFilter.h"
+#include "ServiceRecorder.h"
+
+
+CServiceRecorder::CServiceRecorder()
+    : m_hFile(INVALID_HANDLE_VALUE)
+    , m_hThread(NULL)
+    , m_hEvent(NULL)
+    , m_bufNum(0)
+    , m_writeIndex(0)
+    , m_readyCount(0)
+    , m_fStop(false)
+    , m_fWriteFailed(false)
+    , m_fPreallocated(false)
+    , m_droppedPackets(0)
+    , m_polledDroppedPackets(0)
+{
+    for (int i = 0; i < BUFFER_NUM_MAX; ++i) {
+        m_pBuf[i] = NULL;
+        m_bufLen[i] = 0;
+    }
+    m_fileName[0] = 0;
+}
+
+
+CServiceRecorder::~CServiceRecorder()
+{
+    Close();
+}
+
+
+// ストリームコールバックに渡す前に呼ぶこと
+// kbytesPerSecは見込みのビットレート(KB/秒)で、バッファの大きさを決める(0のときは最小)
+bool CServiceRecorder::Open(LPCTSTR fileName, WORD serviceID, bool fLean, DWORD preallocMBytes, int kbytesPerSec)
+{
+    Close();
+    m_hFile = ::CreateFile(fileName, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE) return false;
+    if (preallocMBytes > 0) {
+        // 確保できなければ(空き容量不足など)そのまま書く
+        LARGE_INTEGER size;
+        size.QuadPart = static_cast<LONGLONG>(preallocMBytes) << 20;
+        m_fPreallocated = ::SetFilePointerEx(m_hFile, size, NULL, FILE_BEGIN) && ::SetEndOfFile(m_hFile);
+        size.QuadPart = 0;
+        ::SetFilePointerEx(m_hFile, size, NULL, FILE_BEGIN);
+        if (!m_fPreallocated) ::SetEndOfFile(m_hFile);
+    }
+    m_hEvent = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (m_hEvent) {
+        LONGLONG bufferBytes = static_cast<LONGLONG>(max(kbytesPerSec, 0)) * 1024 * BUFFER_SEC;
+        m_bufNum = static_cast<int>(min(max(bufferBytes / BUFFER_SIZE + 1, BUFFER_NUM_MIN), BUFFER_NUM_MAX));
+        for (int i = 0; i < m_bufNum; ++i) {
+            m_pBuf[i] = new BYTE[BUFFER_SIZE];
+            m_bufLen[i] = 0;
+        }
+        m_writeIndex = m_readyCount = 0;
+        m_fStop = m_fWriteFailed = false;
+        m_droppedPackets = m_polledDroppedPackets = 0;
+        m_filter.Reset(serviceID, fLean);
+        ::lstrcpyn(m_fileName, fileName, ARRAY_SIZE(m_fileName));
+        m_hThread = ::CreateThread(NULL, 0, WriteThread, this, 0, NULL);
+        if (m_hThread) return true;
+    }
+    Close();
+    ::DeleteFile(fileName);
+    return false;
+}
+
+
+// ストリームコールバックから外してから呼ぶこと
+void CServiceRecorder::Close()
+{
+    if (m_hThread) {
+        {
+            CBlockLock lock(&m_lock);
+            m_fStop = true;
+        }
+        ::SetEvent(m_hEvent);
+        ::WaitForSingleObject(m_hThread, INFINITE);
+        ::CloseHandle(m_hThread);
+        m_hThread = NULL;
+    }
+    if (m_hEvent) {
+        ::CloseHandle(m_hEvent);
+        m_hEvent = NULL;
+    }
+    if (m_hFile != INVALID_HANDLE_VALUE) {
+        // 書き込みは先頭から順に行うので、現在位置より後ろが確保した余り
+        if (m_fPreallocated) ::SetEndOfFile(m_hFile);
+        m_fPreallocated = false;
+        ::CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+    for (int i = 0; i < m_bufNum; ++i) {
+        delete [] m_pBuf[i];
+        m_pBuf[i] = NULL;
+    }
+    m_bufNum = 0;
+}
+
+
+// パケットを1つ渡す(ストリームコールバックのスレッド)
+void CServiceRecorder::Write(const BYTE *pPacket)
+{
+    const BYTE *pOut;
+    int n = m_filter.Filter(pPacket, &pOut);
+    if (n <= 0) return;
+
+    CBlockLock lock(&m_lock);
+    for (; n > 0; --n, pOut += CTsServiceFilter::PACKET_SIZE) {
+        if (m_readyCount >= m_bufNum) {
+            // すべてのバッファが書き込み待ち
+            m_droppedPackets += n;
+            return;
+        }
+        int index = (m_writeIndex + m_readyCount) % m_bufNum;
+        ::CopyMemory(m_pBuf[index] + m_bufLen[index], pOut, CTsServiceFilter::PACKET_SIZE);
+        m_bufLen[index] += CTsServiceFilter::PACKET_SIZE;
+        if (m_bufLen[index] >= BUFFER_SIZE) {
+            ++m_readyCount;
+            ::SetEvent(m_hEvent);
+        }
+    }
+}
+
+
+// タイムシフトで保持しているposからtoPosの手前までを、録画の先頭として書き込む
+// Open()の後、ストリームコールバックに渡す前に呼ぶこと(書き込みスレッドを介さずにすぐ書き込む)
+// 一部でも保持していなければfalseを返す
+bool CServiceRecorder::WriteHead(CTsRingBuffer *pTimeShiftBuf, LONGLONG pos, LONGLONG toPos)
+{
+    if (!m_hThread || m_readyCount > 0) return false;
+    // 書き込み待ちのバッファはないので、次に埋めるバッファを直接使う
+    int index = m_writeIndex;
+    bool fRet = true;
+    while (fRet && pos < toPos) {
+        const BYTE *pData;
+        DWORD n = pTimeShiftBuf->Peek(pos, toPos, &pData);
+        if (n == 0) {
+            fRet = false;
+            break;
+        }
+        for (DWORD i = 0; fRet && i < n; ++i, pData += CTsServiceFilter::PACKET_SIZE) {
+            const BYTE *pOut;
+            for (int m = m_filter.Filter(pData, &pOut); m > 0; --m, pOut += CTsServiceFilter::PACKET_SIZE) {
+                ::CopyMemory(m_pBuf[index] + m_bufLen[index], pOut, CTsServiceFilter::PACKET_SIZE);
+                m_bufLen[index] += CTsServiceFilter::PACKET_SIZE;
+                if (m_bufLen[index] >= BUFFER_SIZE) {
+                    DWORD written;
+                    if (!::WriteFile(m_hFile, m_pBuf[index], m_bufLen[index], &written, NULL) || written != m_bufLen[index]) {
+                        m_fWriteFailed = true;
+                        fRet = false;
+                    }
+                    m_bufLen[index] = 0;
+                }
+            }
+        }
+        // 読み出している間に上書きされていないか確かめる
+        if (!pTimeShiftBuf->IsRetained(pos)) fRet = false;
+        pos += n;
+    }
+    // 埋めかけのバッファは続きのパケットとともに書き込みスレッドが書き出す
+    return fRet;
+}
+
+
+DWORD WINAPI CServiceRecorder::WriteThread(LPVOID pParam)
+{
+    static_cast<CServiceRecorder*>(pParam)->WriteBuffers();
+    return 0;
+}
+
+
+void CServiceRecorder::WriteBuffers()
+{
+    for (;;) {
+        ::WaitForSingleObject(m_hEvent, INFINITE);
+        for (;;) {
+            int index;
+            bool fLast = false;
+            {
+                CBlockLock lock(&m_lock);
+                if (m_readyCount == 0) {
+                    if (!m_fStop) break;
+                    // 埋めかけのバッファを書き出して終了
+                    m_readyCount = 1;
+                    fLast = true;
+                }
+                index = m_writeIndex;
+            }
+            // 書き込み中のバッファにコールバックは触れない
+            DWORD written;
+            if (m_bufLen[index] > 0 && !m_fWriteFailed &&
+                (!::WriteFile(m_hFile, m_pBuf[index], m_bufLen[index], &written, NULL) || written != m_bufLen[index]))
+            {
+                m_fWriteFailed = true;
+            }
+            {
+                CBlockLock lock(&m_lock);
+                m_bufLen[index] = 0;
+                m_writeIndex = (m_writeIndex + 1) % m_bufNum;
+                --m_readyCount;
+            }
+            if (fLast) return;
+        }
+    }
+}
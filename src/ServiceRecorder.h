@@ -0,0 +1,59 @@
+﻿#ifndef INCLUDE_SERVICE_RECORDER_H
+#define INCLUDE_SERVICE_RECORDER_H
+
+// ストリームコールバックで受け取ったTSから1つのサービスを取り出してファイルに書き出す
+// 書き込みは専用のスレッドで行い、コールバックのスレッドを待たせない
+class CServiceRecorder
+{
+public:
+    static const DWORD BUFFER_SIZE = 188 * 4096;
+    // バッファの数は見込みのビットレートでBUFFER_SEC秒分(ディスクが一時的に応答しなくても捨てないため)
+    static const int BUFFER_SEC = 8;
+    static const int BUFFER_NUM_MIN = 4;
+    static const int BUFFER_NUM_MAX = 64;
+
+    CServiceRecorder();
+    ~CServiceRecorder();
+    bool Open(LPCTSTR fileName, WORD serviceID, bool fLean = false, DWORD preallocMBytes = 0, int kbytesPerSec = 0);
+    void Close();
+    bool IsOpen() const { return m_hThread != NULL; }
+    void Write(const BYTE *pPacket);
+    bool WriteHead(CTsRingBuffer *pTimeShiftBuf, LONGLONG pos, LONGLONG toPos);
+    LPCTSTR GetFileName() const { return m_fileName; }
+    DWORD GetDroppedPackets() const { return m_droppedPackets; }
+    // 前回の呼び出しから捨てたパケット数(録画中に監視するためのもの)
+    DWORD PollDroppedPackets() {
+        DWORD dropped = m_droppedPackets;
+        DWORD n = dropped - m_polledDroppedPackets;
+        m_polledDroppedPackets = dropped;
+        return n;
+    }
+    bool IsWriteFailed() const { return m_fWriteFailed; }
+private:
+    CServiceRecorder(const CServiceRecorder&);
+    CServiceRecorder &operator=(const CServiceRecorder&);
+    static DWORD WINAPI WriteThread(LPVOID pParam);
+    void WriteBuffers();
+
+    CCriticalLock m_lock;
+    CTsServiceFilter m_filter;
+    HANDLE m_hFile;
+    HANDLE m_hThread;
+    HANDLE m_hEvent;
+    // 書き込み待ちのバッファ(m_writeIndexからm_readyCount個)と埋めているバッファのリング
+    BYTE *m_pBuf[BUFFER_NUM_MAX];
+    DWORD m_bufLen[BUFFER_NUM_MAX];
+    int m_bufNum;
+    int m_writeIndex;
+    int m_readyCount;
+    bool m_fStop;
+    bool m_fWriteFailed;
+    // 断片化を避けるため見積もった大きさを先に確保した(閉じるときに切り詰める)
+    bool m_fPreallocated;
+    // 書き込みが追いつかずに捨てたパケット数
+    volatile DWORD m_droppedPackets;
+    DWORD m_polledDroppedPackets;
+    TCHAR m_fileName[MAX_PATH];
+};
+
+#endif // INCLUDE_SERVICE_RECORDER_H
@@ -0,0 +1,185 @@
+﻿#include <Windows.h>
+#include <Shlwapi.h>
+#include "JstTime.h"
+#include "Util.h"
+#include "Stats.h"
+
+static const LPCTSTR STAGE_NAME_LIST[] = {
+    TEXT("CheckQuery"),
+    TEXT("FollowUpReserves"),
+    TEXT("CheckRecording"),
+    TEXT("ReserveLoad"),
+    TEXT("ReserveSave"),
+    TEXT("SaveTask"),
+};
+
+static const LPCTSTR COUNTER_NAME_LIST[] = {
+    TEXT("EventsScanned"),
+    TEXT("QueriesEvaluated"),
+    TEXT("ReservesTouched"),
+};
+
+
+CStats::CStats()
+{
+    LARGE_INTEGER freq;
+    m_frequency = ::QueryPerformanceFrequency(&freq) ? freq.QuadPart : 0;
+    m_saveFileName[0] = 0;
+    Reset();
+}
+
+
+void CStats::SetPluginFileName(LPCTSTR fileName)
+{
+    TCHAR saveFileName[MAX_PATH + 32];
+    ::lstrcpy(saveFileName, fileName);
+    ::PathRemoveExtension(saveFileName);
+    ::lstrcat(saveFileName, TEXT("_Stats.txt"));
+    ::lstrcpyn(m_saveFileName, saveFileName, ARRAY_SIZE(m_saveFileName));
+}
+
+
+void CStats::Reset()
+{
+    CBlockLock lock(&m_lock);
+    ::ZeroMemory(m_hist, sizeof(m_hist));
+    ::ZeroMemory(m_counters, sizeof(m_counters));
+}
+
+
+LONGLONG CStats::Begin() const
+{
+    LARGE_INTEGER count;
+    return m_frequency > 0 && ::QueryPerformanceCounter(&count) ? count.QuadPart : 0;
+}
+
+
+void CStats::End(STAGE stage, LONGLONG begin)
+{
+    LONGLONG end = Begin();
+    if (begin == 0 || end < begin) return;
+
+    LONGLONG usec = (end - begin) * 1000000 / m_frequency;
+    DWORD value = usec > 0xFFFFFFFF ? 0xFFFFFFFF : static_cast<DWORD>(usec);
+
+    CBlockLock lock(&m_lock);
+    HISTOGRAM &hist = m_hist[stage];
+    ++hist.count;
+    hist.total += value;
+    hist.max = max(hist.max, value);
+    hist.last = value;
+    ++hist.buckets[GetBucketIndex(value)];
+}
+
+
+void CStats::Add(COUNTER counter, DWORD n)
+{
+    CBlockLock lock(&m_lock);
+    m_counters[counter] += n;
+}
+
+
+DWORD CStats::GetValue(STAGE stage, VALUE value)
+{
+    CBlockLock lock(&m_lock);
+    return GetValueUnlocked(m_hist[stage], value);
+}
+
+
+DWORD CStats::GetCounter(COUNTER counter)
+{
+    CBlockLock lock(&m_lock);
+    return m_counters[counter];
+}
+
+
+// 値が属するヒストグラムの区間を求める
+int CStats::GetBucketIndex(DWORD usec)
+{
+    if (usec < SUB_BUCKETS) return usec;
+    int msb = 31;
+    while (!(usec & (1UL << msb))) --msb;
+    return (msb - SUB_BUCKETS_BITS + 1) * SUB_BUCKETS + ((usec >> (msb - SUB_BUCKETS_BITS)) & (SUB_BUCKETS - 1));
+}
+
+
+// 区間に属する値の最大値
+// 64ビットのシフトや符号なし除算はランタイムのヘルパを呼ぶのでDWORDの範囲で求める
+DWORD CStats::GetBucketUpperBound(int index)
+{
+    if (index < SUB_BUCKETS) return index;
+    int shift = index / SUB_BUCKETS - 1;
+    if (shift > 32 - SUB_BUCKETS_BITS - 1) return 0xFFFFFFFF;
+    // 最後の区間の上限でもちょうど0xFFFFFFFFなのであふれない
+    DWORD lower = static_cast<DWORD>(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+    return lower + ((1UL << shift) - 1);
+}
+
+
+DWORD CStats::GetPercentile(const HISTOGRAM &hist, int percent)
+{
+    if (hist.count == 0) return 0;
+    // 切り上げ
+    LONGLONG rank = (static_cast<LONGLONG>(hist.count) * percent + 99) / 100;
+    LONGLONG sum = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+        sum += hist.buckets[i];
+        if (sum >= rank) return min(GetBucketUpperBound(i), hist.max);
+    }
+    return hist.max;
+}
+
+
+DWORD CStats::GetValueUnlocked(const HISTOGRAM &hist, VALUE value) const
+{
+    switch (value) {
+    case VALUE_COUNT:   return hist.count;
+    case VALUE_AVERAGE: return hist.count == 0 ? 0 : static_cast<DWORD>(hist.total / static_cast<LONGLONG>(hist.count));
+    case VALUE_P50:     return GetPercentile(hist, 50);
+    case VALUE_P90:     return GetPercentile(hist, 90);
+    case VALUE_P99:     return GetPercentile(hist, 99);
+    case VALUE_MAX:     return hist.max;
+    case VALUE_LAST:    return hist.last;
+    }
+    return 0;
+}
+
+
+// 書式: 名前<TAB>回数<TAB>平均<TAB>50%<TAB>90%<TAB>99%<TAB>最大<TAB>最新
+//       名前<TAB>件数
+bool CStats::Save()
+{
+    if (!m_saveFileName[0]) return false;
+
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    for (int i = 0; i < 5; ++i) {
+        hFile = ::CreateFile(m_saveFileName, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile != INVALID_HANDLE_VALUE) break;
+        ::Sleep(200);
+    }
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+
+    DWORD writtenBytes;
+    WCHAR bom = L'\xFEFF';
+    ::WriteFile(hFile, &bom, sizeof(bom), &writtenBytes, NULL);
+
+    TCHAR buf[256];
+    int len = ::wsprintf(buf, TEXT("; Stage\tCount\tAverage\tP50\tP90\tP99\tMax\tLast (usec)\r\n"));
+    ::WriteFile(hFile, buf, len * sizeof(TCHAR), &writtenBytes, NULL);
+
+    CBlockLock lock(&m_lock);
+    for (int i = 0; i < STAGE_MAX; ++i) {
+        const HISTOGRAM &hist = m_hist[i];
+        len = ::wsprintf(buf, TEXT("%s\t%u\t%u\t%u\t%u\t%u\t%u\t%u\r\n"), STAGE_NAME_LIST[i],
+                         hist.count, GetValueUnlocked(hist, VALUE_AVERAGE), GetPercentile(hist, 50),
+                         GetPercentile(hist, 90), GetPercentile(hist, 99), hist.max, hist.last);
+        ::WriteFile(hFile, buf, len * sizeof(TCHAR), &writtenBytes, NULL);
+    }
+    for (int i = 0; i < COUNTER_MAX; ++i) {
+        len = ::wsprintf(buf, TEXT("%s\t%u\r\n"), COUNTER_NAME_LIST[i], m_counters[i]);
+        ::WriteFile(hFile, buf, len * sizeof(TCHAR), &writtenBytes, NULL);
+    }
+
+    ::CloseHandle(hFile);
+    return true;
+}
@@ -0,0 +1,80 @@
+﻿#ifndef INCLUDE_STATS_H
+#define INCLUDE_STATS_H
+
+// 主要な処理の所要時間と処理件数の統計
+class CStats
+{
+public:
+    enum STAGE {
+        STAGE_CHECK_QUERY,
+        STAGE_FOLLOW_UP,
+        STAGE_CHECK_RECORDING,
+        STAGE_RESERVE_LOAD,
+        STAGE_RESERVE_SAVE,
+        STAGE_SAVE_TASK,
+        STAGE_MAX
+    };
+    enum COUNTER {
+        COUNTER_EVENTS_SCANNED,
+        COUNTER_QUERIES_EVALUATED,
+        COUNTER_RESERVES_TOUCHED,
+        COUNTER_MAX
+    };
+    // GetValue()で取得する値(時間はマイクロ秒)
+    enum VALUE {
+        VALUE_COUNT,
+        VALUE_AVERAGE,
+        VALUE_P50,
+        VALUE_P90,
+        VALUE_P99,
+        VALUE_MAX,
+        VALUE_LAST,
+    };
+    // ヒストグラムは2のべき乗の区間をさらにSUB_BUCKETS等分する(相対誤差は1/SUB_BUCKETS以下)
+    static const int SUB_BUCKETS_BITS = 2;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKETS_BITS;
+    static const int BUCKETS = (32 - SUB_BUCKETS_BITS + 1) * SUB_BUCKETS;
+
+    CStats();
+    void SetPluginFileName(LPCTSTR fileName);
+    void Reset();
+    LONGLONG Begin() const;
+    void End(STAGE stage, LONGLONG begin);
+    void Add(COUNTER counter, DWORD n);
+    DWORD GetValue(STAGE stage, VALUE value);
+    DWORD GetCounter(COUNTER counter);
+    bool Save();
+private:
+    struct HISTOGRAM {
+        DWORD count;
+        LONGLONG total;
+        DWORD max;
+        DWORD last;
+        DWORD buckets[BUCKETS];
+    };
+    static int GetBucketIndex(DWORD usec);
+    static DWORD GetBucketUpperBound(int index);
+    static DWORD GetPercentile(const HISTOGRAM &hist, int percent);
+    DWORD GetValueUnlocked(const HISTOGRAM &hist, VALUE value) const;
+
+    CCriticalLock m_lock;
+    LONGLONG m_frequency;
+    HISTOGRAM m_hist[STAGE_MAX];
+    DWORD m_counters[COUNTER_MAX];
+    TCHAR m_saveFileName[MAX_PATH];
+};
+
+// スコープの所要時間を記録する
+class CStatScope
+{
+public:
+    CStatScope(CStats *pStats, CStats::STAGE stage)
+        : m_pStats(pStats), m_stage(stage), m_begin(pStats ? pStats->Begin() : 0) {}
+    ~CStatScope() { if (m_pStats) m_pStats->End(m_stage, m_begin); }
+private:
+    CStats *m_pStats;
+    CStats::STAGE m_stage;
+    LONGLONG m_begin;
+};
+
+#endif // INCLUDE_STATS_H
@@ -0,0 +1,260 @@
+﻿#include <Windows.h>
+#include <Shlwapi.h>
+#include "JstTime.h"
+#include "Util.h"
+#include "StoragePool.h"
+
+
+CStoragePool::CStoragePool()
+    : m_dirNum(0)
+    , m_volumeNum(0)
+{
+    m_saveFileName[0] = 0;
+}
+
+
+void CStoragePool::SetPluginFileName(LPCTSTR fileName)
+{
+    TCHAR saveFileName[MAX_PATH + 32];
+    ::lstrcpy(saveFileName, fileName);
+    ::PathRemoveExtension(saveFileName);
+    ::lstrcat(saveFileName, TEXT("_Storage.txt"));
+    ::lstrcpyn(m_saveFileName, saveFileName, ARRAY_SIZE(m_saveFileName));
+}
+
+
+// 書式: KB/秒<TAB>ボリュームのパス
+bool CStoragePool::Load()
+{
+    if (!m_saveFileName[0] || !::PathFileExists(m_saveFileName)) return false;
+    LPTSTR text = NULL;
+    for (int i = 0; i < 5; ++i) {
+        if ((text = NewReadTextFileToEnd(m_saveFileName, FILE_SHARE_READ)) != NULL) break;
+        ::Sleep(200);
+    }
+    if (!text) return false;
+
+    for (LPCTSTR line = text; line && *line;) {
+        LPCTSTR p = line;
+        int throughput = ::StrToInt(p);
+        if (throughput > 0 && NextToken(&p)) {
+            TCHAR root[MAX_PATH];
+            int len = ::StrCSpn(p, TEXT("\t\r\n"));
+            ::lstrcpyn(root, p, min(len + 1, ARRAY_SIZE(root)));
+            int index = AddVolume(root);
+            if (index >= 0) m_volumes[index].throughput = throughput;
+        }
+        line = ::StrChr(line, TEXT('\n'));
+        if (line) ++line;
+    }
+    delete [] text;
+    return true;
+}
+
+
+bool CStoragePool::Save() const
+{
+    if (!m_saveFileName[0]) return false;
+
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    for (int i = 0; i < 5; ++i) {
+        hFile = ::CreateFile(m_saveFileName, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile != INVALID_HANDLE_VALUE) break;
+        ::Sleep(200);
+    }
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+
+    DWORD writtenBytes;
+    WCHAR bom = L'\xFEFF';
+    ::WriteFile(hFile, &bom, sizeof(bom), &writtenBytes, NULL);
+
+    for (int i = 0; i < m_volumeNum; ++i) {
+        if (m_volumes[i].throughput == 0) continue;
+        TCHAR buf[MAX_PATH + 32];
+        ::wsprintf(buf, TEXT("%u\t%s\r\n"), m_volumes[i].throughput, m_volumes[i].root);
+        ::WriteFile(hFile, buf, ::lstrlen(buf) * sizeof(TCHAR), &writtenBytes, NULL);
+    }
+
+    ::CloseHandle(hFile);
+    return true;
+}
+
+
+// 書式: フォルダ[*重み]|フォルダ[*重み]|...
+void CStoragePool::SetDirectories(LPCTSTR list)
+{
+    m_dirNum = 0;
+    for (LPCTSTR p = list; *p && m_dirNum < DIR_MAX;) {
+        int len = ::StrCSpn(p, TEXT("|"));
+        DIR &dir = m_dirs[m_dirNum];
+        ::lstrcpyn(dir.path, p, min(len + 1, ARRAY_SIZE(dir.path)));
+        p += len;
+        if (*p) ++p;
+
+        dir.weight = 1;
+        LPTSTR pWeight = ::StrRChr(dir.path, NULL, TEXT('*'));
+        if (pWeight) {
+            dir.weight = min(max(::StrToInt(pWeight + 1), 1), WEIGHT_MAX);
+            *pWeight = 0;
+        }
+        ::StrTrim(dir.path, TEXT(" "));
+        if (!dir.path[0]) continue;
+
+        // ボリュームがつながっていなければドライブのルートとみなす
+        TCHAR root[MAX_PATH];
+        if (!::GetVolumePathName(dir.path, root, ARRAY_SIZE(root))) {
+            ::lstrcpy(root, dir.path);
+            ::PathStripToRoot(root);
+        }
+        ::PathAddBackslash(root);
+        dir.volume = AddVolume(root);
+        if (dir.volume >= 0) ++m_dirNum;
+    }
+}
+
+
+int CStoragePool::FindVolume(LPCTSTR root) const
+{
+    for (int i = 0; i < m_volumeNum; ++i) {
+        if (!::lstrcmpi(m_volumes[i].root, root)) return i;
+    }
+    return -1;
+}
+
+
+int CStoragePool::AddVolume(LPCTSTR root)
+{
+    int index = FindVolume(root);
+    if (index >= 0) return index;
+    if (m_volumeNum < VOLUME_MAX) {
+        index = m_volumeNum++;
+    }
+    else {
+        // 保存先から参照されていないものを捨てる
+        for (int i = 0; i < m_volumeNum && index < 0; ++i) {
+            index = i;
+            for (int j = 0; j < m_dirNum; ++j) {
+                if (m_dirs[j].volume == i) index = -1;
+            }
+        }
+        if (index < 0) return -1;
+    }
+    ::lstrcpyn(m_volumes[index].root, root, ARRAY_SIZE(m_volumes[index].root));
+    m_volumes[index].throughput = 0;
+    m_volumes[index].activity = 0;
+    return index;
+}
+
+
+// 各ボリュームに書き込んで速度を計測する(スピンアップも兼ねる)
+// 書き込み中のボリューム(activityが正)は録画を邪魔しないようスピンアップだけにする
+void CStoragePool::Probe()
+{
+    LARGE_INTEGER freq;
+    if (!::QueryPerformanceFrequency(&freq) || freq.QuadPart == 0) return;
+    BYTE *buf = new BYTE[PROBE_CHUNK_SIZE];
+    ::ZeroMemory(buf, PROBE_CHUNK_SIZE);
+
+    for (int i = 0; i < m_dirNum; ++i) {
+        // 同じボリュームは1度だけ
+        int j = 0;
+        while (j < i && m_dirs[j].volume != m_dirs[i].volume) ++j;
+        if (j < i) continue;
+
+        TCHAR path[MAX_PATH];
+        if (!::PathCombine(path, m_dirs[i].path, TEXT("_SPINUP_"))) continue;
+        HANDLE hFile = ::CreateFile(path, GENERIC_WRITE, 0, 0, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_WRITE_THROUGH, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) continue;
+
+        // 最初の書き込みはスピンアップを待つので計測に含めない
+        DWORD written;
+        bool fOK = ::WriteFile(hFile, buf, 512, &written, NULL) != FALSE;
+        VOLUME &vol = m_volumes[m_dirs[i].volume];
+        if (vol.activity > 0) {
+            ::CloseHandle(hFile);
+            ::DeleteFile(path);
+            continue;
+        }
+        LARGE_INTEGER start, end;
+        ::QueryPerformanceCounter(&start);
+        for (DWORD n = 0; fOK && n < PROBE_SIZE; n += PROBE_CHUNK_SIZE) {
+            fOK = ::WriteFile(hFile, buf, PROBE_CHUNK_SIZE, &written, NULL) && written == PROBE_CHUNK_SIZE;
+        }
+        ::QueryPerformanceCounter(&end);
+        ::CloseHandle(hFile);
+        ::DeleteFile(path);
+
+        LONGLONG usec = (end.QuadPart - start.QuadPart) * 1000000 / freq.QuadPart;
+        if (fOK && usec > 0) {
+            DWORD throughput = static_cast<DWORD>(min((static_cast<LONGLONG>(PROBE_SIZE) >> 10) * 1000000 / usec, 0x7FFFFFFFLL));
+            // 1回の計測はばらつくので過去の値と平均する
+            vol.throughput = vol.throughput == 0 ? max(throughput, 1UL) : max((vol.throughput * 3 + throughput) / 4, 1UL);
+        }
+    }
+    delete [] buf;
+}
+
+
+void CStoragePool::ClearActivity()
+{
+    for (int i = 0; i < m_volumeNum; ++i) m_volumes[i].activity = 0;
+}
+
+
+// textがパスを含むボリュームの書き込み数を増やす(ファイルのパスかコマンドライン)
+// コマンドラインはどのファイルに書くかわからないので、現れるボリュームすべてに数える
+bool CStoragePool::AddActivity(LPCTSTR text)
+{
+    bool fFound = false;
+    for (int i = 0; i < m_volumeNum; ++i) {
+        if (::StrStrI(text, m_volumes[i].root)) {
+            ++m_volumes[i].activity;
+            fFound = true;
+        }
+    }
+    return fFound;
+}
+
+
+// 見積もった録画サイズ(MB)の空きがある保存先のうち、重み×書き込み速度÷(1+書き込み数)が最大のものを返す
+// 空きが足りるものがなければ最も空きが大きいものを返し、*pfEnoughをfalseにする。どれも使えなければ-1
+// avoidPathを指定したときはそのボリュームの保存先を選ばない
+int CStoragePool::Select(DWORD needMBytes, LPCTSTR avoidPath, bool *pfEnough) const
+{
+    // 計測していないボリュームは計測済みのものの平均とみなす
+    // (64ビットの符号なし除算はランタイムの_aulldivを呼ぶので符号つきで計算する)
+    LONGLONG sum = 0;
+    int known = 0;
+    for (int i = 0; i < m_dirNum; ++i) {
+        DWORD throughput = m_volumes[m_dirs[i].volume].throughput;
+        if (throughput) {
+            sum += throughput;
+            ++known;
+        }
+    }
+    DWORD average = known > 0 ? static_cast<DWORD>(sum / known) : 1;
+
+    int best = -1;
+    LONGLONG bestScore = 0;
+    int largest = -1;
+    DWORD largestMBytes = 0;
+    for (int i = 0; i < m_dirNum; ++i) {
+        const VOLUME &vol = m_volumes[m_dirs[i].volume];
+        if (avoidPath && !::StrCmpNI(avoidPath, vol.root, ::lstrlen(vol.root))) continue;
+        DWORD freeMBytes;
+        // 調べられないもの(切断されたネットワークドライブなど)は使わない
+        if (!GetFreeSpaceMBytes(m_dirs[i].path, &freeMBytes)) continue;
+        if (largest < 0 || freeMBytes > largestMBytes) {
+            largest = i;
+            largestMBytes = freeMBytes;
+        }
+        if (freeMBytes < needMBytes) continue;
+        LONGLONG score = static_cast<LONGLONG>(m_dirs[i].weight) * (vol.throughput ? vol.throughput : average) / (1 + vol.activity);
+        if (best < 0 || score > bestScore) {
+            best = i;
+            bestScore = score;
+        }
+    }
+    *pfEnough = best >= 0;
+    return best >= 0 ? best : largest;
+}
@@ -0,0 +1,51 @@
+﻿#ifndef INCLUDE_STORAGE_POOL_H
+#define INCLUDE_STORAGE_POOL_H
+
+// 重みをつけた保存先フォルダの集合から、録画を始めるときに保存先を1つ選ぶ
+// 空き容量、このプラグインによる書き込みの数、ボリュームごとに計測した書き込み速度を使う
+class CStoragePool
+{
+public:
+    static const int DIR_MAX = 8;
+    // 書き込み速度を記録するボリュームの数
+    static const int VOLUME_MAX = 16;
+    static const int WEIGHT_MAX = 100;
+    // 書き込み速度の計測に書くバイト数
+    static const DWORD PROBE_SIZE = 4 * 1024 * 1024;
+    static const DWORD PROBE_CHUNK_SIZE = 256 * 1024;
+
+    CStoragePool();
+    void SetPluginFileName(LPCTSTR fileName);
+    bool Load();
+    bool Save() const;
+    void SetDirectories(LPCTSTR list);
+    int GetCount() const { return m_dirNum; }
+    LPCTSTR GetDirectory(int index) const { return m_dirs[index].path; }
+    void Probe();
+    void ClearActivity();
+    bool AddActivity(LPCTSTR text);
+    int Select(DWORD needMBytes, LPCTSTR avoidPath, bool *pfEnough) const;
+    // 予約の保存先がこの集合から選ぶことを表すものかどうか
+    static bool IsPoolDirectory(LPCTSTR dir) { return !::lstrcmpi(dir, TEXT("%storage-pool%")); }
+private:
+    struct DIR {
+        TCHAR path[MAX_PATH];
+        int weight;
+        int volume;             // m_volumesのインデックス
+    };
+    struct VOLUME {
+        TCHAR root[MAX_PATH];
+        DWORD throughput;       // KB/秒、0は未計測
+        int activity;           // 書き込み中のファイルと実行中のコマンドの数
+    };
+    int FindVolume(LPCTSTR root) const;
+    int AddVolume(LPCTSTR root);
+
+    DIR m_dirs[DIR_MAX];
+    int m_dirNum;
+    VOLUME m_volumes[VOLUME_MAX];
+    int m_volumeNum;
+    TCHAR m_saveFileName[MAX_PATH];
+};
+
+#endif // INCLUDE_STORAGE_POOL_H
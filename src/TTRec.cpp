@@ -6,10 +6,26 @@
 #include <Shlwapi.h>
 #include <CommCtrl.h>
 #include "resource.h"
+#include "JstTime.h"
 #include "Util.h"
+#include "IniFile.h"
 #include "RecordingOption.h"
+#include "Stats.h"
 #include "ReserveList.h"
 #include "QueryList.h"
+#include "JobQueue.h"
+#include "FormatTemplate.h"
+#include "WakeTrace.h"
+#include "TuneLatency.h"
+#include "RecHistory.h"
+#include "StoragePool.h"
+#include "FileWatcher.h"
+#include "ControlPipe.h"
+#include "ChannelIndex.h"
+#include "TsRingBuffer.h"
+#include "TsServiceFilter.h"
+#include "ServiceRecorder.h"
+#include "EitScheduleWatcher.h"
 #define TVTEST_PLUGIN_CLASS_IMPLEMENT
 #define TVTEST_PLUGIN_VERSION TVTEST_PLUGIN_VERSION_(0,0,15)
 #include "TVTestPlugin.h"
@@ -27,12 +43,17 @@ static const LPCTSTR DEFAULT_PLUGIN_NAME = TEXT("TTRec.tvtp");
 
 #define WM_RUN_SAVE_TASK_DONE   (WM_APP + 1)
 #define WM_NOTIFY_ICON          (WM_APP + 2)
+#define WM_FILE_CHANGED         (WM_APP + 3)
+#define WM_CONTROL_REQUEST      (WM_APP + 4)
 
-#define TTREC_CURRENT_MSGVER 1
+#define TTREC_CURRENT_MSGVER 2
 #define WM_TTREC_GET_MSGVER     (WM_APP + 50)
 #define WM_TTREC_LOAD_RESERVES  (WM_APP + 51)
 #define WM_TTREC_LOAD_QUERIES   (WM_APP + 52)
 #define WM_TTREC_EVENT_PROGRAMGUIDE_COMMAND  (WM_APP + 53)
+#define WM_TTREC_GET_STATS      (WM_APP + 54)
+#define WM_TTREC_GET_COUNTER    (WM_APP + 55)
+#define WM_TTREC_RESET_STATS    (WM_APP + 56)
 
 const TVTest::ProgramGuideCommandInfo CTTRec::PROGRAM_GUIDE_COMMAND_LIST[] = {
     { TVTest::PROGRAMGUIDE_COMMAND_TYPE_PROGRAM, 0, COMMAND_RESERVE, L"Reserve", L"TTRec-予約設定" },
@@ -55,9 +76,11 @@ CTTRec::CTTRec()
     , m_joinsEvents(false)
     , m_fEventRelay(false)
     , m_chChangeBefore(0)
+    , m_chChangeMargin(0)
     , m_spinUpBefore(0)
     , m_suspendWait(0)
     , m_execWait(0)
+    , m_fExecProbe(false)
     , m_fForceSuspend(false)
     , m_fDoSetPreview(false)
     , m_fDoSetPreviewNoViewOnly(false)
@@ -68,6 +91,24 @@ CTTRec::CTTRec()
     , m_appSuspendTimeout(0)
     , m_notifyLevel(0)
     , m_logLevel(0)
+    , m_fAnalyzeTsOnEndRec(false)
+    , m_execMaxJobs(0)
+    , m_execRetry(0)
+    , m_fExecLowPriorityWhileRec(false)
+    , m_fSaveMetaFile(false)
+    , m_statsFlushInterval(0)
+    , m_fWatchFiles(false)
+    , m_fControlPipe(false)
+    , m_timeShift(0)
+    , m_fMultiServiceRec(false)
+    , m_failoverDropRate(0)
+    , m_failoverDuration(0)
+    , m_writeStallPercent(0)
+    , m_writeStallDuration(0)
+    , m_fEpgCapSchedule(false)
+    , m_epgCapQuietTime(0)
+    , m_fCheckFreeSpace(false)
+    , m_fPreallocate(false)
     , m_normalColor(RGB(0,0,0))
     , m_disabledColor(RGB(0,0,0))
     , m_inactiveNormalColor(RGB(0,0,0))
@@ -80,10 +121,10 @@ CTTRec::CTTRec()
     , m_onStopped(ON_STOPPED_NONE)
     , m_checkRecordingCount(0)
     , m_checkQueryIndex(0)
-    , m_followUpIndex(FOLLOW_UP_MAX)
     , m_fFollowUpFast(false)
     , m_fChChanged(false)
     , m_fSpunUp(false)
+    , m_fSpaceChecked(false)
     , m_fStopRecording(false)
     , m_fOnStoppedPostponed(false)
     , m_fOnStoppedDlgShowing(false)
@@ -93,6 +134,12 @@ CTTRec::CTTRec()
     , m_epgCapTimeout(0)
     , m_epgCapSpace(-1)
     , m_epgCapChannel(0)
+    , m_fEpgCapScheduling(false)
+    , m_epgCapStreamNum(0)
+    , m_epgCapCurrent(-1)
+    , m_epgCapStartTick(0)
+    , m_pLeanRec(NULL)
+    , m_streamPacketCount(0)
     , m_totIsValid(false)
     , m_totGrabbedTick(0)
     , m_totAdjustedTick(0)
@@ -109,9 +156,24 @@ CTTRec::CTTRec()
     m_szEventNameTr[0] = 0;
     m_szEventNameRm[0] = 0;
     m_szStatusItemPrefix[0] = 0;
+    m_szAltSaveDir[0] = 0;
+    m_szStoragePool[0] = 0;
+    m_szRedirectDir[0] = 0;
+    m_historySample.fActive = false;
+    m_tuneMeasure.fActive = false;
+    m_tuneMeasure.latency = -1;
+    m_failover.fActive = false;
+    m_writeWatch.fValid = false;
     m_nearest.networkID = m_nearest.transportStreamID =
         m_nearest.serviceID = m_nearest.eventID = 0;
     m_recordingInfo.fEnabled = false;
+    m_recordingInfo.fSplit = false;
+    m_recordingInfo.minWriteRate = -1;
+    m_recordingInfo.writeStalls = 0;
+    m_szHeadFilePath[0] = 0;
+    for (int i = 0; i < SERVICE_REC_MAX; ++i) {
+        m_serviceRec[i] = NULL;
+    }
 }
 
 
@@ -135,6 +197,18 @@ bool CTTRec::Initialize()
 
     m_reserveList.SetPluginFileName(pluginPath);
     m_queryList.SetPluginFileName(pluginPath);
+    m_jobQueue.SetPluginFileName(pluginPath);
+    m_stats.SetPluginFileName(pluginPath);
+    m_reserveList.SetStats(&m_stats);
+    m_wakeTrace.SetPluginFileName(pluginPath);
+    m_tuneLatency.SetPluginFileName(pluginPath);
+    m_tuneLatency.Load();
+    m_recHistory.SetPluginFileName(pluginPath);
+    m_recHistory.Load();
+    m_storagePool.SetPluginFileName(pluginPath);
+    m_storagePool.Load();
+    // 予約起動であれば記録を引き継ぐ
+    if (m_wakeTrace.Resume()) m_wakeTrace.Mark(CWakeTrace::STAGE_PLUGIN_INIT);
 
     // プラグイン名に応じてキャプションやステータス項目を修飾する
     LPTSTR pluginName = ::PathFindFileName(pluginPath);
@@ -182,6 +256,11 @@ bool CTTRec::Finalize()
 {
     if (m_pApp->IsPluginEnabled()) EnablePlugin(false, true);
 
+    // 実行中のコマンドは放置、待機中のものは次回起動時に実行する
+    m_jobQueue.Finalize();
+    if (m_statsFlushInterval > 0) m_stats.Save();
+    m_wakeTrace.Finish();
+
     if (m_recordingInfo.fEnabled && m_recordingInfo.pEpgEventInfo) {
         m_pApp->FreeEpgEventInfo(m_recordingInfo.pEpgEventInfo);
         m_recordingInfo.pEpgEventInfo = NULL;
@@ -202,82 +281,122 @@ void CTTRec::LoadSettings()
     if (!GetLongModuleFileName(g_hinstDLL, m_szIniFileName, ARRAY_SIZE(m_szIniFileName)) ||
         !::PathRenameExtension(m_szIniFileName, TEXT(".ini"))) m_szIniFileName[0] = 0;
 
-    ::GetPrivateProfileString(TEXT("Settings"), TEXT("Driver"), TEXT(""),
-                              m_szDriverName, ARRAY_SIZE(m_szDriverName), m_szIniFileName);
-    ::GetPrivateProfileString(TEXT("Settings"), TEXT("SubDriver"), TEXT(""),
-                              m_szSubDriverName, ARRAY_SIZE(m_szSubDriverName), m_szIniFileName);
+    // 設定はまとめて読み込む
+    CIniFile ini;
+    ini.Load(m_szIniFileName);
 
-    m_totAdjustMax = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("TotAdjustMax"), 5, m_szIniFileName);
+    ini.GetString(TEXT("Settings"), TEXT("Driver"), TEXT(""),
+                  m_szDriverName, ARRAY_SIZE(m_szDriverName));
+    ini.GetString(TEXT("Settings"), TEXT("SubDriver"), TEXT(""),
+                  m_szSubDriverName, ARRAY_SIZE(m_szSubDriverName));
+
+    m_totAdjustMax = ini.GetInt(TEXT("Settings"), TEXT("TotAdjustMax"), 5);
     m_totAdjustMax = min(max(m_totAdjustMax, 0), TOT_ADJUST_MAX_MAX);
-    m_usesTask = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("UseTask"), 0, m_szIniFileName) != 0;
-    m_fNoWakeViewOnly = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("NoWakeViewOnly"), 0, m_szIniFileName) != 0;
-    m_resumeMargin = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("ResumeMargin"), 5, m_szIniFileName);
+    m_usesTask = ini.GetInt(TEXT("Settings"), TEXT("UseTask"), 0) != 0;
+    m_fNoWakeViewOnly = ini.GetInt(TEXT("Settings"), TEXT("NoWakeViewOnly"), 0) != 0;
+    m_resumeMargin = ini.GetInt(TEXT("Settings"), TEXT("ResumeMargin"), 5);
     m_resumeMargin = max(m_resumeMargin, 0);
-    m_suspendMargin = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("SuspendMargin"), 5, m_szIniFileName);
+    m_suspendMargin = ini.GetInt(TEXT("Settings"), TEXT("SuspendMargin"), 5);
     m_suspendMargin = max(m_suspendMargin, 0);
-    m_joinsEvents = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("JoinEvents"), 0, m_szIniFileName) != 0;
-    m_fEventRelay = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("EventRelay"), 0, m_szIniFileName) != 0;
+    m_joinsEvents = ini.GetInt(TEXT("Settings"), TEXT("JoinEvents"), 0) != 0;
+    m_fEventRelay = ini.GetInt(TEXT("Settings"), TEXT("EventRelay"), 0) != 0;
 
-    ::GetPrivateProfileString(TEXT("Settings"), TEXT("TVTestCmdOption"), TEXT(""),
-                              m_szCmdOption, ARRAY_SIZE(m_szCmdOption), m_szIniFileName);
+    ini.GetString(TEXT("Settings"), TEXT("TVTestCmdOption"), TEXT(""),
+                  m_szCmdOption, ARRAY_SIZE(m_szCmdOption));
 
-    m_chChangeBefore = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("ChChangeBefore"), 120, m_szIniFileName);
+    m_chChangeBefore = ini.GetInt(TEXT("Settings"), TEXT("ChChangeBefore"), 120);
     if (m_chChangeBefore <= 0) m_chChangeBefore = 0;
     else if (m_chChangeBefore < 15) m_chChangeBefore = 15;
+    m_chChangeMargin = ini.GetInt(TEXT("Settings"), TEXT("ChChangeMargin"), 15);
+    m_chChangeMargin = min(max(m_chChangeMargin, -1), CH_CHANGE_MARGIN_MAX);
 
-    m_spinUpBefore = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("SpinUpBefore"), 20, m_szIniFileName);
+    m_spinUpBefore = ini.GetInt(TEXT("Settings"), TEXT("SpinUpBefore"), 20);
     if (m_spinUpBefore <= 0) m_spinUpBefore = 0;
     else if (m_spinUpBefore < 15) m_spinUpBefore = 15;
 
-    m_suspendWait = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("SuspendWait"), 10, m_szIniFileName);
+    m_suspendWait = ini.GetInt(TEXT("Settings"), TEXT("SuspendWait"), 10);
 	m_suspendWait = min(max(m_suspendWait, 0), 120);
-    m_execWait = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("ExecWait"), 10, m_szIniFileName);
+    m_execWait = ini.GetInt(TEXT("Settings"), TEXT("ExecWait"), 10);
 	m_execWait = min(max(m_execWait, 0), 120);
-    m_fForceSuspend = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("ForceSuspend"), 0, m_szIniFileName) != 0;
-    m_fDoSetPreview = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("SetPreview"), 1, m_szIniFileName) != 0;
-    m_fDoSetPreviewNoViewOnly = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("SetPreviewNoViewOnly"), 0, m_szIniFileName) != 0;
-    m_fShowDlgOnAppSuspend = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("ShowDialogOnAppSuspend"), 1, m_szIniFileName) != 0;
+    m_fExecProbe = ini.GetInt(TEXT("Settings"), TEXT("ExecProbe"), 1) != 0;
+    m_fForceSuspend = ini.GetInt(TEXT("Settings"), TEXT("ForceSuspend"), 0) != 0;
+    m_fDoSetPreview = ini.GetInt(TEXT("Settings"), TEXT("SetPreview"), 1) != 0;
+    m_fDoSetPreviewNoViewOnly = ini.GetInt(TEXT("Settings"), TEXT("SetPreviewNoViewOnly"), 0) != 0;
+    m_fShowDlgOnAppSuspend = ini.GetInt(TEXT("Settings"), TEXT("ShowDialogOnAppSuspend"), 1) != 0;
     // 0.9.0以降は待機状態で確実にタスクトレイが出るのでオフ
-    m_fShowNotifyIcon = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("ShowTrayWhileAppSuspend"),
-                                               m_pApp->GetVersion() < TVTest::MakeVersion(0,9,0), m_szIniFileName) != 0;
-    m_fStatusItemVisible = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("StatusItemVisible"), 0, m_szIniFileName) != 0;
-    m_fAlwaysDrawProgramRect = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("AlwaysDrawProgramRect"), 0, m_szIniFileName) != 0;
-    m_appSuspendTimeout = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("AppSuspendTimeout"), 20, m_szIniFileName);
+    m_fShowNotifyIcon = ini.GetInt(TEXT("Settings"), TEXT("ShowTrayWhileAppSuspend"),
+                                   m_pApp->GetVersion() < TVTest::MakeVersion(0,9,0)) != 0;
+    m_fStatusItemVisible = ini.GetInt(TEXT("Settings"), TEXT("StatusItemVisible"), 0) != 0;
+    m_fAlwaysDrawProgramRect = ini.GetInt(TEXT("Settings"), TEXT("AlwaysDrawProgramRect"), 0) != 0;
+    m_appSuspendTimeout = ini.GetInt(TEXT("Settings"), TEXT("AppSuspendTimeout"), 20);
     m_appSuspendTimeout = max(m_appSuspendTimeout, 1);
-    m_notifyLevel = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("NotifyLevel"), 1, m_szIniFileName);
+    m_notifyLevel = ini.GetInt(TEXT("Settings"), TEXT("NotifyLevel"), 1);
     m_notifyLevel = min(max(m_notifyLevel, 0), 3);
-    m_logLevel = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("LogLevel"), 1, m_szIniFileName);
+    m_logLevel = ini.GetInt(TEXT("Settings"), TEXT("LogLevel"), 1);
     m_logLevel = min(max(m_logLevel, 0), 3);
-
-    ::GetPrivateProfileString(TEXT("Settings"), TEXT("ExecOnStartRec"), TEXT(";\"\"Plugins\\TTRec_Exec.bat\"\""),
-                              m_szExecOnStartRec, ARRAY_SIZE(m_szExecOnStartRec), m_szIniFileName);
-    ::GetPrivateProfileString(TEXT("Settings"), TEXT("ExecOnEndRec"), TEXT(";\"\"Plugins\\TTRec_Exec.bat\"\""),
-                              m_szExecOnEndRec, ARRAY_SIZE(m_szExecOnEndRec), m_szIniFileName);
+    m_fAnalyzeTsOnEndRec = ini.GetInt(TEXT("Settings"), TEXT("AnalyzeTsOnEndRec"), 0) != 0;
+    m_execMaxJobs = ini.GetInt(TEXT("Settings"), TEXT("ExecMaxJobs"), 2);
+    m_execMaxJobs = min(max(m_execMaxJobs, 1), CJobQueue::RUNNING_MAX);
+    m_execRetry = ini.GetInt(TEXT("Settings"), TEXT("ExecRetry"), 0);
+    m_execRetry = min(max(m_execRetry, 0), 5);
+    m_fExecLowPriorityWhileRec = ini.GetInt(TEXT("Settings"), TEXT("ExecLowPriorityWhileRec"), 1) != 0;
+    m_fSaveMetaFile = ini.GetInt(TEXT("Settings"), TEXT("SaveMetaFile"), 1) != 0;
+    m_statsFlushInterval = ini.GetInt(TEXT("Settings"), TEXT("StatsFlushInterval"), 0);
+    m_statsFlushInterval = min(max(m_statsFlushInterval, 0), STATS_FLUSH_INTERVAL_MAX);
+    m_fWatchFiles = ini.GetInt(TEXT("Settings"), TEXT("WatchFiles"), 1) != 0;
+    m_fControlPipe = ini.GetInt(TEXT("Settings"), TEXT("ControlPipe"), 0) != 0;
+    m_timeShift = ini.GetInt(TEXT("Settings"), TEXT("TimeShift"), 0);
+    m_timeShift = min(max(m_timeShift, 0), TIME_SHIFT_MAX);
+    m_fMultiServiceRec = ini.GetInt(TEXT("Settings"), TEXT("MultiServiceRec"), 0) != 0;
+    m_reserveList.SetMultiServiceRec(m_fMultiServiceRec);
+    m_failoverDropRate = ini.GetInt(TEXT("Settings"), TEXT("FailoverDropRate"), 0);
+    m_failoverDropRate = min(max(m_failoverDropRate, 0), FAILOVER_DROP_RATE_MAX);
+    m_failoverDuration = ini.GetInt(TEXT("Settings"), TEXT("FailoverDuration"), 10);
+    m_failoverDuration = min(max(m_failoverDuration, 4), FAILOVER_DURATION_MAX);
+    m_fCheckFreeSpace = ini.GetInt(TEXT("Settings"), TEXT("CheckFreeSpace"), 0) != 0;
+    ini.GetString(TEXT("Settings"), TEXT("AltSaveDir"), TEXT(""),
+                  m_szAltSaveDir, ARRAY_SIZE(m_szAltSaveDir));
+    m_fPreallocate = ini.GetInt(TEXT("Settings"), TEXT("Preallocate"), 0) != 0;
+    ini.GetString(TEXT("Settings"), TEXT("StoragePool"), TEXT(""),
+                  m_szStoragePool, ARRAY_SIZE(m_szStoragePool));
+    m_storagePool.SetDirectories(m_szStoragePool);
+    m_writeStallPercent = ini.GetInt(TEXT("Settings"), TEXT("WriteStallPercent"), 0);
+    m_writeStallPercent = min(max(m_writeStallPercent, 0), 100);
+    m_writeStallDuration = ini.GetInt(TEXT("Settings"), TEXT("WriteStallDuration"), 30);
+    m_writeStallDuration = min(max(m_writeStallDuration, 10), WRITE_STALL_DURATION_MAX);
+    m_fEpgCapSchedule = ini.GetInt(TEXT("Settings"), TEXT("EpgCapSchedule"), 0) != 0;
+    m_epgCapQuietTime = ini.GetInt(TEXT("Settings"), TEXT("EpgCapQuietTime"), 60);
+    m_epgCapQuietTime = min(max(m_epgCapQuietTime, 10), EPGCAP_TIMEOUT);
+
+    ini.GetString(TEXT("Settings"), TEXT("ExecOnStartRec"), TEXT(";\"\"Plugins\\TTRec_Exec.bat\"\""),
+                  m_szExecOnStartRec, ARRAY_SIZE(m_szExecOnStartRec));
+    ini.GetString(TEXT("Settings"), TEXT("ExecOnEndRec"), TEXT(";\"\"Plugins\\TTRec_Exec.bat\"\""),
+                  m_szExecOnEndRec, ARRAY_SIZE(m_szExecOnEndRec));
 
     int color;
-    color = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("NormalColor"), 64255000, m_szIniFileName);
+    color = ini.GetInt(TEXT("Settings"), TEXT("NormalColor"), 64255000);
     m_normalColor = RGB(color/1000000%1000, color/1000%1000, color%1000);
-    color = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("DisabledColor"), 64064064, m_szIniFileName);
+    color = ini.GetInt(TEXT("Settings"), TEXT("DisabledColor"), 64064064);
     m_disabledColor = RGB(color/1000000%1000, color/1000%1000, color%1000);
-    color = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("InactiveNormalColor"), 120188096, m_szIniFileName);
+    color = ini.GetInt(TEXT("Settings"), TEXT("InactiveNormalColor"), 120188096);
     m_inactiveNormalColor = RGB(color/1000000%1000, color/1000%1000, color%1000);
-    color = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("InactiveDisabledColor"), 96096096, m_szIniFileName);
+    color = ini.GetInt(TEXT("Settings"), TEXT("InactiveDisabledColor"), 96096096);
     m_inactiveDisabledColor = RGB(color/1000000%1000, color/1000%1000, color%1000);
-    color = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("NearestColor"), 255160000, m_szIniFileName);
+    color = ini.GetInt(TEXT("Settings"), TEXT("NearestColor"), 255160000);
     m_nearestColor = RGB(color/1000000%1000, color/1000%1000, color%1000);
-    color = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("RecColor"), 255064000, m_szIniFileName);
+    color = ini.GetInt(TEXT("Settings"), TEXT("RecColor"), 255064000);
     m_recColor = RGB(color/1000000%1000, color/1000%1000, color%1000);
-    color = ::GetPrivateProfileInt(TEXT("Settings"), TEXT("PriorityColor"), 64064064, m_szIniFileName);
+    color = ini.GetInt(TEXT("Settings"), TEXT("PriorityColor"), 64064064);
     m_priorityColor = RGB(color/1000000%1000, color/1000%1000, color%1000);
 
-    ::GetPrivateProfileString(TEXT("Settings"), TEXT("EventNameTr"), TEXT(""),
-                              m_szEventNameTr, ARRAY_SIZE(m_szEventNameTr), m_szIniFileName);
-    ::GetPrivateProfileString(TEXT("Settings"), TEXT("EventNameRm"), TEXT(""),
-                              m_szEventNameRm, ARRAY_SIZE(m_szEventNameRm), m_szIniFileName);
-    ::GetPrivateProfileString(TEXT("Settings"), TEXT("StatusItemPrefix"), TEXT(";"),
-                              m_szStatusItemPrefix, ARRAY_SIZE(m_szStatusItemPrefix), m_szIniFileName);
+    ini.GetString(TEXT("Settings"), TEXT("EventNameTr"), TEXT(""),
+                  m_szEventNameTr, ARRAY_SIZE(m_szEventNameTr));
+    ini.GetString(TEXT("Settings"), TEXT("EventNameRm"), TEXT(""),
+                  m_szEventNameRm, ARRAY_SIZE(m_szEventNameRm));
+    ini.GetString(TEXT("Settings"), TEXT("StatusItemPrefix"), TEXT(";"),
+                  m_szStatusItemPrefix, ARRAY_SIZE(m_szStatusItemPrefix));
 
-    m_defaultRecOption.LoadDefaultSetting(m_szIniFileName);
+    m_defaultRecOption.LoadDefaultSetting(ini);
 
     // デフォルト保存先フォルダはTVTest本体の設定を使用する
     if (m_pApp->GetSetting(L"RecordFolder", m_defaultRecOption.saveDir,
@@ -286,7 +405,7 @@ void CTTRec::LoadSettings()
     m_fSettingsLoaded = true;
 
     // デフォルトの設定キーを出力するため
-    if (::GetPrivateProfileInt(TEXT("Settings"), TEXT("AlwaysDrawProgramRect"), 99, m_szIniFileName) == 99)
+    if (ini.GetInt(TEXT("Settings"), TEXT("AlwaysDrawProgramRect"), 99) == 99)
         SaveSettings();
 }
 
@@ -296,66 +415,85 @@ void CTTRec::SaveSettings() const
 {
     if (!m_fSettingsLoaded) return;
 
-    ::WritePrivateProfileString(TEXT("Settings"), TEXT("Driver"), m_szDriverName, m_szIniFileName);
-    ::WritePrivateProfileString(TEXT("Settings"), TEXT("SubDriver"), m_szSubDriverName, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("TotAdjustMax"), m_totAdjustMax, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("UseTask"), m_usesTask, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("NoWakeViewOnly"), m_fNoWakeViewOnly, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("ResumeMargin"), m_resumeMargin, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("SuspendMargin"), m_suspendMargin, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("JoinEvents"), m_joinsEvents, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("EventRelay"), m_fEventRelay, m_szIniFileName);
-    WritePrivateProfileStringQuote(TEXT("Settings"), TEXT("TVTestCmdOption"), m_szCmdOption, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("ChChangeBefore"), m_chChangeBefore, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("SpinUpBefore"), m_spinUpBefore, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("SuspendWait"), m_suspendWait, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("ExecWait"), m_execWait, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("ForceSuspend"), m_fForceSuspend, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("SetPreview"), m_fDoSetPreview, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("SetPreviewNoViewOnly"), m_fDoSetPreviewNoViewOnly, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("ShowDialogOnAppSuspend"), m_fShowDlgOnAppSuspend, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("ShowTrayWhileAppSuspend"), m_fShowNotifyIcon, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("StatusItemVisible"), m_fStatusItemVisible, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("AlwaysDrawProgramRect"), m_fAlwaysDrawProgramRect, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("AppSuspendTimeout"), m_appSuspendTimeout, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("NotifyLevel"), m_notifyLevel, m_szIniFileName);
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("LogLevel"), m_logLevel, m_szIniFileName);
-    WritePrivateProfileStringQuote(TEXT("Settings"), TEXT("ExecOnStartRec"), m_szExecOnStartRec, m_szIniFileName);
-    WritePrivateProfileStringQuote(TEXT("Settings"), TEXT("ExecOnEndRec"), m_szExecOnEndRec, m_szIniFileName);
-
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("NormalColor"),
-                           GetRValue(m_normalColor)*1000000 + GetGValue(m_normalColor)*1000 + GetBValue(m_normalColor),
-                           m_szIniFileName);
-
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("DisabledColor"),
-                           GetRValue(m_disabledColor)*1000000 + GetGValue(m_disabledColor)*1000 + GetBValue(m_disabledColor),
-                           m_szIniFileName);
-
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("InactiveNormalColor"),
-                           GetRValue(m_inactiveNormalColor)*1000000 + GetGValue(m_inactiveNormalColor)*1000 + GetBValue(m_inactiveNormalColor),
-                           m_szIniFileName);
-
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("InactiveDisabledColor"),
-                           GetRValue(m_inactiveDisabledColor)*1000000 + GetGValue(m_inactiveDisabledColor)*1000 + GetBValue(m_inactiveDisabledColor),
-                           m_szIniFileName);
-
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("NearestColor"),
-                           GetRValue(m_nearestColor)*1000000 + GetGValue(m_nearestColor)*1000 + GetBValue(m_nearestColor),
-                           m_szIniFileName);
-
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("RecColor"),
-                           GetRValue(m_recColor)*1000000 + GetGValue(m_recColor)*1000 + GetBValue(m_recColor),
-                           m_szIniFileName);
-
-    WritePrivateProfileInt(TEXT("Settings"), TEXT("PriorityColor"),
-                           GetRValue(m_priorityColor)*1000000 + GetGValue(m_priorityColor)*1000 + GetBValue(m_priorityColor),
-                           m_szIniFileName);
-
-    ::WritePrivateProfileString(TEXT("Settings"), TEXT("EventNameTr"), m_szEventNameTr, m_szIniFileName);
-    ::WritePrivateProfileString(TEXT("Settings"), TEXT("EventNameRm"), m_szEventNameRm, m_szIniFileName);
+    // 他で書かれたキーを残すため読み込みなおしてから、まとめて書き戻す
+    CIniFile ini;
+    ini.Load(m_szIniFileName);
+    ini.SetString(TEXT("Settings"), TEXT("Driver"), m_szDriverName);
+    ini.SetString(TEXT("Settings"), TEXT("SubDriver"), m_szSubDriverName);
+    ini.SetInt(TEXT("Settings"), TEXT("TotAdjustMax"), m_totAdjustMax);
+    ini.SetInt(TEXT("Settings"), TEXT("UseTask"), m_usesTask);
+    ini.SetInt(TEXT("Settings"), TEXT("NoWakeViewOnly"), m_fNoWakeViewOnly);
+    ini.SetInt(TEXT("Settings"), TEXT("ResumeMargin"), m_resumeMargin);
+    ini.SetInt(TEXT("Settings"), TEXT("SuspendMargin"), m_suspendMargin);
+    ini.SetInt(TEXT("Settings"), TEXT("JoinEvents"), m_joinsEvents);
+    ini.SetInt(TEXT("Settings"), TEXT("EventRelay"), m_fEventRelay);
+    ini.SetString(TEXT("Settings"), TEXT("TVTestCmdOption"), m_szCmdOption);
+    ini.SetInt(TEXT("Settings"), TEXT("ChChangeBefore"), m_chChangeBefore);
+    ini.SetInt(TEXT("Settings"), TEXT("ChChangeMargin"), m_chChangeMargin);
+    ini.SetInt(TEXT("Settings"), TEXT("SpinUpBefore"), m_spinUpBefore);
+    ini.SetInt(TEXT("Settings"), TEXT("SuspendWait"), m_suspendWait);
+    ini.SetInt(TEXT("Settings"), TEXT("ExecWait"), m_execWait);
+    ini.SetInt(TEXT("Settings"), TEXT("ExecProbe"), m_fExecProbe);
+    ini.SetInt(TEXT("Settings"), TEXT("ForceSuspend"), m_fForceSuspend);
+    ini.SetInt(TEXT("Settings"), TEXT("SetPreview"), m_fDoSetPreview);
+    ini.SetInt(TEXT("Settings"), TEXT("SetPreviewNoViewOnly"), m_fDoSetPreviewNoViewOnly);
+    ini.SetInt(TEXT("Settings"), TEXT("ShowDialogOnAppSuspend"), m_fShowDlgOnAppSuspend);
+    ini.SetInt(TEXT("Settings"), TEXT("ShowTrayWhileAppSuspend"), m_fShowNotifyIcon);
+    ini.SetInt(TEXT("Settings"), TEXT("StatusItemVisible"), m_fStatusItemVisible);
+    ini.SetInt(TEXT("Settings"), TEXT("AlwaysDrawProgramRect"), m_fAlwaysDrawProgramRect);
+    ini.SetInt(TEXT("Settings"), TEXT("AppSuspendTimeout"), m_appSuspendTimeout);
+    ini.SetInt(TEXT("Settings"), TEXT("NotifyLevel"), m_notifyLevel);
+    ini.SetInt(TEXT("Settings"), TEXT("LogLevel"), m_logLevel);
+    ini.SetInt(TEXT("Settings"), TEXT("AnalyzeTsOnEndRec"), m_fAnalyzeTsOnEndRec);
+    ini.SetInt(TEXT("Settings"), TEXT("ExecMaxJobs"), m_execMaxJobs);
+    ini.SetInt(TEXT("Settings"), TEXT("ExecRetry"), m_execRetry);
+    ini.SetInt(TEXT("Settings"), TEXT("ExecLowPriorityWhileRec"), m_fExecLowPriorityWhileRec);
+    ini.SetInt(TEXT("Settings"), TEXT("SaveMetaFile"), m_fSaveMetaFile);
+    ini.SetInt(TEXT("Settings"), TEXT("StatsFlushInterval"), m_statsFlushInterval);
+    ini.SetInt(TEXT("Settings"), TEXT("WatchFiles"), m_fWatchFiles);
+    ini.SetInt(TEXT("Settings"), TEXT("ControlPipe"), m_fControlPipe);
+    ini.SetInt(TEXT("Settings"), TEXT("TimeShift"), m_timeShift);
+    ini.SetInt(TEXT("Settings"), TEXT("MultiServiceRec"), m_fMultiServiceRec);
+    ini.SetInt(TEXT("Settings"), TEXT("FailoverDropRate"), m_failoverDropRate);
+    ini.SetInt(TEXT("Settings"), TEXT("FailoverDuration"), m_failoverDuration);
+    ini.SetInt(TEXT("Settings"), TEXT("CheckFreeSpace"), m_fCheckFreeSpace);
+    ini.SetString(TEXT("Settings"), TEXT("AltSaveDir"), m_szAltSaveDir);
+    ini.SetInt(TEXT("Settings"), TEXT("Preallocate"), m_fPreallocate);
+    ini.SetString(TEXT("Settings"), TEXT("StoragePool"), m_szStoragePool);
+    ini.SetInt(TEXT("Settings"), TEXT("WriteStallPercent"), m_writeStallPercent);
+    ini.SetInt(TEXT("Settings"), TEXT("WriteStallDuration"), m_writeStallDuration);
+    ini.SetInt(TEXT("Settings"), TEXT("EpgCapSchedule"), m_fEpgCapSchedule);
+    ini.SetInt(TEXT("Settings"), TEXT("EpgCapQuietTime"), m_epgCapQuietTime);
+    ini.SetString(TEXT("Settings"), TEXT("ExecOnStartRec"), m_szExecOnStartRec);
+    ini.SetString(TEXT("Settings"), TEXT("ExecOnEndRec"), m_szExecOnEndRec);
+
+    ini.SetInt(TEXT("Settings"), TEXT("NormalColor"),
+               GetRValue(m_normalColor)*1000000 + GetGValue(m_normalColor)*1000 + GetBValue(m_normalColor));
+
+    ini.SetInt(TEXT("Settings"), TEXT("DisabledColor"),
+               GetRValue(m_disabledColor)*1000000 + GetGValue(m_disabledColor)*1000 + GetBValue(m_disabledColor));
+
+    ini.SetInt(TEXT("Settings"), TEXT("InactiveNormalColor"),
+               GetRValue(m_inactiveNormalColor)*1000000 + GetGValue(m_inactiveNormalColor)*1000 + GetBValue(m_inactiveNormalColor));
+
+    ini.SetInt(TEXT("Settings"), TEXT("InactiveDisabledColor"),
+               GetRValue(m_inactiveDisabledColor)*1000000 + GetGValue(m_inactiveDisabledColor)*1000 + GetBValue(m_inactiveDisabledColor));
+
+    ini.SetInt(TEXT("Settings"), TEXT("NearestColor"),
+               GetRValue(m_nearestColor)*1000000 + GetGValue(m_nearestColor)*1000 + GetBValue(m_nearestColor));
+
+    ini.SetInt(TEXT("Settings"), TEXT("RecColor"),
+               GetRValue(m_recColor)*1000000 + GetGValue(m_recColor)*1000 + GetBValue(m_recColor));
+
+    ini.SetInt(TEXT("Settings"), TEXT("PriorityColor"),
+               GetRValue(m_priorityColor)*1000000 + GetGValue(m_priorityColor)*1000 + GetBValue(m_priorityColor));
+
+    ini.SetString(TEXT("Settings"), TEXT("EventNameTr"), m_szEventNameTr);
+    ini.SetString(TEXT("Settings"), TEXT("EventNameRm"), m_szEventNameRm);
     // "StatusItemPrefix"は空白文字の扱いがややこしくなるため保存しない
 
-    m_defaultRecOption.SaveDefaultSetting(m_szIniFileName);
+    m_defaultRecOption.SaveDefaultSetting(ini);
+    ini.Save();
 }
 
 
@@ -434,6 +572,14 @@ bool CTTRec::InitializePlugin()
             );
         return false;
     }
+    // 前回終了時に実行されなかったコマンドを読み込む
+    if (!m_jobQueue.Load()) {
+        m_pApp->AddLog(L"_Jobs.txtの読み込みエラーが発生しました。"
+#if TVTEST_PLUGIN_VERSION >= TVTEST_PLUGIN_VERSION_(0,0,14)
+            , TVTest::LOG_TYPE_WARNING
+#endif
+            );
+    }
 
 #if TVTEST_PLUGIN_VERSION >= TVTEST_PLUGIN_VERSION_(0,0,14)
     // 前回終了時点のステータス項目の表示/非表示を復元する
@@ -447,6 +593,7 @@ bool CTTRec::InitializePlugin()
 #endif
 
     m_fInitialized = true;
+    m_wakeTrace.Mark(CWakeTrace::STAGE_PLUGIN_ENABLE);
     return true;
 }
 
@@ -455,6 +602,8 @@ bool CTTRec::InitializePlugin()
 bool CTTRec::EnablePlugin(bool fEnable, bool fExit) {
     if (fEnable) {
         if (!InitializePlugin()) return false;
+        // 番組表だけ使う同名のTTRecに予約を公開する
+        m_reserveList.SetSharedWriter(m_hModuleMutex);
         // バルーンチップ作成
         m_balloonTip.Initialize(m_pApp->GetAppWindow(), g_hinstDLL);
 
@@ -474,16 +623,46 @@ bool CTTRec::EnablePlugin(bool fEnable, bool fExit) {
                     if (m_hwndRecording) {
                         // トレイアイコン準備
                         m_notifyIcon.Initialize(m_hwndRecording, 1, WM_NOTIFY_ICON);
+                        // タイムシフトのバッファ確保
+                        if (m_timeShift > 0 &&
+                            !m_timeShiftBuf.Allocate(m_timeShift * TIME_SHIFT_BYTES_PER_SEC, m_timeShift * 1000))
+                        {
+                            m_pApp->AddLog(L"タイムシフトのバッファを確保できませんでした。");
+                        }
                         // ストリームコールバックの登録
                         m_pApp->SetStreamCallback(0, StreamCallback, this);
+                        // 予約・クエリファイルの外部での変更を監視
+                        if (m_fWatchFiles) {
+                            TCHAR dirName[MAX_PATH];
+                            ::lstrcpy(dirName, m_szIniFileName);
+                            if (dirName[0] && ::PathRemoveFileSpec(dirName)) {
+                                m_fileWatcher.Start(dirName, m_hwndRecording, WM_FILE_CHANGED);
+                            }
+                        }
+                        // 一括操作の要求を受け付ける
+                        if (m_fControlPipe) {
+                            TCHAR pipeName[MAX_PATH + 32];
+                            ::lstrcpy(pipeName, TEXT("\\\\.\\pipe\\TTREC-CTL-"));
+                            if (GetIdentifierFromModule(g_hinstDLL, pipeName + ::lstrlen(pipeName), MAX_PATH)) {
+                                m_controlPipe.Start(pipeName, m_hwndRecording, WM_CONTROL_REQUEST);
+                            }
+                        }
                     }
                 }
             }
         }
     }
     else {
+        m_reserveList.SetSharedWriter(NULL);
+        m_fileWatcher.Stop();
+        m_controlPipe.Stop();
         // ストリームコールバックの登録解除
         m_pApp->SetStreamCallback(TVTest::STREAM_CALLBACK_REMOVE, StreamCallback);
+        m_timeShiftBuf.Free();
+        for (int i = 0; i < SERVICE_REC_MAX; ++i) {
+            if (m_serviceRec[i]) StopServiceRecording(i);
+        }
+        StopLeanRecord();
         // トレイアイコン破棄
         m_notifyIcon.Finalize();
         // 録画制御ウィンドウの破棄
@@ -583,6 +762,10 @@ LRESULT CALLBACK CTTRec::EventCallback(UINT Event, LPARAM lParam1, LPARAM lParam
             static_cast<UINT>(lParam2));
     case TVTest::EVENT_PROGRAMGUIDE_PROGRAM_DRAWBACKGROUND:
         // 番組の背景を描画
+        if (!pThis->m_hwndRecording && pThis->m_fAlwaysDrawProgramRect) {
+            // 有効なTTRecでの予約の変更を取り込む
+            pThis->m_reserveList.LoadShared();
+        }
         return pThis->DrawBackground(
             reinterpret_cast<const TVTest::ProgramGuideProgramInfo*>(lParam1),
             reinterpret_cast<const TVTest::ProgramGuideProgramDrawBackgroundInfo*>(lParam2));
@@ -596,6 +779,16 @@ LRESULT CALLBACK CTTRec::EventCallback(UINT Event, LPARAM lParam1, LPARAM lParam
     case TVTest::EVENT_SERVICECHANGE:
         // REC_ACTIVE_VIEW_ONLY状態で上記のイベントが起きた(=ユーザによる視聴停止)
         if (pThis->m_recordingState == REC_ACTIVE_VIEW_ONLY) pThis->m_fStopRecording = true;
+        // 別のストリームになったのでタイムシフトの内容は使えない
+        if (Event == TVTest::EVENT_CHANNELCHANGE) pThis->m_timeShiftBuf.Reset();
+        break;
+    case TVTest::EVENT_DRIVERCHANGE:
+        // ドライバが変更された
+        pThis->m_timeShiftBuf.Reset();
+        // FALL THROUGH!
+    case TVTest::EVENT_SETTINGSCHANGE:
+        // 設定が変更された(チャンネルスキャンなど)
+        pThis->InvalidateChannelIndex();
         break;
     case TVTest::EVENT_STANDBY:
         // 待機状態が変化した
@@ -630,22 +823,20 @@ LRESULT CALLBACK CTTRec::EventCallback(UINT Event, LPARAM lParam1, LPARAM lParam
             if (drawState < 0) {
                 // フォーカスが当たっているときは次の予約について描画
                 TCHAR text[64];
-                SYSTEMTIME st;
+                JST_CIVIL c;
                 if (!pThis->m_nearest.IsValid()) {
                     ::lstrcpy(text, TEXT("予約無し"));
                 } else if (pThis->m_recordingState == REC_ACTIVE || pThis->m_recordingState == REC_ACTIVE_VIEW_ONLY) {
-                    FILETIME endTime = pThis->m_nearest.startTime;
-                    endTime += pThis->m_nearest.duration * FILETIME_SECOND;
-                    ::FileTimeToSystemTime(&endTime, &st);
-                    ::wsprintf(text, TEXT("～%d:%02d %.31s"), st.wHour, st.wMinute, pThis->m_nearest.eventName);
+                    JstTimeToCivil(FileTimeToJst(pThis->m_nearest.startTime) + pThis->m_nearest.duration * FILETIME_SECOND, &c);
+                    ::wsprintf(text, TEXT("～%d:%02d %.31s"), c.hour, c.minute, pThis->m_nearest.eventName);
                 } else {
-                    ::FileTimeToSystemTime(&pThis->m_nearest.startTime, &st);
+                    JstTimeToCivil(FileTimeToJst(pThis->m_nearest.startTime), &c);
                     FILETIME now;
                     GetEpgTimeAsFileTime(&now);
                     if (pThis->m_nearest.startTime - now >= 24 * FILETIME_HOUR) {
-                        ::wsprintf(text, TEXT("%d(%s) %.31s"), st.wDay, GetDayOfWeekText(st.wDayOfWeek), pThis->m_nearest.eventName);
+                        ::wsprintf(text, TEXT("%d(%s) %.31s"), c.day, GetDayOfWeekText(c.dayOfWeek), pThis->m_nearest.eventName);
                     } else {
-                        ::wsprintf(text, TEXT("%d:%02d %.31s"), st.wHour, st.wMinute, pThis->m_nearest.eventName);
+                        ::wsprintf(text, TEXT("%d:%02d %.31s"), c.hour, c.minute, pThis->m_nearest.eventName);
                     }
                 }
                 pThis->m_pApp->ThemeDrawText(pInfo->pszStyle, pInfo->hdc, text, pInfo->DrawRect, drawFlags);
@@ -749,6 +940,187 @@ void CTTRec::ShowBalloonTip(LPCTSTR text, int notifyLevel)
 }
 
 
+// 外部で書き換えられた予約・クエリファイルの変化した行を取り込む
+// 自身が書き込んだだけのときは何もしない
+void CTTRec::MergeFileChanges()
+{
+    int ret = m_reserveList.Merge();
+    if (ret < 0) {
+        ShowBalloonTip(TEXT("_Reserves.txtの読み込みエラーが発生しました。"), 1);
+    }
+    else if (ret > 0) {
+        m_checkRecordingCount = 0;
+        RunSaveTask();
+        RedrawProgramGuide();
+    }
+    if (m_queryList.Merge() < 0) {
+        ShowBalloonTip(TEXT("_Queries.txtの読み込みエラーが発生しました。"), 1);
+    }
+}
+
+
+// 制御パイプで受け取った一括操作を実行する
+// 1行1操作(TAB区切り):
+//   +  予約ファイルの1行              予約の登録/変更
+//   -  NID TSID SID EID               予約の削除
+//   ?  開始時刻 終了時刻              期間に重なる予約の一覧
+//   !  開始時刻 終了時刻              期間に重なる有効な予約どうしの重複の一覧
+//   Q+ クエリファイルの1行            クエリの追加
+//   Q- インデックス                   クエリの削除(ほかの操作より先に、一括操作前のインデックスで行う)
+//   Q?                                クエリの一覧
+// 解釈できない行が1つでもあれば何も変更しない。保存とタスク登録は最後に1度だけ行う
+// 実行に失敗した行があれば応答の1行目で最初のものを知らせる(ほかの行は実行される)
+void CTTRec::ExecuteControlBatch(CONTROL_REQUEST *pReq)
+{
+    bool fDeleteQuery[CQueryList::QUERIES_MAX] = {};
+    bool fReserveChanged = false;
+    bool fQueryChanged = false;
+    int failedLineNum = 0;
+    int queryLen = m_queryList.Length();
+    CControlResponse data;
+    // LNK2001:__chkstk対策のため
+    LPTSTR buf = new TCHAR[1024 + 2];
+
+    // 1巡目で検証し、2巡目で実行する
+    for (int pass = 0; pass < 2; ++pass) {
+        if (pass == 1) {
+            for (int i = m_queryList.Length() - 1; i >= 0; --i) {
+                if (fDeleteQuery[i]) {
+                    m_queryList.Delete(i);
+                    fQueryChanged = true;
+                }
+            }
+        }
+        int lineNum = 0;
+        for (LPCTSTR line = pReq->text; line && *line; ) {
+            ++lineNum;
+            TCHAR op[4];
+            GetToken(line, op, ARRAY_SIZE(op));
+            LPCTSTR args = line;
+            bool fArgs = NextToken(&args);
+            bool fValid = false;
+
+            if (!op[0]) {
+                // 空行
+                fValid = true;
+            }
+            else if (!::lstrcmp(op, TEXT("+"))) {
+                RESERVE res;
+                fValid = fArgs && CReserveList::FromString(args, &res);
+                if (fValid && pass == 1) {
+                    if (m_reserveList.Insert(res)) fReserveChanged = true;
+                    else if (!failedLineNum) failedLineNum = lineNum;
+                }
+            }
+            else if (!::lstrcmp(op, TEXT("-"))) {
+                int ids[4];
+                int i = 0;
+                for (; fArgs && i < 4; ++i) {
+                    if (!::StrToIntEx(args, STIF_SUPPORT_HEX, &ids[i])) break;
+                    if (i < 3) fArgs = NextToken(&args);
+                }
+                fValid = i == 4;
+                if (fValid && pass == 1 && m_reserveList.Delete(ids[0], ids[1], ids[2], ids[3])) {
+                    fReserveChanged = true;
+                }
+            }
+            else if (!::lstrcmp(op, TEXT("?")) || !::lstrcmp(op, TEXT("!"))) {
+                FILETIME rangeStart, rangeEnd;
+                fValid = fArgs && StrToFileTime(args, &rangeStart) &&
+                         NextToken(&args) && StrToFileTime(args, &rangeEnd);
+                if (fValid && pass == 1) {
+                    for (const RESERVE *pRes = m_reserveList.Get(0); pRes; pRes = pRes->next) {
+                        if (pRes->GetTrimmedStartTime() - rangeEnd >= 0) break;
+                        if (pRes->GetTrimmedEndTime() - rangeStart <= 0) continue;
+                        if (op[0] == TEXT('?')) {
+                            CReserveList::ToString(*pRes, buf);
+                            ::lstrcat(buf, TEXT("\r\n"));
+                            data.Append(buf);
+                        }
+                        else if (pRes->isEnabled) {
+                            // 予約は開始時刻順なので、後ろの予約と比べればよい
+                            for (const RESERVE *pNext = pRes->next; pNext; pNext = pNext->next) {
+                                LONGLONG overlap = pRes->GetTrimmedEndTime() - pNext->GetTrimmedStartTime();
+                                if (overlap <= 0) break;
+                                if (!pNext->isEnabled) continue;
+                                ::wsprintf(buf, TEXT("0x%04X\t0x%04X\t0x%04X\t0x%04X\t0x%04X\t0x%04X\t0x%04X\t0x%04X\t%d\r\n"),
+                                           pRes->networkID, pRes->transportStreamID, pRes->serviceID, pRes->eventID,
+                                           pNext->networkID, pNext->transportStreamID, pNext->serviceID, pNext->eventID,
+                                           min(static_cast<int>(overlap / FILETIME_SECOND), pNext->GetTrimmedDuration()));
+                                data.Append(buf);
+                            }
+                        }
+                    }
+                }
+            }
+            else if (!::lstrcmp(op, TEXT("Q+"))) {
+                QUERY query;
+                fValid = fArgs && CQueryList::FromString(args, &query) && (pass == 1 || queryLen < CQueryList::QUERIES_MAX);
+                if (fValid && pass == 0) {
+                    ++queryLen;
+                }
+                else if (fValid && pass == 1) {
+                    if (m_queryList.Insert(-1, query) >= 0) fQueryChanged = true;
+                    else if (!failedLineNum) failedLineNum = lineNum;
+                }
+            }
+            else if (!::lstrcmp(op, TEXT("Q-"))) {
+                // StrToInt()は数でなければ0を返すので、インデックス0を消してしまわないようStrToIntEx()で調べる
+                int index;
+                fValid = pass == 1 ||
+                         fArgs && ::StrToIntEx(args, STIF_DEFAULT, &index) &&
+                         0 <= index && index < m_queryList.Length() && !fDeleteQuery[index];
+                if (fValid && pass == 0) {
+                    fDeleteQuery[index] = true;
+                    --queryLen;
+                }
+            }
+            else if (!::lstrcmp(op, TEXT("Q?"))) {
+                fValid = true;
+                if (pass == 1) {
+                    for (int i = 0; i < m_queryList.Length(); ++i) {
+                        CQueryList::ToString(*m_queryList.Get(i), buf);
+                        ::lstrcat(buf, TEXT("\r\n"));
+                        data.Append(buf);
+                    }
+                }
+            }
+
+            if (!fValid) {
+                // 2巡目では起こらない
+                ::wsprintf(buf, TEXT("ERR\t%d\r\n"), lineNum);
+                pReq->response.Append(buf);
+                delete [] buf;
+                return;
+            }
+            line = ::StrChr(line, TEXT('\n'));
+            if (line) ++line;
+        }
+    }
+
+    if (fQueryChanged && !m_queryList.Save()) {
+        ShowBalloonTip(TEXT("_Queries.txtの書き込みエラーが発生しました。"), 1);
+    }
+    if (fReserveChanged) {
+        if (!m_reserveList.Save()) {
+            ShowBalloonTip(TEXT("_Reserves.txtの書き込みエラーが発生しました。"), 1);
+        }
+        m_checkRecordingCount = 0;
+        RunSaveTask();
+        RedrawProgramGuide();
+    }
+    if (failedLineNum) {
+        ::wsprintf(buf, TEXT("NG\t%d\r\n"), failedLineNum);
+        pReq->response.Append(buf);
+    }
+    else {
+        pReq->response.Append(TEXT("OK\r\n"));
+    }
+    delete [] buf;
+    pReq->response.Append(data);
+}
+
+
 // 必要であればタスクスケジューラ登録を行う
 void CTTRec::RunSaveTask()
 {
@@ -761,11 +1133,35 @@ void CTTRec::RunSaveTask()
             ShowBalloonTip(TEXT("タスクスケジューラ登録に失敗しました。"), 1);
         }
 
+        // 予約起動時に保存先の準備を確認できるよう、次に復帰して録画する予約の保存先を記録する
+        TCHAR probeDir[MAX_PATH];
+        probeDir[0] = 0;
+        if (m_fExecProbe) {
+            FILETIME now;
+            GetEpgTimeAsFileTime(&now);
+            for (int i = 0; i < TASK_TRIGGER_MAX; ++i) {
+                const RESERVE *pRes = m_reserveList.Get(i);
+                if (!pRes) break;
+                RECORDING_OPTION recOption = pRes->recOption;
+                recOption.ApplyDefault(m_defaultRecOption);
+                FILETIME resumeTime = pRes->GetTrimmedStartTime();
+                resumeTime += -m_resumeMargin * FILETIME_MINUTE;
+                if (pRes->isEnabled && resumeTime - now > 0 && !recOption.IsViewOnly()) {
+                    if (!CStoragePool::IsPoolDirectory(recOption.saveDir)) ::lstrcpy(probeDir, recOption.saveDir);
+                    else if (m_storagePool.GetCount() > 0) ::lstrcpy(probeDir, m_storagePool.GetDirectory(0));
+                    break;
+                }
+            }
+        }
+        CIniFile ini;
+        ini.Load(m_szIniFileName);
+        ini.SetString(TEXT("Settings"), TEXT("ExecProbeDir"), probeDir);
+
         if (m_szSubDriverName[0]) {
             TCHAR times[128];
             times[0] = 0;
-            TVTest::DriverTuningSpaceList list;
-            if (m_pApp->GetDriverTuningSpaceList(m_szDriverName, &list)) {
+            const CChannelIndex *pMainIndex = GetDriverIndex(m_szDriverName, &m_mainDriverIndex);
+            if (pMainIndex) {
                 // 補欠のドライバで起動すると都合のよい時間を記録する
                 FILETIME now;
                 GetEpgTimeAsFileTime(&now);
@@ -774,17 +1170,17 @@ void CTTRec::RunSaveTask()
                     if (!pRes) break;
                     FILETIME resumeTime = pRes->GetTrimmedStartTime();
                     resumeTime += -m_resumeMargin * FILETIME_MINUTE;
-                    if (pRes->isEnabled && resumeTime - now > 0 && !IsChannelOnDriver(pRes->networkID, pRes->serviceID, list)) {
+                    if (pRes->isEnabled && resumeTime - now > 0 && !pMainIndex->Find(pRes->networkID, pRes->serviceID)) {
                         int len = ::lstrlen(times);
                         times[len++] = TEXT('/');
                         FileTimeToStr(&resumeTime, times + len);
                         if (len >= 20 * 4) break;
                     }
                 }
-                m_pApp->FreeDriverTuningSpaceList(&list);
             }
-            ::WritePrivateProfileString(TEXT("Settings"), TEXT("SubDriverUseTimes"), times, m_szIniFileName);
+            ini.SetString(TEXT("Settings"), TEXT("SubDriverUseTimes"), times);
         }
+        ini.Save();
     }
 }
 
@@ -904,8 +1300,12 @@ void CTTRec::DrawReserveFrame(const TVTest::ProgramGuideProgramInfo *pProgramInf
 void CTTRec::GetReserveFrameRect(const TVTest::ProgramGuideProgramInfo *pProgramInfo,
                                  const RESERVE &res, const RECT &itemRect, RECT *pFrameRect)
 {
-    FILETIME eventStart;
-    ::SystemTimeToFileTime(&pProgramInfo->StartTime, &eventStart);
+    JST_TIME jstEventStart;
+    if (!SystemTimeToJst(pProgramInfo->StartTime, &jstEventStart)) {
+        *pFrameRect = itemRect;
+        return;
+    }
+    FILETIME eventStart = JstToFileTime(jstEventStart);
 
     int startOffset = static_cast<int>((res.GetTrimmedStartTime() - eventStart) / FILETIME_SECOND);
     if (startOffset < 0) startOffset = 0;
@@ -1020,8 +1420,10 @@ bool CTTRec::OnMenuOrProgramMenuSelected(const TVTest::ProgramGuideProgramInfo *
             }
         }
         else {
-            // 番組の情報を取得
-            TVTest::EpgEventInfo *pEpgEventInfo = GetEventInfo(pProgramInfo);
+            // 番組の情報を取得(開始時刻が未定のものは予約できない)
+            JST_TIME startTime;
+            TVTest::EpgEventInfo *pEpgEventInfo =
+                SystemTimeToJst(pProgramInfo->StartTime, &startTime) ? GetEventInfo(pProgramInfo) : NULL;
             if (pEpgEventInfo) {
                 // サービスの名前を取得
                 TCHAR serviceName[64];
@@ -1038,7 +1440,7 @@ bool CTTRec::OnMenuOrProgramMenuSelected(const TVTest::ProgramGuideProgramInfo *
                 res.duration            = pProgramInfo->Duration;
                 res.followMode          = FOLLOW_MODE_DEFAULT;
                 res.recOption.SetDefault(m_defaultRecOption.IsViewOnly());
-                ::SystemTimeToFileTime(&pProgramInfo->StartTime, &res.startTime);
+                res.startTime           = JstToFileTime(startTime);
                 res.eventName[0] = PREFIX_EPGORIGIN;
                 ::lstrcpyn(res.eventName + 1, pEpgEventInfo->pszEventName ? pEpgEventInfo->pszEventName : TEXT(""), ARRAY_SIZE(res.eventName) - 1);
 
@@ -1280,6 +1682,8 @@ INT_PTR CALLBACK CTTRec::SettingsDlgProc(HWND hDlg, UINT uMsg, WPARAM wParam, LP
                 pThis->m_szDriverName[0] = 0;
             if (!::GetDlgItemText(hDlg, IDC_COMBO_SUB_DRIVER_NAME, pThis->m_szSubDriverName, ARRAY_SIZE(pThis->m_szSubDriverName)))
                 pThis->m_szSubDriverName[0] = 0;
+            pThis->m_mainDriverIndex.Invalidate();
+            pThis->m_subDriverIndex.Invalidate();
 
             pThis->m_totAdjustMax = static_cast<int>(::SendDlgItemMessage(hDlg, IDC_COMBO_TOT, CB_GETCURSEL, 0, 0));
             if (pThis->m_totAdjustMax < 0) pThis->m_totAdjustMax = 0;
@@ -1376,6 +1780,7 @@ void CTTRec::CheckQuery()
     if (++m_checkQueryIndex >= m_queryList.Length()) m_checkQueryIndex = 0;
     if (!pQuery || !pQuery->isEnabled) return;
 
+    CStatScope scope(&m_stats, CStats::STAGE_CHECK_QUERY);
     TVTest::EpgEventList eventList;
     eventList.NetworkID         = pQuery->networkID;
     eventList.TransportStreamID = pQuery->transportStreamID;
@@ -1383,6 +1788,8 @@ void CTTRec::CheckQuery()
     if (!m_pApp->GetEpgEventList(&eventList)) return;
 
     DEBUG_OUT(TEXT("CTTRec::CheckQuery()\n"));
+    m_stats.Add(CStats::COUNTER_QUERIES_EVALUATED, 1);
+    m_stats.Add(CStats::COUNTER_EVENTS_SCANNED, eventList.NumEvents);
 
     FILETIME now;
     GetEpgTimeAsFileTime(&now);
@@ -1390,11 +1797,11 @@ void CTTRec::CheckQuery()
     updatedEvents[0] = 0;
 
     // すでに開始しているイベントをスキップする
+    JST_TIME jstNow = FileTimeToJst(now);
     int i = 0;
     for (; i < eventList.NumEvents; i++) {
-        const TVTest::EpgEventInfo &ev = *eventList.EventList[i];
-        FILETIME evStart;
-        if (::SystemTimeToFileTime(&ev.StartTime, &evStart) && evStart - now > 0) break;
+        JST_TIME evStart;
+        if (SystemTimeToJst(eventList.EventList[i]->StartTime, &evStart) && evStart > jstNow) break;
     }
 
     for (; i < eventList.NumEvents; i++) {
@@ -1407,9 +1814,10 @@ void CTTRec::CheckQuery()
 
         // クエリから予約を生成する
         RESERVE res;
-        FILETIME evStart;
-        if (::SystemTimeToFileTime(&ev.StartTime, &evStart) && ev.Duration != 0 &&
-            m_queryList.CreateReserve(queryIndex, &res, ev.EventID, ev.pszEventName ? ev.pszEventName : TEXT(""), evStart, ev.Duration) &&
+        JST_TIME evStart;
+        if (SystemTimeToJst(ev.StartTime, &evStart) && ev.Duration != 0 &&
+            m_queryList.CreateReserve(queryIndex, &res, ev.EventID, ev.pszEventName ? ev.pszEventName : TEXT(""),
+                                      JstToFileTime(evStart), ev.Duration) &&
             m_reserveList.Insert(res))
         {
             if (::lstrlen(updatedEvents) < ARRAY_SIZE(updatedEvents) - 32) {
@@ -1436,10 +1844,22 @@ void CTTRec::CheckQuery()
 }
 
 
+// 番組表からEventIDの一致するイベントを探す
+const TVTest::EpgEventInfo *CTTRec::FindEpgEvent(const TVTest::EpgEventList &list, WORD eventID)
+{
+    for (int i = 0; i < list.NumEvents; ++i) {
+        if (list.EventList[i]->EventID == eventID) return list.EventList[i];
+    }
+    return NULL;
+}
+
+
 // 予約を追従する
-void CTTRec::FollowUpReserves()
+// fPfOnlyのときはEIT[p/f]による追従とイベントリレーのみ行う
+void CTTRec::FollowUpReserves(bool fPfOnly)
 {
     DEBUG_OUT(TEXT("CTTRec::FollowUpReserves()\n"));
+    CStatScope scope(&m_stats, CStats::STAGE_FOLLOW_UP);
 
     bool fEventTimeUpdated = false;
     bool fEventRenamed = false;
@@ -1452,105 +1872,128 @@ void CTTRec::FollowUpReserves()
 
     m_fFollowUpFast = false;
 
-    for (int i = 0; i < FOLLOW_UP_MAX + 1; ++i) {
-        // 直近FOLLOW_UP_MAX個より後ろの予約は1つずつチェックする
-        const RESERVE *pRes;
-        if (i == FOLLOW_UP_MAX) {
-            pRes = m_reserveList.Get(m_followUpIndex++);
-        }
-        else {
-            pRes = m_reserveList.Get(i);
-        }
-        if (!pRes) {
-            m_followUpIndex = FOLLOW_UP_MAX;
-            break;
+    // 追従処理中に予約の順序が変わるのでIDを控えておく
+    int numReserves = m_reserveList.Length();
+    if (numReserves == 0) return;
+    m_stats.Add(CStats::COUNTER_RESERVES_TOUCHED, numReserves);
+    FOLLOW_UP_KEY *pIDs = new FOLLOW_UP_KEY[numReserves];
+    int i = 0;
+    for (const RESERVE *pRes = m_reserveList.GetHead(); pRes && i < numReserves; pRes = pRes->next, ++i) {
+        pIDs[i].networkID = pRes->networkID;
+        pIDs[i].transportStreamID = pRes->transportStreamID;
+        pIDs[i].serviceID = pRes->serviceID;
+        pIDs[i].eventID = pRes->eventID;
+    }
+    // 番組表はサービスごとに1回だけ取得する(サービスから引く索引をつける。-1は空き)
+    FOLLOW_UP_EPG *pEpgs = new FOLLOW_UP_EPG[numReserves];
+    int numEpgs = 0;
+    int epgIndexSize = 64;
+    while (epgIndexSize < numReserves * 2) epgIndexSize *= 2;
+    int *pEpgIndex = new int[epgIndexSize];
+    for (int j = 0; j < epgIndexSize; ++j) pEpgIndex[j] = -1;
+
+    // EIT[p/f]を取得
+    if (!m_pApp->GetCurrentProgramInfo(&nextPf, true)) {
+        nextPf.Size = 0;
+    }
+    if (!m_pApp->GetCurrentProgramInfo(&currPf, false)) {
+        currPf.Size = 0;
+    }
+#if 0
+    // 延長テスト
+    static bool fDebugStart, fDebugEnd;
+    if (!fDebugEnd) {
+        static TVTest::ProgramInfo debugCurrPf, debugNextPf;
+        if (!fDebugStart && currPf.Size != 0 && nextPf.Size != 0) {
+            debugCurrPf = currPf;
+            debugNextPf = nextPf;
+            fDebugStart = true;
         }
-        // EIT[p/f]を取得
-        if (i == 0) {
-            if (!m_pApp->GetCurrentProgramInfo(&nextPf, true)) {
-                nextPf.Size = 0;
+        if (fDebugStart) {
+            currPf = debugCurrPf;
+            nextPf = debugNextPf;
+            JST_TIME currStart = 0;
+            SystemTimeToJst(currPf.StartTime, &currStart);
+            FILETIME endTime = JstToFileTime(currStart + currPf.Duration * FILETIME_SECOND);
+            // 番組終了1200秒後に消してみる
+            if (m_totAdjustedNow - endTime > 1200 * FILETIME_SECOND) {
+                fDebugEnd = true;
             }
-            if (!m_pApp->GetCurrentProgramInfo(&currPf, false)) {
-                currPf.Size = 0;
-            }
-#if 0
-            // 延長テスト
-            static bool fDebugStart, fDebugEnd;
-            if (!fDebugEnd) {
-                static TVTest::ProgramInfo debugCurrPf, debugNextPf;
-                if (!fDebugStart && currPf.Size != 0 && nextPf.Size != 0) {
-                    debugCurrPf = currPf;
-                    debugNextPf = nextPf;
-                    fDebugStart = true;
-                }
-                if (fDebugStart) {
-                    currPf = debugCurrPf;
-                    nextPf = debugNextPf;
-                    FILETIME endTime;
-                    ::SystemTimeToFileTime(&currPf.StartTime, &endTime);
-                    endTime += currPf.Duration * FILETIME_SECOND;
-                    // 番組終了1200秒後に消してみる
-                    if (m_totAdjustedNow - endTime > 1200 * FILETIME_SECOND) {
-                        fDebugEnd = true;
-                    }
-                    // 番組終了300秒前から終了時刻不明にしてみる
-                    if (m_totAdjustedNow - endTime > -300 * FILETIME_SECOND) {
-                        currPf.Duration = 0;
-                    }
-                }
+            // 番組終了300秒前から終了時刻不明にしてみる
+            if (m_totAdjustedNow - endTime > -300 * FILETIME_SECOND) {
+                currPf.Duration = 0;
             }
+        }
+    }
 #endif
+
+    for (i = 0; i < numReserves; ++i) {
+        const RESERVE *pRes = m_reserveList.Get(pIDs[i].networkID, pIDs[i].transportStreamID, pIDs[i].serviceID, pIDs[i].eventID);
+        if (!pRes) continue;
+
+        // 予約のサービスの番組表を探す(なければ取得する)
+        const TVTest::EpgEventList *pList = NULL;
+        if (!fPfOnly || m_fEventRelay && currPf.Size != 0 && currPf.ServiceID == pRes->serviceID && currPf.EventID == pRes->eventID) {
+            DWORD key = (static_cast<DWORD>(pRes->networkID) << 16 | pRes->serviceID) * 2654435761UL ^ pRes->transportStreamID;
+            int k = (key ^ key >> 16) & (epgIndexSize - 1);
+            for (; pEpgIndex[k] >= 0; k = (k + 1) & (epgIndexSize - 1)) {
+                const TVTest::EpgEventList &list = pEpgs[pEpgIndex[k]].list;
+                if (list.NetworkID == pRes->networkID &&
+                    list.TransportStreamID == pRes->transportStreamID &&
+                    list.ServiceID == pRes->serviceID) break;
+            }
+            int j = pEpgIndex[k];
+            if (j < 0) {
+                j = pEpgIndex[k] = numEpgs;
+                pEpgs[j].list.NetworkID         = pRes->networkID;
+                pEpgs[j].list.TransportStreamID = pRes->transportStreamID;
+                pEpgs[j].list.ServiceID         = pRes->serviceID;
+                pEpgs[j].fAvailable = m_pApp->GetEpgEventList(&pEpgs[j].list);
+                if (pEpgs[j].fAvailable) m_stats.Add(CStats::COUNTER_EVENTS_SCANNED, pEpgs[j].list.NumEvents);
+                ++numEpgs;
+            }
+            if (pEpgs[j].fAvailable) pList = &pEpgs[j].list;
         }
 
         // いちどp/fで更新した予約はEIT[schedule]を参照しない
-        if (pRes->followMode == FOLLOW_MODE_DEFAULT || pRes->followMode == FOLLOW_MODE_FIXED) {
-            TVTest::EpgEventQueryInfo queryInfo;
-            queryInfo.NetworkID         = pRes->networkID;
-            queryInfo.TransportStreamID = pRes->transportStreamID;
-            queryInfo.ServiceID         = pRes->serviceID;
-            queryInfo.EventID           = pRes->eventID;
-            queryInfo.Type              = TVTest::EPG_EVENT_QUERY_EVENTID;
-            queryInfo.Flags             = 0;
-            TVTest::EpgEventInfo *pEvent = m_pApp->GetEpgEventInfo(&queryInfo);
-            if (pEvent) {
-                FILETIME startTime;
-                // EventIDの使いまわしに備えるため必要以上の追従をしない
-                if (::SystemTimeToFileTime(&pEvent->StartTime, &startTime) && pEvent->Duration != 0 &&
-                    startTime - pRes->startTime < 12 * FILETIME_HOUR)
-                {
-                    // 予約時刻に変更があるか
-                    bool fUpdateTime = pRes->followMode == FOLLOW_MODE_DEFAULT &&
-                                       (startTime - pRes->startTime != 0 || pEvent->Duration - pRes->duration != 0);
-                    // イベント名に変更があれば、予約のイベント名がEPG由来の場合はリネームする。録画中は(無用な混乱を避けるため)リネームしない
-                    bool fRename =
-                        pRes->eventName[0] == PREFIX_EPGORIGIN &&
-                        ::StrCmpN(pRes->eventName + 1, pEvent->pszEventName ? pEvent->pszEventName : TEXT(""), ARRAY_SIZE(pRes->eventName) - 2) != 0 &&
-                        (m_recordingState != REC_ACTIVE && m_recordingState != REC_ACTIVE_VIEW_ONLY ||
-                         pRes->eventID != m_nearest.eventID || pRes->networkID != m_nearest.networkID ||
-                         pRes->transportStreamID != m_nearest.transportStreamID || pRes->serviceID != m_nearest.serviceID);
-
-                    if (fUpdateTime || fRename) {
-                        newRes = *pRes;
-                        if (fUpdateTime) {
-                            newRes.startTime = startTime;
-                            newRes.duration = pEvent->Duration;
-                        }
-                        if (fRename) {
-                            newRes.eventName[0] = PREFIX_EPGORIGIN;
-                            ::lstrcpyn(newRes.eventName + 1, pEvent->pszEventName ? pEvent->pszEventName : TEXT(""), ARRAY_SIZE(newRes.eventName) - 1);
-                        }
-                        if (m_reserveList.Insert(newRes)) {
-                            if (::lstrlen(updatedEvents) < ARRAY_SIZE(updatedEvents) - 32) {
-                                ::wsprintf(updatedEvents + ::lstrlen(updatedEvents), TEXT("\n%.31s"), newRes.eventName + (newRes.eventName[0]==PREFIX_EPGORIGIN ? 1 : 0));
-                            }
-                            fEventTimeUpdated = fEventTimeUpdated || fUpdateTime;
-                            fEventRenamed = fEventRenamed || fRename;
-                            m_pApp->FreeEpgEventInfo(pEvent);
-                            continue;
+        const TVTest::EpgEventInfo *pEvent = pList ? FindEpgEvent(*pList, pRes->eventID) : NULL;
+        if (!fPfOnly && pEvent && (pRes->followMode == FOLLOW_MODE_DEFAULT || pRes->followMode == FOLLOW_MODE_FIXED)) {
+            JST_TIME evStart;
+            // EventIDの使いまわしに備えるため必要以上の追従をしない
+            if (SystemTimeToJst(pEvent->StartTime, &evStart) && pEvent->Duration != 0 &&
+                evStart - FileTimeToJst(pRes->startTime) < 12 * FILETIME_HOUR)
+            {
+                FILETIME startTime = JstToFileTime(evStart);
+                // 予約時刻に変更があるか
+                bool fUpdateTime = pRes->followMode == FOLLOW_MODE_DEFAULT &&
+                                   (startTime - pRes->startTime != 0 || pEvent->Duration - pRes->duration != 0);
+                // イベント名に変更があれば、予約のイベント名がEPG由来の場合はリネームする。録画中は(無用な混乱を避けるため)リネームしない
+                bool fRename =
+                    pRes->eventName[0] == PREFIX_EPGORIGIN &&
+                    ::StrCmpN(pRes->eventName + 1, pEvent->pszEventName ? pEvent->pszEventName : TEXT(""), ARRAY_SIZE(pRes->eventName) - 2) != 0 &&
+                    (m_recordingState != REC_ACTIVE && m_recordingState != REC_ACTIVE_VIEW_ONLY ||
+                     pRes->eventID != m_nearest.eventID || pRes->networkID != m_nearest.networkID ||
+                     pRes->transportStreamID != m_nearest.transportStreamID || pRes->serviceID != m_nearest.serviceID);
+
+                if (fUpdateTime || fRename) {
+                    newRes = *pRes;
+                    if (fUpdateTime) {
+                        newRes.startTime = startTime;
+                        newRes.duration = pEvent->Duration;
+                    }
+                    if (fRename) {
+                        newRes.eventName[0] = PREFIX_EPGORIGIN;
+                        ::lstrcpyn(newRes.eventName + 1, pEvent->pszEventName ? pEvent->pszEventName : TEXT(""), ARRAY_SIZE(newRes.eventName) - 1);
+                    }
+                    if (m_reserveList.Insert(newRes)) {
+                        if (::lstrlen(updatedEvents) < ARRAY_SIZE(updatedEvents) - 32) {
+                            ::wsprintf(updatedEvents + ::lstrlen(updatedEvents), TEXT("\n%.31s"), newRes.eventName + (newRes.eventName[0]==PREFIX_EPGORIGIN ? 1 : 0));
                         }
+                        fEventTimeUpdated = fEventTimeUpdated || fUpdateTime;
+                        fEventRenamed = fEventRenamed || fRename;
+                        continue;
                     }
                 }
-                m_pApp->FreeEpgEventInfo(pEvent);
             }
         }
 
@@ -1563,6 +2006,7 @@ void CTTRec::FollowUpReserves()
         bool fNoCheckCh = false;
         FILETIME startTime = {0};
         int duration = 0;
+        JST_TIME pfStart;
 
         if (pRes->followMode == FOLLOW_MODE_PF_FOLLOWING && currPf.Size != 0 && (currPf.ServiceID != pRes->serviceID || currPf.EventID != pRes->eventID)) {
             // 番組終了まで延長の予約が消滅した→この時点を終了時刻とみなす
@@ -1572,9 +2016,10 @@ void CTTRec::FollowUpReserves()
             fNoCheckCh = true;
         }
         else if (currPf.Size != 0 && currPf.ServiceID == pRes->serviceID && currPf.EventID == pRes->eventID &&
-                 ::SystemTimeToFileTime(&currPf.StartTime, &startTime) && startTime - pRes->startTime < 12 * FILETIME_HOUR)
+                 SystemTimeToJst(currPf.StartTime, &pfStart) && pfStart - FileTimeToJst(pRes->startTime) < 12 * FILETIME_HOUR)
         {
             // 現在番組
+            startTime = JstToFileTime(pfStart);
             duration = currPf.Duration;
             if (duration == 0) {
                 // 終了時刻未定→番組終了まで延長
@@ -1590,62 +2035,53 @@ void CTTRec::FollowUpReserves()
                     followMode = FOLLOW_MODE_PF_UPDATE;
                 }
                 // 流動編成対策とアナウンスを兼ねて、イベントリレーはリレー元終了の直前にやる
-                if (m_fEventRelay && m_totAdjustedNow - startTime > (duration - EVENT_RELAY_CREATE_TIME) * FILETIME_SECOND) {
-                    TVTest::EpgEventQueryInfo queryInfo;
-                    queryInfo.NetworkID         = pRes->networkID;
-                    queryInfo.TransportStreamID = pRes->transportStreamID;
-                    queryInfo.ServiceID         = pRes->serviceID;
-                    queryInfo.EventID           = pRes->eventID;
-                    queryInfo.Type              = TVTest::EPG_EVENT_QUERY_EVENTID;
-                    queryInfo.Flags             = 0;
-                    TVTest::EpgEventInfo *pEvent = m_pApp->GetEpgEventInfo(&queryInfo);
-                    if (pEvent) {
-                        for (int j = 0; j < pEvent->EventGroupListLength; ++j) {
-                            BYTE groupType = pEvent->EventGroupList[j]->GroupType;
-                            for (int k = 0; (groupType == 2 || groupType == 4) && k < pEvent->EventGroupList[j]->EventListLength; ++k) {
-                                TVTest::EpgGroupEventInfo relayInfo = pEvent->EventGroupList[j]->EventList[k];
-                                if (groupType == 2) {
-                                    // 自ネットワークへのイベントリレー
-                                    relayInfo.NetworkID = pRes->networkID;
-                                    relayInfo.TransportStreamID = pRes->transportStreamID;
-                                }
-                                int space, channel;
-                                if (GetChannel(&space, &channel, relayInfo.NetworkID, relayInfo.ServiceID)) {
-                                    if (m_reserveList.Get(relayInfo.NetworkID, relayInfo.TransportStreamID, relayInfo.ServiceID, relayInfo.EventID) == NULL) {
-                                        // イベントリレー予約追加
-                                        newRes.isEnabled = pRes->isEnabled;
-                                        newRes.networkID = relayInfo.NetworkID;
-                                        newRes.transportStreamID = relayInfo.TransportStreamID;
-                                        newRes.serviceID = relayInfo.ServiceID;
-                                        newRes.eventID = relayInfo.EventID;
-                                        newRes.duration = EVENT_RELAY_CREATE_DURATION;
-                                        newRes.followMode = FOLLOW_MODE_PF_UPDATE;
-                                        newRes.recOption = pRes->recOption;
-                                        // リレー元の終了時間をリレー先の開始時間とする
-                                        newRes.startTime = startTime;
-                                        newRes.startTime += duration * FILETIME_SECOND;
-                                        ::lstrcpy(newRes.eventName, pRes->eventName);
-                                        if (m_reserveList.Insert(newRes)) {
-                                            if (::lstrlen(updatedEvents) < ARRAY_SIZE(updatedEvents) - 32) {
-                                                ::wsprintf(updatedEvents + ::lstrlen(updatedEvents), TEXT("\n%.31s"), newRes.eventName + (newRes.eventName[0]==PREFIX_EPGORIGIN ? 1 : 0));
-                                            }
-                                            fEventRelayed = true;
+                // (イベントグループ記述子は取得済みの番組表のものを使う)
+                if (m_fEventRelay && pEvent && m_totAdjustedNow - startTime > (duration - EVENT_RELAY_CREATE_TIME) * FILETIME_SECOND) {
+                    for (int j = 0; j < pEvent->EventGroupListLength; ++j) {
+                        BYTE groupType = pEvent->EventGroupList[j]->GroupType;
+                        for (int k = 0; (groupType == 2 || groupType == 4) && k < pEvent->EventGroupList[j]->EventListLength; ++k) {
+                            TVTest::EpgGroupEventInfo relayInfo = pEvent->EventGroupList[j]->EventList[k];
+                            if (groupType == 2) {
+                                // 自ネットワークへのイベントリレー
+                                relayInfo.NetworkID = pRes->networkID;
+                                relayInfo.TransportStreamID = pRes->transportStreamID;
+                            }
+                            int space, channel;
+                            if (GetChannel(&space, &channel, relayInfo.NetworkID, relayInfo.ServiceID)) {
+                                if (m_reserveList.Get(relayInfo.NetworkID, relayInfo.TransportStreamID, relayInfo.ServiceID, relayInfo.EventID) == NULL) {
+                                    // イベントリレー予約追加
+                                    newRes.isEnabled = pRes->isEnabled;
+                                    newRes.networkID = relayInfo.NetworkID;
+                                    newRes.transportStreamID = relayInfo.TransportStreamID;
+                                    newRes.serviceID = relayInfo.ServiceID;
+                                    newRes.eventID = relayInfo.EventID;
+                                    newRes.duration = EVENT_RELAY_CREATE_DURATION;
+                                    newRes.followMode = FOLLOW_MODE_PF_UPDATE;
+                                    newRes.recOption = pRes->recOption;
+                                    // リレー元の終了時間をリレー先の開始時間とする
+                                    newRes.startTime = startTime;
+                                    newRes.startTime += duration * FILETIME_SECOND;
+                                    ::lstrcpy(newRes.eventName, pRes->eventName);
+                                    if (m_reserveList.Insert(newRes)) {
+                                        if (::lstrlen(updatedEvents) < ARRAY_SIZE(updatedEvents) - 32) {
+                                            ::wsprintf(updatedEvents + ::lstrlen(updatedEvents), TEXT("\n%.31s"), newRes.eventName + (newRes.eventName[0]==PREFIX_EPGORIGIN ? 1 : 0));
                                         }
+                                        fEventRelayed = true;
                                     }
-                                    j = pEvent->EventGroupListLength;
-                                    break;
                                 }
+                                j = pEvent->EventGroupListLength;
+                                break;
                             }
                         }
-                        m_pApp->FreeEpgEventInfo(pEvent);
                     }
                 }
             }
         }
         else if (nextPf.Size != 0 && nextPf.ServiceID == pRes->serviceID && nextPf.EventID == pRes->eventID &&
-                 ::SystemTimeToFileTime(&nextPf.StartTime, &startTime) && startTime - pRes->startTime < 12 * FILETIME_HOUR)
+                 SystemTimeToJst(nextPf.StartTime, &pfStart) && pfStart - FileTimeToJst(pRes->startTime) < 12 * FILETIME_HOUR)
         {
             // 次番組(ARIB TR-B14によるとStartTimeが未定の場合もあるがとりあえず無視する)
+            startTime = JstToFileTime(pfStart);
             duration = nextPf.Duration;
             if (duration != 0 && (startTime - pRes->startTime != 0 || duration != pRes->duration)) {
                 followMode = FOLLOW_MODE_PF_UPDATE;
@@ -1669,6 +2105,13 @@ void CTTRec::FollowUpReserves()
         }
     }
 
+    for (i = 0; i < numEpgs; ++i) {
+        if (pEpgs[i].fAvailable) m_pApp->FreeEpgEventList(&pEpgs[i].list);
+    }
+    delete [] pEpgIndex;
+    delete [] pEpgs;
+    delete [] pIDs;
+
     if (fEventTimeUpdated || fEventRenamed || fEventRelayed) {
         TCHAR text[64 + ARRAY_SIZE(updatedEvents)];
         ::wsprintf(text, TEXT("%s%s%s%s%sに変更がありました:%s"),
@@ -1690,56 +2133,85 @@ void CTTRec::FollowUpReserves()
 }
 
 
+// チャンネルを索引から探す。索引がなければ作成する
+const CChannelIndex::CHANNEL *CTTRec::FindChannel(WORD networkID, WORD serviceID)
+{
+    if (!m_channelIndex.IsValid()) {
+        int count = 0;
+        TVTest::TuningSpaceInfo spaceInfo;
+        for (int space = 0; m_pApp->GetTuningSpaceInfo(space, &spaceInfo); space++) {
+            TVTest::ChannelInfo channelInfo;
+            for (int channel = 0; m_pApp->GetChannelInfo(space, channel, &channelInfo); channel++) {
+                m_channelIndex.Add(channelInfo.NetworkID, channelInfo.ServiceID, space, channel, channelInfo.szChannelName);
+                count++;
+            }
+        }
+        // ドライバの読み込み前などでチャンネルがなければ次回また作成する
+        if (count > 0) m_channelIndex.SetValid();
+    }
+    return m_channelIndex.Find(networkID, serviceID);
+}
+
+
+// networkIDがおかしなものを弾く(念の為)
+// http://www.arib.or.jp/tyosakenkyu/sakutei/img/sakutei3-07.pdf
+static bool IsValidNetworkID(WORD networkID)
+{
+    return (0x0001 <= networkID && networkID <= 0x000B) || (0x7880 <= networkID && networkID <= 0x7FEF);
+}
+
+
 // チャンネルを取得する
 bool CTTRec::GetChannel(int *pSpace, int *pChannel, WORD networkID, WORD serviceID)
 {
-    if (!pSpace || !pChannel) return false;
-
-    // networkIDがおかしなものを弾く(念の為)
-    // http://www.arib.or.jp/tyosakenkyu/sakutei/img/sakutei3-07.pdf
-    if (!(0x0001 <= networkID && networkID <= 0x000B) && !(0x7880 <= networkID && networkID <= 0x7FEF)) {
-        return false;
-    }
+    if (!pSpace || !pChannel || !IsValidNetworkID(networkID)) return false;
 
-    TVTest::TuningSpaceInfo spaceInfo;
-    for (*pSpace = 0; m_pApp->GetTuningSpaceInfo(*pSpace, &spaceInfo); (*pSpace)++) {
-        // networkIDとserviceIDの一致するチャンネルを探す
-        TVTest::ChannelInfo channelInfo;
-        for (*pChannel = 0; m_pApp->GetChannelInfo(*pSpace, *pChannel, &channelInfo); (*pChannel)++) {
-            if (channelInfo.NetworkID == networkID && channelInfo.ServiceID == serviceID) return true;
-        }
-    }
-    return false;
+    const CChannelIndex::CHANNEL *pCh = FindChannel(networkID, serviceID);
+    if (!pCh) return false;
+    *pSpace = pCh->space;
+    *pChannel = pCh->channel;
+    return true;
 }
 
 
 // チャンネルの名前を取得する
 bool CTTRec::GetChannelName(LPTSTR name, int max, WORD networkID, WORD serviceID)
 {
-    int space, channel;
-    if (!GetChannel(&space, &channel, networkID, serviceID)) return false;
-
-    TVTest::ChannelInfo chInfo;
-    if (!m_pApp->GetChannelInfo(space, channel, &chInfo)) return false;
+    if (!IsValidNetworkID(networkID)) return false;
 
-    ::lstrcpyn(name, chInfo.szChannelName, max);
+    const CChannelIndex::CHANNEL *pCh = FindChannel(networkID, serviceID);
+    if (!pCh) return false;
+    ::lstrcpyn(name, pCh->name, max);
     return true;
 }
 
 
-// チャンネルがドライバに存在するかどうか調べる
-bool CTTRec::IsChannelOnDriver(WORD networkID, WORD serviceID, const TVTest::DriverTuningSpaceList &list)
+// ドライバのチャンネルの索引を取得する(pIndexに作成する)。ドライバの情報を取得できなければNULLを返す
+const CChannelIndex *CTTRec::GetDriverIndex(LPCTSTR driverName, CChannelIndex *pIndex)
 {
-    for (DWORD i = 0; i < list.NumSpaces; i++) {
-        const TVTest::DriverTuningSpaceInfo &spaceInfo = *list.SpaceList[i];
-        for (DWORD j = 0; j < spaceInfo.NumChannels; j++) {
-            const TVTest::ChannelInfo &channelInfo = *spaceInfo.ChannelList[j];
-            if (channelInfo.NetworkID == networkID && channelInfo.ServiceID == serviceID) {
-                return true;
+    if (!pIndex->IsValid()) {
+        TVTest::DriverTuningSpaceList list;
+        if (!m_pApp->GetDriverTuningSpaceList(driverName, &list)) return NULL;
+        for (DWORD i = 0; i < list.NumSpaces; i++) {
+            const TVTest::DriverTuningSpaceInfo &spaceInfo = *list.SpaceList[i];
+            for (DWORD j = 0; j < spaceInfo.NumChannels; j++) {
+                const TVTest::ChannelInfo &channelInfo = *spaceInfo.ChannelList[j];
+                pIndex->Add(channelInfo.NetworkID, channelInfo.ServiceID, i, j, channelInfo.szChannelName);
             }
         }
+        m_pApp->FreeDriverTuningSpaceList(&list);
+        pIndex->SetValid();
     }
-    return false;
+    return pIndex;
+}
+
+
+// ドライバやチャンネル設定の変更に備えてチャンネルの索引を破棄する
+void CTTRec::InvalidateChannelIndex()
+{
+    m_channelIndex.Invalidate();
+    m_mainDriverIndex.Invalidate();
+    m_subDriverIndex.Invalidate();
 }
 
 
@@ -1748,11 +2220,10 @@ bool CTTRec::SetChannel(WORD networkID, WORD serviceID)
 {
     LPCTSTR targetDriverName = m_szDriverName;
     if (m_szSubDriverName[0]) {
-        TVTest::DriverTuningSpaceList list;
-        if (m_pApp->GetDriverTuningSpaceList(m_szDriverName, &list)) {
+        const CChannelIndex *pMainIndex = GetDriverIndex(m_szDriverName, &m_mainDriverIndex);
+        if (pMainIndex) {
             // チャンネルが主ドライバになければ補欠のドライバを使う
-            targetDriverName = IsChannelOnDriver(networkID, serviceID, list) ? m_szDriverName : m_szSubDriverName;
-            m_pApp->FreeDriverTuningSpaceList(&list);
+            targetDriverName = pMainIndex->Find(networkID, serviceID) ? m_szDriverName : m_szSubDriverName;
         }
     }
 
@@ -1763,6 +2234,7 @@ bool CTTRec::SetChannel(WORD networkID, WORD serviceID)
          ::lstrcmpi(::PathFindFileName(driverName), ::PathFindFileName(targetDriverName)))) {
         ShowBalloonTip(TEXT("BonDriverを変更します。"), 3);
         m_pApp->SetDriverName(targetDriverName);
+        m_channelIndex.Invalidate();
     }
     // 本体待機状態ならば解除する
     m_pApp->SetStandby(false);
@@ -1770,113 +2242,635 @@ bool CTTRec::SetChannel(WORD networkID, WORD serviceID)
     int space, channel;
     if (!GetChannel(&space, &channel, networkID, serviceID)) return false;
 
+    m_wakeTrace.Mark(CWakeTrace::STAGE_SET_CHANNEL);
+    BeginTuneMeasure(space, channel);
     return m_pApp->SetChannel(space, channel, serviceID);
 }
 
 
-// 録画を開始する
-bool CTTRec::StartRecord(LPCTSTR saveDir, LPCTSTR saveName)
+// チャンネル変更から受信が安定するまでの時間の計測を始める
+void CTTRec::BeginTuneMeasure(int space, int channel)
 {
-    TCHAR fullPath[MAX_PATH];
-    ::PathCombine(fullPath, saveDir, saveName);
+    m_tuneMeasure.fActive = false;
+    m_tuneMeasure.latency = -1;
+    TVTest::ChannelInfo ci, currentCi;
+    if (!m_pApp->GetChannelInfo(space, channel, &ci)) return;
+    // ストリームが変わらないときは計測しない
+    if (m_pApp->GetCurrentChannelInfo(&currentCi) &&
+        currentCi.NetworkID == ci.NetworkID && currentCi.TransportStreamID == ci.TransportStreamID) return;
+
+    m_tuneMeasure.fActive = true;
+    m_tuneMeasure.fStatusValid = false;
+    m_tuneMeasure.networkID = ci.NetworkID;
+    m_tuneMeasure.transportStreamID = ci.TransportStreamID;
+    m_tuneMeasure.startTick = ::GetTickCount();
+}
 
-    TVTest::RecordInfo recordInfo;
-    recordInfo.Mask = TVTest::RECORD_MASK_FILENAME;
-    recordInfo.Flags = 0;
-    recordInfo.StartTimeSpec = TVTest::RECORD_START_NOTSPECIFIED;
-    recordInfo.StopTimeSpec = TVTest::RECORD_STOP_NOTSPECIFIED;
-    recordInfo.pszFileName = fullPath;
 
-    if (m_pApp->StartRecord(&recordInfo)) {
-        return true;
+// 変更先のストリームでTOTを受信し、かつドロップが増えなくなった時点を受信が安定した時点とする
+void CTTRec::UpdateTuneMeasure()
+{
+    if (!m_tuneMeasure.fActive) return;
+
+    DWORD tick = ::GetTickCount();
+    if (tick - m_tuneMeasure.startTick >= TUNE_MEASURE_TIMEOUT) {
+        // 受信できなかった
+        m_tuneMeasure.fActive = false;
+        return;
+    }
+    bool fTotGrabbed;
+    {
+        CBlockLock lock(&m_totLock);
+        fTotGrabbed = static_cast<int>(m_totGrabbedTick - m_tuneMeasure.startTick) > 0;
+    }
+    TVTest::ChannelInfo ci;
+    TVTest::StatusInfo si;
+    if (!fTotGrabbed || !m_pApp->GetCurrentChannelInfo(&ci) ||
+        ci.NetworkID != m_tuneMeasure.networkID || ci.TransportStreamID != m_tuneMeasure.transportStreamID ||
+        !m_pApp->GetStatus(&si))
+    {
+        m_tuneMeasure.fStatusValid = false;
+        return;
     }
-    // TVTest本体のパス重複対策にはパス確定からファイルオープンまでに微妙なラグがあり、そこを突くと録画失敗することがあるため
-    ::Sleep(200);
-    m_pApp->AddLog(L"録画を再試行します。");
-    return m_pApp->StartRecord(&recordInfo);
+    if (m_tuneMeasure.fStatusValid && si.DropPacketCount == m_tuneMeasure.dropCount) {
+        // 前回の確認以降ドロップがない
+        m_tuneMeasure.latency = static_cast<int>(m_tuneMeasure.statusTick - m_tuneMeasure.startTick);
+        m_tuneLatency.Add(m_tuneMeasure.networkID, m_tuneMeasure.transportStreamID, m_tuneMeasure.latency);
+        m_tuneLatency.Save();
+        m_tuneMeasure.fActive = false;
+        return;
+    }
+    m_tuneMeasure.fStatusValid = true;
+    m_tuneMeasure.statusTick = tick;
+    m_tuneMeasure.dropCount = si.DropPacketCount;
 }
 
 
-// 録画停止中かどうか調べる
-bool CTTRec::IsNotRecording()
+// 録画中のドロップ・エラーの増え方とパケットの受信を監視し、受信不良が続けば補欠のドライバに切り替える
+// 切り替えて録画をやりなおしたときはtrueを返す
+bool CTTRec::CheckFailover()
 {
-    TVTest::RecordStatusInfo recInfo;
-    return m_pApp->GetRecordStatus(&recInfo) &&
-           recInfo.Status == TVTest::RECORD_STATUS_NOTRECORDING;
+    if (m_failoverDropRate <= 0 || !m_szSubDriverName[0] || !m_failover.fActive) return false;
+
+    DWORD tick = ::GetTickCount();
+    DWORD packetCount = m_streamPacketCount;
+    TVTest::StatusInfo si;
+    if (!m_pApp->GetStatus(&si)) {
+        m_failover.fStatusValid = false;
+        return false;
+    }
+    DWORD badCount = si.DropPacketCount + si.ErrorPacketCount;
+    // ステータスのリセットでカウントが減ったときは判断しない
+    if (m_failover.fStatusValid && badCount >= m_failover.badCount) {
+        DWORD elapsed = tick - m_failover.statusTick;
+        // パケットが届いていないか、ドロップ・エラーが設定の割合を超えて増えている
+        bool fDegraded = packetCount == m_failover.packetCount ||
+                         badCount - m_failover.badCount > static_cast<DWORD>(m_failoverDropRate) * elapsed / 1000;
+        if (!fDegraded) {
+            m_failover.fDegraded = false;
+        }
+        else if (!m_failover.fDegraded) {
+            m_failover.fDegraded = true;
+            m_failover.degradedTick = m_failover.statusTick;
+        }
+        else if (tick - m_failover.degradedTick >= static_cast<DWORD>(m_failoverDuration) * 1000) {
+            // 切り替えは1つの録画につき1度だけ
+            m_failover.fActive = false;
+            return FailoverToSubDriver();
+        }
+    }
+    m_failover.fStatusValid = true;
+    m_failover.statusTick = tick;
+    m_failover.badCount = badCount;
+    m_failover.packetCount = packetCount;
+    return false;
 }
 
 
-// 録画の制御をリセットする
-// CheckRecording()使用の開始前と終了後に呼ぶ
-void CTTRec::ResetRecording()
+// 補欠のドライバに切り替えて、録画を新しいファイルで続ける
+bool CTTRec::FailoverToSubDriver()
 {
-    m_nearest.networkID = m_nearest.transportStreamID =
-        m_nearest.serviceID = m_nearest.eventID = 0;
-
-    m_recordingState = REC_IDLE;
-    m_onStopped = ON_STOPPED_NONE;
-    m_fChChanged = m_fSpunUp = false;
-    m_fStopRecording = false;
-    m_fOnStoppedPostponed = false;
-    m_fOnStoppedDlgShowing = false;
+    // すでに補欠のドライバを使っているか、そのドライバにチャンネルがなければ何もしない
+    TCHAR driverName[MAX_PATH];
+    if (m_pApp->GetDriverName(driverName, ARRAY_SIZE(driverName)) > 0 &&
+        !::lstrcmpi(::PathFindFileName(driverName), ::PathFindFileName(m_szSubDriverName)) ||
+        !GetDriverIndex(m_szSubDriverName, &m_subDriverIndex) ||
+        !m_subDriverIndex.Find(m_nearest.networkID, m_nearest.serviceID)) return false;
+
+    ShowBalloonTip(TEXT("受信状態が悪いため補欠のBonDriverに切り替えます。"), 1);
+    m_pApp->AddLog(L"受信不良のため補欠のBonDriverに切り替えます。");
+    if (!RestartInNewSegment(m_szSubDriverName)) {
+        ShowBalloonTip(TEXT("補欠のBonDriverでの録画の開始に失敗しました。"), 1);
+        return false;
+    }
+    return true;
 }
 
 
-// 録画を制御する
-void CTTRec::CheckRecording()
+// 録画をいったん止めて、(driverNameを指定すればドライバを切り替えて)新しいファイルで続ける
+// 保存先はGetNearestSaveDir()。分割前のファイルは録画終了時と同様に解析する
+bool CTTRec::RestartInNewSegment(LPCTSTR driverName)
 {
-    bool fUpdated = false;
-    bool fOnStopped = false;
-    WORD prevNetworkID = m_nearest.networkID;
-    WORD prevTransportStreamID = m_nearest.transportStreamID;
-    WORD prevServiceID = m_nearest.serviceID;
-    WORD prevEventID = m_nearest.eventID;
+    // 分割前のファイルとカウント
+    bool fLean = m_pLeanRec != NULL;
+    TCHAR prevPath[MAX_PATH];
+    TVTest::RecordStatusInfo rsi;
+    rsi.pszFileName = prevPath;
+    rsi.MaxFileName = ARRAY_SIZE(prevPath);
+    if (fLean) {
+        ::lstrcpyn(prevPath, m_pLeanRec->GetFileName(), ARRAY_SIZE(prevPath));
+    }
+    else if (!m_pApp->GetRecordStatus(&rsi)) {
+        prevPath[0] = 0;
+    }
+    TVTest::StatusInfo si;
+    bool fStatusValid = m_recordingInfo.startStatusInfo.Size && m_pApp->GetStatus(&si);
 
-    // 直近の予約とその開始までのオフセットを取得する
-    LONGLONG startOffset;
-    for (;;) {
-        FILETIME &now = m_totAdjustedNow;
-        // 追従処理等により予約は入れ替わることがある
-        if (!m_reserveList.GetNearest(&m_nearest, m_defaultRecOption, REC_READY_OFFSET)) {
-            // 予約がない
-            m_nearest.networkID = m_nearest.transportStreamID =
-                m_nearest.serviceID = m_nearest.eventID = 0;
-            startOffset = LLONG_MAX;
-            break;
+    if (fLean) {
+        StopLeanRecord();
+    }
+    else {
+        m_pApp->StopRecord();
+    }
+    EndHistorySample();
+    EndHeadFile();
+    if (m_fAnalyzeTsOnEndRec && prevPath[0]) {
+        if (!ExecuteAnalyzeTs(prevPath)) {
+            ShowBalloonTip(TEXT("録画ファイル解析の起動に失敗しました。"), 1);
         }
-        else if (now - m_nearest.startTime < (m_nearest.duration + m_nearest.recOption.endMargin) * FILETIME_SECOND) {
-            // 予約開始前か予約時間内
-            startOffset = m_nearest.startTime - now - m_nearest.recOption.startMargin * FILETIME_SECOND;
-            break;
+    }
+
+    // ドライバを切り替えないときは、分割してから録画を始めるまでの部分をタイムシフトで補う
+    // (切り替えるとタイムシフトの内容は捨てられるので、その間の部分は欠ける)
+    DWORD startTick = ::GetTickCount();
+    int space, channel;
+    bool fStarted = false;
+    if (driverName) {
+        m_pApp->SetDriverName(driverName);
+        m_channelIndex.Invalidate();
+    }
+    if (!driverName ||
+        GetChannel(&space, &channel, m_nearest.networkID, m_nearest.serviceID) &&
+        m_pApp->SetChannel(space, channel, m_nearest.serviceID))
+    {
+        TCHAR replacedName[MAX_PATH];
+        FormatReserveFileName(replacedName, ARRAY_SIZE(replacedName), m_nearest);
+        if (fLean) {
+            fStarted = StartLeanRecord(GetNearestSaveDir(), replacedName, startTick);
         }
         else {
-            // 予約時間を過ぎた
-            m_reserveList.DeleteNearest(m_defaultRecOption);
-            fUpdated = true;
+            TCHAR path[MAX_PATH];
+            fStarted = GetUniqueRecordPath(path, GetNearestSaveDir(), replacedName, true) &&
+                       StartRecord(GetNearestSaveDir(), path, startTick);
         }
+        if (fStarted) BeginHistorySample();
     }
-    // 予約時間を過ぎた無効な予約を削除する
-    for (;;) {
-        const RESERVE *pRes = m_reserveList.GetNearest(m_defaultRecOption, false);
-        if (!pRes || pRes->isEnabled || m_totAdjustedNow - pRes->GetTrimmedStartTime() < pRes->GetTrimmedDuration() * FILETIME_SECOND) {
-            break;
+    // 上記の録画停止はユーザによる停止ではない
+    m_fStopRecording = false;
+    if (!fStarted) {
+        // 次の確認で録画を終える(ドライバを切り替えたときは改めて主ドライバで録画を開始する)
+        m_recordingState = REC_ENDED;
+        return false;
+    }
+
+    if (m_recordingInfo.fEnabled) {
+        // 分割点を記録し、分割後のカウントの起点を取りなおす
+        m_recordingInfo.fSplit = true;
+        m_recordingInfo.splitTime = m_totAdjustedNow;
+        rsi.pszFileName = m_recordingInfo.splitFilePath;
+        rsi.MaxFileName = ARRAY_SIZE(m_recordingInfo.splitFilePath);
+        if (m_pLeanRec) {
+            ::lstrcpyn(m_recordingInfo.splitFilePath, m_pLeanRec->GetFileName(), ARRAY_SIZE(m_recordingInfo.splitFilePath));
+        }
+        else if (!m_pApp->GetRecordStatus(&rsi)) {
+            m_recordingInfo.splitFilePath[0] = 0;
+        }
+        if (driverName) {
+            ::lstrcpyn(m_recordingInfo.splitDriverName, ::PathFindFileName(driverName), ARRAY_SIZE(m_recordingInfo.splitDriverName));
+        }
+        else if (m_pApp->GetDriverName(m_recordingInfo.splitDriverName, ARRAY_SIZE(m_recordingInfo.splitDriverName)) > 0) {
+            ::lstrcpy(m_recordingInfo.splitDriverName, ::PathFindFileName(m_recordingInfo.splitDriverName));
         }
         else {
-            m_reserveList.DeleteNearest(m_defaultRecOption, false);
-            fUpdated = true;
+            m_recordingInfo.splitDriverName[0] = 0;
         }
+        const TVTest::StatusInfo &start = m_recordingInfo.startStatusInfo;
+        m_recordingInfo.splitErrors = fStatusValid ? max((int)si.ErrorPacketCount - (int)start.ErrorPacketCount, -1) : -1;
+        m_recordingInfo.splitScrambles = fStatusValid ? max((int)si.ScramblePacketCount - (int)start.ScramblePacketCount, -1) : -1;
+        m_recordingInfo.splitDrops = fStatusValid ? max((int)si.DropPacketCount - (int)start.DropPacketCount, -1) : -1;
+        ::SetTimer(m_hwndRecording, GET_START_STATUS_INFO_TIMER_ID, GET_START_STATUS_INFO_DELAY, NULL);
+        m_recordingInfo.startStatusInfo.Size = 0;
     }
+    return true;
+}
 
-    // 予約サービスが変化したか
-    bool fServiceChanged = prevNetworkID != m_nearest.networkID ||
-                           prevTransportStreamID != m_nearest.transportStreamID ||
-                           prevServiceID != m_nearest.serviceID;
-    // 予約イベントが変化したか
-    bool fEventChanged = fServiceChanged || prevEventID != m_nearest.eventID;
-    // ┌───┐
-    // │      ↓
-    // │  ┌─REC_IDLE
-    // │  │  ↓
+
+// 録画ファイルの大きさの増え方を監視し、サービスのビットレートに比べて書き込みが滞れば通知する
+// 代わりの保存先があれば、そこで録画を続ける
+void CTTRec::CheckWriteThroughput()
+{
+    HISTORY_SAMPLE &hs = m_historySample;
+    if (!hs.fActive) return;
+
+    // プラグイン自身で書き出す録画は、書き込みが追いつかずにパケットを捨て始めればすぐ知らせる
+    for (int i = 0; i < SERVICE_REC_MAX; ++i) {
+        DWORD dropped = m_serviceRec[i] ? m_serviceRec[i]->PollDroppedPackets() : 0;
+        if (dropped > 0) {
+            TCHAR text[128];
+            ::wsprintf(text, TEXT("同時録画の書き込みが追いつかず%luパケットを捨てました。"), dropped);
+            ShowBalloonTip(text, 1);
+            m_pApp->AddLog(text);
+        }
+    }
+
+    TCHAR path[MAX_PATH];
+    TVTest::RecordStatusInfo rsi;
+    rsi.pszFileName = path;
+    rsi.MaxFileName = ARRAY_SIZE(path);
+    if (m_pLeanRec) {
+        ::lstrcpyn(path, m_pLeanRec->GetFileName(), ARRAY_SIZE(path));
+        // 捨てたパケットがあればファイルの大きさの増え方によらず滞っている
+        DWORD dropped = m_pLeanRec->PollDroppedPackets();
+        if (dropped > 0) {
+            ++hs.entry.writeStalls;
+            ++m_recordingInfo.writeStalls;
+            TCHAR text[128];
+            ::wsprintf(text, TEXT("軽量録画の書き込みが追いつかず%luパケットを捨てました。"), dropped);
+            ShowBalloonTip(text, 1);
+            m_pApp->AddLog(text);
+            if (m_writeStallPercent > 0) RestartOnOtherStorage(path);
+            return;
+        }
+    }
+    else if (!m_pApp->GetRecordStatus(&rsi) || !path[0]) {
+        ::lstrcpy(path, hs.filePath);
+    }
+    if (m_writeStallPercent <= 0) return;
+
+    // 調べられない(ネットワークドライブの切断など)ときは増えていないとみなす
+    DWORD tick = ::GetTickCount();
+    LONGLONG fileSize = m_writeWatch.fValid ? m_writeWatch.fileSize : 0;
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    if (path[0] && ::GetFileAttributesEx(path, GetFileExInfoStandard, &fad)) {
+        fileSize = static_cast<LONGLONG>(fad.nFileSizeHigh) << 32 | fad.nFileSizeLow;
+    }
+    if (!m_writeWatch.fValid) {
+        m_writeWatch.fValid = true;
+        m_writeWatch.tick = tick;
+        m_writeWatch.fileSize = fileSize;
+        return;
+    }
+    // 書き込みはまとめて行われるので、ある程度の間隔で判断する
+    DWORD elapsed = tick - m_writeWatch.tick;
+    if (elapsed < static_cast<DWORD>(m_writeStallDuration) * 1000) return;
+    LONGLONG written = fileSize - m_writeWatch.fileSize;
+    m_writeWatch.tick = tick;
+    m_writeWatch.fileSize = fileSize;
+    // ファイルが置き換えられるなどして小さくなったときは判断しない
+    if (written < 0) return;
+
+    int rate = static_cast<int>(min((written * 1000 / elapsed) >> 10, 0x7FFFFFFFLL));
+    CRecHistory::ENTRY &e = hs.entry;
+    e.minWriteRate = e.minWriteRate < 0 ? rate : min(e.minWriteRate, rate);
+    m_recordingInfo.minWriteRate = m_recordingInfo.minWriteRate < 0 ? rate : min(m_recordingInfo.minWriteRate, rate);
+    int expected = m_recHistory.GetBitrate(e.networkID, e.serviceID, 50);
+    if (expected <= 0) expected = DEFAULT_REC_KBYTES_PER_SEC;
+    if (static_cast<LONGLONG>(rate) * 100 >= static_cast<LONGLONG>(expected) * m_writeStallPercent) return;
+
+    ++e.writeStalls;
+    ++m_recordingInfo.writeStalls;
+    TCHAR text[128];
+    ::wsprintf(text, TEXT("録画ファイルへの書き込みが滞っています(%dKB/秒)。"), rate);
+    ShowBalloonTip(text, 1);
+    m_pApp->AddLog(text);
+    RestartOnOtherStorage(path);
+}
+
+
+// 書き込みが滞った録画ファイルとは別のボリュームの保存先で録画を続ける
+bool CTTRec::RestartOnOtherStorage(LPCTSTR filePath)
+{
+    if (!m_failover.fActive) return false;
+
+    // 保存先の集合かAltSaveDirから選ぶ
+    TCHAR dir[MAX_PATH];
+    if (CStoragePool::IsPoolDirectory(m_nearest.recOption.saveDir)) {
+        if (!SelectStorage(m_nearest, dir, filePath)) return false;
+    }
+    else {
+        if (!m_szAltSaveDir[0] || IsSameVolume(filePath, m_szAltSaveDir)) return false;
+        ::lstrcpy(dir, m_szAltSaveDir);
+    }
+    m_failover.fActive = false;
+    ::lstrcpy(m_szRedirectDir, dir);
+    ShowBalloonTip(TEXT("書き込みが滞ったため別の保存先で録画を続けます。"), 1);
+    m_pApp->AddLog(L"書き込みが滞ったため別の保存先で録画を続けます。");
+    if (!RestartInNewSegment(NULL)) {
+        ShowBalloonTip(TEXT("別の保存先での録画の開始に失敗しました。"), 1);
+        return false;
+    }
+    return true;
+}
+
+
+// 直近の予約のチャンネル変更を予約開始(マージン込み)の何秒前に行うか
+int CTTRec::GetChChangeBefore() const
+{
+    if (m_chChangeBefore <= 0 || m_chChangeMargin < 0) return m_chChangeBefore;
+
+    int latency = m_tuneLatency.GetPercentile(m_nearest.networkID, m_nearest.transportStreamID,
+                                              TUNE_LATENCY_PERCENTILE, TUNE_LATENCY_MIN_SAMPLES);
+    if (latency < 0) return m_chChangeBefore;
+    // 学習した所要時間に余裕を加える。ChChangeBeforeより早くはしない
+    return min(max((latency + 999) / 1000 + m_chChangeMargin, 15), m_chChangeBefore);
+}
+
+
+// 予約の保存ファイル名を作る
+void CTTRec::FormatReserveFileName(LPTSTR name, int max, const RESERVE &res)
+{
+    // フォーマット指示子を"部分的に"置換
+    TCHAR replacedEventName[EVENT_NAME_MAX];
+    ::lstrcpy(replacedEventName, res.eventName);
+    TranslateText(replacedEventName, m_szEventNameTr);
+    RemoveTextPattern(replacedEventName, m_szEventNameRm);
+    FORMAT_PARAMS params;
+    params.mask = FORMAT_PARAM_START_TIME | FORMAT_PARAM_EVENT_NAME | FORMAT_PARAM_EVENT_ID |
+                  FORMAT_PARAM_DURATION | FORMAT_PARAM_SERVICE_ID;
+    params.startTime = res.startTime;
+    params.pszEventName = replacedEventName;
+    params.eventID = res.eventID;
+    params.duration = res.duration;
+    params.networkID = res.networkID;
+    params.serviceID = res.serviceID;
+    // 取得にコストのかかるものはフォーマットが参照するときだけ取得する
+    DWORD paramMask = GetFormatParamMask(res.recOption.saveName);
+    TCHAR serviceName[64];
+    if ((paramMask & FORMAT_PARAM_SERVICE_NAME) &&
+        GetChannelName(serviceName, ARRAY_SIZE(serviceName), res.networkID, res.serviceID))
+    {
+        params.pszServiceName = serviceName;
+        params.mask |= FORMAT_PARAM_SERVICE_NAME;
+    }
+    if (paramMask & FORMAT_PARAM_GENRE) {
+        TVTest::EpgEventQueryInfo queryInfo;
+        queryInfo.NetworkID         = res.networkID;
+        queryInfo.TransportStreamID = res.transportStreamID;
+        queryInfo.ServiceID         = res.serviceID;
+        queryInfo.EventID           = res.eventID;
+        queryInfo.Type              = TVTest::EPG_EVENT_QUERY_EVENTID;
+        queryInfo.Flags             = 0;
+        TVTest::EpgEventInfo *pEpgEventInfo = m_pApp->GetEpgEventInfo(&queryInfo);
+        if (pEpgEventInfo) {
+            params.genre = pEpgEventInfo->ContentListLength > 0 ?
+                           pEpgEventInfo->ContentList[0].ContentNibbleLevel1 : -1;
+            params.mask |= FORMAT_PARAM_GENRE;
+            m_pApp->FreeEpgEventInfo(pEpgEventInfo);
+        }
+    }
+    FormatFileName(name, max, params, res.recOption.saveName);
+}
+
+
+// 録画を開始する
+// タイムシフトが有効なら、startTickの時点から録画開始までの部分を"{録画ファイルの拡張子を除いた名前}.head{拡張子}"に書き出す
+// (TVTest本体が書いている録画ファイルの先頭には挿入できないので別のファイルになる)
+bool CTTRec::StartRecord(LPCTSTR saveDir, LPCTSTR saveName, DWORD startTick)
+{
+    m_szHeadFilePath[0] = 0;
+
+    TCHAR fullPath[MAX_PATH];
+    ::PathCombine(fullPath, saveDir, saveName);
+
+    TVTest::RecordInfo recordInfo;
+    recordInfo.Mask = TVTest::RECORD_MASK_FILENAME;
+    recordInfo.Flags = 0;
+    recordInfo.StartTimeSpec = TVTest::RECORD_START_NOTSPECIFIED;
+    recordInfo.StopTimeSpec = TVTest::RECORD_STOP_NOTSPECIFIED;
+    recordInfo.pszFileName = fullPath;
+
+    LONGLONG headEnd = m_timeShiftBuf.GetPosition();
+    if (!m_pApp->StartRecord(&recordInfo)) {
+        // TVTest本体のパス重複対策にはパス確定からファイルオープンまでに微妙なラグがあり、そこを突くと録画失敗することがあるため
+        ::Sleep(200);
+        m_pApp->AddLog(L"録画を再試行します。");
+        headEnd = m_timeShiftBuf.GetPosition();
+        if (!m_pApp->StartRecord(&recordInfo)) return false;
+    }
+
+    if (m_timeShiftBuf.IsAllocated()) {
+        // 実際のファイル名は重複対策などで変わっているかもしれない
+        TCHAR recPath[MAX_PATH];
+        TVTest::RecordStatusInfo rsi;
+        rsi.pszFileName = recPath;
+        rsi.MaxFileName = ARRAY_SIZE(recPath);
+        if (m_pApp->GetRecordStatus(&rsi) && recPath[0]) {
+            LPCTSTR pExt = ::PathFindExtension(recPath);
+            int len = static_cast<int>(pExt - recPath);
+            ::lstrcpyn(m_szHeadFilePath, recPath, len + 1);
+            ::wsprintf(m_szHeadFilePath + len, TEXT(".head%s"), pExt);
+            if (!m_timeShiftBuf.BeginDump(m_szHeadFilePath, startTick, headEnd)) {
+                m_szHeadFilePath[0] = 0;
+            }
+        }
+    }
+    return true;
+}
+
+
+// 保存先のパスを作る。同名のファイルがあれば番号をつける
+// fExpandVarsのときは、TVTestが録画開始時に置換する変数(%event-name%など)を先に展開してから調べる
+bool CTTRec::GetUniqueRecordPath(LPTSTR path, LPCTSTR saveDir, LPCTSTR saveName, bool fExpandVars)
+{
+    TCHAR expandedName[MAX_PATH];
+    if (fExpandVars && ::StrChr(saveName, TEXT('%'))) {
+        TVTest::VarStringFormatInfo info;
+        info.Size = sizeof(info);
+        info.Flags = TVTest::VAR_STRING_FORMAT_FLAG_FILENAME;
+        info.pszFormat = saveName;
+        info.pContext = NULL;
+        info.pMapFunc = NULL;
+        info.pClientData = NULL;
+        info.pszResult = NULL;
+        // 展開できなければ(古いTVTestなど)そのまま調べる
+        if (m_pApp->FormatVarString(&info) && info.pszResult) {
+            ::lstrcpyn(expandedName, info.pszResult, ARRAY_SIZE(expandedName));
+            m_pApp->MemoryFree(info.pszResult);
+            saveName = expandedName;
+        }
+    }
+    if (!::PathCombine(path, saveDir, saveName)) return false;
+    for (int n = 1; n <= 9 && ::PathFileExists(path) && ::lstrlen(path) + 2 < MAX_PATH; ++n) {
+        if (!::PathCombine(path, saveDir, saveName)) return false;
+        LPTSTR pExt = ::PathFindExtension(path);
+        TCHAR ext[MAX_PATH];
+        ::lstrcpy(ext, pExt);
+        ::wsprintf(pExt, TEXT("-%d%s"), n, ext);
+    }
+    return true;
+}
+
+
+// 軽量録画を開始する
+// TVTestの録画機能は使わず、映像と主音声だけをストリームコールバックで書き出す
+// タイムシフトが有効なら、startTickの時点から録画開始までの部分を録画ファイルの先頭に書く
+bool CTTRec::StartLeanRecord(LPCTSTR saveDir, LPCTSTR saveName, DWORD startTick)
+{
+    StopLeanRecord();
+    TCHAR path[MAX_PATH];
+    CServiceRecorder *pRec = new CServiceRecorder;
+    if (!GetUniqueRecordPath(path, saveDir, saveName) ||
+        !pRec->Open(path, m_nearest.serviceID, true, m_fPreallocate ? EstimateRecordMBytes(m_nearest) : 0,
+                    EstimateRecordKBytesPerSec(m_nearest))) {
+        delete pRec;
+        ShowBalloonTip(TEXT("軽量録画の開始に失敗しました。"), 1);
+        return false;
+    }
+    if (!AttachServiceRecorder(&m_pLeanRec, pRec, startTick)) {
+        ShowBalloonTip(TEXT("タイムシフト部分の書き出しに失敗しました。"), 1);
+    }
+    return true;
+}
+
+
+// プラグイン自身で書き出す録画をストリームコールバックに渡す(*ppRecはm_serviceRecLockで保護されるもの)
+// タイムシフトが有効なら、startTickの時点から渡すまでの部分を先に書き込んで途切れずにつなげる
+// 先頭の部分を書き込めなかったときもfalseを返して録画は続ける
+bool CTTRec::AttachServiceRecorder(CServiceRecorder **ppRec, CServiceRecorder *pRec, DWORD startTick)
+{
+    bool fRet = true;
+    LONGLONG pos = m_timeShiftBuf.GetTickPosition(startTick);
+    // 書き込んでいる間に受け取った部分は、残りがバッファ1つ分に収まるまで繰り返し書き込む
+    for (int i = 0; pos >= 0 && i < 8; ++i) {
+        LONGLONG toPos = m_timeShiftBuf.GetPosition();
+        if (toPos - pos <= CServiceRecorder::BUFFER_SIZE / CTsRingBuffer::PACKET_SIZE) break;
+        if (pRec->WriteHead(&m_timeShiftBuf, pos, toPos)) {
+            pos = toPos;
+        }
+        else {
+            fRet = false;
+            pos = -1;
+        }
+    }
+    CBlockLock lock(&m_serviceRecLock);
+    if (pos >= 0) {
+        // ロック中はストリームコールバックがタイムシフトに書き込まないので、現在位置までを渡せば以降のパケットとつながる
+        LONGLONG toPos = m_timeShiftBuf.GetPosition();
+        while (pos < toPos) {
+            const BYTE *pData;
+            DWORD n = m_timeShiftBuf.Peek(pos, toPos, &pData);
+            if (n == 0) {
+                fRet = false;
+                break;
+            }
+            for (DWORD i = 0; i < n; ++i) {
+                pRec->Write(pData + i * CTsRingBuffer::PACKET_SIZE);
+            }
+            pos += n;
+        }
+    }
+    *ppRec = pRec;
+    return fRet;
+}
+
+
+void CTTRec::StopLeanRecord()
+{
+    CServiceRecorder *pRec = m_pLeanRec;
+    if (!pRec) return;
+    {
+        CBlockLock lock(&m_serviceRecLock);
+        m_pLeanRec = NULL;
+    }
+    pRec->Close();
+    if (pRec->IsWriteFailed() || pRec->GetDroppedPackets() > 0) {
+        ShowBalloonTip(TEXT("軽量録画の書き込みに失敗しました。"), 1);
+    }
+    delete pRec;
+}
+
+
+// 録画停止中かどうか調べる
+bool CTTRec::IsNotRecording()
+{
+    TVTest::RecordStatusInfo recInfo;
+    return !m_pLeanRec && m_pApp->GetRecordStatus(&recInfo) &&
+           recInfo.Status == TVTest::RECORD_STATUS_NOTRECORDING;
+}
+
+
+// 録画の制御をリセットする
+// CheckRecording()使用の開始前と終了後に呼ぶ
+void CTTRec::ResetRecording()
+{
+    m_nearest.networkID = m_nearest.transportStreamID =
+        m_nearest.serviceID = m_nearest.eventID = 0;
+
+    m_recordingState = REC_IDLE;
+    m_onStopped = ON_STOPPED_NONE;
+    m_fChChanged = m_fSpunUp = false;
+    m_fStopRecording = false;
+    m_fOnStoppedPostponed = false;
+    m_fOnStoppedDlgShowing = false;
+}
+
+
+// 録画を制御する
+void CTTRec::CheckRecording()
+{
+    CStatScope scope(&m_stats, CStats::STAGE_CHECK_RECORDING);
+    UpdateTuneMeasure();
+    bool fUpdated = false;
+    bool fOnStopped = false;
+    WORD prevNetworkID = m_nearest.networkID;
+    WORD prevTransportStreamID = m_nearest.transportStreamID;
+    WORD prevServiceID = m_nearest.serviceID;
+    WORD prevEventID = m_nearest.eventID;
+
+    // 直近の予約とその開始までのオフセットを取得する
+    LONGLONG startOffset;
+    for (;;) {
+        FILETIME &now = m_totAdjustedNow;
+        // 追従処理等により予約は入れ替わることがある
+        if (!m_reserveList.GetNearest(&m_nearest, m_defaultRecOption, REC_READY_OFFSET)) {
+            // 予約がない
+            m_nearest.networkID = m_nearest.transportStreamID =
+                m_nearest.serviceID = m_nearest.eventID = 0;
+            startOffset = LLONG_MAX;
+            break;
+        }
+        else if (now - m_nearest.startTime < (m_nearest.duration + m_nearest.recOption.endMargin) * FILETIME_SECOND) {
+            // 予約開始前か予約時間内
+            startOffset = m_nearest.startTime - now - m_nearest.recOption.startMargin * FILETIME_SECOND;
+            break;
+        }
+        else {
+            // 予約時間を過ぎた
+            m_reserveList.DeleteNearest(m_defaultRecOption);
+            fUpdated = true;
+        }
+    }
+    // 予約時間を過ぎた無効な予約を削除する
+    if (m_reserveList.DeleteExpiredDisabled(m_totAdjustedNow)) {
+        fUpdated = true;
+    }
+    if (m_wakeTrace.IsActive()) {
+        // 予約開始までの余裕を記録する
+        m_wakeTrace.Mark(CWakeTrace::STAGE_FIRST_CHECK, startOffset == LLONG_MAX ? CWakeTrace::HEADROOM_NONE :
+                                                        static_cast<int>(startOffset / FILETIME_SECOND));
+        m_wakeTrace.FinishIfExpired();
+    }
+
+    // 予約サービスが変化したか
+    bool fServiceChanged = prevNetworkID != m_nearest.networkID ||
+                           prevTransportStreamID != m_nearest.transportStreamID ||
+                           prevServiceID != m_nearest.serviceID;
+    // 予約イベントが変化したか
+    bool fEventChanged = fServiceChanged || prevEventID != m_nearest.eventID;
+    // ┌───┐
+    // │      ↓
+    // │  ┌─REC_IDLE
+    // │  │  ↓
     // │  │  REC_STANDBY──┐
     // │  │  ↓             │
     // │  └→REC_READY───┤
@@ -1886,6 +2880,16 @@ void CTTRec::CheckRecording()
     // │      REC_ENDED REC_CANCELED
     // └───┴──────-┘
     // startOffset==LLONG_MAXのとき予約がない(m_nearestは無効)ので注意
+    if (fEventChanged && (m_recordingState == REC_STANDBY || m_recordingState == REC_READY)) {
+        m_fSpaceChecked = false;
+        m_szRedirectDir[0] = 0;
+    }
+    // 保存先の空き容量(録画開始の遅くとも1回前の確認で行う)
+    if (m_fCheckFreeSpace && !m_fSpaceChecked &&
+        (m_recordingState == REC_STANDBY || m_recordingState == REC_READY) && !m_nearest.recOption.IsViewOnly()) {
+        CheckFreeSpace();
+        m_fSpaceChecked = true;
+    }
     int lastRecordingState = m_recordingState;
     switch (m_recordingState) {
         case REC_IDLE:
@@ -1927,7 +2931,7 @@ void CTTRec::CheckRecording()
                 ShowBalloonTip(text, 2);
             }
             // チャンネル変更
-            if (startOffset < m_chChangeBefore * FILETIME_SECOND) {
+            if (startOffset < GetChChangeBefore() * FILETIME_SECOND) {
                 if (!m_fChChanged && IsNotRecording()) {
                     SetChannel(m_nearest.networkID, m_nearest.serviceID);
                     m_fChChanged = true;
@@ -1937,7 +2941,15 @@ void CTTRec::CheckRecording()
             // スピンアップ
             if (startOffset < m_spinUpBefore * FILETIME_SECOND) {
                 if (!m_fSpunUp && m_spinUpBefore != 0 && !m_nearest.recOption.IsViewOnly()) {
-                    WriteFileForSpinUp(m_nearest.recOption.saveDir);
+                    if (CStoragePool::IsPoolDirectory(GetNearestSaveDir())) {
+                        // 保存先の集合のすべてをスピンアップし、書き込み中でないものは書き込み速度を計測する
+                        UpdateStorageActivity();
+                        m_storagePool.Probe();
+                        m_storagePool.Save();
+                    }
+                    else {
+                        WriteFileForSpinUp(GetNearestSaveDir());
+                    }
                     m_fSpunUp = true;
                 }
             }
@@ -1962,6 +2974,8 @@ void CTTRec::CheckRecording()
                         m_pApp->SetPreview(true);
                     }
                 }
+                // 予約開始時刻(過ぎていればタイムシフトで遡る)
+                DWORD startTick = ::GetTickCount() + static_cast<int>(startOffset / FILETIME_MILLISECOND);
                 if (m_nearest.recOption.IsViewOnly()) {
                     SetChannel(m_nearest.networkID, m_nearest.serviceID);
                     m_recordingState = REC_ACTIVE_VIEW_ONLY;
@@ -1969,15 +2983,19 @@ void CTTRec::CheckRecording()
                 else {
                     SetChannel(m_nearest.networkID, m_nearest.serviceID);
                     m_recordingState = REC_ACTIVE;
-                    // フォーマット指示子を"部分的に"置換
+                    m_failover.fActive = true;
+                    m_failover.fStatusValid = false;
+                    m_failover.fDegraded = false;
+                    if (!m_szRedirectDir[0] && CStoragePool::IsPoolDirectory(m_nearest.recOption.saveDir)) {
+                        SelectStorage(m_nearest, m_szRedirectDir);
+                    }
                     TCHAR replacedName[MAX_PATH];
-                    TCHAR replacedEventName[EVENT_NAME_MAX];
-                    ::lstrcpy(replacedEventName, m_nearest.eventName);
-                    TranslateText(replacedEventName, m_szEventNameTr);
-                    RemoveTextPattern(replacedEventName, m_szEventNameRm);
-                    FormatFileName(replacedName, ARRAY_SIZE(replacedName), m_nearest.eventID,
-                                   m_nearest.startTime, replacedEventName, m_nearest.recOption.saveName);
-                    StartRecord(m_nearest.recOption.saveDir, replacedName);
+                    FormatReserveFileName(replacedName, ARRAY_SIZE(replacedName), m_nearest);
+                    if (m_nearest.recOption.recMode == REC_MODE_LEAN ?
+                            StartLeanRecord(GetNearestSaveDir(), replacedName, startTick) :
+                            StartRecord(GetNearestSaveDir(), replacedName, startTick)) {
+                        BeginHistorySample();
+                    }
                 }
                 OnStartRecording();
                 RedrawProgramGuide();
@@ -2013,6 +3031,7 @@ void CTTRec::CheckRecording()
                 m_onStopped = m_nearest.recOption.onStopped;
             }
             if (m_recordingState == REC_ENDED) {
+                StopLeanRecord();
                 ShowBalloonTip(TEXT("録画が終了しました。"), 2);
             }
             break;
@@ -2045,7 +3064,8 @@ void CTTRec::CheckRecording()
                 // 予約開始まで時間に余裕があり、かつ録画停止中
                 fOnStopped = true;
             }
-            m_fChChanged = m_fSpunUp = false;
+            m_fChChanged = m_fSpunUp = m_fSpaceChecked = false;
+            m_szRedirectDir[0] = 0;
             m_fStopRecording = false;
             break;
         default:
@@ -2053,6 +3073,16 @@ void CTTRec::CheckRecording()
             break;
     }
 
+    if (m_recordingState == REC_ACTIVE && lastRecordingState == REC_ACTIVE && !m_fStopRecording) {
+        // 補欠のドライバで録画をやりなおしたときは、書き込みの監視も次の確認から始めなおす
+        if (!CheckFailover() && m_recordingState == REC_ACTIVE) {
+            CheckWriteThroughput();
+        }
+    }
+    if (CheckServiceRecording()) {
+        fUpdated = true;
+    }
+
     if (m_recordingState != lastRecordingState) {
 #if TVTEST_PLUGIN_VERSION >= TVTEST_PLUGIN_VERSION_(0,0,14)
         // ステータス項目を再描画
@@ -2108,114 +3138,192 @@ void CTTRec::CheckRecording()
 }
 
 
-// 録画開始/終了時プロセスを起動
-bool CTTRec::ExecuteCommandLine(LPTSTR commandLine, LPCTSTR currentDirectory, const RECORDING_INFO &info, LPCTSTR envExec)
+// 録画情報をメタデータファイルに書き出す
+// 順番待ちのコマンドが読む前に上書きしないよう、開始時と終了時で別のファイルにする
+// 録画ファイルがあれば"{録画ファイル}.{start|end}.meta.txt"、なければ一時フォルダに一意な名前で作る
+bool CTTRec::WriteMetaFile(const RECORDING_INFO &info, bool fEnd, LPTSTR metaPath)
 {
     if (!info.fEnabled) return false;
 
-    // 現在の環境変数ブロックを取得
-    LPTCH envStr = ::GetEnvironmentStrings();
-    if (!envStr) return false;
-
-    // 子プロセスに継承するために環境変数ブロックをコピー
-    LPTSTR tail = envStr;
-    do { tail += ::lstrlen(tail) + 1; } while (*tail);
-    LPTSTR envNew = new TCHAR[tail - envStr + 64 * 17 + ARRAY_SIZE(info.filePath) + ARRAY_SIZE(info.serviceName) + (info.pEpgEventInfo ?
-        (info.pEpgEventInfo->pszEventName ? ::lstrlen(info.pEpgEventInfo->pszEventName) : 0) +
-        (info.pEpgEventInfo->pszEventText ? ::lstrlen(info.pEpgEventInfo->pszEventText) : 0) +
-        (info.pEpgEventInfo->pszEventExtendedText ? ::lstrlen(info.pEpgEventInfo->pszEventExtendedText) : 0) : 0)];
-    ::memcpy(envNew, envStr, (tail - envStr + 1) * sizeof(TCHAR));
-    ::FreeEnvironmentStrings(envStr);
-
-    // "TTRec"で始まる環境変数をエスケープ
-    tail = envNew;
-    do {
-        if (::StrCmpNI(tail, TEXT("TTRec"), 5) == 0) *tail = TEXT('_');
-        tail += ::lstrlen(tail) + 1;
-    } while (*tail);
-
-    // 環境変数を追加
-    tail += ::wsprintf(tail, TEXT("TTRecExec=%s"), envExec) + 1;
+    LPCTSTR execType = fEnd ? TEXT("EndRec") : TEXT("StartRec");
+    if (info.filePath[0]) {
+        if (::lstrlen(info.filePath) + 16 > MAX_PATH) return false;
+        ::wsprintf(metaPath, TEXT("%s.%s.meta.txt"), info.filePath, fEnd ? TEXT("end") : TEXT("start"));
+    }
+    else {
+        TCHAR pluginPath[MAX_PATH];
+        if (!::GetTempPath(MAX_PATH, metaPath) ||
+            !GetLongModuleFileName(g_hinstDLL, pluginPath, ARRAY_SIZE(pluginPath))) return false;
+        LPTSTR pluginName = ::PathFindFileName(pluginPath);
+        ::PathRemoveExtension(pluginName);
+        if (::lstrlen(metaPath) + ::lstrlen(pluginName) + 48 > MAX_PATH) return false;
+        LPTSTR metaName = metaPath + ::lstrlen(metaPath);
+
+        // 1日以上前に作ったものは読まれ終えたとみなして消す
+        ::wsprintf(metaName, TEXT("%s_ViewOnly_*.meta.txt"), pluginName);
+        WIN32_FIND_DATA fd;
+        HANDLE hFind = ::FindFirstFile(metaPath, &fd);
+        if (hFind != INVALID_HANDLE_VALUE) {
+            FILETIME now;
+            ::GetSystemTimeAsFileTime(&now);
+            do {
+                if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+                    now - fd.ftLastWriteTime > 24 * FILETIME_HOUR &&
+                    (metaName - metaPath) + ::lstrlen(fd.cFileName) < MAX_PATH)
+                {
+                    ::lstrcpy(metaName, fd.cFileName);
+                    ::DeleteFile(metaPath);
+                }
+            } while (::FindNextFile(hFind, &fd));
+            ::FindClose(hFind);
+        }
+        ::wsprintf(metaName, TEXT("%s_ViewOnly_%04X%04X_%08X.%s.meta.txt"), pluginName,
+                   info.reserve.serviceID, info.reserve.eventID, ::GetTickCount(), fEnd ? TEXT("end") : TEXT("start"));
+    }
+
+    // EPGのテキストは改行などをエスケープするので2倍確保
+    LPTSTR buf = new TCHAR[64 * 27 + ARRAY_SIZE(info.filePath) + ARRAY_SIZE(info.serviceName) +
+        ARRAY_SIZE(info.splitFilePath) + ARRAY_SIZE(info.splitDriverName) + ARRAY_SIZE(info.headFilePath) + (info.pEpgEventInfo ?
+        (info.pEpgEventInfo->pszEventName ? ::lstrlen(info.pEpgEventInfo->pszEventName) * 2 : 0) +
+        (info.pEpgEventInfo->pszEventText ? ::lstrlen(info.pEpgEventInfo->pszEventText) * 2 : 0) +
+        (info.pEpgEventInfo->pszEventExtendedText ? ::lstrlen(info.pEpgEventInfo->pszEventExtendedText) * 2 : 0) +
+        info.pEpgEventInfo->ContentListLength * 5 : 0)];
+    LPTSTR tail = buf;
+    *tail++ = L'\xFEFF';
+    tail += ::wsprintf(tail, TEXT("[TTRec]\r\nExec=%s\r\n"), execType);
+
     TCHAR str[64];
     FILETIME time = info.reserve.startTime;
     time += -info.reserve.recOption.startMargin * FILETIME_SECOND;
     FileTimeToStr(&time, str);
-    tail += ::wsprintf(tail, TEXT("TTRecStartTime=%s"), str) + 1;
+    tail += ::wsprintf(tail, TEXT("StartTime=%s\r\n"), str);
     TimeSpanToStr(info.reserve.duration +
                   info.reserve.recOption.startMargin +
                   info.reserve.recOption.endMargin, str);
-    tail += ::wsprintf(tail, TEXT("TTRecDuration=%s"), str) + 1;
+    tail += ::wsprintf(tail, TEXT("Duration=%s\r\n"), str);
+    tail += ::wsprintf(tail, TEXT("StartMargin=%d\r\nEndMargin=%d\r\n"),
+                       info.reserve.recOption.startMargin, info.reserve.recOption.endMargin);
 
-    tail += ::wsprintf(tail, TEXT("TTRecONID=%d"), info.reserve.networkID) + 1;
-    tail += ::wsprintf(tail, TEXT("TTRecTSID=%d"), info.reserve.transportStreamID) + 1;
-    tail += ::wsprintf(tail, TEXT("TTRecSID=%d"), info.reserve.serviceID) + 1;
-    tail += ::wsprintf(tail, TEXT("TTRecEID=%d"), info.reserve.eventID) + 1;
+    tail += ::wsprintf(tail, TEXT("ONID=%d\r\n"), info.reserve.networkID);
+    tail += ::wsprintf(tail, TEXT("TSID=%d\r\n"), info.reserve.transportStreamID);
+    tail += ::wsprintf(tail, TEXT("SID=%d\r\n"), info.reserve.serviceID);
+    tail += ::wsprintf(tail, TEXT("EID=%d\r\n"), info.reserve.eventID);
 
     bool fErr = !info.startStatusInfo.Size || !info.endStatusInfo.Size;
-    tail += ::wsprintf(tail, TEXT("TTRecErrors=%d"), fErr ? -1 : max((int)info.endStatusInfo.ErrorPacketCount - (int)info.startStatusInfo.ErrorPacketCount, -1)) + 1;
-    tail += ::wsprintf(tail, TEXT("TTRecScrambles=%d"), fErr ? -1 : max((int)info.endStatusInfo.ScramblePacketCount - (int)info.startStatusInfo.ScramblePacketCount, -1)) + 1;
-    tail += ::wsprintf(tail, TEXT("TTRecDrops=%d"), fErr ? -1 : max((int)info.endStatusInfo.DropPacketCount - (int)info.startStatusInfo.DropPacketCount, -1)) + 1;
+    int errors = fErr ? -1 : max((int)info.endStatusInfo.ErrorPacketCount - (int)info.startStatusInfo.ErrorPacketCount, -1);
+    int scrambles = fErr ? -1 : max((int)info.endStatusInfo.ScramblePacketCount - (int)info.startStatusInfo.ScramblePacketCount, -1);
+    int drops = fErr ? -1 : max((int)info.endStatusInfo.DropPacketCount - (int)info.startStatusInfo.DropPacketCount, -1);
+    if (info.fSplit) {
+        // 切り替え前後の合計
+        errors = errors < 0 || info.splitErrors < 0 ? -1 : errors + info.splitErrors;
+        scrambles = scrambles < 0 || info.splitScrambles < 0 ? -1 : scrambles + info.splitScrambles;
+        drops = drops < 0 || info.splitDrops < 0 ? -1 : drops + info.splitDrops;
+    }
+    tail += ::wsprintf(tail, TEXT("Errors=%d\r\n"), errors);
+    tail += ::wsprintf(tail, TEXT("Scrambles=%d\r\n"), scrambles);
+    tail += ::wsprintf(tail, TEXT("Drops=%d\r\n"), drops);
+    tail += ::wsprintf(tail, TEXT("MinWriteRate=%d\r\nWriteStalls=%d\r\n"), info.minWriteRate, info.writeStalls);
 
     if (info.filePath[0]) {
-        tail += ::wsprintf(tail, TEXT("TTRecFilePath=%s"), info.filePath) + 1;
+        tail += ::wsprintf(tail, TEXT("FilePath=%s\r\n"), info.filePath);
+    }
+    if (info.headFilePath[0]) {
+        tail += ::wsprintf(tail, TEXT("HeadFilePath=%s\r\n"), info.headFilePath);
     }
     if (info.serviceName[0]) {
-        tail += ::wsprintf(tail, TEXT("TTRecServiceName=%s"), info.serviceName) + 1;
+        tail += ::wsprintf(tail, TEXT("ServiceName=%s\r\n"), info.serviceName);
+    }
+    if (info.fSplit) {
+        time = info.splitTime;
+        FileTimeToStr(&time, str);
+        tail += ::wsprintf(tail, TEXT("SplitTime=%s\r\n"), str);
+        if (info.splitFilePath[0]) {
+            tail += ::wsprintf(tail, TEXT("SplitFilePath=%s\r\n"), info.splitFilePath);
+        }
+        tail += ::wsprintf(tail, TEXT("SplitDriver=%s\r\n"), info.splitDriverName);
     }
 
     if (info.pEpgEventInfo) {
-        ::SystemTimeToFileTime(&info.pEpgEventInfo->StartTime, &time);
-        FileTimeToStr(&time, str);
-        tail += ::wsprintf(tail, TEXT("TTRecEventStartTime=%s"), str) + 1;
+        JST_TIME evStart;
+        if (SystemTimeToJst(info.pEpgEventInfo->StartTime, &evStart)) {
+            time = JstToFileTime(evStart);
+            FileTimeToStr(&time, str);
+            tail += ::wsprintf(tail, TEXT("EventStartTime=%s\r\n"), str);
+        }
         TimeSpanToStr(info.pEpgEventInfo->Duration, str);
-        tail += ::wsprintf(tail, TEXT("TTRecEventDuration=%s"), str) + 1;
-
+        tail += ::wsprintf(tail, TEXT("EventDuration=%s\r\n"), str);
+
+        if (info.pEpgEventInfo->ContentListLength > 0 && info.pEpgEventInfo->ContentList) {
+            // 上位8bit=大分類,下位8bit=中分類
+            tail += ::wsprintf(tail, TEXT("Genre="));
+            for (int i = 0; i < info.pEpgEventInfo->ContentListLength; ++i) {
+                const TVTest::EpgEventContentInfo &content = info.pEpgEventInfo->ContentList[i];
+                tail += ::wsprintf(tail, TEXT("%s%02X%02X"), i ? TEXT(",") : TEXT(""),
+                                   content.ContentNibbleLevel1, content.ContentNibbleLevel2);
+            }
+            tail += ::wsprintf(tail, TEXT("\r\n"));
+        }
         if (info.pEpgEventInfo->pszEventName) {
-            tail += ::wsprintf(tail, TEXT("TTRecEventName="));
-            tail += ::lstrlen(::lstrcpy(tail, info.pEpgEventInfo->pszEventName)) + 1;
+            tail = EscapeTextField(tail + ::wsprintf(tail, TEXT("EventName=")), info.pEpgEventInfo->pszEventName);
+            tail += ::wsprintf(tail, TEXT("\r\n"));
         }
         if (info.pEpgEventInfo->pszEventText) {
-            tail += ::wsprintf(tail, TEXT("TTRecEventText="));
-            tail += ::lstrlen(::lstrcpy(tail, info.pEpgEventInfo->pszEventText)) + 1;
+            tail = EscapeTextField(tail + ::wsprintf(tail, TEXT("EventText=")), info.pEpgEventInfo->pszEventText);
+            tail += ::wsprintf(tail, TEXT("\r\n"));
         }
         if (info.pEpgEventInfo->pszEventExtendedText) {
-            tail += ::wsprintf(tail, TEXT("TTRecEventExText="));
-            tail += ::lstrlen(::lstrcpy(tail, info.pEpgEventInfo->pszEventExtendedText)) + 1;
+            tail = EscapeTextField(tail + ::wsprintf(tail, TEXT("EventExText=")), info.pEpgEventInfo->pszEventExtendedText);
+            tail += ::wsprintf(tail, TEXT("\r\n"));
         }
     }
-    *tail = 0;
 
-    // ファイルパスをコマンドライン引数に追加
+    HANDLE hFile = ::CreateFile(metaPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    bool fRet = false;
+    if (hFile != INVALID_HANDLE_VALUE) {
+        DWORD writtenBytes;
+        DWORD bytes = static_cast<DWORD>(tail - buf) * sizeof(TCHAR);
+        fRet = ::WriteFile(hFile, buf, bytes, &writtenBytes, NULL) && writtenBytes == bytes;
+        ::CloseHandle(hFile);
+    }
+    delete [] buf;
+    return fRet;
+}
+
+
+// 録画開始/終了時プロセスを実行待ち行列に加える
+bool CTTRec::ExecuteCommandLine(LPCTSTR commandLine, LPCTSTR currentDirectory, LPCTSTR metaPath)
+{
+    if (::StrChr(metaPath, TEXT('"'))) return false;
+
+    // メタデータファイルのパスをコマンドライン引数に追加
     TCHAR commandLinePath[MAX_PATH * 2 + 3];
     ::lstrcpyn(commandLinePath, commandLine, MAX_PATH);
-    if (info.filePath[0] && !::StrChr(info.filePath, TEXT('"'))) {
-        ::lstrcat(commandLinePath, TEXT(" \""));
-        ::lstrcat(commandLinePath, info.filePath);
-        ::lstrcat(commandLinePath, TEXT("\""));
-    }
-
-    STARTUPINFO si = { sizeof(si) };
-    PROCESS_INFORMATION ps;
-    if (::CreateProcess(NULL, commandLinePath, NULL, NULL, FALSE, CREATE_UNICODE_ENVIRONMENT, envNew, currentDirectory, &si, &ps)) {
-        ::CloseHandle(ps.hThread);
-        ::CloseHandle(ps.hProcess);
-        delete [] envNew;
-        return true;
-    }
-    delete [] envNew;
-    return false;
+    ::lstrcat(commandLinePath, TEXT(" \""));
+    ::lstrcat(commandLinePath, metaPath);
+    ::lstrcat(commandLinePath, TEXT("\""));
+
+    // 実行中のジョブが終わるまで待たされることがある
+    bool fRet = m_jobQueue.Push(commandLinePath, currentDirectory, m_execRetry);
+    DispatchJobs();
+    return fRet;
 }
 
 
 void CTTRec::OnStartRecording()
 {
+    m_wakeTrace.Mark(CWakeTrace::STAGE_START_RECORD);
+    m_wakeTrace.Finish();
+
     if (m_szExecOnStartRec[0] && m_szExecOnStartRec[0] != TEXT(';') ||
-        m_szExecOnEndRec[0] && m_szExecOnEndRec[0] != TEXT(';'))
+        m_szExecOnEndRec[0] && m_szExecOnEndRec[0] != TEXT(';') || m_fAnalyzeTsOnEndRec || m_fSaveMetaFile)
     {
         TVTest::RecordStatusInfo rsi;
         rsi.pszFileName = m_recordingInfo.filePath;
         rsi.MaxFileName = ARRAY_SIZE(m_recordingInfo.filePath);
-        if (m_nearest.recOption.IsViewOnly() || !m_pApp->GetRecordStatus(&rsi)) {
+        if (m_pLeanRec) {
+            ::lstrcpyn(m_recordingInfo.filePath, m_pLeanRec->GetFileName(), ARRAY_SIZE(m_recordingInfo.filePath));
+        }
+        else if (m_nearest.recOption.IsViewOnly() || !m_pApp->GetRecordStatus(&rsi)) {
             m_recordingInfo.filePath[0] = 0;
         }
         if (!GetChannelName(m_recordingInfo.serviceName, ARRAY_SIZE(m_recordingInfo.serviceName),
@@ -2240,13 +3348,58 @@ void CTTRec::OnStartRecording()
         m_recordingInfo.startStatusInfo.Size = 0;
         m_recordingInfo.endStatusInfo.Size = 0;
         m_recordingInfo.reserve = m_nearest;
+        m_recordingInfo.fSplit = false;
+        m_recordingInfo.headFilePath[0] = 0;
+        m_recordingInfo.minWriteRate = -1;
+        m_recordingInfo.writeStalls = 0;
         m_recordingInfo.fEnabled = true;
 
-        if (m_szExecOnStartRec[0] && m_szExecOnStartRec[0] != TEXT(';')) {
+        bool fExec = m_szExecOnStartRec[0] && m_szExecOnStartRec[0] != TEXT(';');
+        if (fExec || m_fSaveMetaFile) {
+            TCHAR metaPath[MAX_PATH];
+            if (!WriteMetaFile(m_recordingInfo, false, metaPath)) {
+                ShowBalloonTip(TEXT("メタデータファイルの書き込みに失敗しました。"), 1);
+            }
+            else if (fExec) {
+                TCHAR appDir[MAX_PATH];
+                if (!GetLongModuleFileName(NULL, appDir, ARRAY_SIZE(appDir)) ||
+                    !::PathRemoveFileSpec(appDir) ||
+                    !ExecuteCommandLine(m_szExecOnStartRec, appDir, metaPath))
+                {
+                    ShowBalloonTip(TEXT("コマンドラインの起動に失敗しました。"), 1);
+                }
+            }
+        }
+    }
+}
+
+
+void CTTRec::OnEndRecording()
+{
+    EndHistorySample();
+    EndHeadFile();
+    // 分割したときは最後のファイルを解析する(それより前のものは分割時に解析済み)
+    LPCTSTR lastFilePath = m_recordingInfo.fSplit ? m_recordingInfo.splitFilePath : m_recordingInfo.filePath;
+    if (m_fAnalyzeTsOnEndRec && m_recordingInfo.fEnabled && lastFilePath[0]) {
+        if (!ExecuteAnalyzeTs(lastFilePath)) {
+            ShowBalloonTip(TEXT("録画ファイル解析の起動に失敗しました。"), 1);
+        }
+    }
+    bool fExec = m_szExecOnEndRec[0] && m_szExecOnEndRec[0] != TEXT(';');
+    if (m_recordingInfo.fEnabled && (fExec || m_fSaveMetaFile)) {
+        // 終了時のステータスを取得
+        if (!m_pApp->GetStatus(&m_recordingInfo.endStatusInfo)) {
+            m_recordingInfo.endStatusInfo.Size = 0;
+        }
+        TCHAR metaPath[MAX_PATH];
+        if (!WriteMetaFile(m_recordingInfo, true, metaPath)) {
+            ShowBalloonTip(TEXT("メタデータファイルの書き込みに失敗しました。"), 1);
+        }
+        else if (fExec) {
             TCHAR appDir[MAX_PATH];
             if (!GetLongModuleFileName(NULL, appDir, ARRAY_SIZE(appDir)) ||
                 !::PathRemoveFileSpec(appDir) ||
-                !ExecuteCommandLine(m_szExecOnStartRec, appDir, m_recordingInfo, TEXT("StartRec")))
+                !ExecuteCommandLine(m_szExecOnEndRec, appDir, metaPath))
             {
                 ShowBalloonTip(TEXT("コマンドラインの起動に失敗しました。"), 1);
             }
@@ -2255,20 +3408,317 @@ void CTTRec::OnStartRecording()
 }
 
 
-void CTTRec::OnEndRecording()
+// 予約のビットレート(KB/秒)を過去の録画から見積もる
+int CTTRec::EstimateRecordKBytesPerSec(const RESERVE &res) const
 {
-    if (m_szExecOnEndRec[0] && m_szExecOnEndRec[0] != TEXT(';')) {
-        // 終了時のステータスを取得
-        if (!m_pApp->GetStatus(&m_recordingInfo.endStatusInfo)) {
-            m_recordingInfo.endStatusInfo.Size = 0;
+    // 番組によって変わるので記録の最大値を使う
+    int rate = m_recHistory.GetBitrate(res.networkID, res.serviceID, 100);
+    return rate > 0 ? rate : DEFAULT_REC_KBYTES_PER_SEC;
+}
+
+
+// 予約の録画サイズ(MB)を過去の録画から見積もる
+DWORD CTTRec::EstimateRecordMBytes(const RESERVE &res) const
+{
+    int rate = EstimateRecordKBytesPerSec(res);
+    int duration = max(res.GetTrimmedDuration() + res.recOption.startMargin + res.recOption.endMargin, 0);
+    return static_cast<DWORD>((static_cast<LONGLONG>(rate) * duration >> 10) + 1);
+}
+
+
+// 直近の予約の保存先に見積もった録画サイズの空きがあるか調べ、なければ代わりの保存先を使う
+void CTTRec::CheckFreeSpace()
+{
+    m_szRedirectDir[0] = 0;
+    // 保存先の集合から選ぶときは選ぶときに調べる
+    if (CStoragePool::IsPoolDirectory(m_nearest.recOption.saveDir)) return;
+    DWORD needMBytes = EstimateRecordMBytes(m_nearest) + FREE_SPACE_MARGIN_MBYTES;
+    DWORD freeMBytes;
+    // 調べられないとき(ネットワークドライブの切断など)は何もしない
+    if (!GetFreeSpaceMBytes(m_nearest.recOption.saveDir, &freeMBytes) || freeMBytes >= needMBytes) return;
+
+    TCHAR text[128];
+    if (m_szAltSaveDir[0] && GetFreeSpaceMBytes(m_szAltSaveDir, &freeMBytes) && freeMBytes >= needMBytes) {
+        ::lstrcpy(m_szRedirectDir, m_szAltSaveDir);
+        ::wsprintf(text, TEXT("空き容量が足りないため代わりの保存先に録画します(見積もり%uMB)。"), needMBytes);
+        ShowBalloonTip(text, 1);
+        m_pApp->AddLog(text);
+        return;
+    }
+    ::wsprintf(text, TEXT("保存先の空き容量が足りない可能性があります(見積もり%uMB)。"), needMBytes);
+    ShowBalloonTip(text, 1);
+    m_pApp->AddLog(text);
+}
+
+
+// 保存先の集合の各ボリュームに、このプラグインが書き込み中の録画ファイルと実行中のコマンドを数える
+void CTTRec::UpdateStorageActivity()
+{
+    m_storagePool.ClearActivity();
+    if (m_historySample.fActive) m_storagePool.AddActivity(m_historySample.filePath);
+    {
+        CBlockLock lock(&m_serviceRecLock);
+        if (m_pLeanRec) m_storagePool.AddActivity(m_pLeanRec->GetFileName());
+        for (int i = 0; i < SERVICE_REC_MAX; ++i) {
+            if (m_serviceRec[i]) m_storagePool.AddActivity(m_serviceRec[i]->GetFileName());
         }
-        TCHAR appDir[MAX_PATH];
-        if (!GetLongModuleFileName(NULL, appDir, ARRAY_SIZE(appDir)) ||
-            !::PathRemoveFileSpec(appDir) ||
-            !ExecuteCommandLine(m_szExecOnEndRec, appDir, m_recordingInfo, TEXT("EndRec")))
-        {
-            ShowBalloonTip(TEXT("コマンドラインの起動に失敗しました。"), 1);
+    }
+    for (int i = 0; i < m_jobQueue.GetRunningCount(); ++i) {
+        const CJobQueue::JOB &job = m_jobQueue.GetRunningJob(i);
+        if (!m_storagePool.AddActivity(job.commandLine)) m_storagePool.AddActivity(job.currentDirectory);
+    }
+}
+
+
+// 保存先の集合から予約の保存先を選ぶ
+// このプラグインが書き込み中の録画ファイルと実行中のコマンドが多いボリュームは避ける
+// avoidPathを指定したときは、そのボリュームを除いて選べなければfalseを返す
+bool CTTRec::SelectStorage(const RESERVE &res, LPTSTR dir, LPCTSTR avoidPath)
+{
+    UpdateStorageActivity();
+    DWORD needMBytes = EstimateRecordMBytes(res) + FREE_SPACE_MARGIN_MBYTES;
+    bool fEnough;
+    int index = m_storagePool.Select(needMBytes, avoidPath, &fEnough);
+    TCHAR text[MAX_PATH + 64];
+    if (index < 0 && avoidPath) return false;
+    if (index < 0) {
+        // どれも使えなければTVTestの保存先に録画する
+        ::lstrcpy(dir, m_defaultRecOption.saveDir);
+        ::lstrcpy(text, TEXT("保存先の集合のどれも使えないため、TVTestの保存先に録画します。"));
+        ShowBalloonTip(text, 1);
+        m_pApp->AddLog(text);
+        return false;
+    }
+    ::lstrcpy(dir, m_storagePool.GetDirectory(index));
+    if (!fEnough) {
+        ::wsprintf(text, TEXT("保存先の空き容量が足りない可能性があります(見積もり%uMB)。"), needMBytes);
+        ShowBalloonTip(text, 1);
+        m_pApp->AddLog(text);
+    }
+    ::wsprintf(text, TEXT("保存先の集合から%sを選びました。"), dir);
+    m_pApp->AddLog(text);
+    return true;
+}
+
+
+// 録画履歴に残す情報を録画開始時に集める
+void CTTRec::BeginHistorySample()
+{
+    HISTORY_SAMPLE &hs = m_historySample;
+    CRecHistory::ENTRY &e = hs.entry;
+    TVTest::RecordStatusInfo rsi;
+    rsi.pszFileName = hs.filePath;
+    rsi.MaxFileName = ARRAY_SIZE(hs.filePath);
+    e.fLean = m_pLeanRec != NULL;
+    if (e.fLean) {
+        ::lstrcpyn(hs.filePath, m_pLeanRec->GetFileName(), ARRAY_SIZE(hs.filePath));
+    }
+    else if (!m_pApp->GetRecordStatus(&rsi)) {
+        hs.filePath[0] = 0;
+    }
+    ::lstrcpyn(hs.eventName, m_nearest.eventName, ARRAY_SIZE(hs.eventName));
+    e.filePath = hs.filePath;
+    e.eventName = hs.eventName;
+    e.networkID = m_nearest.networkID;
+    e.transportStreamID = m_nearest.transportStreamID;
+    e.serviceID = m_nearest.serviceID;
+    e.eventID = m_nearest.eventID;
+
+    // m_nearestは優先度によって切り詰め済みなので、元の予約と比べる
+    e.plannedStart = m_nearest.startTime;
+    e.plannedStart += -m_nearest.recOption.startMargin * FILETIME_SECOND;
+    e.plannedDuration = m_nearest.duration + m_nearest.recOption.startMargin + m_nearest.recOption.endMargin;
+    e.truncated = 0;
+    const RESERVE *pRes = m_reserveList.Get(e.networkID, e.transportStreamID, e.serviceID, e.eventID);
+    if (pRes) {
+        RECORDING_OPTION recOption = pRes->recOption;
+        recOption.ApplyDefault(m_defaultRecOption);
+        FILETIME start = pRes->GetTrimmedStartTime();
+        start += -recOption.startMargin * FILETIME_SECOND;
+        int duration = pRes->GetTrimmedDuration() + recOption.startMargin + recOption.endMargin;
+        FILETIME end = start;
+        end += duration * FILETIME_SECOND;
+        FILETIME resolvedEnd = e.plannedStart;
+        resolvedEnd += e.plannedDuration * FILETIME_SECOND;
+        e.truncated = max(static_cast<int>((end - resolvedEnd) / FILETIME_SECOND), 0);
+        e.plannedStart = start;
+        e.plannedDuration = duration;
+    }
+    e.actualStart = m_totAdjustedNow;
+    if (!m_pApp->GetStatus(&hs.startStatusInfo)) {
+        hs.startStatusInfo.Size = 0;
+    }
+    e.minWriteRate = -1;
+    e.writeStalls = 0;
+    hs.startTick = ::GetTickCount();
+    hs.fActive = true;
+    m_writeWatch.fValid = false;
+}
+
+
+// 録画を終えたファイルの大きさなどを録画履歴に書き出す
+void CTTRec::EndHistorySample()
+{
+    HISTORY_SAMPLE &hs = m_historySample;
+    if (!hs.fActive) return;
+    hs.fActive = false;
+
+    CRecHistory::ENTRY &e = hs.entry;
+    e.actualEnd = m_totAdjustedNow;
+    e.recordedSec = static_cast<int>((::GetTickCount() - hs.startTick) / 1000);
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    if (hs.filePath[0] && ::GetFileAttributesEx(hs.filePath, GetFileExInfoStandard, &fad)) {
+        e.fileKBytes = fad.nFileSizeHigh >= 1024 ? 0xFFFFFFFF : (fad.nFileSizeHigh << 22) | (fad.nFileSizeLow >> 10);
+    }
+    else {
+        e.fileKBytes = 0;
+    }
+    TVTest::StatusInfo si;
+    const TVTest::StatusInfo &start = hs.startStatusInfo;
+    bool fStatusValid = start.Size && m_pApp->GetStatus(&si);
+    e.errors = fStatusValid ? max((int)si.ErrorPacketCount - (int)start.ErrorPacketCount, -1) : -1;
+    e.scrambles = fStatusValid ? max((int)si.ScramblePacketCount - (int)start.ScramblePacketCount, -1) : -1;
+    e.drops = fStatusValid ? max((int)si.DropPacketCount - (int)start.DropPacketCount, -1) : -1;
+    // 録画のためのチャンネル変更で計測できていれば使う(1度だけ)
+    e.tuneLatency = -1;
+    if (m_tuneMeasure.latency >= 0 && m_tuneMeasure.networkID == e.networkID &&
+        m_tuneMeasure.transportStreamID == e.transportStreamID) {
+        e.tuneLatency = m_tuneMeasure.latency;
+        m_tuneMeasure.latency = -1;
+    }
+    if (!m_recHistory.Append(e)) {
+        ShowBalloonTip(TEXT("録画履歴の書き込みに失敗しました。"), 1);
+    }
+}
+
+
+// TVTest本体の録画について、タイムシフトで録画開始前の部分を書き出し終えるのを待つ
+// 録画ファイルに連結すると録画ファイル全体を書きなおすことになるので、別のファイルのままにしておく
+// (プラグイン自身で書き出す録画はAttachServiceRecorder()で録画ファイルの先頭に書く)
+void CTTRec::EndHeadFile()
+{
+    if (!m_szHeadFilePath[0]) return;
+    if (m_timeShiftBuf.WaitDump()) {
+        // メタデータファイルには最初の録画ファイルのものを書く
+        if (m_recordingInfo.fEnabled && !m_recordingInfo.headFilePath[0]) {
+            ::lstrcpyn(m_recordingInfo.headFilePath, m_szHeadFilePath, ARRAY_SIZE(m_recordingInfo.headFilePath));
+        }
+    }
+    else {
+        ShowBalloonTip(TEXT("タイムシフト部分の書き出しに失敗しました。"), 1);
+    }
+    m_szHeadFilePath[0] = 0;
+}
+
+
+// 録画ファイルを解析するプロセスを実行待ち行列に加える
+bool CTTRec::ExecuteAnalyzeTs(LPCTSTR filePath)
+{
+    if (::StrChr(filePath, TEXT('"'))) return false;
+
+    TCHAR pluginShortPath[MAX_PATH];
+    if (!GetShortModuleFileName(g_hinstDLL, pluginShortPath, ARRAY_SIZE(pluginShortPath))) return false;
+
+    TCHAR rundllPath[MAX_PATH];
+    if (!GetRundll32Path(rundllPath)) return false;
+
+    TCHAR commandLine[MAX_PATH * 3 + 32];
+    ::wsprintf(commandLine, TEXT("\"%s\" %s,AnalyzeTs \"%s\""), rundllPath, pluginShortPath, filePath);
+
+    bool fRet = m_jobQueue.Push(commandLine, NULL, 0);
+    DispatchJobs();
+    return fRet;
+}
+
+
+// 録画中のストリームにある別サービスの予約を同時に録画する
+// 予約を削除したときはtrueを返す
+bool CTTRec::CheckServiceRecording()
+{
+    const FILETIME &now = m_totAdjustedNow;
+    for (int i = 0; i < SERVICE_REC_MAX; ++i) {
+        if (m_serviceRec[i]) {
+            const RESERVE &res = m_serviceRecRes[i];
+            FILETIME resEnd = res.startTime;
+            resEnd += (res.duration + res.recOption.endMargin) * FILETIME_SECOND;
+            // 録画が終わればストリームを受信し続けるとは限らないので、同時録画も終える
+            if (m_recordingState != REC_ACTIVE || now - resEnd >= 0) StopServiceRecording(i);
+        }
+    }
+    if (m_recordingState != REC_ACTIVE) return false;
+
+    bool fUpdated = false;
+    RESERVE res;
+    while (m_reserveList.GetServiceRecordable(&res, m_nearest, now, m_defaultRecOption)) {
+        int index = 0;
+        while (index < SERVICE_REC_MAX && m_serviceRec[index]) ++index;
+        if (index >= SERVICE_REC_MAX) break;
+
+        // 開始に失敗しても予約は取り除く(繰り返し試みない)
+        m_reserveList.Delete(res.networkID, res.transportStreamID, res.serviceID, res.eventID);
+        fUpdated = true;
+
+        TCHAR saveName[MAX_PATH];
+        FormatReserveFileName(saveName, ARRAY_SIZE(saveName), res);
+        TCHAR saveDir[MAX_PATH];
+        ::lstrcpy(saveDir, res.recOption.saveDir);
+        if (CStoragePool::IsPoolDirectory(saveDir)) SelectStorage(res, saveDir);
+        TCHAR path[MAX_PATH];
+        CServiceRecorder *pRec = new CServiceRecorder;
+        if (!GetUniqueRecordPath(path, saveDir, saveName) ||
+            !pRec->Open(path, res.serviceID, res.recOption.recMode == REC_MODE_LEAN,
+                        m_fPreallocate ? EstimateRecordMBytes(res) : 0, EstimateRecordKBytesPerSec(res))) {
+            delete pRec;
+            ShowBalloonTip(TEXT("同時録画の開始に失敗しました。"), 1);
+            continue;
+        }
+        m_serviceRecRes[index] = res;
+        // 開始時刻(過ぎていればタイムシフトで遡る)
+        LONGLONG startOffset = res.startTime - now - res.recOption.startMargin * FILETIME_SECOND;
+        DWORD startTick = ::GetTickCount() + static_cast<int>(max(startOffset, -TIME_SHIFT_MAX * FILETIME_SECOND) / FILETIME_MILLISECOND);
+        if (!AttachServiceRecorder(&m_serviceRec[index], pRec, startTick)) {
+            ShowBalloonTip(TEXT("タイムシフト部分の書き出しに失敗しました。"), 1);
         }
+        ShowBalloonTip(TEXT("同時録画を開始しました。"), 2);
+    }
+    return fUpdated;
+}
+
+
+void CTTRec::StopServiceRecording(int index)
+{
+    CServiceRecorder *pRec = m_serviceRec[index];
+    {
+        CBlockLock lock(&m_serviceRecLock);
+        m_serviceRec[index] = NULL;
+    }
+    pRec->Close();
+    if (pRec->IsWriteFailed() || pRec->GetDroppedPackets() > 0) {
+        ShowBalloonTip(TEXT("同時録画の書き込みに失敗しました。"), 1);
+    }
+    else {
+        ShowBalloonTip(TEXT("同時録画が終了しました。"), 2);
+    }
+    if (m_fAnalyzeTsOnEndRec && !ExecuteAnalyzeTs(pRec->GetFileName())) {
+        ShowBalloonTip(TEXT("録画ファイル解析の起動に失敗しました。"), 1);
+    }
+    delete pRec;
+}
+
+
+// 実行待ち行列を処理する
+void CTTRec::DispatchJobs()
+{
+    int completed;
+    DWORD exitCode;
+    bool fRecording = m_recordingState == REC_READY || m_recordingState == REC_ACTIVE;
+    if (m_jobQueue.Dispatch(m_execMaxJobs, m_fExecLowPriorityWhileRec && fRecording, &completed, &exitCode) > 0) {
+        TCHAR text[128];
+        ::wsprintf(text, TEXT("コマンドラインが失敗しました(終了コード=%d)。"), static_cast<int>(exitCode));
+        ShowBalloonTip(text, 1);
+    }
+    if (completed > 0) {
+        ShowBalloonTip(TEXT("コマンドラインが終了しました。"), 3);
     }
 }
 
@@ -2307,6 +3757,140 @@ HWND CTTRec::GetFullscreenWindow()
 }
 
 
+// 録画後の待機中に取得する番組表のストリームを集める
+// 有効なクエリと予約が参照するストリームだけを、参照の多い順、番組表が先まで埋まっていない順に取得する
+void CTTRec::BeginEpgCapture()
+{
+    m_fEpgCapScheduling = true;
+    m_epgCapStreamNum = 0;
+    m_epgCapCurrent = -1;
+    TVTest::TuningSpaceInfo spaceInfo;
+    for (int space = 0; m_pApp->GetTuningSpaceInfo(space, &spaceInfo); space++) {
+        TVTest::ChannelInfo ci;
+        for (int channel = 0; m_pApp->GetChannelInfo(space, channel, &ci); channel++) {
+            if (m_epgCapStreamNum >= EPGCAP_STREAM_MAX ||
+                FindEpgCapStream(ci.NetworkID, ci.TransportStreamID) >= 0) continue;
+            EPGCAP_STREAM &st = m_epgCapStreams[m_epgCapStreamNum++];
+            st.networkID = ci.NetworkID;
+            st.transportStreamID = ci.TransportStreamID;
+            st.serviceID = ci.ServiceID;
+            st.space = space;
+            st.channel = channel;
+            st.relevance = 0;
+            st.coverage = 0;
+            st.fDone = false;
+            ::lstrcpyn(st.name, ci.szChannelName, ARRAY_SIZE(st.name));
+        }
+    }
+
+    for (int i = 0; i < m_queryList.Length(); ++i) {
+        const QUERY *pQuery = m_queryList.Get(i);
+        int index = pQuery && pQuery->isEnabled ? FindEpgCapStream(pQuery->networkID, pQuery->transportStreamID) : -1;
+        if (index >= 0) ++m_epgCapStreams[index].relevance;
+    }
+    for (int i = 0; i < m_reserveList.Length(); ++i) {
+        const RESERVE *pRes = m_reserveList.Get(i);
+        int index = pRes && pRes->isEnabled ? FindEpgCapStream(pRes->networkID, pRes->transportStreamID) : -1;
+        if (index >= 0) ++m_epgCapStreams[index].relevance;
+    }
+
+    FILETIME now;
+    GetEpgTimeAsFileTime(&now);
+    for (int i = 0; i < m_epgCapStreamNum; ++i) {
+        EPGCAP_STREAM &st = m_epgCapStreams[i];
+        if (st.relevance <= 0) continue;
+        TVTest::EpgEventList eventList;
+        eventList.NetworkID         = st.networkID;
+        eventList.TransportStreamID = st.transportStreamID;
+        eventList.ServiceID         = st.serviceID;
+        if (!m_pApp->GetEpgEventList(&eventList)) continue;
+        for (int j = 0; j < eventList.NumEvents; j++) {
+            const TVTest::EpgEventInfo &ev = *eventList.EventList[j];
+            JST_TIME evStart;
+            if (!SystemTimeToJst(ev.StartTime, &evStart)) continue;
+            FILETIME end = JstToFileTime(evStart + ev.Duration * FILETIME_SECOND);
+            st.coverage = max(st.coverage, static_cast<int>((end - now) / FILETIME_SECOND));
+        }
+        m_pApp->FreeEpgEventList(&eventList);
+    }
+}
+
+
+// 番組表の取得を進める(1秒ごと)。取得するものがなくなればfalseを返す
+bool CTTRec::CheckEpgCapture()
+{
+    DWORD tick = ::GetTickCount();
+    if (m_epgCapCurrent >= 0) {
+        EPGCAP_STREAM &st = m_epgCapStreams[m_epgCapCurrent];
+        DWORD lastNewTick;
+        DWORD sectionCount = m_eitWatcher.GetSectionCount(&lastNewTick);
+        DWORD elapsed = tick - m_epgCapStartTick;
+        // 新しいEIT[schedule]のセクションが届かなくなれば取得済みとする
+        bool fQuiet = sectionCount > 0 && tick - lastNewTick >= static_cast<DWORD>(m_epgCapQuietTime) * 1000;
+        if (!fQuiet &&
+            !(sectionCount == 0 && elapsed >= EPGCAP_NO_EIT_TIMEOUT * 1000) &&
+            elapsed < EPGCAP_TIMEOUT * 1000) return true;
+
+        st.fDone = true;
+        if (fQuiet) {
+            // 他ストリームの番組表も届いていれば(BS/CSなど)、それらも取得済みとする
+            DWORD ids[CEitScheduleWatcher::OTHER_STREAM_MAX];
+            int n = m_eitWatcher.GetOtherStreams(ids, ARRAY_SIZE(ids));
+            for (int i = 0; i < n; ++i) {
+                int index = FindEpgCapStream(HIWORD(ids[i]), LOWORD(ids[i]));
+                if (index >= 0) m_epgCapStreams[index].fDone = true;
+            }
+        }
+        TCHAR text[128 + ARRAY_SIZE(st.name)];
+        ::wsprintf(text, TEXT("番組表を取得しました: %s (%d秒,%s)"), st.name, elapsed / 1000,
+                   fQuiet ? TEXT("完了") : sectionCount == 0 ? TEXT("EITなし") : TEXT("打ち切り"));
+        m_pApp->AddLog(text);
+        m_epgCapCurrent = -1;
+    }
+
+    int next = -1;
+    for (int i = 0; i < m_epgCapStreamNum; ++i) {
+        const EPGCAP_STREAM &st = m_epgCapStreams[i];
+        if (st.fDone || st.relevance <= 0) continue;
+        if (next < 0 || st.relevance > m_epgCapStreams[next].relevance ||
+            st.relevance == m_epgCapStreams[next].relevance && st.coverage < m_epgCapStreams[next].coverage) next = i;
+    }
+    if (next < 0) return false;
+
+    EPGCAP_STREAM &st = m_epgCapStreams[next];
+    if (!m_pApp->SetChannel(st.space, st.channel, st.serviceID)) {
+        // 次の確認でほかのストリームに移る
+        st.fDone = true;
+        return true;
+    }
+    m_epgCapCurrent = next;
+    m_epgCapStartTick = tick;
+    m_eitWatcher.Start();
+    TCHAR text[128 + ARRAY_SIZE(st.name)];
+    ::wsprintf(text, TEXT("TTRec%s: EPG取得中 / %s"), m_szCaptionSuffix, st.name);
+    m_notifyIcon.SetText(text);
+    return true;
+}
+
+
+void CTTRec::EndEpgCapture()
+{
+    m_fEpgCapScheduling = false;
+    m_epgCapCurrent = -1;
+    m_eitWatcher.Stop();
+}
+
+
+int CTTRec::FindEpgCapStream(WORD networkID, WORD transportStreamID) const
+{
+    for (int i = 0; i < m_epgCapStreamNum; ++i) {
+        if (m_epgCapStreams[i].networkID == networkID &&
+            m_epgCapStreams[i].transportStreamID == transportStreamID) return i;
+    }
+    return -1;
+}
+
+
 // 録画終了/キャンセル後の動作を行う
 bool CTTRec::OnStopped(BYTE mode)
 {
@@ -2334,6 +3918,11 @@ bool CTTRec::OnStopped(BYTE mode)
         //::SendMessage(m_pApp->GetAppWindow(), WM_SYSCOMMAND, SC_MINIMIZE, 0);
         m_epgCapSpace = -1;
         m_epgCapTimeout = 30;
+        if (m_fEpgCapSchedule) {
+            // 番組表の取得をTVTestに任せず、必要なチャンネルだけを順に取得する
+            BeginEpgCapture();
+            m_epgCapTimeout = m_appSuspendTimeout * 60;
+        }
         ::SetTimer(m_hwndRecording, WATCH_EPGCAP_TIMER_ID, 1000, NULL);
         if (m_pApp->SetStandby(true)) {
             TCHAR text[64];
@@ -2427,6 +4016,7 @@ LRESULT CALLBACK CTTRec::RecordingWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, L
         return 0;
     case WM_DESTROY:
         ::KillTimer(hwnd, CHECK_RECORDING_TIMER_ID);
+        ::KillTimer(hwnd, MERGE_FILES_TIMER_ID);
         return 0;
     case WM_POWERBROADCAST:
         if (wParam == PBT_APMQUERYSUSPEND) {
@@ -2449,6 +4039,14 @@ LRESULT CALLBACK CTTRec::RecordingWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, L
             ::PostMessage(hwnd, WM_TIMER, DONE_APP_SUSPEND_TIMER_ID, 0);
         }
         break;
+    case WM_FILE_CHANGED:
+        // 書き込みが続いている間は取り込みを先延ばしする
+        pThis->m_fileWatcher.Acknowledge();
+        ::SetTimer(hwnd, MERGE_FILES_TIMER_ID, MERGE_FILES_DELAY, NULL);
+        return 0;
+    case WM_CONTROL_REQUEST:
+        pThis->ExecuteControlBatch(reinterpret_cast<CONTROL_REQUEST*>(lParam));
+        return 0;
     case WM_TIMER:
         switch (wParam) {
             case CHECK_RECORDING_TIMER_ID:
@@ -2458,9 +4056,16 @@ LRESULT CALLBACK CTTRec::RecordingWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, L
                     pThis->CheckQuery();
                 }
                 if (pThis->m_checkRecordingCount % (pThis->m_fFollowUpFast ? 1 : FOLLOWUP_INTERVAL) == 0) {
-                    pThis->FollowUpReserves();
+                    // 番組表との照合は通常の追従間隔でのみ行う
+                    pThis->FollowUpReserves(pThis->m_checkRecordingCount % FOLLOWUP_INTERVAL != 0);
                 }
                 pThis->CheckRecording();
+                pThis->DispatchJobs();
+                if (pThis->m_statsFlushInterval > 0 &&
+                    pThis->m_checkRecordingCount % max(pThis->m_statsFlushInterval * 1000 / CHECK_RECORDING_INTERVAL, 1) == 0)
+                {
+                    pThis->m_stats.Save();
+                }
                 // これを0にすることでCheckQuery()やFollowUpReserves()を即座に実行できる
                 ++pThis->m_checkRecordingCount;
                 break;
@@ -2477,6 +4082,7 @@ LRESULT CALLBACK CTTRec::RecordingWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, L
             case DONE_APP_SUSPEND_TIMER_ID:
                 ::KillTimer(hwnd, DONE_APP_SUSPEND_TIMER_ID);
                 ::KillTimer(hwnd, WATCH_EPGCAP_TIMER_ID);
+                pThis->EndEpgCapture();
                 if (pThis->m_fOnStoppedPostponed) {
                     pThis->m_fOnStoppedPostponed = false;
                     pThis->ShowBalloonTip(TEXT("EPG取得が完了(または中断)しました。"), 2);
@@ -2489,10 +4095,11 @@ LRESULT CALLBACK CTTRec::RecordingWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, L
                 break;
             case WATCH_EPGCAP_TIMER_ID:
                 // EPG取得の終了を監視する
-                if (!pThis->m_fOnStoppedPostponed || --pThis->m_epgCapTimeout <= 0) {
+                if (!pThis->m_fOnStoppedPostponed || --pThis->m_epgCapTimeout <= 0 ||
+                    pThis->m_fEpgCapScheduling && !pThis->CheckEpgCapture()) {
                     ::SendMessage(hwnd, WM_TIMER, DONE_APP_SUSPEND_TIMER_ID, 0);
                 }
-                else {
+                else if (!pThis->m_fEpgCapScheduling) {
                     TVTest::ChannelInfo ci;
                     if (!pThis->m_pApp->GetCurrentChannelInfo(&ci)) {
                         if (pThis->m_epgCapSpace >= 0) {
@@ -2515,6 +4122,10 @@ LRESULT CALLBACK CTTRec::RecordingWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, L
                     }
                 }
                 break;
+            case MERGE_FILES_TIMER_ID:
+                ::KillTimer(hwnd, MERGE_FILES_TIMER_ID);
+                pThis->MergeFileChanges();
+                break;
         }
         return 0;
     case WM_TTREC_GET_MSGVER:
@@ -2534,6 +4145,17 @@ LRESULT CALLBACK CTTRec::RecordingWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, L
             return FALSE;
         }
         return TRUE;
+    case WM_TTREC_GET_STATS:
+        // wParam=CStats::STAGE, lParam=CStats::VALUE
+        if (wParam >= CStats::STAGE_MAX || lParam < 0 || lParam > CStats::VALUE_LAST) return 0;
+        return pThis->m_stats.GetValue(static_cast<CStats::STAGE>(wParam), static_cast<CStats::VALUE>(lParam));
+    case WM_TTREC_GET_COUNTER:
+        // wParam=CStats::COUNTER
+        if (wParam >= CStats::COUNTER_MAX) return 0;
+        return pThis->m_stats.GetCounter(static_cast<CStats::COUNTER>(wParam));
+    case WM_TTREC_RESET_STATS:
+        pThis->m_stats.Reset();
+        return TRUE;
     case WM_TTREC_EVENT_PROGRAMGUIDE_COMMAND:
         {
             const TVTest::ProgramGuideCommandParam *pCommandParam =
@@ -2627,7 +4249,21 @@ void CTTRec::UpdateTotAdjust()
 // TOT時刻を取得するストリームコールバック(別スレッド)
 BOOL CALLBACK CTTRec::StreamCallback(BYTE *pData, void *pClientData)
 {
+    CTTRec *pThis = static_cast<CTTRec*>(pClientData);
+    // 書き込みはこのスレッドだけなのでロックしない
+    pThis->m_streamPacketCount = pThis->m_streamPacketCount + 1;
+    if (pThis->m_timeShiftBuf.IsAllocated() || pThis->m_fMultiServiceRec || pThis->m_pLeanRec) {
+        // タイムシフトへの書き込みも同じロックの中で行い、AttachServiceRecorder()で録画に渡す位置とずれないようにする
+        CBlockLock lock(&pThis->m_serviceRecLock);
+        if (pThis->m_timeShiftBuf.IsAllocated()) pThis->m_timeShiftBuf.Write(pData);
+        if (pThis->m_pLeanRec) pThis->m_pLeanRec->Write(pData);
+        for (int i = 0; i < SERVICE_REC_MAX; ++i) {
+            if (pThis->m_serviceRec[i]) pThis->m_serviceRec[i]->Write(pData);
+        }
+    }
+
     int pid = ((pData[1]&0x1f)<<8) | pData[2];
+    if (pid == 0x12 && pThis->m_eitWatcher.IsActive()) pThis->m_eitWatcher.Write(pData);
     if (pid != 0x14) return TRUE;
 
     int unitStartIndicator = (pData[1]>>6)&0x01;
@@ -2654,13 +4290,12 @@ BOOL CALLBACK CTTRec::StreamCallback(BYTE *pData, void *pClientData)
     // TOTパケットは地上波の実測で6秒に1個程度
     // ARIB規格では最低30秒に1個
 
-    CTTRec *pThis = static_cast<CTTRec*>(pClientData);
-
     // TOT時刻とTickカウントを記録する
     CBlockLock lock(&pThis->m_totLock);
-    if (AribToFileTime(&pTable[3], &pThis->m_totGrabbedTime)) {
+    JST_TIME totTime;
+    if (JstTimeFromArib(&pTable[3], &totTime)) {
         // バッファがあるので少し時刻を戻す(TVTest_0.7.19r2_Src/TVTest.cpp参考)
-        pThis->m_totGrabbedTime += -2000 * FILETIME_MILLISECOND;
+        pThis->m_totGrabbedTime = JstToFileTime(totTime - 2000 * FILETIME_MILLISECOND);
         pThis->m_totGrabbedTick = ::GetTickCount();
         pThis->m_totIsValid = true;
     }
@@ -22,19 +22,49 @@ class CTTRec : public TVTest::CTVTestPlugin
     static const int BALLOON_TIP_TIMEOUT = 10000;
     // 予約開始時にステータス(エラーパケット数など)を取得するまでの待ち時間(ミリ秒)
     static const int GET_START_STATUS_INFO_DELAY = 10000;
+    // 予約・クエリファイルの変更通知が途切れてから取り込むまでの時間(ミリ秒)
+    static const int MERGE_FILES_DELAY = 1000;
+    // 統計ファイルの書き出し間隔の設定上限(秒)
+    static const int STATS_FLUSH_INTERVAL_MAX = 86400;
     // 終了確認ダイアログの表示時間(秒)
     static const int ON_STOPPED_DLG_TIMEOUT = 15;
-    // 追従処理する予約の最大件数
-    static const int FOLLOW_UP_MAX = 5;
     // TOT時刻補正の最大値の設定上限(分)
     static const int TOT_ADJUST_MAX_MAX = 15;
     // 予約待機状態に入るオフセット(秒)(予約開始まで安定に保つべき時間)
     static const int REC_READY_OFFSET = 10;
+    // チャンネル変更の所要時間の計測を打ち切る時間(ミリ秒)
+    static const DWORD TUNE_MEASURE_TIMEOUT = 180000;
+    // チャンネル変更のタイミングには所要時間の記録のこの百分位点を使う
+    static const int TUNE_LATENCY_PERCENTILE = 90;
+    // 記録がこれより少なければChChangeBeforeのまま
+    static const int TUNE_LATENCY_MIN_SAMPLES = 3;
+    // タイムシフトの設定上限(秒)
+    static const int TIME_SHIFT_MAX = 30;
+    // タイムシフトのバッファに見込むビットレート(バイト/秒)
+    static const DWORD TIME_SHIFT_BYTES_PER_SEC = 4 * 1024 * 1024;
+    // 同じストリームから同時に録画する別サービスの最大数
+    static const int SERVICE_REC_MAX = 4;
+    // 受信不良とみなすドロップ・エラーの割合の設定上限(パケット/秒)
+    static const int FAILOVER_DROP_RATE_MAX = 100000;
+    // 受信不良が続いたとみなす時間の設定上限(秒)
+    static const int FAILOVER_DURATION_MAX = 300;
+    // 書き込み速度を計測する間隔の設定上限(秒)
+    static const int WRITE_STALL_DURATION_MAX = 300;
+    // ビットレートの記録がないサービスの録画サイズの見積もりに使う値(KB/秒)
+    static const int DEFAULT_REC_KBYTES_PER_SEC = 3 * 1024;
+    // 空き容量の確認で見積もりに加える余裕(MB)
+    static const DWORD FREE_SPACE_MARGIN_MBYTES = 256;
+    // 所要時間に加える余裕の設定上限(秒)
+    static const int CH_CHANGE_MARGIN_MAX = 600;
     // 1チャンネルあたりのEPG取得時間の最悪値(秒)
     // 根拠はTVTest_0.8.0_Src/TVTest.cpp/TIMER_ID_PROGRAMGUIDEUPDATE
     static const int EPGCAP_TIMEOUT = 360 + 30;
     // 根拠はTVTest_0.7.23_Src/TVTest.cpp/BeginProgramGuideUpdate()
     static const int EPGCAP_TIMEOUT_OLD = 120 + 30;
+    // 番組表の取得を自前で行うとき、EITが届かなければ次のチャンネルに移るまでの時間(秒)
+    static const int EPGCAP_NO_EIT_TIMEOUT = 30;
+    // 番組表の取得を順序づけるストリームの最大数
+    static const int EPGCAP_STREAM_MAX = 64;
 
     struct RECORDING_INFO {
         bool fEnabled;
@@ -44,6 +74,68 @@ class CTTRec : public TVTest::CTVTestPlugin
         TCHAR filePath[MAX_PATH];
         TCHAR serviceName[64];
         TVTest::EpgEventInfo *pEpgEventInfo; // 解放忘れ注意
+        // 補欠のドライバに切り替えて録画ファイルを分けたとき
+        bool fSplit;
+        FILETIME splitTime;
+        TCHAR splitFilePath[MAX_PATH];
+        TCHAR splitDriverName[MAX_PATH];
+        // 切り替えまでのカウント(不明なとき-1)
+        int splitErrors;
+        int splitScrambles;
+        int splitDrops;
+        // 録画中に計測した書き込み速度の最小値(KB/秒、不明なとき-1)と滞った回数
+        int minWriteRate;
+        int writeStalls;
+        // タイムシフトで補った録画開始前の部分のファイル(最初の録画ファイルのもの)
+        TCHAR headFilePath[MAX_PATH + 8];
+    };
+    // チャンネル変更から受信が安定するまでの計測
+    struct TUNE_MEASURE {
+        bool fActive;
+        bool fStatusValid;
+        WORD networkID;
+        WORD transportStreamID;
+        DWORD startTick;
+        DWORD statusTick;
+        DWORD dropCount;
+        int latency;        // 計測できた所要時間(ミリ秒)、-1は未計測
+    };
+    // 録画中の受信状態の監視
+    struct FAILOVER_MONITOR {
+        bool fActive;           // 録画ファイルの分割は1つの録画につき1度だけ(書き込みの監視と共通)
+        bool fStatusValid;
+        bool fDegraded;
+        DWORD statusTick;
+        DWORD degradedTick;
+        DWORD badCount;
+        DWORD packetCount;
+    };
+    // 番組表を取得するストリーム
+    struct EPGCAP_STREAM {
+        WORD networkID;
+        WORD transportStreamID;
+        WORD serviceID;
+        int space;
+        int channel;
+        int relevance;      // ストリームを参照する有効なクエリと予約の数
+        int coverage;       // 番組表が何秒先まで埋まっているか
+        bool fDone;
+        TCHAR name[64];
+    };
+    // 録画中の録画ファイルの書き込みの監視
+    struct WRITE_WATCH {
+        bool fValid;
+        DWORD tick;
+        LONGLONG fileSize;
+    };
+    // 録画履歴に残す録画中の情報
+    struct HISTORY_SAMPLE {
+        bool fActive;
+        DWORD startTick;
+        TVTest::StatusInfo startStatusInfo;
+        CRecHistory::ENTRY entry;
+        TCHAR filePath[MAX_PATH];
+        TCHAR eventName[EVENT_NAME_MAX];
     };
     enum {
         CHECK_RECORDING_TIMER_ID = 1,
@@ -51,6 +143,7 @@ class CTTRec : public TVTest::CTVTestPlugin
         GET_START_STATUS_INFO_TIMER_ID,
         DONE_APP_SUSPEND_TIMER_ID,
         WATCH_EPGCAP_TIMER_ID,
+        MERGE_FILES_TIMER_ID,
     };
     // 番組表メニュー・ダブルクリックコマンド
     enum {
@@ -63,6 +156,18 @@ class CTTRec : public TVTest::CTVTestPlugin
         NUM_COMMANDS = COMMAND_QUERYLIST + MENULIST_MAX
     };
     static const TVTest::ProgramGuideCommandInfo PROGRAM_GUIDE_COMMAND_LIST[4];
+    // 予約追従で使うサービスごとの番組表
+    struct FOLLOW_UP_EPG {
+        TVTest::EpgEventList list;
+        bool fAvailable;
+    };
+    // 予約追従中に予約を探しなおすためのキー
+    struct FOLLOW_UP_KEY {
+        WORD networkID;
+        WORD transportStreamID;
+        WORD serviceID;
+        WORD eventID;
+    };
 public:
     CTTRec();
     virtual bool GetPluginInfo(TVTest::PluginInfo *pInfo);
@@ -76,6 +181,8 @@ private:
     static LRESULT CALLBACK EventCallback(UINT Event, LPARAM lParam1, LPARAM lParam2, void *pClientData);
     void ShowBalloonTip(LPCTSTR text, int notifyLevel);
     void RunSaveTask();
+    void MergeFileChanges();
+    void ExecuteControlBatch(CONTROL_REQUEST *pReq);
     // プログラムガイド
     bool DrawBackground(const TVTest::ProgramGuideProgramInfo *pProgramInfo,
                         const TVTest::ProgramGuideProgramDrawBackgroundInfo *pInfo) const;
@@ -102,18 +209,52 @@ private:
     // 録画
     bool IsEventMatch(const TVTest::EpgEventInfo &ev, const QUERY &q);
     void CheckQuery();
-    void FollowUpReserves();
+    static const TVTest::EpgEventInfo *FindEpgEvent(const TVTest::EpgEventList &list, WORD eventID);
+    void FollowUpReserves(bool fPfOnly);
     bool GetChannel(int *pSpace, int *pChannel, WORD networkID, WORD serviceID);
     bool GetChannelName(LPTSTR name, int max, WORD networkID, WORD serviceID);
-    bool IsChannelOnDriver(WORD networkID, WORD serviceID, const TVTest::DriverTuningSpaceList &list);
+    const CChannelIndex::CHANNEL *FindChannel(WORD networkID, WORD serviceID);
+    const CChannelIndex *GetDriverIndex(LPCTSTR driverName, CChannelIndex *pIndex);
+    void InvalidateChannelIndex();
     bool SetChannel(WORD networkID, WORD serviceID);
-    bool StartRecord(LPCTSTR saveDir, LPCTSTR saveName);
+    void BeginTuneMeasure(int space, int channel);
+    void UpdateTuneMeasure();
+    int GetChChangeBefore() const;
+    void FormatReserveFileName(LPTSTR name, int max, const RESERVE &res);
+    bool StartRecord(LPCTSTR saveDir, LPCTSTR saveName, DWORD startTick);
+    bool GetUniqueRecordPath(LPTSTR path, LPCTSTR saveDir, LPCTSTR saveName, bool fExpandVars = false);
+    bool StartLeanRecord(LPCTSTR saveDir, LPCTSTR saveName, DWORD startTick);
+    void StopLeanRecord();
+    bool AttachServiceRecorder(CServiceRecorder **ppRec, CServiceRecorder *pRec, DWORD startTick);
     bool IsNotRecording();
     void ResetRecording();
     void CheckRecording();
-    static bool ExecuteCommandLine(LPTSTR commandLine, LPCTSTR currentDirectory, const RECORDING_INFO &info, LPCTSTR envExec);
+    static bool WriteMetaFile(const RECORDING_INFO &info, bool fEnd, LPTSTR metaPath);
+    bool ExecuteCommandLine(LPCTSTR commandLine, LPCTSTR currentDirectory, LPCTSTR metaPath);
     void OnStartRecording();
     void OnEndRecording();
+    bool ExecuteAnalyzeTs(LPCTSTR filePath);
+    bool CheckServiceRecording();
+    void StopServiceRecording(int index);
+    bool CheckFailover();
+    bool FailoverToSubDriver();
+    bool RestartInNewSegment(LPCTSTR driverName);
+    void CheckWriteThroughput();
+    bool RestartOnOtherStorage(LPCTSTR filePath);
+    void EndHeadFile();
+    int EstimateRecordKBytesPerSec(const RESERVE &res) const;
+    DWORD EstimateRecordMBytes(const RESERVE &res) const;
+    void CheckFreeSpace();
+    void UpdateStorageActivity();
+    bool SelectStorage(const RESERVE &res, LPTSTR dir, LPCTSTR avoidPath = NULL);
+    LPCTSTR GetNearestSaveDir() const { return m_szRedirectDir[0] ? m_szRedirectDir : m_nearest.recOption.saveDir; }
+    void BeginHistorySample();
+    void EndHistorySample();
+    void BeginEpgCapture();
+    bool CheckEpgCapture();
+    void EndEpgCapture();
+    int FindEpgCapStream(WORD networkID, WORD transportStreamID) const;
+    void DispatchJobs();
     HWND GetTTRecWindow();
     HWND GetFullscreenWindow();
     bool OnStopped(BYTE mode);
@@ -135,6 +276,20 @@ private:
     TCHAR m_szDefaultStatusItemPrefix[32];
     CBalloonTip m_balloonTip;
     CNotifyIcon m_notifyIcon;
+    CStats m_stats;
+    CWakeTrace m_wakeTrace;
+    CTuneLatency m_tuneLatency;
+    CRecHistory m_recHistory;
+    CStoragePool m_storagePool;
+    CFileWatcher m_fileWatcher;
+    CControlPipe m_controlPipe;
+    // 現在のドライバのチャンネルの索引
+    CChannelIndex m_channelIndex;
+    // 主ドライバ(m_szDriverName)と補欠のドライバ(m_szSubDriverName)のチャンネルの索引
+    CChannelIndex m_mainDriverIndex;
+    CChannelIndex m_subDriverIndex;
+    // 直近の受信内容(録画開始前の部分を補うため)
+    CTsRingBuffer m_timeShiftBuf;
 
     // 設定
     TCHAR m_szDriverName[MAX_PATH];
@@ -148,9 +303,11 @@ private:
     bool m_joinsEvents;
     bool m_fEventRelay;
     int m_chChangeBefore;
+    int m_chChangeMargin;
     int m_spinUpBefore;
     int m_suspendWait;
     int m_execWait;
+    bool m_fExecProbe;
     bool m_fForceSuspend;
     bool m_fDoSetPreview;
     bool m_fDoSetPreviewNoViewOnly;
@@ -161,6 +318,26 @@ private:
     int m_appSuspendTimeout;
     int m_notifyLevel;
     int m_logLevel;
+    bool m_fAnalyzeTsOnEndRec;
+    int m_execMaxJobs;
+    int m_execRetry;
+    bool m_fExecLowPriorityWhileRec;
+    bool m_fSaveMetaFile;
+    int m_statsFlushInterval;
+    bool m_fWatchFiles;
+    bool m_fControlPipe;
+    int m_timeShift;
+    bool m_fMultiServiceRec;
+    int m_failoverDropRate;
+    int m_failoverDuration;
+    int m_writeStallPercent;
+    int m_writeStallDuration;
+    bool m_fEpgCapSchedule;
+    int m_epgCapQuietTime;
+    bool m_fCheckFreeSpace;
+    bool m_fPreallocate;
+    TCHAR m_szAltSaveDir[MAX_PATH];
+    TCHAR m_szStoragePool[MAX_PATH * 2];
     RECORDING_OPTION m_defaultRecOption;
     COLORREF m_normalColor;
     COLORREF m_disabledColor;
@@ -180,14 +357,15 @@ private:
     enum { REC_IDLE, REC_STANDBY, REC_READY, REC_ACTIVE, REC_ACTIVE_VIEW_ONLY, REC_ENDED, REC_CANCELED } m_recordingState;
     CReserveList m_reserveList;
     CQueryList m_queryList;
+    CJobQueue m_jobQueue;
     RESERVE m_nearest;
     BYTE m_onStopped;
     DWORD m_checkRecordingCount;
     int m_checkQueryIndex;
-    int m_followUpIndex;
     bool m_fFollowUpFast;
     bool m_fChChanged;
     bool m_fSpunUp;
+    bool m_fSpaceChecked;
     bool m_fStopRecording;
     bool m_fOnStoppedPostponed;
     bool m_fOnStoppedDlgShowing;
@@ -197,7 +375,30 @@ private:
     int m_epgCapTimeout;
     int m_epgCapSpace;
     int m_epgCapChannel;
+    // 番組表の取得を自前で行っている
+    bool m_fEpgCapScheduling;
+    CEitScheduleWatcher m_eitWatcher;
+    EPGCAP_STREAM m_epgCapStreams[EPGCAP_STREAM_MAX];
+    int m_epgCapStreamNum;
+    int m_epgCapCurrent;
+    DWORD m_epgCapStartTick;
     RECORDING_INFO m_recordingInfo;
+    // タイムシフトで書き出した録画開始前の部分のファイル
+    TCHAR m_szHeadFilePath[MAX_PATH + 8];
+    // 同じストリームの別サービスの同時録画(ストリームコールバックで書き出す)
+    CCriticalLock m_serviceRecLock;
+    CServiceRecorder *m_serviceRec[SERVICE_REC_MAX];
+    RESERVE m_serviceRecRes[SERVICE_REC_MAX];
+    // 軽量録画(m_serviceRecLockで保護する)
+    CServiceRecorder *m_pLeanRec;
+    TUNE_MEASURE m_tuneMeasure;
+    FAILOVER_MONITOR m_failover;
+    WRITE_WATCH m_writeWatch;
+    // ストリームコールバックで受け取ったパケット数(受信の途絶を調べる)
+    volatile DWORD m_streamPacketCount;
+    // 空き容量が足りないときや保存先の集合から選んだときに直近の予約に使う保存先
+    TCHAR m_szRedirectDir[MAX_PATH];
+    HISTORY_SAMPLE m_historySample;
 
     // 時刻補正
     CCriticalLock m_totLock;
@@ -0,0 +1,306 @@
+﻿#include <Windows.h>
+#include <Shlwapi.h>
+#include "JstTime.h"
+#include "Util.h"
+#include "TsAnalyzer.h"
+
+
+CTsAnalyzer::CTsAnalyzer()
+{
+    m_pPidInfo = new PID_INFO[PID_NUM];
+    Reset();
+}
+
+
+CTsAnalyzer::~CTsAnalyzer()
+{
+    delete [] m_pPidInfo;
+}
+
+
+void CTsAnalyzer::Reset()
+{
+    ::memset(m_pPidInfo, 0, sizeof(PID_INFO) * PID_NUM);
+    for (int i = 0; i < PID_NUM; ++i) {
+        m_pPidInfo[i].counter = 0x10;
+    }
+    m_carryLen = 0;
+    m_fSynced = true;
+    m_packets = 0;
+    m_errors = 0;
+    m_drops = 0;
+    m_scrambles = 0;
+    m_syncErrors = 0;
+    m_fTotValid = false;
+    m_burstCount = 0;
+    m_lastEventPacket = 0;
+}
+
+
+// TSデータを追加する
+// パケット境界で区切られている必要はない
+void CTsAnalyzer::AddData(const BYTE *pData, DWORD size)
+{
+    while (size > 0) {
+        if (!m_fSynced) {
+            if (!Resync(&pData, &size)) break;
+            continue;
+        }
+        if (m_carryLen > 0) {
+            // 前回の端数を補う
+            if (m_carryLen < 188) {
+                DWORD len = min(188 - m_carryLen, size);
+                ::memcpy(m_carry + m_carryLen, pData, len);
+                m_carryLen += len;
+                pData += len;
+                size -= len;
+                if (m_carryLen < 188) break;
+            }
+            if (m_carry[0] != 0x47) {
+                ++m_syncErrors;
+                m_fSynced = false;
+                continue;
+            }
+            AddPacket(m_carry);
+            m_carryLen -= 188;
+            ::memmove(m_carry, m_carry + 188, m_carryLen);
+            continue;
+        }
+        // 整列したパケットはコピーせずにそのまま処理する
+        for (; size >= 188 && pData[0] == 0x47; pData += 188, size -= 188) {
+            AddPacket(pData);
+        }
+        if (size > 0) {
+            if (pData[0] == 0x47) {
+                ::memcpy(m_carry, pData, size);
+                m_carryLen = size;
+                break;
+            }
+            ++m_syncErrors;
+            m_fSynced = false;
+        }
+    }
+}
+
+
+// 前回の端数とpDataをつないだ列から、188バイト間隔で同期バイトが3つ続く位置を探す
+// (ペイロード中の0x47を同期バイトと取り違えないため)
+// 見つかれば前回の端数かpDataの先頭をその位置に合わせてtrueを返す
+// 見つからなければ判定できない末尾だけを端数に残してfalseを返す
+bool CTsAnalyzer::Resync(const BYTE **ppData, DWORD *pSize)
+{
+    const BYTE *pData = *ppData;
+    DWORD size = *pSize;
+    DWORD total = m_carryLen + size;
+    for (DWORD i = 0; i + 188 * 2 < total; ++i) {
+        if ((i < m_carryLen ? m_carry[i] : pData[i - m_carryLen]) == 0x47) {
+            DWORD j = i + 188;
+            DWORD k = i + 188 * 2;
+            if ((j < m_carryLen ? m_carry[j] : pData[j - m_carryLen]) == 0x47 &&
+                (k < m_carryLen ? m_carry[k] : pData[k - m_carryLen]) == 0x47)
+            {
+                if (i < m_carryLen) {
+                    m_carryLen -= i;
+                    ::memmove(m_carry, m_carry + i, m_carryLen);
+                }
+                else {
+                    *ppData = pData + (i - m_carryLen);
+                    *pSize = size - (i - m_carryLen);
+                    m_carryLen = 0;
+                }
+                m_fSynced = true;
+                return true;
+            }
+        }
+    }
+    // 末尾の188*2バイトは次のデータが来るまで判定できない
+    DWORD keep = min(total, 188 * 2);
+    DWORD start = total - keep;
+    if (start >= m_carryLen) {
+        ::memcpy(m_carry, pData + (start - m_carryLen), keep);
+    }
+    else {
+        ::memmove(m_carry, m_carry + start, m_carryLen - start);
+        ::memcpy(m_carry + (m_carryLen - start), pData, size);
+    }
+    m_carryLen = keep;
+    *ppData = pData + size;
+    *pSize = 0;
+    return false;
+}
+
+
+void CTsAnalyzer::AddPacket(const BYTE *pPacket)
+{
+    int pid = (pPacket[1] & 0x1F) << 8 | pPacket[2];
+    PID_INFO &info = m_pPidInfo[pid];
+    ++m_packets;
+    ++info.packets;
+
+    // transport_error_indicator
+    if (pPacket[1] & 0x80) {
+        // TVTest本体と同様に連続性は評価しない
+        ++info.errors;
+        ++m_errors;
+        AddErrorEvent(true);
+        return;
+    }
+    // transport_scrambling_control
+    if (pPacket[3] & 0xC0) {
+        ++info.scrambles;
+        ++m_scrambles;
+    }
+    int adaptationControl = pPacket[3] >> 4 & 0x03;
+    if (adaptationControl == 0 || pid == 0x1FFF) return;
+
+    // discontinuity_indicatorが立っていれば連続性をリセット
+    if ((adaptationControl & 2) && pPacket[4] > 0 && (pPacket[5] & 0x80)) {
+        info.counter = 0x10;
+    }
+    // ペイロードがあるときだけ連続性指標は増加する
+    if (adaptationControl & 1) {
+        BYTE counter = pPacket[3] & 0x0F;
+        if (info.counter < 0x10 && counter != (info.counter + 1 & 0x0F) && counter != info.counter) {
+            ++info.drops;
+            ++m_drops;
+            AddErrorEvent(false);
+        }
+        info.counter = counter;
+
+        if (pid == 0x14) ParseTot(pPacket);
+    }
+}
+
+
+// エラーの集中箇所を記録する
+void CTsAnalyzer::AddErrorEvent(bool fError)
+{
+    DWORD pos = m_packets - 1;
+    if (m_burstCount == 0 || pos - m_lastEventPacket > BURST_GAP) {
+        if (m_burstCount < BURST_MAX) {
+            BURST &burst = m_bursts[m_burstCount];
+            burst.startPacket = pos;
+            burst.errors = 0;
+            burst.drops = 0;
+            burst.totTime = m_totTime;
+            burst.fTotValid = m_fTotValid;
+        }
+        ++m_burstCount;
+    }
+    if (m_burstCount <= BURST_MAX) {
+        BURST &burst = m_bursts[m_burstCount - 1];
+        burst.endPacket = pos;
+        if (fError) ++burst.errors;
+        else ++burst.drops;
+    }
+    m_lastEventPacket = pos;
+}
+
+
+// TOT時刻を取得する(CTTRec::StreamCallback()と同様)
+void CTsAnalyzer::ParseTot(const BYTE *pPacket)
+{
+    int unitStartIndicator = pPacket[1] >> 6 & 0x01;
+    int adaptationControl  = pPacket[3] >> 4 & 0x03;
+    if (!unitStartIndicator) return;
+
+    const BYTE *pPayload = pPacket + 4;
+    if (adaptationControl == 3) {
+        int adaptationLength = pPacket[4];
+        if (adaptationLength > 182) return;
+        pPayload += 1 + adaptationLength;
+    }
+    const BYTE *pTable = pPayload + 1 + pPayload[0];
+    if (pTable + 7 >= pPacket + 188) return;
+
+    // TOT or TDT (ARIB STD-B10)
+    if (pTable[0] != 0x73 && pTable[0] != 0x70) return;
+
+    JST_TIME totTime;
+    if (JstTimeFromArib(&pTable[3], &totTime)) {
+        m_totTime = JstToFileTime(totTime);
+        if (!m_fTotValid) {
+            // TOTより前のエラー集中箇所はこの時刻で代用する
+            for (int i = 0; i < min(m_burstCount, BURST_MAX); ++i) {
+                m_bursts[i].totTime = m_totTime;
+                m_bursts[i].fTotValid = true;
+            }
+        }
+        m_fTotValid = true;
+    }
+}
+
+
+// ファイル全体を解析する
+bool CTsAnalyzer::AnalyzeFile(LPCTSTR fileName, HANDLE hAbortEvent)
+{
+    Reset();
+
+    HANDLE hFile = ::CreateFile(fileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+
+    // 大きな領域なのでヒープを経由せずページ境界にそろえる
+    BYTE *pBuf = static_cast<BYTE*>(::VirtualAlloc(NULL, 188 * READ_PACKETS, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+    if (!pBuf) {
+        ::CloseHandle(hFile);
+        return false;
+    }
+    bool fRet = true;
+    for (;;) {
+        if (hAbortEvent && ::WaitForSingleObject(hAbortEvent, 0) == WAIT_OBJECT_0) {
+            fRet = false;
+            break;
+        }
+        DWORD readBytes;
+        if (!::ReadFile(hFile, pBuf, 188 * READ_PACKETS, &readBytes, NULL)) {
+            fRet = false;
+            break;
+        }
+        if (readBytes == 0) break;
+        AddData(pBuf, readBytes);
+    }
+    ::VirtualFree(pBuf, 0, MEM_RELEASE);
+    ::CloseHandle(hFile);
+    return fRet;
+}
+
+
+// 解析結果をテキストファイルに書き出す
+bool CTsAnalyzer::WriteReport(LPCTSTR fileName, LPCTSTR tsFileName) const
+{
+    HANDLE hFile = ::CreateFile(fileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+
+    DWORD writtenBytes;
+    WCHAR bom = L'\xFEFF';
+    ::WriteFile(hFile, &bom, sizeof(bom), &writtenBytes, NULL);
+
+    TCHAR buf[MAX_PATH + 128];
+    int len = ::wsprintf(buf, TEXT("File=%s\r\nPackets=%lu\r\nErrors=%lu\r\nDrops=%lu\r\nScrambles=%lu\r\nSyncErrors=%lu\r\nBursts=%d\r\n\r\n"),
+                         tsFileName, m_packets, m_errors, m_drops, m_scrambles, m_syncErrors, m_burstCount);
+    ::WriteFile(hFile, buf, len * sizeof(TCHAR), &writtenBytes, NULL);
+
+    len = ::wsprintf(buf, TEXT("PID\tPackets\tErrors\tDrops\tScrambles\r\n"));
+    ::WriteFile(hFile, buf, len * sizeof(TCHAR), &writtenBytes, NULL);
+    for (int i = 0; i < PID_NUM; ++i) {
+        const PID_INFO &info = m_pPidInfo[i];
+        if (info.packets == 0) continue;
+        len = ::wsprintf(buf, TEXT("0x%04X\t%lu\t%lu\t%lu\t%lu\r\n"), i, info.packets, info.errors, info.drops, info.scrambles);
+        ::WriteFile(hFile, buf, len * sizeof(TCHAR), &writtenBytes, NULL);
+    }
+
+    len = ::wsprintf(buf, TEXT("\r\nTOT\tStartPacket\tEndPacket\tErrors\tDrops\r\n"));
+    ::WriteFile(hFile, buf, len * sizeof(TCHAR), &writtenBytes, NULL);
+    for (int i = 0; i < min(m_burstCount, BURST_MAX); ++i) {
+        const BURST &burst = m_bursts[i];
+        TCHAR szTime[64];
+        if (burst.fTotValid) FileTimeToStr(&burst.totTime, szTime);
+        else ::lstrcpy(szTime, TEXT("-"));
+        len = ::wsprintf(buf, TEXT("%s\t%lu\t%lu\t%lu\t%lu\r\n"), szTime, burst.startPacket, burst.endPacket, burst.errors, burst.drops);
+        ::WriteFile(hFile, buf, len * sizeof(TCHAR), &writtenBytes, NULL);
+    }
+
+    ::CloseHandle(hFile);
+    return true;
+}
@@ -0,0 +1,69 @@
+﻿#ifndef INCLUDE_TS_ANALYZER_H
+#define INCLUDE_TS_ANALYZER_H
+
+// 録画ファイルのTSパケットを検査する
+class CTsAnalyzer
+{
+public:
+    static const int PID_NUM = 8192;
+    // 記録するエラー集中箇所の最大数
+    static const int BURST_MAX = 64;
+    // 同じエラー集中箇所とみなすパケット間隔(地上波でおよそ3秒)
+    static const DWORD BURST_GAP = 32768;
+    // 1回の読み込みパケット数
+    static const DWORD READ_PACKETS = 8192;
+
+    struct PID_INFO {
+        DWORD packets;
+        DWORD errors;
+        DWORD drops;
+        DWORD scrambles;
+        BYTE counter; // 直前の連続性指標(0x10以上は未取得)
+    };
+    struct BURST {
+        DWORD startPacket;
+        DWORD endPacket;
+        DWORD errors;
+        DWORD drops;
+        FILETIME totTime; // 直前(なければ直後)のTOT時刻
+        bool fTotValid;
+    };
+
+    CTsAnalyzer();
+    ~CTsAnalyzer();
+    void Reset();
+    void AddData(const BYTE *pData, DWORD size);
+    bool AnalyzeFile(LPCTSTR fileName, HANDLE hAbortEvent = NULL);
+    bool WriteReport(LPCTSTR fileName, LPCTSTR tsFileName) const;
+    const PID_INFO &GetPidInfo(int pid) const { return m_pPidInfo[pid & (PID_NUM - 1)]; }
+    DWORD GetPackets() const { return m_packets; }
+    DWORD GetErrors() const { return m_errors; }
+    DWORD GetDrops() const { return m_drops; }
+    DWORD GetScrambles() const { return m_scrambles; }
+    DWORD GetSyncErrors() const { return m_syncErrors; }
+    int GetBurstCount() const { return m_burstCount; }
+    const BURST *GetBurst(int index) const { return 0 <= index && index < min(m_burstCount, BURST_MAX) ? &m_bursts[index] : NULL; }
+private:
+    bool Resync(const BYTE **ppData, DWORD *pSize);
+    void AddPacket(const BYTE *pPacket);
+    void AddErrorEvent(bool fError);
+    void ParseTot(const BYTE *pPacket);
+
+    PID_INFO *m_pPidInfo;
+    // 前回の端数(同期を失っている間は同期バイトの判定待ちの末尾)
+    BYTE m_carry[188 * 2];
+    DWORD m_carryLen;
+    bool m_fSynced;
+    DWORD m_packets;
+    DWORD m_errors;
+    DWORD m_drops;
+    DWORD m_scrambles;
+    DWORD m_syncErrors;
+    FILETIME m_totTime;
+    bool m_fTotValid;
+    BURST m_bursts[BURST_MAX];
+    int m_burstCount;
+    DWORD m_lastEventPacket;
+};
+
+#endif // INCLUDE_TS_ANALYZER_H
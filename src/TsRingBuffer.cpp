@@ -0,0 +1,216 @@
+﻿#include <Windows.h>
+#include "JstTime.h"
+#include "Util.h"
+#include "TsRingBuffer.h"
+
+
+CTsRingBuffer::CTsRingBuffer()
+    : m_pBuf(NULL)
+    , m_capacity(0)
+    , m_writeSlot(0)
+    , m_writePos(0)
+    , m_validPos(0)
+    , m_index(NULL)
+    , m_indexSize(0)
+    , m_indexHead(0)
+    , m_indexCount(0)
+    , m_hDumpThread(NULL)
+    , m_dumpFrom(0)
+    , m_dumpTo(0)
+{
+    m_dumpFileName[0] = 0;
+}
+
+
+CTsRingBuffer::~CTsRingBuffer()
+{
+    Free();
+}
+
+
+// bufferSizeバイトのバッファを確保する。maxMsecは保持する時間の目安
+// ストリームコールバックの登録前に呼ぶこと
+bool CTsRingBuffer::Allocate(DWORD bufferSize, DWORD maxMsec)
+{
+    Free();
+    m_capacity = bufferSize / PACKET_SIZE;
+    if (m_capacity == 0) return false;
+    // 大きな領域なのでヒープを経由しない
+    m_pBuf = static_cast<BYTE*>(::VirtualAlloc(NULL, m_capacity * PACKET_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+    if (!m_pBuf) {
+        m_capacity = 0;
+        return false;
+    }
+    m_indexSize = maxMsec / INDEX_INTERVAL + 16;
+    m_index = new INDEX[m_indexSize];
+    m_writeSlot = 0;
+    m_writePos = m_validPos = 0;
+    m_indexHead = m_indexCount = 0;
+    return true;
+}
+
+
+// ストリームコールバックの登録解除後に呼ぶこと
+void CTsRingBuffer::Free()
+{
+    WaitDump();
+    if (m_pBuf) {
+        ::VirtualFree(m_pBuf, 0, MEM_RELEASE);
+        m_pBuf = NULL;
+    }
+    m_capacity = 0;
+    delete [] m_index;
+    m_index = NULL;
+    m_indexSize = 0;
+}
+
+
+// パケットを1つ書き込む(ストリームコールバックのスレッド)
+void CTsRingBuffer::Write(const BYTE *pPacket)
+{
+    DWORD tick = ::GetTickCount();
+    CBlockLock lock(&m_lock);
+    if (m_indexCount == 0 || tick - m_index[(m_indexHead + m_indexCount - 1) % m_indexSize].tick >= INDEX_INTERVAL) {
+        INDEX *pIndex;
+        if (m_indexCount < m_indexSize) {
+            pIndex = &m_index[(m_indexHead + m_indexCount++) % m_indexSize];
+        }
+        else {
+            pIndex = &m_index[m_indexHead];
+            m_indexHead = (m_indexHead + 1) % m_indexSize;
+        }
+        pIndex->tick = tick;
+        pIndex->pos = m_writePos;
+    }
+    ::CopyMemory(m_pBuf + m_writeSlot * PACKET_SIZE, pPacket, PACKET_SIZE);
+    if (++m_writeSlot >= m_capacity) m_writeSlot = 0;
+    ++m_writePos;
+}
+
+
+// これまでに保持した内容を無効にする(チャンネル変更時など)
+void CTsRingBuffer::Reset()
+{
+    CBlockLock lock(&m_lock);
+    m_validPos = m_writePos;
+    m_indexHead = m_indexCount = 0;
+}
+
+
+// これまでに書き込んだパケット数
+LONGLONG CTsRingBuffer::GetPosition()
+{
+    CBlockLock lock(&m_lock);
+    return m_writePos;
+}
+
+
+// fromTickの時点のパケットの位置を返す(保持していなければ保持している最も古い位置)
+// 何も保持していなければ-1を返す
+LONGLONG CTsRingBuffer::GetTickPosition(DWORD fromTick)
+{
+    if (!m_pBuf) return -1;
+    CBlockLock lock(&m_lock);
+    LONGLONG fromPos = -1;
+    // fromTick以前で最後に記録した位置から(なければ最も古い位置から)
+    for (int i = m_indexCount - 1; i >= 0; --i) {
+        const INDEX &idx = m_index[(m_indexHead + i) % m_indexSize];
+        fromPos = idx.pos;
+        if (static_cast<int>(idx.tick - fromTick) <= 0) break;
+    }
+    if (fromPos < 0) return -1;
+    // 読み出している間に上書きされないよう、最も古い部分は余裕をもって捨てる
+    LONGLONG oldestPos = m_writePos - m_capacity + m_capacity / 8;
+    return max(fromPos, max(m_validPos, oldestPos));
+}
+
+
+// posからtoPosの手前までのうち、バッファ上で連続する部分の先頭を*ppDataに返す
+// 戻り値はそのパケット数。保持していなければ0を返す
+// 読み出した後もIsRetained()で上書きされていないか確かめること
+DWORD CTsRingBuffer::Peek(LONGLONG pos, LONGLONG toPos, const BYTE **ppData)
+{
+    CBlockLock lock(&m_lock);
+    toPos = min(toPos, m_writePos);
+    if (!m_pBuf || pos >= toPos || pos < m_validPos || m_writePos - m_capacity > pos) return 0;
+    // 64ビットの剰余はランタイムの_allremを呼ぶので除算で求める
+    DWORD slot = static_cast<DWORD>(pos - pos / m_capacity * m_capacity);
+    DWORD n = m_capacity - slot;
+    if (toPos - pos < n) n = static_cast<DWORD>(toPos - pos);
+    *ppData = m_pBuf + slot * PACKET_SIZE;
+    return n;
+}
+
+
+// posのパケットがまだ上書きされていないかどうか
+bool CTsRingBuffer::IsRetained(LONGLONG pos)
+{
+    CBlockLock lock(&m_lock);
+    return pos >= m_validPos && m_writePos - m_capacity <= pos;
+}
+
+
+// fromTickの時点からtoPosの手前までのパケットをファイルに書き出すスレッドを開始する
+// 保持していない部分は書き出さない。書き出すものがなければfalseを返す
+bool CTsRingBuffer::BeginDump(LPCTSTR fileName, DWORD fromTick, LONGLONG toPos)
+{
+    WaitDump();
+    LONGLONG fromPos = GetTickPosition(fromTick);
+    if (fromPos < 0) return false;
+    toPos = min(toPos, GetPosition());
+    if (fromPos >= toPos) return false;
+
+    ::lstrcpyn(m_dumpFileName, fileName, ARRAY_SIZE(m_dumpFileName));
+    m_dumpFrom = fromPos;
+    m_dumpTo = toPos;
+    m_hDumpThread = ::CreateThread(NULL, 0, DumpThread, this, 0, NULL);
+    return m_hDumpThread != NULL;
+}
+
+
+// 書き出しの終了を待つ。書き出しに成功していればtrueを返す
+bool CTsRingBuffer::WaitDump()
+{
+    if (!m_hDumpThread) return false;
+    ::WaitForSingleObject(m_hDumpThread, INFINITE);
+    DWORD exitCode;
+    bool fRet = ::GetExitCodeThread(m_hDumpThread, &exitCode) && exitCode != 0;
+    ::CloseHandle(m_hDumpThread);
+    m_hDumpThread = NULL;
+    return fRet;
+}
+
+
+DWORD WINAPI CTsRingBuffer::DumpThread(LPVOID pParam)
+{
+    return static_cast<CTsRingBuffer*>(pParam)->Dump() ? 1 : 0;
+}
+
+
+bool CTsRingBuffer::Dump()
+{
+    HANDLE hFile = ::CreateFile(m_dumpFileName, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                                CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+
+    bool fRet = true;
+    // 64ビットの剰余はランタイムの_allremを呼ぶので、最初の位置だけ除算で求めて以降は折り返して進める
+    DWORD slot = static_cast<DWORD>(m_dumpFrom - m_dumpFrom / m_capacity * m_capacity);
+    for (LONGLONG pos = m_dumpFrom; fRet && pos < m_dumpTo;) {
+        // 一度に書き出すのはバッファの折り返しまでかつ1MB程度まで
+        DWORD n = min(m_capacity - slot, static_cast<DWORD>(1024 * 1024 / PACKET_SIZE));
+        if (m_dumpTo - pos < n) n = static_cast<DWORD>(m_dumpTo - pos);
+        DWORD written;
+        fRet = ::WriteFile(hFile, m_pBuf + slot * PACKET_SIZE, n * PACKET_SIZE, &written, NULL) &&
+               written == n * PACKET_SIZE;
+        // 書き出している間に上書きされていないか確かめる
+        CBlockLock lock(&m_lock);
+        if (m_writePos - m_capacity > pos) fRet = false;
+        pos += n;
+        slot += n;
+        if (slot >= m_capacity) slot = 0;
+    }
+    ::CloseHandle(hFile);
+    if (!fRet) ::DeleteFile(m_dumpFileName);
+    return fRet;
+}
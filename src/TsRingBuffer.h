@@ -0,0 +1,50 @@
+﻿#ifndef INCLUDE_TS_RING_BUFFER_H
+#define INCLUDE_TS_RING_BUFFER_H
+
+// 受信中のTSを直近の一定量だけメモリに保持する(タイムシフト)
+// 書き込みはストリームコールバックのスレッド、ファイルへの書き出しは専用のスレッドで行う
+class CTsRingBuffer
+{
+public:
+    static const int PACKET_SIZE = 188;
+    // 書き込み位置と時刻の対応を記録する間隔(ミリ秒)
+    static const DWORD INDEX_INTERVAL = 100;
+
+    CTsRingBuffer();
+    ~CTsRingBuffer();
+    bool Allocate(DWORD bufferSize, DWORD maxMsec);
+    void Free();
+    bool IsAllocated() const { return m_pBuf != NULL; }
+    void Write(const BYTE *pPacket);
+    void Reset();
+    LONGLONG GetPosition();
+    LONGLONG GetTickPosition(DWORD fromTick);
+    DWORD Peek(LONGLONG pos, LONGLONG toPos, const BYTE **ppData);
+    bool IsRetained(LONGLONG pos);
+    bool BeginDump(LPCTSTR fileName, DWORD fromTick, LONGLONG toPos);
+    bool WaitDump();
+private:
+    struct INDEX {
+        DWORD tick;
+        LONGLONG pos;
+    };
+    static DWORD WINAPI DumpThread(LPVOID pParam);
+    bool Dump();
+
+    CCriticalLock m_lock;
+    BYTE *m_pBuf;
+    DWORD m_capacity;       // パケット数
+    DWORD m_writeSlot;      // 次に書き込むパケットの位置
+    LONGLONG m_writePos;    // これまでに書き込んだパケット数
+    LONGLONG m_validPos;    // これより前のパケットはReset()前のもの
+    INDEX *m_index;
+    int m_indexSize;
+    int m_indexHead;
+    int m_indexCount;
+    HANDLE m_hDumpThread;
+    TCHAR m_dumpFileName[MAX_PATH + 8];
+    LONGLONG m_dumpFrom;
+    LONGLONG m_dumpTo;
+};
+
+#endif // INCLUDE_TS_RING_BUFFER_H
@@ -0,0 +1,304 @@
+﻿#include <Windows.h>
+#include "JstTime.h"
+#include "Util.h"
+#include "TsServiceFilter.h"
+
+
+CTsServiceFilter::CTsServiceFilter()
+    : m_serviceID(0)
+    , m_fLean(false)
+    , m_pmtPid(-1)
+    , m_servicePidCount(0)
+    , m_patCounter(0)
+    , m_pmtPacketCount(0)
+    , m_pmtCounter(0)
+{
+    m_pidType = new BYTE[PID_NUM];
+    Reset(0);
+}
+
+
+CTsServiceFilter::~CTsServiceFilter()
+{
+    delete [] m_pidType;
+}
+
+
+void CTsServiceFilter::Reset(WORD serviceID, bool fLean)
+{
+    m_serviceID = serviceID;
+    m_fLean = fLean;
+    ::ZeroMemory(m_pidType, PID_NUM);
+    m_pidType[0x0000] = PID_PAT;
+    // SDTとTOT(録画ファイルの解析で時刻に使う)は常に通す。軽量モードではTOTだけ
+    if (!fLean) m_pidType[0x0011] = PID_PASS;
+    m_pidType[0x0014] = PID_PASS;
+    m_pmtPid = -1;
+    m_servicePidCount = 0;
+    m_patSection.len = 0;
+    m_pmtSection.len = 0;
+    m_patCounter = 0;
+    m_pmtPacketCount = 0;
+    m_pmtCounter = 0;
+}
+
+
+int CTsServiceFilter::Filter(const BYTE *pPacket, const BYTE **ppOut)
+{
+    if (pPacket[0] != 0x47) return 0;
+    int pid = ((pPacket[1]&0x1f)<<8) | pPacket[2];
+    switch (m_pidType[pid]) {
+    case PID_PASS:
+        *ppOut = pPacket;
+        return 1;
+    case PID_PAT:
+        if (!(pPacket[1]&0x80) && StoreSection(&m_patSection, pPacket) && OnPat(m_patSection.data)) {
+            *ppOut = m_patPacket;
+            return 1;
+        }
+        return 0;
+    case PID_PMT:
+        if (!m_fLean) {
+            if (!(pPacket[1]&0x80) && StoreSection(&m_pmtSection, pPacket)) {
+                OnPmt(m_pmtSection.data);
+            }
+            *ppOut = pPacket;
+            return 1;
+        }
+        // 書き換えたPMTを元のPMTがそろうたびに出力する
+        if (!(pPacket[1]&0x80) && StoreSection(&m_pmtSection, pPacket) && OnPmt(m_pmtSection.data)) {
+            *ppOut = m_pmtPackets;
+            return m_pmtPacketCount;
+        }
+        return 0;
+    }
+    return 0;
+}
+
+
+// パケットのペイロードをセクションに加える。セクションがそろえばtrueを返す
+// (1つのパケットで複数のセクションが始まる場合は最初のものだけを扱う)
+bool CTsServiceFilter::StoreSection(SECTION *pSec, const BYTE *pPacket)
+{
+    int adaptationControl = (pPacket[3]>>4)&0x03;
+    if (!(adaptationControl & 1)) return false;
+    const BYTE *pPayload = pPacket + 4;
+    if (adaptationControl == 3) {
+        if (pPacket[4] > 182) return false;
+        pPayload += 1 + pPacket[4];
+    }
+    int payloadLen = static_cast<int>(pPacket + PACKET_SIZE - pPayload);
+
+    if (pPacket[1]&0x40) {
+        // セクションの開始
+        int pointerField = pPayload[0];
+        if (pointerField + 1 >= payloadLen) {
+            pSec->len = 0;
+            return false;
+        }
+        pPayload += 1 + pointerField;
+        payloadLen -= 1 + pointerField;
+        pSec->len = 0;
+    }
+    else if (pSec->len == 0) {
+        // 開始を待つ
+        return false;
+    }
+    int n = min(payloadLen, static_cast<int>(sizeof(pSec->data)) - pSec->len);
+    ::CopyMemory(pSec->data + pSec->len, pPayload, n);
+    pSec->len += n;
+    if (pSec->len < 3) return false;
+
+    int sectionLen = 3 + (((pSec->data[1]&0x0f)<<8) | pSec->data[2]);
+    if (sectionLen < 12 || sectionLen > 1024) {
+        pSec->len = 0;
+        return false;
+    }
+    if (pSec->len < sectionLen) return false;
+    pSec->len = 0;
+    // CRCを含めて計算すると0になる
+    return CalcCrc32(pSec->data, sectionLen) == 0;
+}
+
+
+DWORD CTsServiceFilter::CalcCrc32(const BYTE *pData, int len)
+{
+    DWORD crc = 0xFFFFFFFF;
+    for (int i = 0; i < len; ++i) {
+        crc ^= static_cast<DWORD>(pData[i]) << 24;
+        for (int j = 0; j < 8; ++j) {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+
+// PATから対象サービスのPMTを探し、対象サービスだけを載せたPATのパケットを作る
+bool CTsServiceFilter::OnPat(const BYTE *pSection)
+{
+    if (pSection[0] != 0x00 || !(pSection[5]&0x01)) return false;
+    int sectionLen = 3 + (((pSection[1]&0x0f)<<8) | pSection[2]);
+
+    int pmtPid = -1;
+    for (int i = 8; i + 4 <= sectionLen - 4; i += 4) {
+        WORD programNumber = (pSection[i]<<8) | pSection[i+1];
+        if (programNumber != 0 && programNumber == m_serviceID) {
+            pmtPid = ((pSection[i+2]&0x1f)<<8) | pSection[i+3];
+            break;
+        }
+    }
+    if (pmtPid < 0) return false;
+
+    if (pmtPid != m_pmtPid) {
+        if (m_pmtPid >= 0) m_pidType[m_pmtPid] = PID_DROP;
+        ClearServicePids();
+        // 固定のPIDと重なるときは上書きしない
+        if (m_pidType[pmtPid] == PID_DROP) m_pidType[pmtPid] = PID_PMT;
+        m_pmtPid = pmtPid;
+        m_pmtSection.len = 0;
+    }
+
+    BYTE *p = m_patPacket;
+    p[0] = 0x47;
+    p[1] = 0x40;
+    p[2] = 0x00;
+    p[3] = 0x10 | m_patCounter;
+    m_patCounter = (m_patCounter + 1) & 0x0f;
+    p[4] = 0;
+    BYTE *pSec = p + 5;
+    pSec[0] = 0x00;
+    pSec[1] = 0xb0;
+    pSec[2] = 5 + 4 + 4;
+    // transport_stream_idとversion_numberは元のものを引き継ぐ
+    pSec[3] = pSection[3];
+    pSec[4] = pSection[4];
+    pSec[5] = pSection[5];
+    pSec[6] = 0;
+    pSec[7] = 0;
+    pSec[8] = static_cast<BYTE>(m_serviceID >> 8);
+    pSec[9] = static_cast<BYTE>(m_serviceID);
+    pSec[10] = static_cast<BYTE>(0xe0 | (pmtPid >> 8));
+    pSec[11] = static_cast<BYTE>(pmtPid);
+    DWORD crc = CalcCrc32(pSec, 12);
+    pSec[12] = static_cast<BYTE>(crc >> 24);
+    pSec[13] = static_cast<BYTE>(crc >> 16);
+    pSec[14] = static_cast<BYTE>(crc >> 8);
+    pSec[15] = static_cast<BYTE>(crc);
+    ::FillMemory(pSec + 16, PACKET_SIZE - 5 - 16, 0xff);
+    return true;
+}
+
+
+// PMTから対象サービスのPID(PCR、ES、ECM)を集める
+bool CTsServiceFilter::OnPmt(const BYTE *pSection)
+{
+    if (pSection[0] != 0x02 || !(pSection[5]&0x01)) return false;
+    WORD programNumber = (pSection[3]<<8) | pSection[4];
+    if (programNumber != m_serviceID) return false;
+    int end = 3 + (((pSection[1]&0x0f)<<8) | pSection[2]) - 4;
+    int pos = 12 + (((pSection[10]&0x0f)<<8) | pSection[11]);
+    if (pos > end) return false;
+
+    ClearServicePids();
+    AddServicePid(((pSection[8]&0x1f)<<8) | pSection[9]);
+    AddCaPids(pSection + 12, pos - 12);
+
+    // 軽量モードのためにESを絞ったセクションも作る
+    BYTE newSection[1024];
+    ::CopyMemory(newSection, pSection, pos);
+    int newLen = pos;
+    bool fVideo = false;
+    bool fAudio = false;
+    while (pos + 5 <= end) {
+        int esLen = 5 + (((pSection[pos+3]&0x0f)<<8) | pSection[pos+4]);
+        if (pos + esLen > end) break;
+        bool fSelect = true;
+        if (m_fLean) {
+            // 最初の映像と最初の音声(主音声)だけ
+            if (!fVideo && IsVideoStream(pSection[pos])) fVideo = true;
+            else if (!fAudio && IsAudioStream(pSection[pos])) fAudio = true;
+            else fSelect = false;
+        }
+        if (fSelect) {
+            AddServicePid(((pSection[pos+1]&0x1f)<<8) | pSection[pos+2]);
+            AddCaPids(pSection + pos + 5, esLen - 5);
+            ::CopyMemory(newSection + newLen, pSection + pos, esLen);
+            newLen += esLen;
+        }
+        pos += esLen;
+    }
+    if (m_fLean) BuildPmtPackets(newSection, newLen);
+    return true;
+}
+
+
+// 記述子のうちCA記述子のPID(ECM)を集める
+void CTsServiceFilter::AddCaPids(const BYTE *pDesc, int len)
+{
+    for (int pos = 0; pos + 2 <= len; pos += 2 + pDesc[pos+1]) {
+        if (pDesc[pos] == 0x09 && pDesc[pos+1] >= 4 && pos + 6 <= len) {
+            AddServicePid(((pDesc[pos+4]&0x1f)<<8) | pDesc[pos+5]);
+        }
+    }
+}
+
+
+// CRCを除くlenバイトのPMTセクションからパケットを作る
+void CTsServiceFilter::BuildPmtPackets(BYTE *pSection, int len)
+{
+    pSection[1] = static_cast<BYTE>((pSection[1]&0xf0) | ((len + 1) >> 8));
+    pSection[2] = static_cast<BYTE>(len + 1);
+    DWORD crc = CalcCrc32(pSection, len);
+    pSection[len++] = static_cast<BYTE>(crc >> 24);
+    pSection[len++] = static_cast<BYTE>(crc >> 16);
+    pSection[len++] = static_cast<BYTE>(crc >> 8);
+    pSection[len++] = static_cast<BYTE>(crc);
+
+    m_pmtPacketCount = 0;
+    for (int pos = 0; pos < len && m_pmtPacketCount < PMT_PACKET_MAX; ++m_pmtPacketCount) {
+        BYTE *p = m_pmtPackets + m_pmtPacketCount * PACKET_SIZE;
+        p[0] = 0x47;
+        p[1] = static_cast<BYTE>((pos == 0 ? 0x40 : 0) | (m_pmtPid >> 8));
+        p[2] = static_cast<BYTE>(m_pmtPid);
+        p[3] = 0x10 | m_pmtCounter;
+        m_pmtCounter = (m_pmtCounter + 1) & 0x0f;
+        int head = 4;
+        if (pos == 0) p[head++] = 0;
+        int n = min(PACKET_SIZE - head, len - pos);
+        ::CopyMemory(p + head, pSection + pos, n);
+        ::FillMemory(p + head + n, PACKET_SIZE - head - n, 0xff);
+        pos += n;
+    }
+}
+
+
+bool CTsServiceFilter::IsVideoStream(BYTE streamType)
+{
+    // MPEG-1/2 Video, H.264, H.265
+    return streamType == 0x01 || streamType == 0x02 || streamType == 0x1b || streamType == 0x24;
+}
+
+
+bool CTsServiceFilter::IsAudioStream(BYTE streamType)
+{
+    // MPEG-1/2 Audio, AAC(ADTS), AAC(LATM), AC-3
+    return streamType == 0x03 || streamType == 0x04 || streamType == 0x0f || streamType == 0x11 || streamType == 0x81;
+}
+
+
+void CTsServiceFilter::AddServicePid(int pid)
+{
+    if (m_pidType[pid] != PID_DROP || pid == 0x1fff || m_servicePidCount >= SERVICE_PID_MAX) return;
+    m_pidType[pid] = PID_PASS;
+    m_servicePids[m_servicePidCount++] = static_cast<WORD>(pid);
+}
+
+
+void CTsServiceFilter::ClearServicePids()
+{
+    for (int i = 0; i < m_servicePidCount; ++i) {
+        m_pidType[m_servicePids[i]] = PID_DROP;
+    }
+    m_servicePidCount = 0;
+}
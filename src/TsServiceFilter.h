@@ -0,0 +1,55 @@
+﻿#ifndef INCLUDE_TS_SERVICE_FILTER_H
+#define INCLUDE_TS_SERVICE_FILTER_H
+
+// TSから1つのサービスに属するパケットだけを取り出す
+// PATは対象サービスだけを載せたものに書き換える。パケットの入出力以外には依存しない
+// 軽量モードでは映像と音声を1つずつ(とPCRとECM)に絞り、PMTもそれだけを載せたものに書き換える
+class CTsServiceFilter
+{
+public:
+    static const int PID_NUM = 8192;
+    static const int PACKET_SIZE = 188;
+    // 対象サービスのPMTが参照するPIDの最大数
+    static const int SERVICE_PID_MAX = 64;
+    // 書き換えたPMTのパケット数の上限(セクションは最大1024バイト)
+    static const int PMT_PACKET_MAX = 6;
+
+    CTsServiceFilter();
+    ~CTsServiceFilter();
+    void Reset(WORD serviceID, bool fLean = false);
+    // 出力するパケット(入力そのものか書き換えたもの)を*ppOutに返し、そのパケット数を返す
+    int Filter(const BYTE *pPacket, const BYTE **ppOut);
+    WORD GetServiceID() const { return m_serviceID; }
+private:
+    enum { PID_DROP, PID_PASS, PID_PAT, PID_PMT };
+    struct SECTION {
+        BYTE data[1024 + PACKET_SIZE];
+        int len;
+    };
+    static bool StoreSection(SECTION *pSec, const BYTE *pPacket);
+    static DWORD CalcCrc32(const BYTE *pData, int len);
+    bool OnPat(const BYTE *pSection);
+    bool OnPmt(const BYTE *pSection);
+    void AddCaPids(const BYTE *pDesc, int len);
+    void BuildPmtPackets(BYTE *pSection, int len);
+    static bool IsVideoStream(BYTE streamType);
+    static bool IsAudioStream(BYTE streamType);
+    void AddServicePid(int pid);
+    void ClearServicePids();
+
+    WORD m_serviceID;
+    bool m_fLean;
+    BYTE *m_pidType;
+    int m_pmtPid;
+    WORD m_servicePids[SERVICE_PID_MAX];
+    int m_servicePidCount;
+    SECTION m_patSection;
+    SECTION m_pmtSection;
+    BYTE m_patPacket[PACKET_SIZE];
+    BYTE m_patCounter;
+    BYTE m_pmtPackets[PACKET_SIZE * PMT_PACKET_MAX];
+    int m_pmtPacketCount;
+    BYTE m_pmtCounter;
+};
+
+#endif // INCLUDE_TS_SERVICE_FILTER_H
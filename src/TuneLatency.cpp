@@ -0,0 +1,144 @@
+﻿#include <Windows.h>
+#include <Shlwapi.h>
+#include "JstTime.h"
+#include "Util.h"
+#include "TuneLatency.h"
+
+
+CTuneLatency::CTuneLatency()
+    : m_num(0)
+{
+    m_saveFileName[0] = 0;
+}
+
+
+void CTuneLatency::SetPluginFileName(LPCTSTR fileName)
+{
+    TCHAR saveFileName[MAX_PATH + 32];
+    ::lstrcpy(saveFileName, fileName);
+    ::PathRemoveExtension(saveFileName);
+    ::lstrcat(saveFileName, TEXT("_Tuning.txt"));
+    ::lstrcpyn(m_saveFileName, saveFileName, ARRAY_SIZE(m_saveFileName));
+}
+
+
+// 書式: NetworkID<TAB>TransportStreamID<TAB>ミリ秒<TAB>ミリ秒...(古い順)
+bool CTuneLatency::Load()
+{
+    m_num = 0;
+    if (!m_saveFileName[0] || !::PathFileExists(m_saveFileName)) return false;
+    LPTSTR text = NULL;
+    for (int i = 0; i < 5; ++i) {
+        if ((text = NewReadTextFileToEnd(m_saveFileName, FILE_SHARE_READ)) != NULL) break;
+        ::Sleep(200);
+    }
+    if (!text) return false;
+
+    for (LPCTSTR line = text; line && *line && m_num < STREAM_MAX;) {
+        STREAM &st = m_streams[m_num];
+        LPCTSTR p = line;
+        st.networkID = static_cast<WORD>(::StrToInt(p));
+        if (NextToken(&p)) {
+            st.transportStreamID = static_cast<WORD>(::StrToInt(p));
+            st.num = 0;
+            while (NextToken(&p) && st.num < SAMPLE_MAX) {
+                st.samples[st.num++] = max(::StrToInt(p), 0);
+            }
+            if (st.num > 0) ++m_num;
+        }
+        line = ::StrChr(line, TEXT('\n'));
+        if (line) ++line;
+    }
+    delete [] text;
+    return true;
+}
+
+
+bool CTuneLatency::Save() const
+{
+    if (!m_saveFileName[0]) return false;
+
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    for (int i = 0; i < 5; ++i) {
+        hFile = ::CreateFile(m_saveFileName, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile != INVALID_HANDLE_VALUE) break;
+        ::Sleep(200);
+    }
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+
+    DWORD writtenBytes;
+    WCHAR bom = L'\xFEFF';
+    ::WriteFile(hFile, &bom, sizeof(bom), &writtenBytes, NULL);
+
+    for (int i = 0; i < m_num; ++i) {
+        const STREAM &st = m_streams[i];
+        TCHAR buf[32 + SAMPLE_MAX * 12];
+        LPTSTR tail = buf + ::wsprintf(buf, TEXT("%d\t%d"), st.networkID, st.transportStreamID);
+        for (int j = 0; j < st.num; ++j) {
+            tail += ::wsprintf(tail, TEXT("\t%d"), st.samples[j]);
+        }
+        ::lstrcpy(tail, TEXT("\r\n"));
+        ::WriteFile(hFile, buf, ::lstrlen(buf) * sizeof(TCHAR), &writtenBytes, NULL);
+    }
+
+    ::CloseHandle(hFile);
+    return true;
+}
+
+
+void CTuneLatency::Add(WORD networkID, WORD transportStreamID, int msec)
+{
+    STREAM st;
+    st.networkID = networkID;
+    st.transportStreamID = transportStreamID;
+    st.num = 0;
+    int i = 0;
+    for (; i < m_num; ++i) {
+        if (m_streams[i].networkID == networkID && m_streams[i].transportStreamID == transportStreamID) {
+            st = m_streams[i];
+            break;
+        }
+    }
+    if (i == m_num && m_num == STREAM_MAX) {
+        // 最も長く使われていないものを捨てる
+        i = 0;
+    }
+    else if (i == m_num) {
+        ++m_num;
+    }
+    // 最後尾に移す
+    for (; i + 1 < m_num; ++i) m_streams[i] = m_streams[i + 1];
+
+    if (st.num == SAMPLE_MAX) {
+        for (int j = 1; j < SAMPLE_MAX; ++j) st.samples[j - 1] = st.samples[j];
+        --st.num;
+    }
+    st.samples[st.num++] = max(msec, 0);
+    m_streams[m_num - 1] = st;
+}
+
+
+const CTuneLatency::STREAM *CTuneLatency::Find(WORD networkID, WORD transportStreamID) const
+{
+    for (int i = 0; i < m_num; ++i) {
+        if (m_streams[i].networkID == networkID && m_streams[i].transportStreamID == transportStreamID) {
+            return &m_streams[i];
+        }
+    }
+    return NULL;
+}
+
+
+// 記録のpercent%点(ミリ秒)を返す。記録がminSamplesに満たなければ-1
+int CTuneLatency::GetPercentile(WORD networkID, WORD transportStreamID, int percent, int minSamples) const
+{
+    const STREAM *pStream = Find(networkID, transportStreamID);
+    if (!pStream || pStream->num < max(minSamples, 1)) return -1;
+
+    int values[SAMPLE_MAX];
+    for (int i = 0; i < pStream->num; ++i) values[i] = pStream->samples[i];
+    SortInt(values, pStream->num);
+    // 切り上げ
+    int rank = (pStream->num * percent + 99) / 100;
+    return values[min(max(rank, 1), pStream->num) - 1];
+}
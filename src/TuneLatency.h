@@ -0,0 +1,34 @@
+﻿#ifndef INCLUDE_TUNE_LATENCY_H
+#define INCLUDE_TUNE_LATENCY_H
+
+// ストリーム(ONID,TSID)ごとにチャンネル変更から受信が安定するまでの時間を記録する
+class CTuneLatency
+{
+public:
+    // 記録するストリームの数
+    static const int STREAM_MAX = 64;
+    // ストリームあたりの記録数(古いものから捨てる)
+    static const int SAMPLE_MAX = 16;
+
+    CTuneLatency();
+    void SetPluginFileName(LPCTSTR fileName);
+    bool Load();
+    bool Save() const;
+    void Add(WORD networkID, WORD transportStreamID, int msec);
+    int GetPercentile(WORD networkID, WORD transportStreamID, int percent, int minSamples) const;
+private:
+    struct STREAM {
+        WORD networkID;
+        WORD transportStreamID;
+        int num;
+        int samples[SAMPLE_MAX];  // ミリ秒、古い順
+    };
+    const STREAM *Find(WORD networkID, WORD transportStreamID) const;
+
+    // 最近記録したものほど後ろ
+    STREAM m_streams[STREAM_MAX];
+    int m_num;
+    TCHAR m_saveFileName[MAX_PATH];
+};
+
+#endif // INCLUDE_TUNE_LATENCY_H
@@ -2,6 +2,7 @@
 #include <Shlwapi.h>
 #include <ShlObj.h>
 #include <tchar.h>
+#include "JstTime.h"
 #include "Util.h"
 
 // CRT非依存のためにはさらに /NODEFAULTLIB /GR- /GS- /EHsc削除 が必要
@@ -18,22 +19,6 @@ void operator delete(void *ptr)
 }
 #endif
 
-// WritePrivateProfileString()の引用符付加版
-BOOL WritePrivateProfileStringQuote(LPCTSTR lpAppName, LPCTSTR lpKeyName, LPCTSTR lpString, LPCTSTR lpFileName)
-{
-    TCHAR szVal[1024];
-    int len = ::lstrlen(lpString);
-    if (lpString[0] != TEXT('"') || lpString[0] != lpString[len-1] || len == 1) {
-        return ::WritePrivateProfileString(lpAppName, lpKeyName, lpString, lpFileName);
-    }
-    if (len >= _countof(szVal) - 2) return FALSE;
-    szVal[0] = TEXT('"');
-    ::lstrcpy(&szVal[1], lpString);
-    szVal[len+1] = TEXT('"');
-    szVal[len+2] = TEXT('\0');
-    return ::WritePrivateProfileString(lpAppName, lpKeyName, szVal, lpFileName);
-}
-
 DWORD GetLongModuleFileName(HMODULE hModule, LPTSTR lpFileName, DWORD nSize)
 {
     TCHAR longOrShortName[MAX_PATH];
@@ -76,6 +61,19 @@ HANDLE CreateFullAccessMutex(BOOL bInitialOwner, LPCTSTR name)
     return ::CreateMutex(&sa, bInitialOwner, name);
 }
 
+// ページファイルを裏付けとする名前つき共有メモリを作成する(既にあれば開く)
+HANDLE CreateFullAccessFileMapping(DWORD size, LPCTSTR name)
+{
+    SECURITY_DESCRIPTOR sd = {0};
+    ::InitializeSecurityDescriptor(&sd, SECURITY_DESCRIPTOR_REVISION);
+    ::SetSecurityDescriptorDacl(&sd, TRUE, NULL, FALSE);
+    SECURITY_ATTRIBUTES sa;
+    sa.nLength = sizeof(sa);
+    sa.lpSecurityDescriptor = &sd;
+    sa.bInheritHandle = FALSE;
+    return ::CreateFileMapping(INVALID_HANDLE_VALUE, &sa, PAGE_READWRITE, 0, size, name);
+}
+
 bool IsWindows7OrLater()
 {
     OSVERSIONINFOEX vi;
@@ -106,6 +104,25 @@ void WriteFileForSpinUp(LPCTSTR dirName)
     ::DeleteFile(path);
 }
 
+// ディレクトリのあるボリュームで使える空き容量(MB)を取得する
+bool GetFreeSpaceMBytes(LPCTSTR dirName, DWORD *pMBytes)
+{
+    ULARGE_INTEGER freeBytes;
+    if (!dirName[0] || !::GetDiskFreeSpaceEx(dirName, &freeBytes, NULL, NULL)) return false;
+    freeBytes.QuadPart >>= 20;
+    *pMBytes = freeBytes.HighPart ? 0xFFFFFFFF : freeBytes.LowPart;
+    return true;
+}
+
+// 2つのパスが同じボリュームにあるかどうか(調べられないときは同じとみなす)
+bool IsSameVolume(LPCTSTR path1, LPCTSTR path2)
+{
+    TCHAR root1[MAX_PATH], root2[MAX_PATH];
+    return !::GetVolumePathName(path1, root1, ARRAY_SIZE(root1)) ||
+           !::GetVolumePathName(path2, root2, ARRAY_SIZE(root2)) ||
+           !::lstrcmpi(root1, root2);
+}
+
 // BOM付きUTF-16テキストファイルを文字列として全て読む
 // 成功するとnewされた配列のポインタが返るので、必ずdeleteすること
 WCHAR *NewReadTextFileToEnd(LPCTSTR fileName, DWORD dwShareMode)
@@ -216,6 +233,41 @@ void RemoveTextPattern(LPTSTR str, LPCTSTR pattern)
     }
 }
 
+// 改行やタブを含む文字列を1つのフィールドとして書き出せるようにエスケープする
+// destにはsrcの2倍の長さが必要。戻り値はdestの終端
+LPTSTR EscapeTextField(LPTSTR dest, LPCTSTR src)
+{
+    for (; *src; ++src) {
+        switch (*src) {
+        case TEXT('\\'): *dest++ = TEXT('\\'); *dest++ = TEXT('\\'); break;
+        case TEXT('\t'): *dest++ = TEXT('\\'); *dest++ = TEXT('t'); break;
+        case TEXT('\r'): *dest++ = TEXT('\\'); *dest++ = TEXT('r'); break;
+        case TEXT('\n'): *dest++ = TEXT('\\'); *dest++ = TEXT('n'); break;
+        default: *dest++ = *src; break;
+        }
+    }
+    *dest = 0;
+    return dest;
+}
+
+// EscapeTextField()の逆(タブか改行の手前まで)
+// 戻り値はdestの終端
+LPTSTR UnescapeTextField(LPCTSTR src, LPTSTR dest, int max)
+{
+    for (; *src && *src != TEXT('\t') && *src != TEXT('\r') && *src != TEXT('\n') && max > 1; ++src, --max) {
+        if (*src == TEXT('\\') && src[1]) {
+            ++src;
+            *dest++ = *src == TEXT('t') ? TEXT('\t') : *src == TEXT('r') ? TEXT('\r') :
+                      *src == TEXT('n') ? TEXT('\n') : *src;
+        }
+        else {
+            *dest++ = *src;
+        }
+    }
+    *dest = 0;
+    return dest;
+}
+
 // フラグ文字列"T.TT..."をbool配列に変換
 bool FlagStrToArray(LPCTSTR str, bool *flags, int len)
 {
@@ -273,14 +325,15 @@ bool StrToFileTime(LPCTSTR str, FILETIME *pTime)
 
 void FileTimeToStr(const FILETIME *pTime, LPTSTR str)
 {
-    SYSTEMTIME sysTime;
-    if (!::FileTimeToSystemTime(pTime, &sysTime)) {
+    JST_TIME t = FileTimeToJst(*pTime);
+    if (t < 0) {
         ::lstrcpy(str, TEXT("0000-00-00T00:00:00"));
     }
     else {
+        JST_CIVIL c;
+        JstTimeToCivil(t, &c);
         ::wsprintf(str, TEXT("%04d-%02d-%02dT%02d:%02d:%02d"),
-                   sysTime.wYear, sysTime.wMonth, sysTime.wDay,
-                   sysTime.wHour, sysTime.wMinute, sysTime.wSecond);
+                   c.year, c.month, c.day, c.hour, c.minute, c.second);
     }
 }
 
@@ -290,50 +343,48 @@ void GetEpgTimeAsFileTime(FILETIME *pTime)
     *pTime += 9 * FILETIME_HOUR;
 }
 
-bool AribToFileTime(const BYTE *pHexData, FILETIME *pTime)
+// 昇順に並べる(要素数が少ないときのための挿入ソート)
+void SortInt(int *p, int n)
 {
-    // 全ビットが1のときは未定義
-    if (pHexData[0] == 0xFF && pHexData[1] == 0xFF && pHexData[2] == 0xFF && pHexData[3] == 0xFF && pHexData[4] == 0xFF) {
-        return false;
+    for (int i = 1; i < n; ++i) {
+        int v = p[i];
+        int j = i;
+        for (; j > 0 && p[j - 1] > v; --j) p[j] = p[j - 1];
+        p[j] = v;
     }
-    // 1858-11-17
-    pTime->dwLowDateTime = 2303934464UL;
-    pTime->dwHighDateTime = 18947191UL;
-    // MJD形式の日付
-    *pTime += (pHexData[0] << 8 | pHexData[1]) * 24 * FILETIME_HOUR;
-    // BCD形式の時刻
-    *pTime += ((pHexData[2] >> 4) * 10 + (pHexData[2] & 15)) * FILETIME_HOUR;
-    *pTime += ((pHexData[3] >> 4) * 10 + (pHexData[3] & 15)) * FILETIME_MINUTE;
-    *pTime += ((pHexData[4] >> 4) * 10 + (pHexData[4] & 15)) * FILETIME_SECOND;
-    return true;
 }
 
 
-#if 1 // From: TVTest_0.7.19r2_Src/Util.cpp
-
-FILETIME &operator+=(FILETIME &ft,LONGLONG Offset)
+// 行末(CR,LF,NUL)までの文字列のハッシュ値(FNV-1a)を求める(0は返さない)
+DWORD HashLine(LPCTSTR str, int *pLength)
 {
-	ULARGE_INTEGER Result;
-
-	Result.LowPart=ft.dwLowDateTime;
-	Result.HighPart=ft.dwHighDateTime;
-	Result.QuadPart+=Offset;
-	ft.dwLowDateTime=Result.LowPart;
-	ft.dwHighDateTime=Result.HighPart;
-	return ft;
+    DWORD hash = 2166136261;
+    int len = 0;
+    for (; str[len] && str[len] != TEXT('\r') && str[len] != TEXT('\n'); ++len) {
+        hash = (hash ^ static_cast<WORD>(str[len])) * 16777619;
+    }
+    if (pLength) *pLength = len;
+    return hash ? hash : 1;
 }
 
-LONGLONG operator-(const FILETIME &ft1,const FILETIME &ft2)
-{
-	LARGE_INTEGER Time1,Time2;
 
-	Time1.LowPart=ft1.dwLowDateTime;
-	Time1.HighPart=ft1.dwHighDateTime;
-	Time2.LowPart=ft2.dwLowDateTime;
-	Time2.HighPart=ft2.dwHighDateTime;
-	return Time1.QuadPart-Time2.QuadPart;
+// ファイルが存在しなければゼロで埋めてfalseを返す
+bool GetFileStamp(LPCTSTR fileName, FILE_STAMP *pStamp)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!fileName[0] || !::GetFileAttributesEx(fileName, GetFileExInfoStandard, &data)) {
+        ::ZeroMemory(pStamp, sizeof(*pStamp));
+        return false;
+    }
+    pStamp->lastWriteTime = data.ftLastWriteTime;
+    pStamp->fileSizeHigh = data.nFileSizeHigh;
+    pStamp->fileSizeLow = data.nFileSizeLow;
+    return true;
 }
 
+
+#if 1 // From: TVTest_0.7.19r2_Src/Util.cpp
+
 LPCTSTR GetDayOfWeekText(int DayOfWeek)
 {
 	if (DayOfWeek<0 || DayOfWeek>6)
@@ -502,161 +553,6 @@ bool MatchKeyword(LPCTSTR pszText,LPCTSTR pszKeyword)
 #endif
 
 
-# if 1 // From: TVTest_0.7.19r2_Src/HelperClass/StdUtil.cpp (vswprintf_s -> wvsprintf改変)
-int StdUtil_snprintf(wchar_t *s,size_t n,const wchar_t *format, ...)
-{
-	va_list args;
-	int Length;
-
-	va_start(args,format);
-	if (n>0) {
-        // wvsprintfのバッファ制限は1KB(KB77255)
-        // 実測ではWCHARだと2KB、超えると1024番目にNULL文字がつく
-        TCHAR buf[1025];
-		Length=::wvsprintf(buf,format,args);
-        ::lstrcpyn(s, buf, n);
-	} else {
-		Length=0;
-	}
-	va_end(args);
-	return Length;
-}
-#endif
-
-
-#if 1 // From: TVTest_0.8.2_Src/Record.cpp (一部改変)
-
-int FormatFileName(LPTSTR pszFileName, int MaxFileName, WORD EventID, FILETIME StartTimeSpec, LPCTSTR pszEventName, LPCTSTR pszFormat)
-{
-	SYSTEMTIME stStart;
-	LPCTSTR p;
-	int i;
-
-	::FileTimeToSystemTime(&StartTimeSpec,&stStart);
-	p=pszFormat;
-	for (i=0;i<MaxFileName-1 && *p!=_T('\0');) {
-		if (*p==_T('%')) {
-			p++;
-			if (*p==_T('%')) {
-				pszFileName[i++]=_T('%');
-				p++;
-			} else {
-				TCHAR szKeyword[32];
-				size_t j;
-
-				for (j=0;p[j]!=_T('%') && p[j]!=_T('\0');j++) {
-					if (j<ARRAY_SIZE(szKeyword)-1)
-						szKeyword[j]=p[j];
-				}
-				if (j<=ARRAY_SIZE(szKeyword)-1 && p[j]==_T('%')) {
-					const int Remain=MaxFileName-i;
-
-					p+=j+1;
-					szKeyword[j]=_T('\0');
-					if (::lstrcmpi(szKeyword,TEXT("date"))==0) {
-						i+=StdUtil_snprintf(&pszFileName[i],Remain,TEXT("%d%02d%02d"),
-											stStart.wYear,stStart.wMonth,stStart.wDay);
-					} else if (::lstrcmpi(szKeyword,TEXT("year"))==0) {
-						i+=StdUtil_snprintf(&pszFileName[i],Remain,TEXT("%d"),stStart.wYear);
-					} else if (::lstrcmpi(szKeyword,TEXT("year2"))==0) {
-						i+=StdUtil_snprintf(&pszFileName[i],Remain,TEXT("%02d"),stStart.wYear%100);
-					} else if (::lstrcmpi(szKeyword,TEXT("month"))==0) {
-						i+=StdUtil_snprintf(&pszFileName[i],Remain,TEXT("%d"),stStart.wMonth);
-					} else if (::lstrcmpi(szKeyword,TEXT("month2"))==0) {
-						i+=StdUtil_snprintf(&pszFileName[i],Remain,TEXT("%02d"),stStart.wMonth);
-					} else if (::lstrcmpi(szKeyword,TEXT("day"))==0) {
-						i+=StdUtil_snprintf(&pszFileName[i],Remain,TEXT("%d"),stStart.wDay);
-					} else if (::lstrcmpi(szKeyword,TEXT("day2"))==0) {
-						i+=StdUtil_snprintf(&pszFileName[i],Remain,TEXT("%02d"),stStart.wDay);
-					} else if (::lstrcmpi(szKeyword,TEXT("time"))==0) {
-						i+=StdUtil_snprintf(&pszFileName[i],Remain,TEXT("%02d%02d%02d"),
-											stStart.wHour,stStart.wMinute,stStart.wSecond);
-					} else if (::lstrcmpi(szKeyword,TEXT("hour"))==0) {
-						i+=StdUtil_snprintf(&pszFileName[i],Remain,TEXT("%d"),stStart.wHour);
-					} else if (::lstrcmpi(szKeyword,TEXT("hour2"))==0) {
-						i+=StdUtil_snprintf(&pszFileName[i],Remain,TEXT("%02d"),stStart.wHour);
-					} else if (::lstrcmpi(szKeyword,TEXT("minute"))==0) {
-						i+=StdUtil_snprintf(&pszFileName[i],Remain,TEXT("%d"),stStart.wMinute);
-					} else if (::lstrcmpi(szKeyword,TEXT("minute2"))==0) {
-						i+=StdUtil_snprintf(&pszFileName[i],Remain,TEXT("%02d"),stStart.wMinute);
-					} else if (::lstrcmpi(szKeyword,TEXT("second"))==0) {
-						i+=StdUtil_snprintf(&pszFileName[i],Remain,TEXT("%d"),stStart.wSecond);
-					} else if (::lstrcmpi(szKeyword,TEXT("second2"))==0) {
-						i+=StdUtil_snprintf(&pszFileName[i],Remain,TEXT("%02d"),stStart.wSecond);
-					} else if (::lstrcmpi(szKeyword,TEXT("day-of-week"))==0) {
-						i+=StdUtil_snprintf(&pszFileName[i],Remain,TEXT("%s"),
-											GetDayOfWeekText(stStart.wDayOfWeek));
-					} else if (::lstrcmpi(szKeyword,TEXT("event-name"))==0) {
-						if (pszEventName!=NULL) {
-							::lstrcpyn(&pszFileName[i],pszEventName,Remain);
-							TranslateText(&pszFileName[i],TEXT("!\\/:*?\"<>|!￥／：＊？”＜＞｜!"));
-							i+=::lstrlen(&pszFileName[i]);
-						}
-					} else if (::lstrcmpi(szKeyword,TEXT("event-id"))==0) {
-						i+=StdUtil_snprintf(&pszFileName[i],Remain,TEXT("%04X"),EventID);
-					} else {
-						i+=StdUtil_snprintf(&pszFileName[i],Remain,TEXT("%%%s%%"),szKeyword);
-					}
-				} else {
-					pszFileName[i++]=_T('%');
-				}
-			}
-		} else {
-			pszFileName[i++]=*p++;
-		}
-	}
-	pszFileName[i]=_T('\0');
-	return i;
-}
-
-#endif
-
-// イベント名に"%num%"or"%num2"(連番)フォーマット指示子があれば置換する
-int FormatEventName(LPTSTR pszEventName, int MaxEventName, int num, LPCTSTR pszFormat)
-{
-	LPCTSTR p;
-	int i;
-
-	p=pszFormat;
-	for (i=0;i<MaxEventName-1 && *p!=_T('\0');) {
-		if (*p==_T('%')) {
-			p++;
-			if (*p==_T('%')) {
-				pszEventName[i++]=_T('%');
-				p++;
-			} else {
-				TCHAR szKeyword[32];
-				size_t j;
-
-				for (j=0;p[j]!=_T('%') && p[j]!=_T('\0');j++) {
-					if (j<ARRAY_SIZE(szKeyword)-1)
-						szKeyword[j]=p[j];
-				}
-				if (j<=ARRAY_SIZE(szKeyword)-1 && p[j]==_T('%')) {
-					const int Remain=MaxEventName-i;
-
-					p+=j+1;
-					szKeyword[j]=_T('\0');
-					if (::lstrcmpi(szKeyword,TEXT("num"))==0) {
-						if (num > 0) i+=StdUtil_snprintf(&pszEventName[i],Remain,TEXT("%d"),num);
-					} else if (::lstrcmpi(szKeyword,TEXT("num2"))==0) {
-						if (num > 0) i+=StdUtil_snprintf(&pszEventName[i],Remain,TEXT("%02d"),num);
-					} else {
-						i+=StdUtil_snprintf(&pszEventName[i],Remain,TEXT("%%%s%%"),szKeyword);
-					}
-				} else {
-					pszEventName[i++]=_T('%');
-				}
-			}
-		} else {
-			pszEventName[i++]=*p++;
-		}
-	}
-	pszEventName[i]=_T('\0');
-	return i;
-}
-
-
 void CNotifyIcon::Initialize(HWND hwnd, UINT uid, UINT msg)
 {
     Finalize();
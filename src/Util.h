@@ -17,10 +17,10 @@
 // NewReadTextFileToEnd()の最大ファイルサイズ
 #define READ_FILE_MAX_SIZE  (4096 * 1024)
 
-#define FILETIME_MILLISECOND    10000LL
-#define FILETIME_SECOND         (1000LL*FILETIME_MILLISECOND)
-#define FILETIME_MINUTE         (60LL*FILETIME_SECOND)
-#define FILETIME_HOUR           (60LL*FILETIME_MINUTE)
+#define FILETIME_MILLISECOND    JST_TIME_MILLISECOND
+#define FILETIME_SECOND         JST_TIME_SECOND
+#define FILETIME_MINUTE         JST_TIME_MINUTE
+#define FILETIME_HOUR           JST_TIME_HOUR
 
 #ifdef _DEBUG
 #define DEBUG_OUT(x) ::OutputDebugString(x)
@@ -48,13 +48,15 @@ void operator delete(void *ptr);
 inline void operator delete[](void *ptr) { operator delete(ptr); }
 #endif
 
-BOOL WritePrivateProfileStringQuote(LPCTSTR lpAppName, LPCTSTR lpKeyName, LPCTSTR lpString, LPCTSTR lpFileName);
 DWORD GetLongModuleFileName(HMODULE hModule, LPTSTR lpFileName, DWORD nSize);
 DWORD GetShortModuleFileName(HMODULE hModule, LPTSTR lpFileName, DWORD nSize);
 bool GetIdentifierFromModule(HMODULE hModule, LPTSTR name, DWORD max);
 HANDLE CreateFullAccessMutex(BOOL bInitialOwner, LPCTSTR name);
+HANDLE CreateFullAccessFileMapping(DWORD size, LPCTSTR name);
 bool IsWindows7OrLater();
 void WriteFileForSpinUp(LPCTSTR dirName);
+bool GetFreeSpaceMBytes(LPCTSTR dirName, DWORD *pMBytes);
+bool IsSameVolume(LPCTSTR path1, LPCTSTR path2);
 WCHAR *NewReadTextFileToEnd(LPCTSTR fileName, DWORD dwShareMode);
 bool GetRundll32Path(LPTSTR rundllPath);
 void GetToken(LPCTSTR str, LPTSTR token, int max);
@@ -62,6 +64,8 @@ bool NextToken(LPCTSTR *str);
 void ReplaceTokenDelimiters(LPTSTR str);
 void TranslateText(LPTSTR str, LPCTSTR pattern);
 void RemoveTextPattern(LPTSTR str, LPCTSTR pattern);
+LPTSTR EscapeTextField(LPTSTR dest, LPCTSTR src);
+LPTSTR UnescapeTextField(LPCTSTR src, LPTSTR dest, int max);
 
 bool FlagStrToArray(LPCTSTR str, bool *flags, int len);
 void FlagArrayToStr(const bool *flags, LPTSTR str, int len);
@@ -70,10 +74,56 @@ void TimeSpanToStr(int span, LPTSTR str);
 bool StrToFileTime(LPCTSTR str, FILETIME *pTime);
 void FileTimeToStr(const FILETIME *pTime, LPTSTR str);
 void GetEpgTimeAsFileTime(FILETIME *pTime);
-bool AribToFileTime(const BYTE *pHexData, FILETIME *pTime);
+void SortInt(int *p, int n);
+DWORD HashLine(LPCTSTR str, int *pLength);
+
+// ファイルの変更の有無を調べるための最終書き込み時刻とサイズ
+struct FILE_STAMP {
+    FILETIME lastWriteTime;
+    DWORD fileSizeHigh;
+    DWORD fileSizeLow;
+    bool operator==(const FILE_STAMP &o) const {
+        return lastWriteTime.dwLowDateTime == o.lastWriteTime.dwLowDateTime &&
+               lastWriteTime.dwHighDateTime == o.lastWriteTime.dwHighDateTime &&
+               fileSizeHigh == o.fileSizeHigh && fileSizeLow == o.fileSizeLow;
+    }
+    bool operator!=(const FILE_STAMP &o) const { return !(*this == o); }
+};
+bool GetFileStamp(LPCTSTR fileName, FILE_STAMP *pStamp);
 
-FILETIME &operator+=(FILETIME &ft,LONGLONG Offset);
-LONGLONG operator-(const FILETIME &ft1,const FILETIME &ft2);
+// FILETIMEとJST_TIMEは同じ表現(値のコピーのみ)
+inline JST_TIME FileTimeToJst(const FILETIME &ft)
+{
+    return static_cast<JST_TIME>(static_cast<ULONGLONG>(ft.dwHighDateTime) << 32 | ft.dwLowDateTime);
+}
+inline FILETIME JstToFileTime(JST_TIME t)
+{
+    FILETIME ft;
+    ft.dwLowDateTime = static_cast<DWORD>(t);
+    ft.dwHighDateTime = static_cast<DWORD>(static_cast<ULONGLONG>(t) >> 32);
+    return ft;
+}
+// SystemTimeToFileTime()と同じく範囲外の日時(EPGの未定の開始時刻など)ならfalseを返す
+inline bool SystemTimeToJst(const SYSTEMTIME &st, JST_TIME *pTime)
+{
+    static const BYTE DAYS_IN_MONTH[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    if (st.wYear < 1601 || st.wYear > 30827 || st.wMonth < 1 || st.wMonth > 12 || st.wDay < 1 ||
+        st.wDay > DAYS_IN_MONTH[st.wMonth - 1] + (st.wMonth == 2 && st.wYear % 4 == 0 &&
+                                                  (st.wYear % 100 != 0 || st.wYear % 400 == 0) ? 1 : 0) ||
+        st.wHour >= 24 || st.wMinute >= 60 || st.wSecond >= 60 || st.wMilliseconds >= 1000) return false;
+    *pTime = JstMakeTime(st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond) +
+             st.wMilliseconds * JST_TIME_MILLISECOND;
+    return true;
+}
+inline FILETIME &operator+=(FILETIME &ft, LONGLONG Offset)
+{
+    ft = JstToFileTime(FileTimeToJst(ft) + Offset);
+    return ft;
+}
+inline LONGLONG operator-(const FILETIME &ft1, const FILETIME &ft2)
+{
+    return FileTimeToJst(ft1) - FileTimeToJst(ft2);
+}
 LPCTSTR GetDayOfWeekText(int DayOfWeek);
 bool BrowseFolderDialog(HWND hwndOwner,LPTSTR pszDirectory,LPCTSTR pszTitle);
 
@@ -82,9 +132,6 @@ BOOL WritePrivateProfileInt(LPCTSTR pszSection,LPCTSTR pszKey,int Value,LPCTSTR
 
 bool MatchKeyword(LPCTSTR pszText,LPCTSTR pszKeyword);
 
-int FormatFileName(LPTSTR pszFileName, int MaxFileName, WORD EventID, FILETIME StartTimeSpec, LPCTSTR pszEventName, LPCTSTR pszFormat);
-int FormatEventName(LPTSTR pszEventName, int MaxEventName, int num, LPCTSTR pszFormat);
-
 class CCriticalLock
 {
 public:
@@ -0,0 +1,323 @@
+﻿#include <Windows.h>
+#include <Shlwapi.h>
+#include "JstTime.h"
+#include "Util.h"
+#include "WakeTrace.h"
+
+static const LPCTSTR STAGE_NAME_LIST[] = {
+    TEXT("ExecWait"),
+    TEXT("AppLaunch"),
+    TEXT("AppIdle"),
+    TEXT("PluginInit"),
+    TEXT("PluginEnable"),
+    TEXT("FirstCheck"),
+    TEXT("SetChannel"),
+    TEXT("StartRecord"),
+};
+
+
+CWakeTrace::CWakeTrace()
+    : m_fActive(false)
+{
+    m_saveFileName[0] = 0;
+}
+
+
+void CWakeTrace::SetPluginFileName(LPCTSTR fileName)
+{
+    TCHAR saveFileName[MAX_PATH + 32];
+    ::lstrcpy(saveFileName, fileName);
+    ::PathRemoveExtension(saveFileName);
+    ::lstrcat(saveFileName, TEXT("_WakeTrace.txt"));
+    ::lstrcpyn(m_saveFileName, saveFileName, ARRAY_SIZE(m_saveFileName));
+}
+
+
+// 新しい記録を始める(予約起動のrundll32側)
+bool CWakeTrace::Begin()
+{
+    FILETIME now;
+    GetEpgTimeAsFileTime(&now);
+    // ファイルには秒単位で保存するので切り捨てておく
+    m_record.trigger = JstToFileTime(FileTimeToJst(now) / FILETIME_SECOND * FILETIME_SECOND);
+    for (int i = 0; i < STAGE_MAX; ++i) m_record.offset[i] = -1;
+    m_record.headroom = HEADROOM_NONE;
+    m_fActive = Update(true);
+    return m_fActive;
+}
+
+
+// 予約起動で始まった記録があれば引き継ぐ(プラグイン側)
+bool CWakeTrace::Resume()
+{
+    m_fActive = false;
+    RECORD *pRecords = new RECORD[RECORD_MAX];
+    HANDLE hMutex = LockFile();
+    int num = LoadRecords(pRecords, RECORD_MAX);
+    UnlockFile(hMutex);
+
+    if (num > 0) {
+        const RECORD &last = pRecords[num - 1];
+        FILETIME now;
+        GetEpgTimeAsFileTime(&now);
+        if (last.offset[STAGE_PLUGIN_INIT] < 0 && last.offset[STAGE_START_RECORD] < 0 &&
+            0 <= now - last.trigger && now - last.trigger < TRACE_TIMEOUT * FILETIME_SECOND)
+        {
+            m_record = last;
+            m_fActive = true;
+        }
+    }
+    delete [] pRecords;
+    return m_fActive;
+}
+
+
+// 現在時刻を段階の時刻として記録する(記録済みなら何もしない)
+bool CWakeTrace::Mark(STAGE stage, int headroom)
+{
+    if (!m_fActive || m_record.offset[stage] >= 0) return false;
+
+    FILETIME now;
+    GetEpgTimeAsFileTime(&now);
+    LONGLONG elapsed = now - m_record.trigger;
+    m_record.offset[stage] = static_cast<int>(min(max(elapsed / FILETIME_MILLISECOND, 0), TRACE_TIMEOUT * 1000LL));
+    if (headroom != HEADROOM_NONE) m_record.headroom = headroom;
+    return Update(false);
+}
+
+
+// 記録を終えて集計を書き出す
+void CWakeTrace::Finish()
+{
+    if (!m_fActive) return;
+    m_fActive = false;
+    WriteReport();
+}
+
+
+void CWakeTrace::FinishIfExpired()
+{
+    if (!m_fActive) return;
+    FILETIME now;
+    GetEpgTimeAsFileTime(&now);
+    if (now - m_record.trigger >= TRACE_TIMEOUT * FILETIME_SECOND) Finish();
+}
+
+
+// 2つのプロセスが読み書きするので名前つきMutexで排他する
+HANDLE CWakeTrace::LockFile() const
+{
+    TCHAR name[MAX_PATH + 16];
+    ::lstrcpy(name, TEXT("TTREC-WAKE-"));
+    ::lstrcat(name, m_saveFileName);
+    ::CharUpperBuff(name, ::lstrlen(name));
+    TranslateText(name, TEXT("!\\!/!"));
+
+    HANDLE hMutex = CreateFullAccessMutex(FALSE, name);
+    if (hMutex && ::WaitForSingleObject(hMutex, 5000) == WAIT_TIMEOUT) {
+        ::CloseHandle(hMutex);
+        hMutex = NULL;
+    }
+    return hMutex;
+}
+
+
+void CWakeTrace::UnlockFile(HANDLE hMutex)
+{
+    if (hMutex) {
+        ::ReleaseMutex(hMutex);
+        ::CloseHandle(hMutex);
+    }
+}
+
+
+// 古いものから順に最大maxRecords個読み込む
+int CWakeTrace::LoadRecords(RECORD *pRecords, int maxRecords) const
+{
+    if (!m_saveFileName[0] || !::PathFileExists(m_saveFileName)) return 0;
+    LPTSTR text = NULL;
+    for (int i = 0; i < 5; ++i) {
+        if ((text = NewReadTextFileToEnd(m_saveFileName, FILE_SHARE_READ)) != NULL) break;
+        ::Sleep(200);
+    }
+    if (!text) return 0;
+
+    int num = 0;
+    for (LPCTSTR line = text; line && *line;) {
+        if (num == maxRecords) {
+            // あふれた分は古いものから捨てる
+            for (int i = 1; i < maxRecords; ++i) pRecords[i - 1] = pRecords[i];
+            --num;
+        }
+        if (RecordFromString(line, &pRecords[num])) ++num;
+        line = ::StrChr(line, TEXT('\n'));
+        if (line) ++line;
+    }
+    delete [] text;
+    return num;
+}
+
+
+bool CWakeTrace::SaveRecords(const RECORD *pRecords, int num) const
+{
+    if (!m_saveFileName[0]) return false;
+
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    for (int i = 0; i < 5; ++i) {
+        hFile = ::CreateFile(m_saveFileName, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile != INVALID_HANDLE_VALUE) break;
+        ::Sleep(200);
+    }
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+
+    DWORD writtenBytes;
+    WCHAR bom = L'\xFEFF';
+    ::WriteFile(hFile, &bom, sizeof(bom), &writtenBytes, NULL);
+
+    for (int i = 0; i < num; ++i) {
+        TCHAR buf[256];
+        RecordToString(pRecords[i], buf);
+        ::WriteFile(hFile, buf, ::lstrlen(buf) * sizeof(TCHAR), &writtenBytes, NULL);
+    }
+
+    ::CloseHandle(hFile);
+    return true;
+}
+
+
+// ファイル上の記録をm_recordで更新する
+bool CWakeTrace::Update(bool fAppend)
+{
+    RECORD *pRecords = new RECORD[RECORD_MAX];
+    HANDLE hMutex = LockFile();
+    int num = LoadRecords(pRecords, RECORD_MAX);
+
+    bool fFound = false;
+    if (fAppend) {
+        if (num == RECORD_MAX) {
+            for (int i = 1; i < num; ++i) pRecords[i - 1] = pRecords[i];
+            --num;
+        }
+        pRecords[num++] = m_record;
+        fFound = true;
+    }
+    else {
+        for (int i = num - 1; i >= 0; --i) {
+            if (pRecords[i].trigger - m_record.trigger == 0) {
+                // もう一方のプロセスが書いた段階を取り込む
+                for (int j = 0; j < STAGE_MAX; ++j) {
+                    if (m_record.offset[j] < 0) m_record.offset[j] = pRecords[i].offset[j];
+                }
+                if (m_record.headroom == HEADROOM_NONE) m_record.headroom = pRecords[i].headroom;
+                pRecords[i] = m_record;
+                fFound = true;
+                break;
+            }
+        }
+    }
+    bool fRet = fFound && SaveRecords(pRecords, num);
+
+    UnlockFile(hMutex);
+    delete [] pRecords;
+    return fRet;
+}
+
+
+// 書式: 段階名<TAB>回数<TAB>最小<TAB>中央値<TAB>最大 (起動トリガからの秒)
+bool CWakeTrace::WriteReport() const
+{
+    if (!m_saveFileName[0]) return false;
+
+    RECORD *pRecords = new RECORD[RECORD_MAX];
+    HANDLE hMutex = LockFile();
+    int num = LoadRecords(pRecords, RECORD_MAX);
+    UnlockFile(hMutex);
+
+    // "～_WakeTrace.txt"→"～_WakeReport.txt"
+    TCHAR reportName[MAX_PATH + 32];
+    ::lstrcpy(reportName, m_saveFileName);
+    reportName[::lstrlen(reportName) - ::lstrlen(TEXT("Trace.txt"))] = 0;
+    ::lstrcat(reportName, TEXT("Report.txt"));
+
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    for (int i = 0; i < 5; ++i) {
+        hFile = ::CreateFile(reportName, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile != INVALID_HANDLE_VALUE) break;
+        ::Sleep(200);
+    }
+    if (hFile == INVALID_HANDLE_VALUE) {
+        delete [] pRecords;
+        return false;
+    }
+
+    DWORD writtenBytes;
+    WCHAR bom = L'\xFEFF';
+    ::WriteFile(hFile, &bom, sizeof(bom), &writtenBytes, NULL);
+
+    TCHAR buf[256];
+    int len = ::wsprintf(buf, TEXT("; 直近%d回の予約起動 (起動トリガからの秒)\r\n; Stage\tCount\tMin\tMedian\tMax\r\n"), num);
+    ::WriteFile(hFile, buf, len * sizeof(TCHAR), &writtenBytes, NULL);
+
+    int values[RECORD_MAX];
+    for (int i = 0; i <= STAGE_MAX; ++i) {
+        int n = 0;
+        for (int j = 0; j < num; ++j) {
+            if (i < STAGE_MAX && pRecords[j].offset[i] >= 0) values[n++] = pRecords[j].offset[i];
+            else if (i == STAGE_MAX && pRecords[j].headroom != HEADROOM_NONE) values[n++] = pRecords[j].headroom;
+        }
+        SortInt(values, n);
+        if (i < STAGE_MAX) {
+            if (n == 0) {
+                len = ::wsprintf(buf, TEXT("%s\t0\t*\t*\t*\r\n"), STAGE_NAME_LIST[i]);
+            }
+            else {
+                len = ::wsprintf(buf, TEXT("%s\t%d\t%d.%03d\t%d.%03d\t%d.%03d\r\n"), STAGE_NAME_LIST[i], n,
+                                 values[0] / 1000, values[0] % 1000, values[n / 2] / 1000, values[n / 2] % 1000,
+                                 values[n - 1] / 1000, values[n - 1] % 1000);
+            }
+        }
+        else {
+            // 余裕が小さい(負なら録画に間に合っていない)ときはResumeMarginやExecWaitを見直す
+            len = ::wsprintf(buf, TEXT("; 最初の録画チェックで予約開始(マージン込み)まで残っていた秒数\r\n"));
+            ::WriteFile(hFile, buf, len * sizeof(TCHAR), &writtenBytes, NULL);
+            if (n == 0) {
+                len = ::wsprintf(buf, TEXT("Headroom\t0\t*\t*\t*\r\n"));
+            }
+            else {
+                len = ::wsprintf(buf, TEXT("Headroom\t%d\t%d\t%d\t%d\r\n"), n, values[0], values[n / 2], values[n - 1]);
+            }
+        }
+        ::WriteFile(hFile, buf, len * sizeof(TCHAR), &writtenBytes, NULL);
+    }
+
+    ::CloseHandle(hFile);
+    delete [] pRecords;
+    return true;
+}
+
+
+// 書式: 起動トリガ時刻<TAB>各段階のミリ秒(*=未到達)...<TAB>余裕秒(*=不明)
+void CWakeTrace::RecordToString(const RECORD &rec, LPTSTR str)
+{
+    FileTimeToStr(&rec.trigger, str);
+    LPTSTR tail = str + ::lstrlen(str);
+    for (int i = 0; i < STAGE_MAX; ++i) {
+        if (rec.offset[i] < 0) tail += ::wsprintf(tail, TEXT("\t*"));
+        else tail += ::wsprintf(tail, TEXT("\t%d"), rec.offset[i]);
+    }
+    if (rec.headroom == HEADROOM_NONE) ::lstrcpy(tail, TEXT("\t*\r\n"));
+    else ::wsprintf(tail, TEXT("\t%d\r\n"), rec.headroom);
+}
+
+
+bool CWakeTrace::RecordFromString(LPCTSTR str, RECORD *pRec)
+{
+    if (!StrToFileTime(str, &pRec->trigger)) return false;
+    for (int i = 0; i < STAGE_MAX; ++i) {
+        if (!NextToken(&str)) return false;
+        pRec->offset[i] = str[0] == TEXT('*') ? -1 : max(::StrToInt(str), 0);
+    }
+    if (!NextToken(&str)) return false;
+    pRec->headroom = str[0] == TEXT('*') ? HEADROOM_NONE : ::StrToInt(str);
+    return true;
+}
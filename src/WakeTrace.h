@@ -0,0 +1,55 @@
+﻿#ifndef INCLUDE_WAKE_TRACE_H
+#define INCLUDE_WAKE_TRACE_H
+
+// 予約起動(タスクスケジューラによる復帰)から録画開始までの各段階の時刻を記録する
+// rundll32のプロセスとTVTestのプロセスが同じファイルに書き込む
+class CWakeTrace
+{
+public:
+    // 記録する段階(起動トリガからの経過ミリ秒を記録する)
+    enum STAGE {
+        STAGE_EXEC_WAIT,        // DelayedExecuteW()の待機完了
+        STAGE_APP_LAUNCH,       // TVTestのプロセス作成
+        STAGE_APP_IDLE,         // TVTestの入力待ち(WaitForInputIdle())
+        STAGE_PLUGIN_INIT,      // プラグインの初期化
+        STAGE_PLUGIN_ENABLE,    // プラグインの有効化(予約・クエリ読み込み済み)
+        STAGE_FIRST_CHECK,      // 最初の録画チェック
+        STAGE_SET_CHANNEL,      // 予約のためのチャンネル変更
+        STAGE_START_RECORD,     // 予約開始
+        STAGE_MAX
+    };
+    // 保存する記録の数
+    static const int RECORD_MAX = 32;
+    // 起動トリガからこれ以上経過した記録は継続しない(秒)
+    static const int TRACE_TIMEOUT = 3600;
+    static const int HEADROOM_NONE = -0x7FFFFFFF - 1;
+
+    CWakeTrace();
+    void SetPluginFileName(LPCTSTR fileName);
+    bool Begin();
+    bool Resume();
+    bool Mark(STAGE stage, int headroom = HEADROOM_NONE);
+    void Finish();
+    void FinishIfExpired();
+    bool IsActive() const { return m_fActive; }
+private:
+    struct RECORD {
+        FILETIME trigger;
+        int offset[STAGE_MAX];  // ミリ秒、未到達なら負
+        int headroom;           // 最初の録画チェックで予約開始(マージン込み)まで残っていた秒数
+    };
+    HANDLE LockFile() const;
+    static void UnlockFile(HANDLE hMutex);
+    int LoadRecords(RECORD *pRecords, int maxRecords) const;
+    bool SaveRecords(const RECORD *pRecords, int num) const;
+    bool Update(bool fAppend);
+    bool WriteReport() const;
+    static void RecordToString(const RECORD &rec, LPTSTR str);
+    static bool RecordFromString(LPCTSTR str, RECORD *pRec);
+
+    bool m_fActive;
+    RECORD m_record;
+    TCHAR m_saveFileName[MAX_PATH];
+};
+
+#endif // INCLUDE_WAKE_TRACE_H
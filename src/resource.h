@@ -78,3 +78,4 @@
 #define IDC_BUTTON_SAVE_DIR_BROWSE              2011
 #define IDC_EDIT_STA_TRIM                       2012
 #define IDC_EDIT_END_TRIM                       2013
+#define IDC_CHECK_LEAN_REC                      2014